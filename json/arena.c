@@ -0,0 +1,164 @@
+/*
+ * arena.c
+ *
+ * This library is free software; you can redistribute it and/or modify
+ * it under the terms of the MIT license. See COPYING for details.
+ *
+ */
+
+#include "../config.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "arena.h"
+
+#define JSON_ARENA_ALIGN(n) (((n) + 15) & ~(size_t)15)
+
+struct json_arena_block {
+  struct json_arena_block *next;
+  size_t size;
+  size_t used;
+  /* keeps data aligned like malloc() */
+  long double data[];
+};
+
+struct json_arena {
+  struct json_arena_block *head;
+  size_t block;
+  void *last; /* most recent allocation, which can grow in place */
+};
+
+static struct json_arena *json_arena_in_use = NULL;
+
+struct json_arena* json_arena_new(size_t block)
+{
+  struct json_arena *a;
+
+  a = (struct json_arena*)calloc(1, sizeof(struct json_arena));
+  if(!a) return NULL;
+  a->block = block ? block : JSON_ARENA_DEFAULT_BLOCK;
+  return a;
+}
+
+void json_arena_free(struct json_arena *a)
+{
+  struct json_arena_block *b, *next;
+
+  if(!a) return;
+  if(json_arena_in_use == a) json_arena_in_use = NULL;
+  for(b = a->head; b; b = next) {
+    next = b->next;
+    free(b);
+  }
+  free(a);
+}
+
+struct json_arena* json_arena_use(struct json_arena *a)
+{
+  struct json_arena *prev = json_arena_in_use;
+  json_arena_in_use = a;
+  return prev;
+}
+
+struct json_arena* json_arena_current(void)
+{
+  return json_arena_in_use;
+}
+
+static struct json_arena_block* json_arena_block_new(size_t size)
+{
+  struct json_arena_block *b;
+
+  b = (struct json_arena_block*)malloc(sizeof(struct json_arena_block) + size);
+  if(!b) return NULL;
+  b->size = size;
+  b->used = 0;
+  return b;
+}
+
+void* json_arena_malloc(struct json_arena *a, size_t size)
+{
+  struct json_arena_block *b;
+  void *p;
+
+  if(!a) return malloc(size);
+
+  size = JSON_ARENA_ALIGN(size ? size : 1);
+  b = a->head;
+
+  if(!b || b->size - b->used < size) {
+    if(size > a->block / 4) {
+      /* a block of its own, behind the current one */
+      if(!(b = json_arena_block_new(size))) return NULL;
+      if(a->head) {
+	b->next = a->head->next;
+	a->head->next = b;
+      } else {
+	b->next = NULL;
+	a->head = b;
+      }
+    } else {
+      if(!(b = json_arena_block_new(a->block))) return NULL;
+      b->next = a->head;
+      a->head = b;
+    }
+  }
+
+  p = (char*)b->data + b->used;
+  b->used += size;
+  if(b == a->head) a->last = p;
+  return p;
+}
+
+void* json_arena_calloc(struct json_arena *a, size_t n, size_t size)
+{
+  void *p;
+
+  if(!a) return calloc(n, size);
+  if(size && n > (size_t)-1 / size) return NULL;
+  if((p = json_arena_malloc(a, n * size)))
+    memset(p, 0, n * size);
+  return p;
+}
+
+void* json_arena_realloc(struct json_arena *a, void *p,
+			 size_t old_size, size_t size)
+{
+  struct json_arena_block *b;
+  void *t;
+
+  if(!a) return realloc(p, size);
+  if(!p) return json_arena_malloc(a, size);
+
+  /* the last allocation of the block grows where it is */
+  b = a->head;
+  if(p == a->last) {
+    size_t start = (char*)p - (char*)b->data;
+    if(start + JSON_ARENA_ALIGN(size) <= b->size) {
+      b->used = start + JSON_ARENA_ALIGN(size);
+      return p;
+    }
+  }
+
+  if(!(t = json_arena_malloc(a, size))) return NULL;
+  memcpy(t, p, old_size < size ? old_size : size);
+  return t;
+}
+
+char* json_arena_strdup(struct json_arena *a, const char *s)
+{
+  size_t len;
+  char *p;
+
+  if(!a) return strdup(s);
+  len = strlen(s) + 1;
+  if((p = (char*)json_arena_malloc(a, len)))
+    memcpy(p, s, len);
+  return p;
+}
+
+void json_arena_release(struct json_arena *a, void *p)
+{
+  if(!a) free(p);
+}
@@ -0,0 +1,54 @@
+/*
+ * arena.h
+ *
+ * This library is free software; you can redistribute it and/or modify
+ * it under the terms of the MIT license. See COPYING for details.
+ *
+ */
+
+#ifndef _arena_h_
+#define _arena_h_
+
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define JSON_ARENA_DEFAULT_BLOCK 8192
+
+/**
+ * An arena hands out memory from a few large blocks, all released at
+ * once by json_arena_free().
+ *
+ * Objects, keys, strings, tables and buffers made while an arena is in
+ * use (see json_arena_use() and json_tokener_parse_arena()) come from
+ * it, and so does whatever those objects allocate later on.
+ * json_object_put() leaves objects of an arena alone. Do not add them
+ * to objects that outlive the arena, nor heap objects to them.
+ */
+struct json_arena;
+
+extern struct json_arena* json_arena_new(size_t block);
+extern void json_arena_free(struct json_arena *a);
+
+/**
+ * Sets the arena new objects come from, NULL for the heap.
+ * @returns the arena in use before
+ */
+extern struct json_arena* json_arena_use(struct json_arena *a);
+extern struct json_arena* json_arena_current(void);
+
+/* Allocation within the library: from arena a, or the heap if NULL */
+extern void* json_arena_malloc(struct json_arena *a, size_t size);
+extern void* json_arena_calloc(struct json_arena *a, size_t n, size_t size);
+extern void* json_arena_realloc(struct json_arena *a, void *p,
+				size_t old_size, size_t size);
+extern char* json_arena_strdup(struct json_arena *a, const char *s);
+extern void json_arena_release(struct json_arena *a, void *p);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -20,20 +20,23 @@
 # include <strings.h>
 #endif /* HAVE_STRINGS_H */
 
+#include "arena.h"
 #include "arraylist.h"
 
 struct array_list*
 array_list_new(array_list_free_fn *free_fn)
 {
   struct array_list *arr;
+  struct json_arena *a = json_arena_current();
 
-  arr = (struct array_list*)calloc(1, sizeof(struct array_list));
+  arr = (struct array_list*)json_arena_calloc(a, 1, sizeof(struct array_list));
   if(!arr) return NULL;
   arr->size = ARRAY_LIST_DEFAULT_SIZE;
   arr->length = 0;
   arr->free_fn = free_fn;
-  if(!(arr->array = (void**)calloc(sizeof(void*), arr->size))) {
-    free(arr);
+  arr->arena = a;
+  if(!(arr->array = (void**)json_arena_calloc(a, sizeof(void*), arr->size))) {
+    json_arena_release(a, arr);
     return NULL;
   }
   return arr;
@@ -45,8 +48,8 @@ array_list_free(struct array_list *arr)
   int i;
   for(i = 0; i < arr->length; i++)
     if(arr->array[i]) arr->free_fn(arr->array[i]);
-  free(arr->array);
-  free(arr);
+  json_arena_release(arr->arena, arr->array);
+  json_arena_release(arr->arena, arr);
 }
 
 void*
@@ -65,7 +68,8 @@ static int array_list_expand_internal(struct array_list *arr, int max)
   new_size = arr->size << 1;
   if (new_size < max)
     new_size = max;
-  if(!(t = realloc(arr->array, new_size*sizeof(void*)))) return -1;
+  if(!(t = json_arena_realloc(arr->arena, arr->array,
+			       arr->size*sizeof(void*), new_size*sizeof(void*)))) return -1;
   arr->array = (void**)t;
   (void)memset(arr->array + arr->size, 0, (new_size-arr->size)*sizeof(void*));
   arr->size = new_size;
@@ -20,12 +20,15 @@ extern "C" {
 
 typedef void (array_list_free_fn) (void *data);
 
+struct json_arena;
+
 struct array_list
 {
   void **array;
   int length;
   int size;
   array_list_free_fn *free_fn;
+  struct json_arena *arena;
 };
 
 extern struct array_list*
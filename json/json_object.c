@@ -23,6 +23,7 @@
 #include "printbuf.h"
 #include "linkhash.h"
 #include "arraylist.h"
+#include "arena.h"
 #include "json_inttypes.h"
 #include "json_object.h"
 #include "json_object_private.h"
@@ -173,7 +174,8 @@ extern struct json_object* json_object_get(struct json_object *jso)
 
 int json_object_put(struct json_object *jso)
 {
-	if(jso)
+	/* objects of an arena go when the arena is freed */
+	if(jso && !jso->_arena)
 	{
 		jso->_ref_count--;
 		if(!jso->_ref_count)
@@ -198,16 +200,18 @@ static void json_object_generic_delete(struct json_object* jso)
 	lh_table_delete(json_object_table, jso);
 #endif /* REFCOUNT_DEBUG */
 	printbuf_free(jso->_pb);
-	free(jso);
+	json_arena_release(jso->_arena, jso);
 }
 
 static struct json_object* json_object_new(enum json_type o_type)
 {
+	struct json_arena *a = json_arena_current();
 	struct json_object *jso;
 
-	jso = (struct json_object*)calloc(sizeof(struct json_object), 1);
+	jso = (struct json_object*)json_arena_calloc(a, sizeof(struct json_object), 1);
 	if (!jso)
 		return NULL;
+	jso->_arena = a;
 	jso->o_type = o_type;
 	jso->_ref_count = 1;
 	jso->_delete = &json_object_generic_delete;
@@ -293,8 +297,14 @@ const char* json_object_to_json_string_ext(struct json_object *jso, int flags)
 	if (!jso)
 		return "null";
 
-	if ((!jso->_pb) && !(jso->_pb = printbuf_new()))
-		return NULL;
+	if (!jso->_pb)
+	{
+		struct json_arena *prev = json_arena_use(jso->_arena);
+		jso->_pb = printbuf_new();
+		json_arena_use(prev);
+		if (!jso->_pb)
+			return NULL;
+	}
 
 	printbuf_reset(jso->_pb);
 
@@ -433,9 +443,16 @@ void json_object_object_add_ex(struct json_object* jso,
 			      lh_table_lookup_entry_w_hash(jso->o.c_object, (void*)key, hash);
 	if (!existing_entry)
 	{
-		void *const k = (opts & JSON_C_OBJECT_KEY_IS_CONSTANT) ?
-					(void*)key : strdup(key);
-		lh_table_insert_w_hash(jso->o.c_object, k, val, hash, opts);
+		void *k = (void*)key;
+		unsigned kopts = opts;
+		if (!(opts & JSON_C_OBJECT_KEY_IS_CONSTANT))
+		{
+			k = json_arena_strdup(jso->_arena, key);
+			/* arena keys are not freed with the entry */
+			if (jso->_arena)
+				kopts |= JSON_C_OBJECT_KEY_IS_CONSTANT;
+		}
+		lh_table_insert_w_hash(jso->o.c_object, k, val, hash, kopts);
 		return;
 	}
 	existing_value = (json_object *)existing_entry->v;
@@ -455,11 +472,12 @@ int json_object_object_add(struct json_object* jso, const char *key,
 	existing_entry = lh_table_lookup_entry_w_hash(jso->o.c_object, (void*)key, hash);
 	if (!existing_entry)
 	{
-		char *keydup = strdup(key);
+		char *keydup = json_arena_strdup(jso->_arena, key);
 		if (keydup == NULL)
 			return -1;
 
-		return lh_table_insert_w_hash(jso->o.c_object, keydup, val, hash, 0);
+		return lh_table_insert_w_hash(jso->o.c_object, keydup, val, hash,
+				jso->_arena ? JSON_C_OBJECT_KEY_IS_CONSTANT : 0);
 	}
 	existing_value = (json_object  *)existing_entry->v;
 	if (existing_value)
@@ -701,7 +719,7 @@ struct json_object* json_object_new_double_s(double d, const char *ds)
 	if (!jso)
 		return NULL;
 
-	char *new_ds = strdup(ds);
+	char *new_ds = json_arena_strdup(jso->_arena, ds);
 	if (!new_ds)
 	{
 		json_object_generic_delete(jso);
@@ -723,7 +741,7 @@ int json_object_userdata_to_json_string(struct json_object *jso,
 
 void json_object_free_userdata(struct json_object *jso, void *userdata)
 {
-	free(userdata);
+	json_arena_release(jso->_arena, userdata);
 }
 
 double json_object_get_double(struct json_object *jso)
@@ -792,7 +810,7 @@ static int json_object_string_to_json_string(struct json_object* jso,
 static void json_object_string_delete(struct json_object* jso)
 {
 	if(jso->o.c_string.len >= LEN_DIRECT_STRING_DATA)
-		free(jso->o.c_string.str.ptr);
+		json_arena_release(jso->_arena, jso->o.c_string.str.ptr);
 	json_object_generic_delete(jso);
 }
 
@@ -807,7 +825,7 @@ struct json_object* json_object_new_string(const char *s)
 	if(jso->o.c_string.len < LEN_DIRECT_STRING_DATA) {
 		memcpy(jso->o.c_string.str.data, s, jso->o.c_string.len);
 	} else {
-		jso->o.c_string.str.ptr = strdup(s);
+		jso->o.c_string.str.ptr = json_arena_strdup(jso->_arena, s);
 		if (!jso->o.c_string.str.ptr)
 		{
 			json_object_generic_delete(jso);
@@ -829,7 +847,7 @@ struct json_object* json_object_new_string_len(const char *s, int len)
 	if(len < LEN_DIRECT_STRING_DATA) {
 		dstbuf = jso->o.c_string.str.data;
 	} else {
-		jso->o.c_string.str.ptr = (char*)malloc(len + 1);
+		jso->o.c_string.str.ptr = (char*)json_arena_malloc(jso->_arena, len + 1);
 		if (!jso->o.c_string.str.ptr)
 		{
 			json_object_generic_delete(jso);
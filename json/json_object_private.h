@@ -46,6 +46,7 @@ struct json_object
   } o;
   json_object_delete_fn *_user_delete;
   void *_userdata;
+  struct json_arena *_arena;    /* freed with the arena, not on put */
 };
 
 #ifdef __cplusplus
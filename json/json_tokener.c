@@ -27,6 +27,7 @@
 #include "debug.h"
 #include "printbuf.h"
 #include "arraylist.h"
+#include "arena.h"
 #include "json_inttypes.h"
 #include "json_object.h"
 #include "json_tokener.h"
@@ -185,6 +186,23 @@ struct json_object* json_tokener_parse_verbose(const char *str, enum json_tokene
     return obj;
 }
 
+struct json_object* json_tokener_parse_arena(const char *str, struct json_arena *a)
+{
+    struct json_tokener* tok;
+    struct json_object* obj;
+
+    tok = json_tokener_new();
+    if (!tok)
+      return NULL;
+    tok->arena = a;
+    obj = json_tokener_parse_ex(tok, str, -1);
+    if(tok->err != json_tokener_success)
+        obj = NULL;
+
+    json_tokener_free(tok);
+    return obj;
+}
+
 #define state  tok->stack[tok->depth].state
 #define saved_state  tok->stack[tok->depth].saved_state
 #define current tok->stack[tok->depth].current
@@ -234,6 +252,7 @@ struct json_object* json_tokener_parse_ex(struct json_tokener *tok,
 					  const char *str, int len)
 {
   struct json_object *obj = NULL;
+  struct json_arena *prev_arena;
   char c = '\1';
 #ifdef HAVE_SETLOCALE
   char *oldlocale=NULL, *tmplocale;
@@ -259,6 +278,9 @@ struct json_object* json_tokener_parse_ex(struct json_tokener *tok,
     return NULL;
   }
 
+  /* without an arena of its own the tokener leaves the current one */
+  prev_arena = tok->arena ? json_arena_use(tok->arena) : json_arena_current();
+
   while (PEEK_CHAR(c, tok)) {
 
   redo_char:
@@ -904,6 +926,8 @@ struct json_object* json_tokener_parse_ex(struct json_tokener *tok,
   free(oldlocale);
 #endif
 
+  json_arena_use(prev_arena);
+
   if (tok->err == json_tokener_success)
   {
     json_object *ret = json_object_get(current);
@@ -924,3 +948,222 @@ void json_tokener_set_flags(struct json_tokener *tok, int flags)
 {
 	tok->flags = flags;
 }
+
+
+/* SAX mode: one pass over the input, no objects built */
+
+#define sax_ws(p, end) \
+  while ((p) < (end) && (*(p) == ' ' || *(p) == '\t' || \
+			 *(p) == '\n' || *(p) == '\r')) (p)++
+
+static void sax_utf8(struct printbuf *pb, unsigned int uc)
+{
+  unsigned char b[4];
+  int n;
+
+  if (uc < 0x80) {
+    b[0] = uc; n = 1;
+  } else if (uc < 0x800) {
+    b[0] = 0xc0 | (uc >> 6);
+    b[1] = 0x80 | (uc & 0x3f); n = 2;
+  } else if (uc < 0x10000) {
+    b[0] = 0xe0 | (uc >> 12);
+    b[1] = 0x80 | ((uc >> 6) & 0x3f);
+    b[2] = 0x80 | (uc & 0x3f); n = 3;
+  } else {
+    b[0] = 0xf0 | (uc >> 18);
+    b[1] = 0x80 | ((uc >> 12) & 0x3f);
+    b[2] = 0x80 | ((uc >> 6) & 0x3f);
+    b[3] = 0x80 | (uc & 0x3f); n = 4;
+  }
+  printbuf_memappend_fast(pb, (char*)b, n);
+}
+
+static int sax_hex4(const char *p, const char *end, unsigned int *uc)
+{
+  int i;
+  *uc = 0;
+  if (end - p < 4) return -1;
+  for (i = 0; i < 4; i++) {
+    if (!isxdigit((unsigned char)p[i])) return -1;
+    *uc = (*uc << 4) | jt_hexdigit(p[i]);
+  }
+  return 0;
+}
+
+/*
+ * Scans the string starting at the quote *pp points to. A string with
+ * no escapes is returned in place, others are decoded into *pb.
+ */
+static int sax_string(const char **pp, const char *end, struct printbuf **pb,
+		      const char **s, int *len)
+{
+  const char *p = *pp + 1, *start = p;
+  struct printbuf *b;
+  unsigned int uc, lo;
+
+  while (p < end && *p != '"' && *p != '\\') p++;
+  if (p == end) return -1;
+
+  if (*p == '"') {
+    *s = start;
+    *len = p - start;
+    *pp = p + 1;
+    return 0;
+  }
+
+  if (!*pb && !(*pb = printbuf_new())) return -1;
+  b = *pb;
+  printbuf_reset(b);
+
+  while (1) {
+    if (p > start)
+      printbuf_memappend_fast(b, start, p - start);
+    if (p == end) return -1;
+    if (*p == '"') break;
+
+    /* at a backslash */
+    if (++p == end) return -1;
+    switch (*p++) {
+    case '"':  printbuf_memappend_fast(b, "\"", 1); break;
+    case '\\': printbuf_memappend_fast(b, "\\", 1); break;
+    case '/':  printbuf_memappend_fast(b, "/", 1); break;
+    case 'b':  printbuf_memappend_fast(b, "\b", 1); break;
+    case 'f':  printbuf_memappend_fast(b, "\f", 1); break;
+    case 'n':  printbuf_memappend_fast(b, "\n", 1); break;
+    case 'r':  printbuf_memappend_fast(b, "\r", 1); break;
+    case 't':  printbuf_memappend_fast(b, "\t", 1); break;
+    case 'u':
+      if (sax_hex4(p, end, &uc)) return -1;
+      p += 4;
+      if (IS_HIGH_SURROGATE(uc)) {
+	if (end - p >= 6 && p[0] == '\\' && p[1] == 'u' &&
+	    !sax_hex4(p + 2, end, &lo) && IS_LOW_SURROGATE(lo)) {
+	  uc = DECODE_SURROGATE_PAIR(uc, lo);
+	  p += 6;
+	} else {
+	  printbuf_memappend_fast(b, (char*)utf8_replacement_char, 3);
+	  break;
+	}
+      } else if (IS_LOW_SURROGATE(uc)) {
+	printbuf_memappend_fast(b, (char*)utf8_replacement_char, 3);
+	break;
+      }
+      sax_utf8(b, uc);
+      break;
+    default:
+      return -1;
+    }
+
+    start = p;
+    while (p < end && *p != '"' && *p != '\\') p++;
+  }
+
+  *s = b->buf;
+  *len = b->bpos;
+  *pp = p + 1;
+  return 0;
+}
+
+#define sax_call(cb, args) \
+  do { if (sax->cb && (rc = sax->cb args)) goto out; } while (0)
+
+int json_tokener_parse_sax(const char *str, int len,
+			   const struct json_sax *sax, void *ud)
+{
+  char stack[JSON_TOKENER_DEFAULT_DEPTH];
+  struct printbuf *pb = NULL;
+  const char *p = str, *end, *s;
+  int depth = 0, rc = -1, n;
+
+  if (len < 0) len = strlen(str);
+  end = str + len;
+
+  while (1) {
+    /* a value */
+    sax_ws(p, end);
+    if (p == end) { rc = -1; goto out; }
+
+    switch (*p) {
+    case '{':
+    case '[':
+      if (depth == JSON_TOKENER_DEFAULT_DEPTH) { rc = -1; goto out; }
+      stack[depth++] = *p;
+      if (*p == '{') sax_call(object_start, (ud, p));
+      else sax_call(array_start, (ud, p));
+      p++;
+      sax_ws(p, end);
+      if (p < end && (*p == '}' || *p == ']'))
+	goto close; /* empty */
+      if (stack[depth - 1] == '{')
+	goto key;
+      continue;
+
+    case '"':
+      if (sax_string(&p, end, &pb, &s, &n)) { rc = -1; goto out; }
+      sax_call(value, (ud, json_type_string, s, n));
+      break;
+
+    case 't':
+    case 'f':
+    case 'n':
+      s = *p == 't' ? "true" : *p == 'f' ? "false" : "null";
+      n = strlen(s);
+      if (end - p < n || strncmp(p, s, n)) { rc = -1; goto out; }
+      sax_call(value, (ud, *s == 'n' ? json_type_null : json_type_boolean, p, n));
+      p += n;
+      break;
+
+    default:
+      {
+	enum json_type type = json_type_int;
+	s = p;
+	if (p < end && *p == '-') p++;
+	if (p == end || !isdigit((unsigned char)*p)) { rc = -1; goto out; }
+	while (p < end && (isdigit((unsigned char)*p) || *p == '.' ||
+			   *p == 'e' || *p == 'E' ||
+			   ((*p == '-' || *p == '+') &&
+			    (p[-1] == 'e' || p[-1] == 'E')))) {
+	  if (!isdigit((unsigned char)*p)) type = json_type_double;
+	  p++;
+	}
+	sax_call(value, (ud, type, s, p - s));
+      }
+      break;
+    }
+
+  next:
+    /* after a value */
+    if (!depth) { rc = 0; goto out; }
+    sax_ws(p, end);
+    if (p == end) { rc = -1; goto out; }
+    if (*p == ',') {
+      p++;
+      if (stack[depth - 1] == '[')
+	continue;
+      goto key;
+    }
+
+  close:
+    if (*p != (stack[depth - 1] == '{' ? '}' : ']')) { rc = -1; goto out; }
+    if (*p == '}') sax_call(object_end, (ud, p));
+    else sax_call(array_end, (ud, p));
+    p++;
+    depth--;
+    goto next;
+
+  key:
+    sax_ws(p, end);
+    if (p == end || *p != '"' || sax_string(&p, end, &pb, &s, &n)) {
+      rc = -1; goto out;
+    }
+    sax_call(object_key, (ud, s, n));
+    sax_ws(p, end);
+    if (p == end || *p != ':') { rc = -1; goto out; }
+    p++;
+  }
+
+ out:
+  if (pb) printbuf_free(pb);
+  return rc;
+}
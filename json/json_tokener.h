@@ -75,6 +75,8 @@ struct json_tokener_srec
 
 #define JSON_TOKENER_DEFAULT_DEPTH 32
 
+struct json_arena;
+
 struct json_tokener
 {
   char *str;
@@ -85,6 +87,7 @@ struct json_tokener
   char quote_char;
   struct json_tokener_srec *stack;
   int flags;
+  struct json_arena *arena;
 };
 
 /**
@@ -125,6 +128,12 @@ extern void json_tokener_reset(struct json_tokener *tok);
 extern struct json_object* json_tokener_parse(const char *str);
 extern struct json_object* json_tokener_parse_verbose(const char *str, enum json_tokener_error *error);
 
+/**
+ * Parses str with every object, key and string allocated from arena a,
+ * see arena.h; the tree goes away with json_arena_free(a).
+ */
+extern struct json_object* json_tokener_parse_arena(const char *str, struct json_arena *a);
+
 /**
  * Set flags that control how parsing will be done.
  */
@@ -201,6 +210,38 @@ if (tok->char_offset < stringlen) // XXX shouldn't access internal fields
 extern struct json_object* json_tokener_parse_ex(struct json_tokener *tok,
 						 const char *str, int len);
 
+/**
+ * Callbacks of json_tokener_parse_sax(), any of which may be NULL.
+ *
+ * The text given is only valid during the call and not NUL terminated:
+ * strings and keys without escapes point into the input, others into a
+ * buffer the escapes were decoded into. Numbers are passed as they
+ * appear with type json_type_int or json_type_double, true and false
+ * as json_type_boolean, null as json_type_null. The at argument of the
+ * start and end callbacks points at the bracket in the input.
+ *
+ * A callback returning non-zero stops the parse.
+ */
+struct json_sax {
+  int (*object_start)(void *ud, const char *at);
+  int (*object_key)(void *ud, const char *key, int len);
+  int (*object_end)(void *ud, const char *at);
+  int (*array_start)(void *ud, const char *at);
+  int (*array_end)(void *ud, const char *at);
+  int (*value)(void *ud, enum json_type type, const char *s, int len);
+};
+
+/**
+ * Parses one JSON value from str (len -1 for NUL terminated) calling
+ * the sax callbacks in document order, without building any objects.
+ * Nesting is limited to JSON_TOKENER_DEFAULT_DEPTH.
+ *
+ * @returns 0 once the value is complete, -1 on a parse error, or what
+ * a callback returned to stop the parse.
+ */
+extern int json_tokener_parse_sax(const char *str, int len,
+				  const struct json_sax *sax, void *ud);
+
 #ifdef __cplusplus
 }
 #endif
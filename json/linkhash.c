@@ -30,6 +30,7 @@
 
 #include "random_seed.h"
 #include "linkhash.h"
+#include "arena.h"
 
 /* hash functions */
 static unsigned long lh_char_hash(const void *k);
@@ -470,25 +471,30 @@ struct lh_table* lh_table_new(int size,
 			      lh_hash_fn *hash_fn,
 			      lh_equal_fn *equal_fn)
 {
-	int i;
+	struct json_arena *a = json_arena_current();
+	int i, n = 1;
 	struct lh_table *t;
 
-	t = (struct lh_table*)calloc(1, sizeof(struct lh_table));
+	/* slots are picked with a mask rather than a modulo */
+	while (n < size) n <<= 1;
+
+	t = (struct lh_table*)json_arena_calloc(a, 1, sizeof(struct lh_table));
 	if (!t)
 		return NULL;
 
+	t->arena = a;
 	t->count = 0;
-	t->size = size;
-	t->table = (struct lh_entry*)calloc(size, sizeof(struct lh_entry));
+	t->size = n;
+	t->table = (struct lh_entry*)json_arena_malloc(a, n * sizeof(struct lh_entry));
 	if (!t->table)
 	{
-		free(t);
+		json_arena_release(a, t);
 		return NULL;
 	}
 	t->free_fn = free_fn;
 	t->hash_fn = hash_fn;
 	t->equal_fn = equal_fn;
-	for(i = 0; i < size; i++) t->table[i].k = LH_EMPTY;
+	for(i = 0; i < n; i++) t->table[i].k = LH_EMPTY;
 	return t;
 }
 
@@ -506,30 +512,37 @@ struct lh_table* lh_kptr_table_new(int size,
 
 int lh_table_resize(struct lh_table *t, int new_size)
 {
-	struct lh_table *new_t;
+	struct lh_entry *table, *ent, *head = NULL, *tail = NULL;
+	unsigned long mask;
+	int i;
 
-	new_t = lh_table_new(new_size, NULL, t->hash_fn, t->equal_fn);
-	if (new_t == NULL)
+	table = (struct lh_entry*)json_arena_malloc(t->arena, new_size * sizeof(struct lh_entry));
+	if (table == NULL)
 		return -1;
+	for(i = 0; i < new_size; i++) table[i].k = LH_EMPTY;
+	mask = new_size - 1;
 
-	for (struct lh_entry *ent = t->head; ent != NULL; ent = ent->next)
+	/* rehash in insertion order from the stored hashes, dropping the
+	   freed slots along the way */
+	for (ent = t->head; ent != NULL; ent = ent->next)
 	{
-		unsigned long h = lh_get_hash(new_t, ent->k);
-		unsigned int opts = 0;
-		if (ent->k_is_constant)
-			opts = JSON_C_OBJECT_KEY_IS_CONSTANT;
-		if (lh_table_insert_w_hash(new_t, ent->k, ent->v, h, opts) != 0)
-		{
-			lh_table_free(new_t);
-			return -1;
-		}
+		unsigned long n = ent->h & mask;
+		while (table[n].k != LH_EMPTY) n = (n + 1) & mask;
+		table[n].k = ent->k;
+		table[n].k_is_constant = ent->k_is_constant;
+		table[n].h = ent->h;
+		table[n].v = ent->v;
+		table[n].next = NULL;
+		table[n].prev = tail;
+		if (tail) tail->next = &table[n];
+		else head = &table[n];
+		tail = &table[n];
 	}
-	free(t->table);
-	t->table = new_t->table;
+	json_arena_release(t->arena, t->table);
+	t->table = table;
 	t->size = new_size;
-	t->head = new_t->head;
-	t->tail = new_t->tail;
-	free(new_t);
+	t->head = head;
+	t->tail = tail;
 
 	return 0;
 }
@@ -542,28 +555,30 @@ void lh_table_free(struct lh_table *t)
 			t->free_fn(c);
 		}
 	}
-	free(t->table);
-	free(t);
+	json_arena_release(t->arena, t->table);
+	json_arena_release(t->arena, t);
 }
 
 
 int lh_table_insert_w_hash(struct lh_table *t, void *k, const void *v, const unsigned long h, const unsigned opts)
 {
-	unsigned long n;
+	unsigned long n, mask;
 
 	if (t->count >= t->size * LH_LOAD_FACTOR)
 		if (lh_table_resize(t, t->size * 2) != 0)
 			return -1;
 
-	n = h % t->size;
+	mask = t->size - 1;
+	n = h & mask;
 
 	while( 1 ) {
 		if(t->table[n].k == LH_EMPTY || t->table[n].k == LH_FREED) break;
-		if ((int)++n == t->size) n = 0;
+		n = (n + 1) & mask;
 	}
 
 	t->table[n].k = k;
 	t->table[n].k_is_constant = (opts & JSON_C_OBJECT_KEY_IS_CONSTANT);
+	t->table[n].h = h;
 	t->table[n].v = v;
 	t->count++;
 
@@ -587,14 +602,15 @@ int lh_table_insert(struct lh_table *t, void *k, const void *v)
 
 struct lh_entry* lh_table_lookup_entry_w_hash(struct lh_table *t, const void *k, const unsigned long h)
 {
-	unsigned long n = h % t->size;
+	unsigned long mask = t->size - 1;
+	unsigned long n = h & mask;
 	int count = 0;
 
 	while( count < t->size ) {
 		if(t->table[n].k == LH_EMPTY) return NULL;
-		if(t->table[n].k != LH_FREED &&
+		if(t->table[n].k != LH_FREED && t->table[n].h == h &&
 		   t->equal_fn(t->table[n].k, k)) return &t->table[n];
-		if ((int)++n == t->size) n = 0;
+		n = (n + 1) & mask;
 		count++;
 	}
 	return NULL;
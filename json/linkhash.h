@@ -59,6 +59,7 @@ extern "C" {
 int json_global_set_string_hash(const int h);
 
 struct lh_entry;
+struct json_arena;
 
 /**
  * callback function prototypes
@@ -82,6 +83,10 @@ struct lh_entry {
 	 */
 	void *k;
 	int k_is_constant;
+	/**
+	 * The hash of the key, compared before equal_fn and reused on resize.
+	 */
+	unsigned long h;
 	/**
 	 * The value.
 	 */
@@ -102,7 +107,7 @@ struct lh_entry {
  */
 struct lh_table {
 	/**
-	 * Size of our hash.
+	 * Size of our hash, always a power of two.
 	 */
 	int size;
 	/**
@@ -128,6 +133,11 @@ struct lh_table {
 	lh_entry_free_fn *free_fn;
 	lh_hash_fn *hash_fn;
 	lh_equal_fn *equal_fn;
+
+	/**
+	 * Arena the table was allocated from, or NULL.
+	 */
+	struct json_arena *arena;
 };
 
 
@@ -26,6 +26,7 @@
 #endif /* HAVE_STDARG_H */
 
 #include "debug.h"
+#include "arena.h"
 #include "printbuf.h"
 
 static int printbuf_extend(struct printbuf *p, int min_size);
@@ -34,12 +35,15 @@ struct printbuf* printbuf_new(void)
 {
   struct printbuf *p;
 
-  p = (struct printbuf*)calloc(1, sizeof(struct printbuf));
+  struct json_arena *a = json_arena_current();
+
+  p = (struct printbuf*)json_arena_calloc(a, 1, sizeof(struct printbuf));
   if(!p) return NULL;
   p->size = 32;
   p->bpos = 0;
-  if(!(p->buf = (char*)malloc(p->size))) {
-    free(p);
+  p->arena = a;
+  if(!(p->buf = (char*)json_arena_malloc(a, p->size))) {
+    json_arena_release(a, p);
     return NULL;
   }
   return p;
@@ -70,7 +74,7 @@ static int printbuf_extend(struct printbuf *p, int min_size)
 	  "bpos=%d min_size=%d old_size=%d new_size=%d\n",
 	  p->bpos, min_size, p->size, new_size);
 #endif /* PRINTBUF_DEBUG */
-	if(!(t = (char*)realloc(p->buf, new_size)))
+	if(!(t = (char*)json_arena_realloc(p->arena, p->buf, p->size, new_size)))
 		return -1;
 	p->size = new_size;
 	p->buf = t;
@@ -187,7 +191,7 @@ void printbuf_reset(struct printbuf *p)
 void printbuf_free(struct printbuf *p)
 {
   if(p) {
-    free(p->buf);
-    free(p);
+    json_arena_release(p->arena, p->buf);
+    json_arena_release(p->arena, p);
   }
 }
@@ -20,10 +20,13 @@
 extern "C" {
 #endif
 
+struct json_arena;
+
 struct printbuf {
   char *buf;
   int bpos;
   int size;
+  struct json_arena *arena;
 };
 
 extern struct printbuf*
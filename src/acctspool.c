@@ -0,0 +1,470 @@
+/* -*- mode: c; c-basic-offset: 2 -*- */
+/*
+ * Copyright (C) 2007-2012 David Bird (Coova Technologies) <support@coova.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include "chilli.h"
+
+#ifdef ENABLE_ACCTSPOOL
+#include <sys/mman.h>
+
+/*
+ *  Accounting requests that no server acknowledged are appended to a
+ *  memory mapped file and replayed, rate limited, once a server
+ *  answers again. Records are only ever marked dead in place; the file
+ *  is rewound when it empties and compacted when it fills up.
+ */
+
+#define ACCT_SPOOL_MAGIC    0x43535031 /* CSP1 */
+#define ACCT_SPOOL_HASH     1024
+
+#define ACCT_SPOOL_DEAD     0
+#define ACCT_SPOOL_LIVE     1
+#define ACCT_SPOOL_INFLIGHT 2
+
+struct acct_spool_hdr {
+  uint32_t magic;
+  uint32_t size;                 /* Size of the file */
+  uint32_t head;                 /* First record that may be live */
+  uint32_t tail;                 /* End of the last record */
+};
+
+struct acct_spool_rec {
+  uint16_t len;                  /* Size of the record, 4 byte aligned */
+  uint8_t state;
+  uint8_t type;                  /* Acct-Status-Type */
+  uint32_t queued;               /* Wall clock time when spooled */
+  uint32_t hash;                 /* Hash of the Acct-Session-Id */
+};
+
+#define ACCT_SPOOL_REC(o) ((struct acct_spool_rec *)(spool.map + (o)))
+#define ACCT_SPOOL_PKT(r) ((struct radius_packet_t *)((r) + 1))
+
+static struct {
+  int fd;
+  uint8_t *map;
+  struct acct_spool_hdr *hdr;
+  uint32_t cursor;               /* Next record to replay */
+  uint32_t sess[ACCT_SPOOL_HASH];/* Latest spooled interim per session */
+  uint32_t records;              /* Live records */
+  int inflight;
+  int up;                        /* Did the last request get an answer? */
+  int dirty;
+
+  uint32_t spooled;
+  uint32_t replayed;
+  uint32_t acked;
+  uint32_t coalesced;
+  uint32_t dropped;
+  uint32_t rate;                 /* Replayed during the last second */
+} spool = { -1 };
+
+static uint32_t acct_spool_hash(struct radius_packet_t *pack, uint8_t *type) {
+  struct radius_attr_t *attr = NULL;
+
+  *type = 0;
+  if (!radius_getattr(pack, &attr, RADIUS_ATTR_ACCT_STATUS_TYPE, 0, 0, 0))
+    *type = ntohl(attr->v.i);
+
+  if (!radius_getattr(pack, &attr, RADIUS_ATTR_ACCT_SESSION_ID, 0, 0, 0))
+    return lookup(attr->v.t, attr->l - 2, 0x5ea1);
+
+  return 0;
+}
+
+/*
+ *  Walk the records: count live ones, turn requests that were in
+ *  flight when we stopped back into live ones and rebuild the session
+ *  index. A record that does not fit ends the spool.
+ */
+static void acct_spool_scan(void) {
+  uint32_t off = spool.hdr->head;
+
+  spool.records = 0;
+  spool.inflight = 0;
+  memset(spool.sess, 0, sizeof(spool.sess));
+
+  while (off < spool.hdr->tail) {
+    struct acct_spool_rec *rec = ACCT_SPOOL_REC(off);
+
+    if (rec->len < sizeof(*rec) + RADIUS_HDRSIZE ||
+	off + rec->len > spool.hdr->tail ||
+	ntohs(ACCT_SPOOL_PKT(rec)->length) > rec->len - sizeof(*rec)) {
+      syslog(LOG_WARNING, "accounting spool truncated at %u", off);
+      spool.hdr->tail = off;
+      break;
+    }
+
+    if (rec->state != ACCT_SPOOL_DEAD) {
+      rec->state = ACCT_SPOOL_LIVE;
+      spool.records++;
+      if (rec->type == RADIUS_STATUS_TYPE_INTERIM_UPDATE && rec->hash)
+	spool.sess[rec->hash % ACCT_SPOOL_HASH] = off;
+    }
+
+    off += rec->len;
+  }
+
+  spool.cursor = spool.hdr->head;
+}
+
+/*
+ *  Skip dead records at the head, rewinding the spool once empty.
+ */
+static void acct_spool_trim(void) {
+  struct acct_spool_hdr *hdr = spool.hdr;
+
+  while (hdr->head < hdr->tail &&
+	 ACCT_SPOOL_REC(hdr->head)->state == ACCT_SPOOL_DEAD)
+    hdr->head += ACCT_SPOOL_REC(hdr->head)->len;
+
+  if (hdr->head >= hdr->tail) {
+    hdr->head = hdr->tail = sizeof(*hdr);
+    spool.cursor = hdr->head;
+    memset(spool.sess, 0, sizeof(spool.sess));
+  } else if (spool.cursor < hdr->head) {
+    spool.cursor = hdr->head;
+  }
+
+  spool.dirty = 1;
+}
+
+/*
+ *  Move the live records to the front. Only done with nothing in
+ *  flight, as the queued requests point into the spool.
+ */
+static void acct_spool_compact(void) {
+  struct acct_spool_hdr *hdr = spool.hdr;
+  uint32_t off = hdr->head;
+  uint32_t to = sizeof(*hdr);
+
+  while (off < hdr->tail) {
+    struct acct_spool_rec *rec = ACCT_SPOOL_REC(off);
+    uint16_t len = rec->len;
+
+    if (rec->state != ACCT_SPOOL_DEAD) {
+      if (to != off)
+	memmove(spool.map + to, rec, len);
+      to += len;
+    }
+
+    off += len;
+  }
+
+  hdr->head = sizeof(*hdr);
+  hdr->tail = to;
+  acct_spool_scan();
+  spool.dirty = 1;
+}
+
+int acct_spool_open(void) {
+  size_t size = (size_t) _options.acctspoolsize * 1024;
+  struct stat st;
+  int fresh = 0;
+
+  if (!_options.acctspool || spool.map)
+    return 0;
+
+  if (size < 16 * 1024)
+    size = 16 * 1024;
+
+  if ((spool.fd = open(_options.acctspool, O_RDWR | O_CREAT, 0600)) < 0) {
+    syslog(LOG_ERR, "%s: could not open accounting spool %s",
+	   strerror(errno), _options.acctspool);
+    return -1;
+  }
+
+  coe(spool.fd);
+
+  if (fstat(spool.fd, &st)) {
+    syslog(LOG_ERR, "%s: fstat(%s)", strerror(errno), _options.acctspool);
+    close(spool.fd);
+    spool.fd = -1;
+    return -1;
+  }
+
+  if ((size_t) st.st_size != size) {
+    /* keep an existing spool at its size, records may be waiting */
+    if (st.st_size >= (off_t)(16 * 1024) && st.st_size <= (off_t) UINT32_MAX) {
+      size = st.st_size;
+    } else if (ftruncate(spool.fd, size)) {
+      syslog(LOG_ERR, "%s: ftruncate(%s)", strerror(errno), _options.acctspool);
+      close(spool.fd);
+      spool.fd = -1;
+      return -1;
+    }
+  }
+
+  spool.map = mmap(0, size, PROT_READ | PROT_WRITE, MAP_SHARED, spool.fd, 0);
+  if (spool.map == MAP_FAILED) {
+    syslog(LOG_ERR, "%s: mmap(%s)", strerror(errno), _options.acctspool);
+    spool.map = 0;
+    close(spool.fd);
+    spool.fd = -1;
+    return -1;
+  }
+
+  spool.hdr = (struct acct_spool_hdr *) spool.map;
+
+  if (spool.hdr->magic != ACCT_SPOOL_MAGIC ||
+      spool.hdr->size != size ||
+      spool.hdr->head < sizeof(*spool.hdr) ||
+      spool.hdr->head > spool.hdr->tail ||
+      spool.hdr->tail > size) {
+    spool.hdr->magic = ACCT_SPOOL_MAGIC;
+    spool.hdr->size = size;
+    spool.hdr->head = spool.hdr->tail = sizeof(*spool.hdr);
+    fresh = 1;
+  }
+
+  acct_spool_scan();
+
+  if (!fresh && spool.records)
+    syslog(LOG_NOTICE, "accounting spool %s has %u requests to replay",
+	   _options.acctspool, spool.records);
+
+  return 0;
+}
+
+void acct_spool_close(void) {
+  if (!spool.map) return;
+  msync(spool.map, spool.hdr->size, MS_SYNC);
+  munmap(spool.map, spool.hdr->size);
+  close(spool.fd);
+  spool.map = 0;
+  spool.hdr = 0;
+  spool.fd = -1;
+}
+
+int acct_spool_owns(void *cbp) {
+  return spool.map && (uint8_t *)cbp > spool.map &&
+      (uint8_t *)cbp < spool.map + spool.hdr->size;
+}
+
+/*
+ * acct_spool_add()
+ * Spool an accounting request that was not acknowledged. An earlier
+ * interim update of the same session, not yet replayed, is superseded.
+ */
+int acct_spool_add(struct radius_packet_t *pack) {
+  struct acct_spool_hdr *hdr = spool.hdr;
+  struct acct_spool_rec *rec;
+  uint16_t plen = ntohs(pack->length);
+  uint32_t len = (sizeof(*rec) + plen + 3) & ~3;
+  uint32_t hash;
+  uint32_t *sess;
+  uint8_t type;
+
+  if (!spool.map || pack->code != RADIUS_CODE_ACCOUNTING_REQUEST ||
+      plen < RADIUS_HDRSIZE || plen > RADIUS_PACKSIZE)
+    return -1;
+
+  spool.up = 0;
+
+  hash = acct_spool_hash(pack, &type);
+  sess = &spool.sess[hash % ACCT_SPOOL_HASH];
+
+  if (hash && *sess &&
+      (type == RADIUS_STATUS_TYPE_INTERIM_UPDATE ||
+       type == RADIUS_STATUS_TYPE_STOP)) {
+    rec = ACCT_SPOOL_REC(*sess);
+    if (rec->state == ACCT_SPOOL_LIVE && rec->hash == hash &&
+	rec->type == RADIUS_STATUS_TYPE_INTERIM_UPDATE) {
+      rec->state = ACCT_SPOOL_DEAD;
+      spool.records--;
+      spool.coalesced++;
+    }
+    *sess = 0;
+  }
+
+  if (hdr->tail + len > hdr->size && !spool.inflight)
+    acct_spool_compact();
+
+  if (hdr->tail + len > hdr->size) {
+    syslog(LOG_ERR, "accounting spool full, dropping request (type %d)",
+	   type);
+    spool.dropped++;
+    return -1;
+  }
+
+  rec = ACCT_SPOOL_REC(hdr->tail);
+  rec->len = len;
+  rec->type = type;
+  rec->hash = hash;
+  rec->queued = mainclock_wall();
+  memcpy(ACCT_SPOOL_PKT(rec), pack, plen);
+  rec->state = ACCT_SPOOL_LIVE;
+
+  if (type == RADIUS_STATUS_TYPE_INTERIM_UPDATE && hash)
+    *sess = hdr->tail;
+
+  hdr->tail += len;
+  spool.records++;
+  spool.spooled++;
+  spool.dirty = 1;
+
+  if (_options.debug)
+    syslog(LOG_DEBUG, "%s(%d): spooled accounting request type %d, %u waiting",
+	   __FUNCTION__, __LINE__, type, spool.records);
+
+  return 0;
+}
+
+/*
+ * acct_spool_conf()
+ * Answer (or timeout) of a replayed request.
+ */
+int acct_spool_conf(struct radius_packet_t *pack, void *cbp) {
+  struct acct_spool_rec *rec = (struct acct_spool_rec *) cbp;
+
+  if (rec->state != ACCT_SPOOL_INFLIGHT)
+    return 0;
+
+  spool.inflight--;
+
+  if (!pack) {
+    rec->state = ACCT_SPOOL_LIVE;
+    spool.up = 0;
+    return 0;
+  }
+
+  rec->state = ACCT_SPOOL_DEAD;
+  spool.records--;
+  spool.acked++;
+  spool.up = 1;
+  acct_spool_trim();
+  return 0;
+}
+
+void acct_spool_ok(void) {
+  spool.up = 1;
+}
+
+/*
+ * acct_spool_replay()
+ * Called once a second. Replays up to acctspoolrate requests while
+ * the server answers, otherwise a single one at a time as a probe.
+ */
+void acct_spool_replay(struct radius_t *radius) {
+  struct acct_spool_hdr *hdr = spool.hdr;
+  struct radius_packet_t pack;
+  struct radius_attr_t *attr = NULL;
+  uint32_t end, delay;
+  int limit = spool.up ? _options.acctspoolrate : 1;
+  int sent = 0;
+
+  if (!spool.map) return;
+
+  if (spool.dirty) {
+    msync(spool.map, hdr->size, MS_ASYNC);
+    spool.dirty = 0;
+  }
+
+  spool.rate = 0;
+
+  if (!spool.records || (!spool.up && spool.inflight))
+    return;
+
+  if (spool.cursor < hdr->head || spool.cursor >= hdr->tail)
+    spool.cursor = hdr->head;
+
+  end = hdr->tail;
+
+  while (sent < limit && spool.cursor < end) {
+    struct acct_spool_rec *rec = ACCT_SPOOL_REC(spool.cursor);
+    struct radius_packet_t *p = ACCT_SPOOL_PKT(rec);
+    size_t len = ntohs(p->length) - RADIUS_HDRSIZE;
+
+    if (rec->state != ACCT_SPOOL_LIVE) {
+      spool.cursor += rec->len;
+      continue;
+    }
+
+    if (radius_default_pack(radius, &pack, RADIUS_CODE_ACCOUNTING_REQUEST))
+      break;
+
+    memcpy(pack.payload, p->payload, len);
+    pack.length = htons(len + RADIUS_HDRSIZE);
+
+    /* Account for the time spent in the spool */
+    delay = mainclock_wall() - rec->queued;
+    if (!radius_getattr(&pack, &attr, RADIUS_ATTR_ACCT_DELAY_TIME, 0, 0, 0))
+      attr->v.i = htonl(ntohl(attr->v.i) + delay);
+    else
+      radius_addattr(radius, &pack, RADIUS_ATTR_ACCT_DELAY_TIME, 0, 0,
+		     delay, NULL, 0);
+
+    rec->state = ACCT_SPOOL_INFLIGHT;
+    spool.inflight++;
+
+    if (radius_req(radius, &pack, rec)) {
+      rec->state = ACCT_SPOOL_LIVE;
+      spool.inflight--;
+      break;
+    }
+
+    spool.cursor += rec->len;
+    spool.replayed++;
+    sent++;
+  }
+
+  spool.rate = sent;
+}
+
+/*
+ * acct_spool_drain()
+ * On shutdown, spool the accounting requests still waiting for an
+ * answer.
+ */
+void acct_spool_drain(struct radius_t *radius) {
+  int size = radius->qsize ? radius->qsize :
+      radius->nsocks * RADIUS_QUEUESIZE;
+  int n;
+
+  if (!spool.map || !radius->queue) return;
+
+  for (n = 0; n < size; n++) {
+    struct radius_queue_t *q = &radius->queue[n];
+    if (q->state == 1 && RADIUS_QUEUE_HASPKT(q->p) &&
+	RADIUS_QUEUE_PKT(q->p, code) == RADIUS_CODE_ACCOUNTING_REQUEST &&
+	!acct_spool_owns(q->cbp))
+      acct_spool_add(RADIUS_QUEUE_PKTPTR(q->p));
+  }
+}
+
+#ifdef ENABLE_CHILLIQUERY
+void acct_spool_print(int fd) {
+  char line[512];
+
+  if (!spool.map) return;
+
+  snprintf(line, sizeof(line),
+	   "acctspool: waiting=%u bytes=%u/%u server=%s inflight=%d "
+	   "spooled=%u replayed=%u acked=%u coalesced=%u dropped=%u "
+	   "rate=%u/s (max %d/s)\n",
+	   spool.records,
+	   spool.hdr->tail - spool.hdr->head, spool.hdr->size,
+	   spool.up ? "up" : "down", spool.inflight,
+	   spool.spooled, spool.replayed, spool.acked,
+	   spool.coalesced, spool.dropped,
+	   spool.rate, _options.acctspoolrate);
+
+  if (!safe_write(fd, line, strlen(line)))
+    /* error */ ;
+}
+#endif
+#endif
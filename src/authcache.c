@@ -0,0 +1,329 @@
+/* -*- mode: c; c-basic-offset: 2 -*- */
+/*
+ * Copyright (C) 2007-2012 David Bird (Coova Technologies) <support@coova.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include "chilli.h"
+
+#ifdef ENABLE_AUTHCACHE
+
+/*
+ *  Cache of PAP Access-Accepts (MAC authentication and re-logins), so
+ *  that a returning device is let in again without a RADIUS round trip.
+ *  The table is direct mapped on a hash of the requested User-Name; an
+ *  entry is bound to the MAC address and a digest of the password and
+ *  holds the session parameters config_radius_session() derived from
+ *  the Access-Accept. Entries live no longer than authcachettl, the
+ *  Session-Timeout or the WISPr-Session-Terminate-Time, and are dropped
+ *  on an Access-Reject or a CoA / Disconnect-Request for the user.
+ */
+
+struct auth_cache_entry {
+  uint32_t hash;
+  time_t stored;                 /* time of the Access-Accept, 0 = unused */
+  time_t expires;
+  uint8_t mac[PKT_ETH_ALEN];
+  uint8_t digest[RADIUS_MD5LEN]; /* of the MAC address and password */
+  char user[USERNAMESIZE];       /* User-Name of the Access-Request */
+  char name[USERNAMESIZE];       /* User-Name of the session */
+  uint8_t classbuf[RADIUS_ATTR_VLEN];
+  size_t classlen;
+  struct session_params params;
+};
+
+static struct auth_cache_entry *_auth_cache = 0;
+static uint32_t _auth_cache_size = 0;
+
+static struct {
+  uint64_t lookups;
+  uint64_t hits;
+  uint64_t expired;
+  uint64_t mismatch;             /* same user, other MAC or password */
+  uint64_t stores;
+  uint64_t evictions;
+  uint64_t invalidated;
+} _auth_cache_stats;
+
+static int auth_cache_init(void) {
+  uint32_t size = 1;
+
+  if (_auth_cache) return 0;
+  if (_options.authcache <= 0) return -1;
+
+  while (size < (uint32_t) _options.authcache && size < (1 << 16))
+    size <<= 1;
+
+  _auth_cache = calloc(size, sizeof(struct auth_cache_entry));
+  if (!_auth_cache) {
+    syslog(LOG_ERR, "%s: could not allocate auth cache of %d entries",
+           strerror(errno), size);
+    return -1;
+  }
+
+  _auth_cache_size = size;
+  return 0;
+}
+
+static void auth_cache_clear(struct auth_cache_entry *e) {
+#ifdef ENABLE_SESSGARDEN
+  garden_ruleset_release(e->params.garden);
+  e->params.garden = 0;
+#endif
+  e->stored = 0;
+}
+
+void auth_cache_flush(void) {
+  uint32_t i;
+
+  if (!_auth_cache) return;
+
+  for (i = 0; i < _auth_cache_size; i++)
+    if (_auth_cache[i].stored)
+      auth_cache_clear(&_auth_cache[i]);
+
+  free(_auth_cache);
+  _auth_cache = 0;
+  _auth_cache_size = 0;
+}
+
+static struct auth_cache_entry *
+auth_cache_slot(char *user, uint32_t *hash) {
+  *hash = lookup((uint8_t *) user, strlen(user), 0);
+  return &_auth_cache[*hash & (_auth_cache_size - 1)];
+}
+
+static void auth_cache_digest(uint8_t *mac, uint8_t *pwd, size_t len,
+			      uint8_t *digest) {
+  MD5_CTX context;
+  MD5Init(&context);
+  MD5Update(&context, mac, PKT_ETH_ALEN);
+  MD5Update(&context, pwd, len);
+  MD5Final(digest, &context);
+}
+
+/*
+ *  Called by auth_radius() with the credentials about to be sent. On a
+ *  hit the session parameters, User-Name and Class of the cached
+ *  Access-Accept are applied to the connection and 0 is returned.
+ */
+int auth_cache_lookup(struct app_conn_t *appconn, char *user, char *pwd) {
+  struct dhcp_conn_t *dhcpconn = (struct dhcp_conn_t *)appconn->dnlink;
+  struct auth_cache_entry *e;
+  uint8_t digest[RADIUS_MD5LEN];
+  uint32_t hash;
+  time_t age;
+
+  if (!_auth_cache || !dhcpconn || appconn->is_adminsession)
+    return -1;
+
+  _auth_cache_stats.lookups++;
+
+  e = auth_cache_slot(user, &hash);
+  if (!e->stored || e->hash != hash || strcmp(e->user, user))
+    return -1;
+
+  if (mainclock_now() >= e->expires) {
+    _auth_cache_stats.expired++;
+    auth_cache_clear(e);
+    return -1;
+  }
+
+  auth_cache_digest(dhcpconn->hismac, (uint8_t *) pwd, strlen(pwd), digest);
+
+  if (memcmp(e->mac, dhcpconn->hismac, PKT_ETH_ALEN) ||
+      memcmp(e->digest, digest, RADIUS_MD5LEN)) {
+    _auth_cache_stats.mismatch++;
+    return -1;
+  }
+
+  _auth_cache_stats.hits++;
+
+#ifdef ENABLE_SESSGARDEN
+  garden_ruleset_release(appconn->s_params.garden);
+#endif
+  memcpy(&appconn->s_params, &e->params, sizeof(e->params));
+#ifdef ENABLE_SESSGARDEN
+  garden_ruleset_ref(appconn->s_params.garden);
+#endif
+
+  /* What is left of the Session-Timeout granted */
+  age = mainclock_now() - e->stored;
+  if (appconn->s_params.sessiontimeout)
+    appconn->s_params.sessiontimeout -= age;
+
+  strlcpy(appconn->s_state.redir.username, e->name, USERNAMESIZE);
+  memcpy(appconn->s_state.redir.classbuf, e->classbuf, e->classlen);
+  appconn->s_state.redir.classlen = e->classlen;
+
+  if (_options.debug)
+    syslog(LOG_DEBUG, "%s(%d): Access-Accept of %s cached %d seconds ago",
+           __FUNCTION__, __LINE__, user, (int) age);
+
+  return 0;
+}
+
+/*
+ *  Called by cb_radius_auth_conf() once a PAP Access-Accept has been
+ *  applied to the connection; pack_req is the request it answers.
+ */
+void auth_cache_store(struct radius_t *radius,
+		      struct radius_packet_t *pack_req,
+		      struct app_conn_t *appconn) {
+  struct dhcp_conn_t *dhcpconn = (struct dhcp_conn_t *)appconn->dnlink;
+  struct radius_attr_t *uattr = NULL;
+  struct radius_attr_t *pattr = NULL;
+  struct auth_cache_entry *e;
+  char user[USERNAMESIZE];
+  uint8_t pwd[RADIUS_PWSIZE + 1];
+  size_t pwdlen = 0;
+  uint32_t hash;
+  time_t ttl = _options.authcachettl;
+
+  if (!dhcpconn || !pack_req || appconn->is_adminsession ||
+      appconn->authtype != PAP_PASSWORD)
+    return;
+
+#ifdef ENABLE_DHCPRADIUS
+  /* the DHCP options given along are not kept */
+  if (_options.dhcpradius)
+    return;
+#endif
+
+  if (appconn->s_params.sessiontimeout &&
+      appconn->s_params.sessiontimeout < (uint64_t) ttl)
+    ttl = (time_t) appconn->s_params.sessiontimeout;
+
+  if (appconn->s_params.sessionterminatetime) {
+    int left = - mainclock_rtdiff(appconn->s_params.sessionterminatetime);
+    if (left < ttl) ttl = left;
+  }
+
+  if (ttl <= 0 || auth_cache_init())
+    return;
+
+  if (radius_getattr(pack_req, &uattr, RADIUS_ATTR_USER_NAME, 0, 0, 0) ||
+      radius_getattr(pack_req, &pattr, RADIUS_ATTR_USER_PASSWORD, 0, 0, 0) ||
+      uattr->l - 2 >= USERNAMESIZE)
+    return;
+
+  memcpy(user, uattr->v.t, uattr->l - 2);
+  user[uattr->l - 2] = 0;
+
+  if (radius_pwdecode(radius, pwd, RADIUS_PWSIZE, &pwdlen,
+		      (uint8_t *) &pattr->v.t, pattr->l - 2,
+		      pack_req->authenticator,
+		      radius->rsecret, radius->rsecretlen))
+    return;
+
+  pwd[pwdlen] = 0;
+  pwdlen = strlen((char *) pwd);
+
+  e = auth_cache_slot(user, &hash);
+  if (e->stored) {
+    if (e->hash != hash || strcmp(e->user, user))
+      _auth_cache_stats.evictions++;
+    auth_cache_clear(e);
+  }
+
+  e->hash = hash;
+  e->stored = mainclock_now();
+  e->expires = e->stored + ttl;
+  memcpy(e->mac, dhcpconn->hismac, PKT_ETH_ALEN);
+  auth_cache_digest(dhcpconn->hismac, pwd, pwdlen, e->digest);
+  memset(pwd, 0, sizeof(pwd));
+
+  strlcpy(e->user, user, USERNAMESIZE);
+  strlcpy(e->name, appconn->s_state.redir.username, USERNAMESIZE);
+  e->classlen = appconn->s_state.redir.classlen;
+  memcpy(e->classbuf, appconn->s_state.redir.classbuf, e->classlen);
+
+  memcpy(&e->params, &appconn->s_params, sizeof(e->params));
+#ifdef ENABLE_SESSGARDEN
+  garden_ruleset_ref(e->params.garden);
+#endif
+
+  _auth_cache_stats.stores++;
+}
+
+/*
+ *  Drops the entry of an Access-Request that got rejected.
+ */
+void auth_cache_reject(struct radius_packet_t *pack_req) {
+  struct radius_attr_t *uattr = NULL;
+  struct auth_cache_entry *e;
+  char user[USERNAMESIZE];
+  uint32_t hash;
+
+  if (!_auth_cache || !pack_req ||
+      radius_getattr(pack_req, &uattr, RADIUS_ATTR_USER_NAME, 0, 0, 0) ||
+      uattr->l - 2 >= USERNAMESIZE)
+    return;
+
+  memcpy(user, uattr->v.t, uattr->l - 2);
+  user[uattr->l - 2] = 0;
+
+  e = auth_cache_slot(user, &hash);
+  if (e->stored && e->hash == hash && !strcmp(e->user, user)) {
+    _auth_cache_stats.invalidated++;
+    auth_cache_clear(e);
+  }
+}
+
+/*
+ *  Drops all entries of a user named in a CoA or Disconnect-Request,
+ *  which may be the User-Name the Access-Accept gave the session, so
+ *  the whole table is looked at; these requests are rare.
+ */
+void auth_cache_invalidate(uint8_t *name, size_t len) {
+  uint32_t i;
+
+  if (!_auth_cache) return;
+
+  for (i = 0; i < _auth_cache_size; i++) {
+    struct auth_cache_entry *e = &_auth_cache[i];
+    if (!e->stored) continue;
+    if ((strlen(e->user) == len && !memcmp(e->user, name, len)) ||
+	(strlen(e->name) == len && !memcmp(e->name, name, len))) {
+      _auth_cache_stats.invalidated++;
+      auth_cache_clear(e);
+    }
+  }
+}
+
+#ifdef ENABLE_CHILLIQUERY
+void auth_cache_print(int fd) {
+  char line[512];
+  uint64_t l = _auth_cache_stats.lookups;
+  uint64_t h = _auth_cache_stats.hits;
+
+  snprintf(line, sizeof line,
+           "authcache (%u slots): lookups=%llu hits=%llu (%llu%%)"
+           " expired=%llu mismatch=%llu stored=%llu evicted=%llu"
+           " invalidated=%llu\n",
+           _auth_cache_size,
+           (unsigned long long) l, (unsigned long long) h,
+           (unsigned long long) (l ? h * 100 / l : 0),
+           (unsigned long long) _auth_cache_stats.expired,
+           (unsigned long long) _auth_cache_stats.mismatch,
+           (unsigned long long) _auth_cache_stats.stores,
+           (unsigned long long) _auth_cache_stats.evictions,
+           (unsigned long long) _auth_cache_stats.invalidated);
+  if (!safe_write(fd, line, strlen(line))) /* error */
+    ;
+}
+#endif
+#endif
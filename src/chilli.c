@@ -66,6 +66,16 @@ static int acct_req(acct_type type,
 		    struct app_conn_t *conn,
 		    uint8_t status_type);
 
+#ifdef ENABLE_AUTHCACHE
+static int upprot_getip(struct app_conn_t *appconn,
+			struct in_addr *hisip,
+			struct in_addr *hismask);
+#endif
+
+#ifdef ENABLE_COA
+static void coa_index_drop(void);
+#endif
+
 static pid_t chilli_pid = 0;
 
 #ifdef ENABLE_CHILLIPROXY
@@ -895,6 +905,91 @@ static int initconn(void) {
   return 0;
 }
 
+/*
+ * Interim accounting pacing. The first interim update of a session is
+ * brought forward by a share of interimjitter derived from its session
+ * id. With interimrate, updates beyond the budget are left due and the
+ * next checkconn() resumes its walk at the first session deferred.
+ */
+static struct app_conn_t *interim_resume = 0;
+
+static struct {
+  time_t refill;
+  uint32_t tokens;
+  uint32_t check;      /* sent in the current check */
+  uint32_t backlog;    /* deferred in the current check */
+  uint64_t due;
+  uint64_t sent;
+  uint64_t deferred;
+  uint32_t peak;       /* most sent by one check */
+  uint32_t late;       /* most seconds an update was overdue */
+} interim_stats;
+
+static uint32_t interim_due(struct app_conn_t *conn) {
+  uint32_t interval = conn->s_params.interim_interval;
+  uint32_t spread = interval * _options.interimjitter / 100;
+
+  if (!spread || conn->s_state.interim_time != conn->s_state.start_time)
+    return interval;
+
+  return interval - lookup((uint8_t *)conn->s_state.sessionid,
+			   strlen(conn->s_state.sessionid),
+			   conn->unit) % (spread + 1);
+}
+
+static void interim_check(void) {
+  if (_options.interimrate) {
+    uint64_t tokens = interim_stats.tokens + (uint64_t)
+        _options.interimrate * mainclock_diffu(interim_stats.refill);
+    uint64_t cap = (uint64_t) _options.interimrate * CHECK_INTERVAL;
+    interim_stats.tokens = tokens > cap ? cap : tokens;
+  }
+  interim_stats.refill = mainclock.tv_sec;
+  interim_stats.check = 0;
+  interim_stats.backlog = 0;
+}
+
+static int interim_send(struct app_conn_t *conn, uint32_t late) {
+  interim_stats.due++;
+
+  if (_options.interimrate && conn != &admin_session) {
+    if (!interim_stats.tokens) {
+      interim_stats.deferred++;
+      interim_stats.backlog++;
+      if (!interim_resume)
+	interim_resume = conn;
+      return 0;
+    }
+    interim_stats.tokens--;
+  }
+
+  interim_stats.sent++;
+  if (++interim_stats.check > interim_stats.peak)
+    interim_stats.peak = interim_stats.check;
+  if (late > interim_stats.late)
+    interim_stats.late = late;
+
+  return 1;
+}
+
+#ifdef ENABLE_CHILLIQUERY
+static void interim_print(int fd) {
+  char line[256];
+
+  snprintf(line, sizeof line,
+	   "interim (jitter %d%%, rate %u/s): due=%llu sent=%llu"
+	   " deferred=%llu backlog=%u peak=%u/check late=%us\n",
+	   _options.interimjitter, _options.interimrate,
+	   (unsigned long long) interim_stats.due,
+	   (unsigned long long) interim_stats.sent,
+	   (unsigned long long) interim_stats.deferred,
+	   interim_stats.backlog, interim_stats.peak,
+	   interim_stats.late);
+  if (!safe_write(fd, line, strlen(line))) /* error */
+    ;
+}
+#endif
+
 int chilli_new_conn(struct app_conn_t **conn) {
   int n;
 
@@ -961,9 +1056,9 @@ int static freeconn(struct app_conn_t *conn) {
   }
 #endif
 
-#ifdef WITH_PATRICIA
-  if (conn->ptree)
-    patricia_destroy (conn->ptree, free);
+#ifdef ENABLE_SESSGARDEN
+  garden_ruleset_release(conn->s_params.garden);
+  conn->s_params.garden = 0;
 #endif
 
 #if defined(ENABLE_LOCATION) && defined(HAVE_AVL)
@@ -971,6 +1066,9 @@ int static freeconn(struct app_conn_t *conn) {
   if (conn->loc_search_node!=NULL) location_close_conn(conn,1);
 #endif
 
+  if (interim_resume == conn)
+    interim_resume = conn->next;
+
   /* Remove from link of used */
   if ((conn->next) && (conn->prev)) {
     conn->next->prev = conn->prev;
@@ -1098,10 +1196,12 @@ void session_interval(struct app_conn_t *conn) {
   uint32_t sessiontime;
   uint32_t idletime;
   uint32_t interimtime;
+  uint32_t interimdue;
 
   sessiontime = mainclock_diffu(conn->s_state.start_time);
   idletime    = mainclock_diffu(conn->s_state.last_up_time);
   interimtime = mainclock_diffu(conn->s_state.interim_time);
+  interimdue  = interim_due(conn);
 
   if (conn->s_state.authenticated == 1) {
     if ((conn->s_params.sessiontimeout) &&
@@ -1154,7 +1254,8 @@ void session_interval(struct app_conn_t *conn) {
       terminate_appconn(conn, RADIUS_TERMINATE_CAUSE_SESSION_TIMEOUT);
     }
     else if ((conn->s_params.interim_interval) &&
-	     (interimtime >= conn->s_params.interim_interval)) {
+	     (interimtime >= interimdue) &&
+	     interim_send(conn, interimtime - interimdue)) {
 
 #ifdef ENABLE_MODULES
       { int i;
@@ -1184,7 +1285,7 @@ void session_interval(struct app_conn_t *conn) {
 }
 
 static int checkconn(void) {
-  struct app_conn_t *conn;
+  struct app_conn_t *conn, *start, *next;
   struct dhcp_conn_t* dhcpconn;
   uint32_t checkdiff;
   uint32_t rereaddiff;
@@ -1202,11 +1303,18 @@ static int checkconn(void) {
 
   checktime = mainclock.tv_sec;
 
+  interim_check();
+
   if (admin_session.s_state.authenticated) {
     session_interval(&admin_session);
   }
 
-  for (conn = firstusedconn; conn; conn=conn->next) {
+  start = interim_resume ? interim_resume : firstusedconn;
+  interim_resume = 0;
+
+  for (conn = start; conn; conn = next) {
+    next = conn->next ? conn->next : firstusedconn;
+    if (next == start) next = 0;
     if (conn->inuse != 0) {
       if (
 #ifdef ENABLE_LAYER3
@@ -1591,6 +1699,13 @@ int static auth_radius(struct app_conn_t *appconn,
     }
   }
 
+#ifdef ENABLE_AUTHCACHE
+  if (!auth_cache_lookup(appconn, username, password)) {
+    appconn->authtype = PAP_PASSWORD;
+    return upprot_getip(appconn, &appconn->reqip, 0);
+  }
+#endif
+
   radius_addattr(radius, &radius_pack, RADIUS_ATTR_USER_NAME, 0, 0, 0,
 		 (uint8_t *) username, strlen(username));
 
@@ -2904,6 +3019,9 @@ int cb_redir_getstate(struct redir_t *redir,
 
   memcpy(&conn->s_params, &appconn->s_params, sizeof(appconn->s_params));
   memcpy(&conn->s_state,  &appconn->s_state,  sizeof(appconn->s_state));
+#ifdef ENABLE_SESSGARDEN
+  garden_ruleset_ref(conn->s_params.garden);
+#endif
 
   /* reset state */
   appconn->uamexit = 0;
@@ -4148,28 +4266,10 @@ config_radius_session(struct session_params *params,
 	name[len]=0;
 
 	if (len == 5 && !memcmp(name,"reset",5)) {
-	  params->pass_through_count = 0;
-#ifdef HAVE_PATRICIA
-	  if (appconn && appconn->ptree) {
-	    patricia_destroy (appconn->ptree, free);
-	    appconn->ptree = NULL;
-	  }
-#endif
+	  garden_ruleset_release(params->garden);
+	  params->garden = 0;
 	} else {
-
-#ifdef HAVE_PATRICIA
-	  if (appconn && appconn->ptree == NULL)
-	    appconn->ptree = patricia_new (32);
-#endif
-
-	  pass_throughs_from_string(params->pass_throughs,
-				    SESSION_PASS_THROUGH_MAX,
-				    &params->pass_through_count,
-				    name, 0, 0
-#ifdef HAVE_PATRICIA
-				    , appconn ? appconn->ptree : 0
-#endif
-				    );
+	  garden_ruleset_from_string(&params->garden, name, 0, 0);
 	}
       }
 #endif
@@ -4404,6 +4504,20 @@ int cb_radius_acct_conf(struct radius_t *radius,
 			struct radius_packet_t *pack_req, void *cbp) {
   struct app_conn_t *appconn = (struct app_conn_t*) cbp;
 
+#ifdef ENABLE_ACCTSPOOL
+  if (_options.acctspool) {
+    if (acct_spool_owns(cbp))
+      return acct_spool_conf(pack, cbp);
+    if (!pack)
+      acct_spool_add(pack_req);
+    else
+      acct_spool_ok();
+  }
+
+  if (!_options.acct_update)
+    return 0;
+#endif
+
   if (!appconn) {
     syslog(LOG_ERR,"No peer protocol defined");
     return 0;
@@ -4448,6 +4562,11 @@ int cb_radius_auth_conf(struct radius_t *radius,
 
   struct dhcp_conn_t *dhcpconn = NULL;
 
+#ifdef ENABLE_COA
+  /* may name a session after the CoA index was built */
+  coa_index_drop();
+#endif
+
   if (!appconn) {
     syslog(LOG_ERR,"No peer protocol defined");
     return 0;
@@ -4627,6 +4746,9 @@ int cb_radius_auth_conf(struct radius_t *radius,
   if (pack->code == RADIUS_CODE_ACCESS_REJECT) {
     if (_options.debug)
       syslog(LOG_DEBUG, "%s(%d): Received RADIUS Access-Reject", __FUNCTION__, __LINE__);
+#ifdef ENABLE_AUTHCACHE
+    auth_cache_reject(pack_req);
+#endif
     config_radius_session(&appconn->s_params, pack, appconn, 0); /*XXX*/
     return dnprot_reject(appconn);
   }
@@ -4741,7 +4863,7 @@ int cb_radius_auth_conf(struct radius_t *radius,
     if (radius_keydecode(radius, appconn->sendkey, RADIUS_ATTR_VLEN, &appconn->sendlen,
 			 (uint8_t *)&sendattr->v.t, sendattr->l-2,
 			 pack_req->authenticator,
-			 radius->secret, radius->secretlen)) {
+			 radius->rsecret, radius->rsecretlen)) {
       syslog(LOG_ERR, "radius_keydecode() failed!");
       return dnprot_reject(appconn);
     }
@@ -4754,7 +4876,7 @@ int cb_radius_auth_conf(struct radius_t *radius,
     if (radius_keydecode(radius, appconn->recvkey, RADIUS_ATTR_VLEN, &appconn->recvlen,
 			 (uint8_t *)&recvattr->v.t, recvattr->l-2,
 			 pack_req->authenticator,
-			 radius->secret, radius->secretlen) ) {
+			 radius->rsecret, radius->rsecretlen) ) {
       syslog(LOG_ERR, "radius_keydecode() failed!");
       return dnprot_reject(appconn);
     }
@@ -4769,7 +4891,7 @@ int cb_radius_auth_conf(struct radius_t *radius,
     if (radius_pwdecode(radius, appconn->lmntkeys, RADIUS_MPPEKEYSSIZE,
 			&appconn->lmntlen, (uint8_t *)&lmntattr->v.t,
 			lmntattr->l-2, pack_req->authenticator,
-			radius->secret, radius->secretlen)) {
+			radius->rsecret, radius->rsecretlen)) {
       syslog(LOG_ERR, "radius_pwdecode() failed");
       return dnprot_reject(appconn);
     }
@@ -4847,20 +4969,242 @@ int cb_radius_auth_conf(struct radius_t *radius,
       return dnprot_reject(appconn);
   }
 
+#ifdef ENABLE_AUTHCACHE
+  if (!force_ip)
+    auth_cache_store(radius, pack_req, appconn);
+#endif
+
   return upprot_getip(appconn, &hisip, &hismask);
 }
 
 #ifdef ENABLE_COA
+/*
+ *  Index of the sessions by User-Name and Acct-Session-Id for the CoA
+ *  and Disconnect-Requests of one read of the RADIUS socket. It is
+ *  built by the first request that needs it and dropped once the batch
+ *  is done, or when an Access-Accept in it may have named a session.
+ *  Framed-IP-Address and Calling-Station-Id go through the IP pool and
+ *  DHCP hashes instead.
+ */
+#define COA_KEY_USER 1
+#define COA_KEY_SESSIONID 2
+
+static struct {
+  int *buckets;
+  struct coa_index_ent {
+    struct app_conn_t *conn;
+    int next;
+  } *ents;
+  int nbuckets;
+  int size;
+  char valid;
+} coa_index;
+
+static void coa_index_drop(void) {
+  coa_index.valid = 0;
+}
+
+/*
+ *  Acct-Session-Id is compared case-insensitively (see coa_attr_matches),
+ *  so it is hashed case folded.
+ */
+static uint32_t coa_index_hash(uint8_t *s, size_t len, uint32_t key) {
+  uint8_t folded[256];
+  size_t i;
+
+  if (key != COA_KEY_SESSIONID)
+    return lookup(s, len, key);
+
+  if (len > sizeof(folded))
+    len = sizeof(folded);
+  for (i = 0; i < len; i++)
+    folded[i] = tolower(s[i]);
+  return lookup(folded, len, key);
+}
+
+static void coa_index_add(int *n, uint32_t h, struct app_conn_t *appconn) {
+  int *bucket = &coa_index.buckets[h & (coa_index.nbuckets - 1)];
+  coa_index.ents[*n].conn = appconn;
+  coa_index.ents[*n].next = *bucket;
+  *bucket = (*n)++;
+}
+
+static int coa_index_build(void) {
+  struct app_conn_t *appconn;
+  int count = 0, n = 0;
+  int nbuckets = 64;
+
+  if (coa_index.valid) return 0;
+
+  for (appconn = firstusedconn; appconn; appconn = appconn->next)
+    count++;
+
+  while (nbuckets < 2 * count)
+    nbuckets <<= 1;
+
+  if (2 * count > coa_index.size) {
+    struct coa_index_ent *ents = (struct coa_index_ent *)
+        realloc(coa_index.ents, 2 * nbuckets * sizeof(struct coa_index_ent));
+    if (!ents) return -1;
+    coa_index.ents = ents;
+    coa_index.size = 2 * nbuckets;
+  }
+
+  if (nbuckets != coa_index.nbuckets) {
+    int *buckets = (int *) realloc(coa_index.buckets, nbuckets * sizeof(int));
+    if (!buckets) return -1;
+    coa_index.buckets = buckets;
+    coa_index.nbuckets = nbuckets;
+  }
+
+  memset(coa_index.buckets, 0xff, nbuckets * sizeof(int));
+
+  for (appconn = firstusedconn; appconn; appconn = appconn->next) {
+    char *u = appconn->s_state.redir.username;
+    char *sid = appconn->s_state.sessionid;
+    if (u[0])
+      coa_index_add(&n, coa_index_hash((uint8_t *) u, strlen(u),
+				       COA_KEY_USER), appconn);
+    if (sid[0])
+      coa_index_add(&n, coa_index_hash((uint8_t *) sid, strlen(sid),
+				       COA_KEY_SESSIONID), appconn);
+  }
+
+  coa_index.valid = 1;
+  return 0;
+}
+
+static int coa_parse_mac(struct radius_attr_t *attr, uint8_t *mac) {
+  int i, n = 0, len = attr->l - 2;
+  unsigned int v;
+
+  for (i = 0; i < len && n < PKT_ETH_ALEN; ) {
+    char hex[3];
+    if (!isxdigit(attr->v.t[i])) { i++; continue; }
+    if (i + 1 >= len || !isxdigit(attr->v.t[i+1])) return -1;
+    hex[0] = attr->v.t[i]; hex[1] = attr->v.t[i+1]; hex[2] = 0;
+    sscanf(hex, "%2x", &v);
+    mac[n++] = (uint8_t) v;
+    i += 2;
+  }
+
+  return n == PKT_ETH_ALEN ? 0 : -1;
+}
+
+/*
+ *  A session matches when, for every identifying attribute type in the
+ *  request, one of its instances names the session.
+ */
+static int coa_attr_matches(struct app_conn_t *appconn,
+			    struct radius_attr_t *attr, uint8_t type) {
+  size_t len = attr->l - 2;
+
+  switch (type) {
+    case RADIUS_ATTR_USER_NAME:
+      return strlen(appconn->s_state.redir.username) == len &&
+          !memcmp(appconn->s_state.redir.username, attr->v.t, len);
+    case RADIUS_ATTR_ACCT_SESSION_ID:
+      return strlen(appconn->s_state.sessionid) == len &&
+          !strncasecmp(appconn->s_state.sessionid, (char *) attr->v.t, len);
+    case RADIUS_ATTR_FRAMED_IP_ADDRESS:
+      return len == 4 && appconn->hisip.s_addr == attr->v.i;
+    case RADIUS_ATTR_CALLING_STATION_ID:
+      {
+	uint8_t mac[PKT_ETH_ALEN];
+	return !coa_parse_mac(attr, mac) &&
+	    !memcmp(appconn->hismac, mac, PKT_ETH_ALEN);
+      }
+  }
+  return 0;
+}
+
+static const uint8_t coa_id_attrs[] = {
+  RADIUS_ATTR_ACCT_SESSION_ID,
+  RADIUS_ATTR_FRAMED_IP_ADDRESS,
+  RADIUS_ATTR_CALLING_STATION_ID,
+  RADIUS_ATTR_USER_NAME,
+  0
+};
+
+static int coa_session_matches(struct radius_packet_t *pack,
+			       struct app_conn_t *appconn) {
+  struct radius_attr_t *attr = NULL;
+  int i, instance;
+
+  if (!appconn->inuse)
+    return 0;
+
+  for (i = 0; coa_id_attrs[i]; i++) {
+    int seen = 0, match = 0;
+    for (instance = 0; !match &&
+             !radius_getattr(pack, &attr, coa_id_attrs[i], 0, 0, instance);
+         instance++) {
+      seen = 1;
+      match = coa_attr_matches(appconn, attr, coa_id_attrs[i]);
+    }
+    if (seen && !match)
+      return 0;
+  }
+
+  return 1;
+}
+
+static void coa_session_apply(struct radius_packet_t *pack,
+			      struct app_conn_t *appconn, int iscoa) {
+  struct radius_attr_t *attr = NULL;
+  int authorize = 0;
+
+#if(_debug_)
+  if (_options.debug)
+    syslog(LOG_DEBUG, "%s(%d): Found session %s", __FUNCTION__, __LINE__, appconn->s_state.sessionid);
+#endif
+
+  if (iscoa) {
+    /* Session state */
+    if (!radius_getattr(pack, &attr,
+			RADIUS_ATTR_VENDOR_SPECIFIC,
+			RADIUS_VENDOR_COOVACHILLI,
+			RADIUS_ATTR_COOVACHILLI_SESSION_STATE, 0)) {
+      uint32_t v = ntohl(attr->v.i);
+      switch (v) {
+	case RADIUS_VALUE_COOVACHILLI_SESSION_AUTH:
+	  if (!appconn->s_state.authenticated)
+	    authorize = 1;
+	  break;
+	case RADIUS_VALUE_COOVACHILLI_SESSION_NOAUTH:
+	  if (appconn->s_state.authenticated)
+	    terminate_appconn(appconn, RADIUS_TERMINATE_CAUSE_USER_REQUEST);
+	  break;
+      }
+    }
+  } else {
+    terminate_appconn(appconn, RADIUS_TERMINATE_CAUSE_ADMIN_RESET);
+  }
+
+#ifdef ENABLE_AUTHCACHE
+  /* a User-Name in the request has been dealt with once for all */
+  if (radius_getattr(pack, &attr, RADIUS_ATTR_USER_NAME, 0, 0, 0) &&
+      appconn->s_state.redir.username[0])
+    auth_cache_invalidate((uint8_t *) appconn->s_state.redir.username,
+			  strlen(appconn->s_state.redir.username));
+#endif
+
+  config_radius_session(&appconn->s_params, pack, appconn, 0);
+
+  if (authorize)
+    dnprot_accept(appconn);
+}
+
 /* Radius callback when coa or disconnect request has been received */
 int cb_radius_coa_ind(struct radius_t *radius, struct radius_packet_t *pack,
 		      struct sockaddr_in *peer) {
-  struct app_conn_t *appconn;
-  struct radius_attr_t *uattr = NULL;
-  struct radius_attr_t *sattr = NULL;
+  struct radius_attr_t *attr = NULL;
   struct radius_packet_t radius_pack;
-  int authorize = 0;
+  uint8_t key = 0;
+  int instance;
   int found = 0;
   int iscoa = 0;
+  int i;
 
 #if(_debug_)
   if (_options.debug)
@@ -4875,67 +5219,90 @@ int cb_radius_coa_ind(struct radius_t *radius, struct radius_packet_t *pack,
 
   iscoa = pack->code == RADIUS_CODE_COA_REQUEST;
 
-  /* Get username */
-  if (radius_getattr(pack, &uattr, RADIUS_ATTR_USER_NAME, 0, 0, 0)) {
-    syslog(LOG_WARNING, "Username must be included in disconnect request");
+  /*
+   *  The sessions are looked up by the most specific identifier given,
+   *  any instance of it; several instances address several sessions.
+   */
+  for (i = 0; coa_id_attrs[i] && !key; i++)
+    if (!radius_getattr(pack, &attr, coa_id_attrs[i], 0, 0, 0))
+      key = coa_id_attrs[i];
+
+  if (!key) {
+    syslog(LOG_WARNING, "No User-Name, Acct-Session-Id, Framed-IP-Address"
+	   " or Calling-Station-Id in disconnect request");
     return -1;
   }
 
-  if (!radius_getattr(pack, &sattr, RADIUS_ATTR_ACCT_SESSION_ID, 0, 0, 0))
-    if (_options.debug) {
-      syslog(LOG_DEBUG, "%s(%d): Session-id present in disconnect. Only disconnecting that session\n", __FUNCTION__, __LINE__);
-
-      syslog(LOG_DEBUG, "%s(%d): Looking for session [username=%.*s,sessionid=%.*s]", __FUNCTION__, __LINE__,
-             uattr->l-2, uattr->v.t, sattr ? sattr->l-2 : 3,
-             sattr ? (char*)sattr->v.t : "all");
-    }
-
-  for (appconn = firstusedconn; appconn; appconn = appconn->next) {
-
-    if (!appconn->inuse) { syslog(LOG_ERR, "Connection with inuse == 0!"); }
-
-    if (
-            (strlen(appconn->s_state.redir.username) == uattr->l-2 &&
-             !memcmp(appconn->s_state.redir.username, uattr->v.t, uattr->l-2)) &&
-            (!sattr ||
-             (strlen(appconn->s_state.sessionid) == sattr->l-2 &&
-              !strncasecmp(appconn->s_state.sessionid, (char*)sattr->v.t, sattr->l-2)))) {
-
-#if(_debug_)
-      if (_options.debug)
-        syslog(LOG_DEBUG, "%s(%d): Found session %s", __FUNCTION__, __LINE__, appconn->s_state.sessionid);
+#ifdef ENABLE_AUTHCACHE
+  if (!radius_getattr(pack, &attr, RADIUS_ATTR_USER_NAME, 0, 0, 0))
+    auth_cache_invalidate(attr->v.t, attr->l-2);
 #endif
 
-      if (iscoa) {
-	struct radius_attr_t *attr = NULL;
+  if ((key == RADIUS_ATTR_ACCT_SESSION_ID || key == RADIUS_ATTR_USER_NAME) &&
+      coa_index_build()) {
+    syslog(LOG_ERR, "%s: could not index sessions", strerror(errno));
+    return -1;
+  }
 
-	/* Session state */
-	if (!radius_getattr(pack, &attr,
-			    RADIUS_ATTR_VENDOR_SPECIFIC,
-			    RADIUS_VENDOR_COOVACHILLI,
-			    RADIUS_ATTR_COOVACHILLI_SESSION_STATE, 0)) {
-	  uint32_t v = ntohl(attr->v.i);
-	  switch (v) {
-            case RADIUS_VALUE_COOVACHILLI_SESSION_AUTH:
-              if (!appconn->s_state.authenticated)
-                authorize = 1;
-              break;
-            case RADIUS_VALUE_COOVACHILLI_SESSION_NOAUTH:
-              if (appconn->s_state.authenticated)
-                terminate_appconn(appconn, RADIUS_TERMINATE_CAUSE_USER_REQUEST);
-              break;
+  for (instance = 0;
+       !radius_getattr(pack, &attr, key, 0, 0, instance);
+       instance++) {
+    struct app_conn_t *appconn = 0;
+
+    if (_options.debug)
+      syslog(LOG_DEBUG, "%s(%d): Looking for session by attribute %d [%.*s]",
+	     __FUNCTION__, __LINE__, key, attr->l-2,
+	     key == RADIUS_ATTR_FRAMED_IP_ADDRESS ? "ip" : (char *) attr->v.t);
+
+    switch (key) {
+      case RADIUS_ATTR_FRAMED_IP_ADDRESS:
+	{
+	  struct ippoolm_t *ipm = 0;
+	  struct in_addr addr;
+	  if (attr->l - 2 != sizeof(addr) || !ippool) break;
+	  addr.s_addr = attr->v.i;
+	  if (!ippool_getip(ippool, &ipm, &addr) && ipm->peer) {
+	    appconn = (struct app_conn_t *) ipm->peer;
+	    if (coa_session_matches(pack, appconn)) {
+	      coa_session_apply(pack, appconn, iscoa);
+	      found = 1;
+	    }
 	  }
 	}
-      } else {
-	terminate_appconn(appconn, RADIUS_TERMINATE_CAUSE_ADMIN_RESET);
-      }
-
-      config_radius_session(&appconn->s_params, pack, appconn, 0);
+	break;
 
-      if (authorize)
-	dnprot_accept(appconn);
+      case RADIUS_ATTR_CALLING_STATION_ID:
+	{
+	  struct dhcp_conn_t *conn = 0;
+	  uint8_t mac[PKT_ETH_ALEN];
+	  if (coa_parse_mac(attr, mac) || !dhcp) break;
+	  if (!dhcp_hashget(dhcp, &conn, mac) && conn->peer) {
+	    appconn = (struct app_conn_t *) conn->peer;
+	    if (coa_session_matches(pack, appconn)) {
+	      coa_session_apply(pack, appconn, iscoa);
+	      found = 1;
+	    }
+	  }
+	}
+	break;
 
-      found = 1;
+      default:
+	{
+	  uint32_t h = coa_index_hash(attr->v.t, attr->l - 2,
+				      key == RADIUS_ATTR_USER_NAME ?
+				      COA_KEY_USER : COA_KEY_SESSIONID);
+	  int e;
+	  for (e = coa_index.buckets[h & (coa_index.nbuckets - 1)];
+	       e >= 0; e = coa_index.ents[e].next) {
+	    appconn = coa_index.ents[e].conn;
+	    if (coa_attr_matches(appconn, attr, key) &&
+		coa_session_matches(pack, appconn)) {
+	      coa_session_apply(pack, appconn, iscoa);
+	      found = 1;
+	    }
+	  }
+	}
+	break;
     }
   }
 
@@ -4959,6 +5326,16 @@ int cb_radius_coa_ind(struct radius_t *radius, struct radius_packet_t *pack,
 
   return 0;
 }
+
+/*
+ *  Reads a batch of RADIUS packets, after which the session index
+ *  built for CoA-Requests in it is stale.
+ */
+static int chilli_radius_decaps(struct radius_t *this, int idx) {
+  int ret = radius_decaps(this, idx);
+  coa_index_drop();
+  return ret;
+}
 #endif
 
 /***********************************************************
@@ -5065,6 +5442,8 @@ int cb_dhcp_request(struct dhcp_conn_t *conn, struct in_addr *addr,
 	   */
 	  auth_radius(appconn, 0, 0, dhcp_pkt, dhcp_len);
 
+	  /* answered from the auth cache */
+	  ipm = (struct ippoolm_t*) appconn->uplink;
 	  allocate = !_options.strictmacauth;
 	  domacauth = 0;
 	}
@@ -5079,6 +5458,8 @@ int cb_dhcp_request(struct dhcp_conn_t *conn, struct in_addr *addr,
 
 	auth_radius(appconn, 0, 0, dhcp_pkt, dhcp_len);
 
+	/* answered from the auth cache */
+	ipm = (struct ippoolm_t*) appconn->uplink;
 	allocate = !_options.strictmacauth;
 	domacauth = 0;
       }
@@ -5153,15 +5534,15 @@ int cb_dhcp_request(struct dhcp_conn_t *conn, struct in_addr *addr,
 
   if (!appconn->s_state.authenticated) {
 
-    if (domacauth) {
-      auth_radius(appconn, 0, 0, dhcp_pkt, dhcp_len);
-    }
-
     /* if not already authenticated, ensure DNAT authstate */
 #ifdef ENABLE_LAYER3
     if (!_options.layer3)
 #endif
       conn->authstate = DHCP_AUTH_DNAT;
+
+    if (domacauth) {
+      auth_radius(appconn, 0, 0, dhcp_pkt, dhcp_len);
+    }
   }
 
   /* If IP was requested before authentication it was UAM */
@@ -5304,12 +5685,6 @@ int chilli_getinfo(struct app_conn_t *appconn, bstring b, int fmt) {
   }
 
   switch(fmt) {
-#ifdef ENABLE_JSON
-    case LIST_JSON_FMT:
-      if (appconn->s_state.authenticated)
-        session_json_fmt(&appconn->s_state, &appconn->s_params, b, 0);
-      break;
-#endif
     default:
       {
         bstring tmp = bfromcstr("");
@@ -5468,47 +5843,36 @@ void chilli_print(bstring s, int listfmt,
 #endif
     return;
   } else {
-    bstring b = bfromcstr("");
-    bstring tmp = bfromcstr("");
+    bstring b, tmp;
 
-    switch(listfmt) {
 #ifdef ENABLE_JSON
-      case LIST_JSON_FMT:
-        if ((conn && conn != dhcp->firstusedconn) ||
-            (appconn && appconn != firstusedconn))
-          bcatcstr(b, ",");
-
-        bcatcstr(b, "{");
-
-        if (appconn) {
-          bcatcstr(b, "\"nasPort\":");
-          bassignformat(tmp, "%d", appconn->unit);
-          bconcat(b, tmp);
-          bcatcstr(b, ",\"clientState\":");
-          bassignformat(tmp, "%d", appconn->s_state.authenticated);
-          bconcat(b, tmp);
-          bcatcstr(b, ",\"ipAddress\":\"");
-          bcatcstr(b, inet_ntoa(appconn->hisip));
-          bcatcstr(b, "\"");
-        }
+    if (listfmt == LIST_JSON_FMT) {
+      /* straight into the reply, one object per connection */
+      jsonw_open(s, 0, '{');
+
+      if (appconn) {
+        jsonw_int(s, "nasPort", appconn->unit);
+        jsonw_int(s, "clientState", appconn->s_state.authenticated);
+        jsonw_ip(s, "ipAddress", &appconn->hisip);
+      }
 
-        if (conn) {
-          if (appconn) bcatcstr(b, ",");
-          bcatcstr(b, "\"macAddress\":\"");
-          bassignformat(tmp, MAC_FMT, MAC_ARG(conn->hismac));
-          bconcat(b, tmp);
-          bcatcstr(b, "\",\"dhcpState\":\"");
-          bcatcstr(b, state2name(conn->authstate));
-          bcatcstr(b, "\"");
-        }
+      if (conn) {
+        jsonw_mac(s, "macAddress", conn->hismac);
+        jsonw_str(s, "dhcpState", state2name(conn->authstate));
+      }
 
-        if (appconn)
-          chilli_getinfo(appconn, b, listfmt);
+      if (appconn && appconn->s_state.authenticated)
+        session_json_fmt(&appconn->s_state, &appconn->s_params, s, 0);
 
-        bcatcstr(b, "}");
-        break;
+      jsonw_close(s, '}');
+      return;
+    }
 #endif
 
+    b = bfromcstr("");
+    tmp = bfromcstr("");
+
+    switch(listfmt) {
       default:
         if (conn && !appconn)
           bassignformat(b, MAC_FMT" %s", MAC_ARG(conn->hismac),
@@ -6095,8 +6459,21 @@ int static uam_msg(struct redir_msg_t *msg) {
     if (msg->mdata.opt & REDIR_MSG_OPT_REDIR)
       memcpy(&appconn->s_state.redir, &msg->mdata.redir, sizeof(msg->mdata.redir));
 
-    if (msg->mdata.opt & REDIR_MSG_OPT_PARAMS)
+    if (msg->mdata.opt & REDIR_MSG_OPT_PARAMS) {
+#ifdef ENABLE_SESSGARDEN
+      garden_ruleset *rs = appconn->s_params.garden;
+      pass_through ptlist[SESSION_PASS_THROUGH_MAX];
+      uint32_t ptcnt = msg->mdata.pass_through_count;
+      if (ptcnt > SESSION_PASS_THROUGH_MAX)
+        ptcnt = SESSION_PASS_THROUGH_MAX;
+      memcpy(ptlist, msg->mdata.pass_throughs, sizeof(pass_through) * ptcnt);
+#endif
       memcpy(&appconn->s_params, &msg->mdata.params, sizeof(msg->mdata.params));
+#ifdef ENABLE_SESSGARDEN
+      appconn->s_params.garden = garden_ruleset_intern(ptlist, ptcnt);
+      garden_ruleset_release(rs);
+#endif
+    }
 
     if (msg->mdata.opt & REDIR_MSG_NSESSIONID)
       set_sessionid(appconn, 0);
@@ -6195,6 +6572,11 @@ int static uam_msg(struct redir_msg_t *msg) {
   return 0;
 }
 
+/* messages of redir connections read in this process */
+static int cb_redir_msg(struct redir_t *redir, struct redir_msg_t *msg) {
+  return uam_msg(msg);
+}
+
 #if defined(ENABLE_CHILLIQUERY) || defined(ENABLE_CLUSTER)
 static struct app_conn_t * find_app_conn(struct cmdsock_request *req,
                                          int *has_criteria) {
@@ -6625,19 +7007,20 @@ int chilli_cmd(struct cmdsock_request *req, bstring s, int sock) {
 #endif
 
 #ifdef ENABLE_SESSGARDEN
-          if (appconn->s_params.pass_through_count > 0) {
+          if (garden_ruleset_count(appconn->s_params.garden) > 0) {
+            garden_ruleset *rs = appconn->s_params.garden;
             char mask[32];
             pass_through *pt;
             int i;
 
             bassignformat(tmp,
-                          "%20s: %d\n",
+                          "%20s: %d (shared by %d)\n",
                           "garden entries",
-                          appconn->s_params.pass_through_count);
+                          rs->count, rs->refcnt);
             bconcat(s, tmp);
 
-            for (i = 0; i < appconn->s_params.pass_through_count; i++) {
-              pt = &appconn->s_params.pass_throughs[i];
+            for (i = 0; i < rs->count; i++) {
+              pt = &rs->rules[i];
 
               strlcpy(mask, inet_ntoa(pt->mask), sizeof(mask));
 
@@ -6689,19 +7072,8 @@ int chilli_cmd(struct cmdsock_request *req, bstring s, int sock) {
                 syslog(LOG_DEBUG, "%s(%d): remote %s garden for session %s", __FUNCTION__, __LINE__,
                        remove ? "rem" : "add", appconn->s_state.sessionid);
 
-#ifdef HAVE_PATRICIA
-              if (appconn->ptree == NULL)
-                appconn->ptree = patricia_new (32);
-#endif
-
-              pass_throughs_from_string(appconn->s_params.pass_throughs,
-                                        SESSION_PASS_THROUGH_MAX,
-                                        &appconn->s_params.pass_through_count,
-                                        req->d.data, 1, remove
-#ifdef HAVE_PATRICIA
-                                        , appconn->ptree
-#endif
-                                        );
+              garden_ruleset_from_string(&appconn->s_params.garden,
+                                         req->d.data, 1, remove);
               break;
             }
             appconn = appconn->next;
@@ -6711,7 +7083,7 @@ int chilli_cmd(struct cmdsock_request *req, bstring s, int sock) {
           pass_throughs_from_string(dhcp->pass_throughs,
                                     MAX_PASS_THROUGHS,
                                     &dhcp->num_pass_throughs,
-                                    req->d.data, 1, remove
+                                    req->d.data, 1, remove, 0
 #ifdef HAVE_PATRICIA
                                     , dhcp->ptree_dyn
 #endif
@@ -6752,6 +7124,23 @@ int chilli_cmd(struct cmdsock_request *req, bstring s, int sock) {
       radius_printqueue(sock, radius);
       break;
 
+    case CMDSOCK_STATS:
+      radius_printservers(sock, radius);
+#ifdef ENABLE_DNSCACHE
+      dns_cache_print(sock);
+#endif
+#ifdef ENABLE_ACCTSPOOL
+      acct_spool_print(sock);
+#endif
+#ifdef ENABLE_AUTHCACHE
+      auth_cache_print(sock);
+#endif
+#ifdef HAVE_SSL
+      openssl_print_stats(sock);
+#endif
+      interim_print(sock);
+      break;
+
     case CMDSOCK_LIST:
       {
         int listfmt = (req->options & CMDSOCK_OPT_JSON) ?
@@ -6764,7 +7153,8 @@ int chilli_cmd(struct cmdsock_request *req, bstring s, int sock) {
 
 #ifdef ENABLE_JSON
         if (listfmt == LIST_JSON_FMT) {
-          bcatcstr(s, "{ \"sessions\":[");
+          jsonw_open(s, 0, '{');
+          jsonw_open(s, "sessions", '[');
         }
 #endif
 
@@ -6800,7 +7190,8 @@ int chilli_cmd(struct cmdsock_request *req, bstring s, int sock) {
 
 #ifdef ENABLE_JSON
         if (listfmt == LIST_JSON_FMT) {
-          bcatcstr(s, "]}");
+          jsonw_close(s, ']');
+          jsonw_close(s, '}');
         }
 #endif
       }
@@ -6815,7 +7206,8 @@ int chilli_cmd(struct cmdsock_request *req, bstring s, int sock) {
 
 #ifdef ENABLE_JSON
         if (listfmt == LIST_JSON_FMT) {
-          bcatcstr(s, "{ \"sessions\":[");
+          jsonw_open(s, 0, '{');
+          jsonw_open(s, "sessions", '[');
         }
 #endif
         conn = dhcp->firstusedconn;
@@ -6825,7 +7217,8 @@ int chilli_cmd(struct cmdsock_request *req, bstring s, int sock) {
         }
 #ifdef ENABLE_JSON
         if (listfmt == LIST_JSON_FMT) {
-          bcatcstr(s, "]}");
+          jsonw_close(s, ']');
+          jsonw_close(s, '}');
         }
 #endif
       }
@@ -6933,9 +7326,17 @@ int chilli_cmd(struct cmdsock_request *req, bstring s, int sock) {
             syslog(LOG_DEBUG, "%s(%d): remotely authorized session %s", __FUNCTION__, __LINE__,
                    appconn->s_state.sessionid);
 
+#ifdef ENABLE_SESSGARDEN
+          garden_ruleset *rs = appconn->s_params.garden;
+#endif
+
           memcpy(&appconn->s_params, &req->d.sess.params,
                  sizeof(req->d.sess.params));
 
+#ifdef ENABLE_SESSGARDEN
+          appconn->s_params.garden = rs;
+#endif
+
           if (uname[0])
             strlcpy(appconn->s_state.redir.username,
                     uname, USERNAMESIZE);
@@ -7032,7 +7433,7 @@ static int cmdsock_accept(void *nullData, int sock) {
   struct sockaddr_un remote;
   struct cmdsock_request req;
 
-  bstring s = 0;
+  static bstring s = 0; /* kept for the next request */
   socklen_t len;
   int csock;
   int rval = 0;
@@ -7054,7 +7455,7 @@ static int cmdsock_accept(void *nullData, int sock) {
     return -1;
   }
 
-  s = bfromcstr("");
+  if (!s) s = bfromcstr("");
   if (s == NULL) {
     syslog(LOG_ERR, "bfromstr(): memory allocation error");
     safe_close(csock);
@@ -7066,7 +7467,12 @@ static int cmdsock_accept(void *nullData, int sock) {
   if (net_write(csock, s->data, s->slen) < 0)
     syslog(LOG_ERR, "%s: write()", strerror(errno));
 
-  bdestroy(s);
+  if (s->mlen > CMDSOCK_KEEPBUF) {
+    bdestroy(s);
+    s = 0;
+  } else {
+    btrunc(s, 0);
+  }
   shutdown(csock, 2);
   safe_close(csock);
 
@@ -7129,9 +7535,28 @@ int static redir_msg(struct redir_t *this) {
 			      &msg.mdata.address,
 			      &msg.mdata.baddress,
 			      &conn) != -1) {
+#ifdef ENABLE_SESSGARDEN
+	  /* the garden follows as a rule count and list */
+	  struct {
+	    uint32_t count;
+	    pass_through rules[SESSION_PASS_THROUGH_MAX];
+	  } garden;
+	  garden.count = garden_ruleset_export(conn.s_params.garden,
+					       garden.rules,
+					       SESSION_PASS_THROUGH_MAX);
+	  garden_ruleset_release(conn.s_params.garden);
+	  conn.s_params.garden = 0;
+#endif
 	  if (safe_write(socket, &conn, sizeof(conn)) < 0) {
 	    syslog(LOG_ERR, "%s: redir_msg writing", strerror(errno));
 	  }
+#ifdef ENABLE_SESSGARDEN
+	  else if (safe_write(socket, &garden,
+			      sizeof(garden) - sizeof(garden.rules) +
+			      sizeof(pass_through) * garden.count) < 0) {
+	    syslog(LOG_ERR, "%s: redir_msg writing", strerror(errno));
+	  }
+#endif
 	}
       } else {
 	uam_msg(&msg);
@@ -7512,6 +7937,11 @@ int chilli_main(int argc, char **argv) {
     if (_options.acct_update)
       radius_set_cb_acct_conf(radius, cb_radius_acct_conf);
 
+#ifdef ENABLE_ACCTSPOOL
+    if (_options.acctspool && !acct_spool_open())
+      radius_set_cb_acct_conf(radius, cb_radius_acct_conf);
+#endif
+
     /* Initialise connections */
     initconn();
 
@@ -7541,6 +7971,7 @@ int chilli_main(int argc, char **argv) {
 
     /* not really needed for chilliredir */
     redir_set_cb_getstate(redir, cb_redir_getstate);
+    redir_set_cb_msg(redir, cb_redir_msg);
 
 #ifdef ENABLE_CHILLIQUERY
     if (_options.cmdsocket) {
@@ -7622,6 +8053,8 @@ int chilli_main(int argc, char **argv) {
     garden_patricia_reload();
 #endif
 
+    garden_names_load();
+
 #ifdef ENABLE_LOCATION
     location_init();
 #endif
@@ -7661,8 +8094,13 @@ int chilli_main(int argc, char **argv) {
                    SELECT_READ, (select_callback)chilli_handle_signal,
                    0, 0);
 
-    net_select_reg(&sctx, radius->fd, SELECT_READ,
-                   (select_callback)radius_decaps, radius, 0);
+    for (i=0; i < radius->nsocks; i++)
+      net_select_reg(&sctx, radius->socks[i].fd, SELECT_READ,
+#ifdef ENABLE_COA
+                     (select_callback)chilli_radius_decaps, radius, i);
+#else
+                     (select_callback)radius_decaps, radius, i);
+#endif
 
 #ifdef ENABLE_RADPROXY
     if (radius->proxyfd)
@@ -7704,6 +8142,7 @@ int chilli_main(int argc, char **argv) {
 #endif
 
     if (!_options.redir) {
+      redir->sctx = &sctx;
       net_select_reg(&sctx, redir->fd[0], SELECT_READ,
                      (select_callback)redir_accept, redir, 0);
       net_select_reg(&sctx, redir->fd[1], SELECT_READ,
@@ -7722,6 +8161,10 @@ int chilli_main(int argc, char **argv) {
                    (select_callback)cmdsock_accept, 0, cmdsock);
 #endif
 
+    if ((i = dns_resolve_init()) >= 0)
+      net_select_reg(&sctx, i, SELECT_READ,
+                     (select_callback)dns_resolve_read, 0, i);
+
     mainclock_tick();
     while (keep_going) {
 
@@ -7752,6 +8195,16 @@ int chilli_main(int argc, char **argv) {
 #ifdef ENABLE_UAMDOMAINFILE
         garden_load_domainfile();
 #endif
+
+        garden_names_load();
+
+#ifdef ENABLE_DNSCACHE
+        dns_cache_flush();
+#endif
+
+#ifdef ENABLE_AUTHCACHE
+        auth_cache_flush();
+#endif
       }
 
       if (do_interval) {
@@ -7768,10 +8221,18 @@ int chilli_main(int argc, char **argv) {
          *  Every second, more or less
          */
         radius_timeout(radius);
+        radius_servers_check(radius);
 
         if (dhcp)
           dhcp_timeout(dhcp);
 
+        dns_resolve_timeout();
+        garden_names_timeout();
+        redir_client_timeout(redir);
+#ifdef ENABLE_ACCTSPOOL
+        acct_spool_replay(radius);
+#endif
+
 #ifdef ENABLE_LAYER3
         if (_options.layer3)
           session_timeout();
@@ -7850,6 +8311,12 @@ int chilli_main(int argc, char **argv) {
     if (redir)
       redir_free(redir);
 
+#ifdef ENABLE_ACCTSPOOL
+    if (radius)
+      acct_spool_drain(radius);
+    acct_spool_close();
+#endif
+
     if (radius)
       radius_free(radius);
 
@@ -7890,6 +8357,16 @@ int chilli_main(int argc, char **argv) {
     garden_free_domainfile();
 #endif
 
+    garden_names_free();
+
+#ifdef ENABLE_DNSCACHE
+    dns_cache_flush();
+#endif
+
+#ifdef ENABLE_AUTHCACHE
+    auth_cache_flush();
+#endif
+
     selfpipe_finish();
 
     /* child_killall(SIGKILL);*/
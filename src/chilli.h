@@ -35,6 +35,7 @@
 #include "net.h"
 #include "md5.h"
 #include "dns.h"
+#include "jsonw.h"
 
 #ifndef HAVE_STRLCPY
 extern size_t strlcpy(char *dst, const char *src, size_t dsize);
@@ -103,10 +104,6 @@ struct app_conn_t {
   struct session_params s_params;         /* Session parameters */
   struct session_state  s_state;          /* Session state */
 
-#ifdef HAVE_PATRICIA
-  patricia_tree_t *ptree;
-#endif
-
   /* Radius authentication stuff */
   /* Parameters are initialised whenever a reply to an access request
      is received. */
@@ -273,6 +270,7 @@ time_t mainclock_now(void);
 time_t mainclock_rt(void);
 time_t mainclock_wall(void);
 time_t mainclock_towall(time_t t);
+int mainclock_rtdiff(time_t past);
 int mainclock_diff(time_t past);
 uint32_t mainclock_diffu(time_t past);
 
@@ -293,6 +291,33 @@ int chilli_learn_location(uint8_t *loc, int loclen,
 			  struct app_conn_t *appconn, char force);
 #endif
 
+#ifdef ENABLE_AUTHCACHE
+int auth_cache_lookup(struct app_conn_t *appconn, char *user, char *pwd);
+void auth_cache_store(struct radius_t *radius,
+		      struct radius_packet_t *pack_req,
+		      struct app_conn_t *appconn);
+void auth_cache_reject(struct radius_packet_t *pack_req);
+void auth_cache_invalidate(uint8_t *name, size_t len);
+void auth_cache_flush(void);
+#ifdef ENABLE_CHILLIQUERY
+void auth_cache_print(int fd);
+#endif
+#endif
+
+#ifdef ENABLE_ACCTSPOOL
+int acct_spool_open(void);
+void acct_spool_close(void);
+int acct_spool_add(struct radius_packet_t *pack);
+int acct_spool_owns(void *cbp);
+int acct_spool_conf(struct radius_packet_t *pack, void *cbp);
+void acct_spool_ok(void);
+void acct_spool_replay(struct radius_t *radius);
+void acct_spool_drain(struct radius_t *radius);
+#ifdef ENABLE_CHILLIQUERY
+void acct_spool_print(int fd);
+#endif
+#endif
+
 #ifdef HAVE_NETFILTER_COOVA
 int kmod_coova_update(struct app_conn_t *appconn);
 int kmod_coova_release(struct dhcp_conn_t *conn);
@@ -49,6 +49,7 @@
 #define REDIR_MAXTIME                    120 /* Seconds */
 #define REDIR_HTTP_MAX_TIME               20 /* Seconds */
 #define REDIR_HTTP_SELECT_TIME             3 /* Seconds */
+#define REDIR_HTTP_KEEPALIVE_TIME         15 /* Seconds idle between requests */
 #define REDIR_RADIUS_MAX_TIME             60 /* Seconds */
 #define REDIR_RADIUS_SELECT_TIME      500000 /* microseconds = 0.5 seconds */
 #define REDIR_CHALLEN                     16
@@ -65,6 +66,16 @@
 #define REDIR_IDENTSIZE                   16
 
 #define REDIR_MAXCONN                     16
+#define REDIR_REQUEST_CHUNK               64 /* chilli_redir requests allocated at a time */
+#define REDIR_REPLY_CACHE                256 /* Rendered redirect replies kept, by client MAC */
+#define MAX_UAM_PROBES                    16 /* Max number of uamprobe options */
+#define REDIR_MAXPROBES                   64 /* Probes answered, with "default" expanded */
+#define REDIR_SSL_SESSIONS               256 /* TLS sessions shared by the redir processes */
+#define REDIR_SSL_SESSION_LEN            512 /* Max DER length of a shared TLS session */
+#define REDIR_SSL_SESSION_TIME          3600 /* Seconds a TLS session may be resumed */
+#define REDIR_SSL_TICKET_TIME           3600 /* Seconds between session ticket key rotations */
+#define REDIR_TEMPLATES                   32 /* Compiled miniportal templates kept */
+#define REDIR_REGEX_CACHE                256 /* Hosts with their uamregex rules kept, power of 2 */
 
 #define REDIR_URL_LEN                   2048
 #define REDIR_SESSIONID_LEN               33
@@ -76,6 +87,7 @@
 #define USERNAMESIZE                     256 /* Max length of username */
 #define CHALLENGESIZE                     24 /* From chap.h MAX_CHALLENGE_LENGTH */
 #define USERURLSIZE                      256 /* Max length of URL requested by user */
+#define CMDSOCK_KEEPBUF          (256*1024) /* Largest chilli_query reply buffer kept */
 
 /* dhcp */
 #define DHCP_DEBUG                         0 /* Print debug information */
@@ -83,11 +95,18 @@
 
 /* radius */
 #define RADIUS_SECRETSIZE                128 /* No secrets that long */
+#define RADIUS_MAXSERVERS                  8 /* Servers per pool */
+#define RADIUS_SERVER_FAILS                3 /* Timeouts before server is down */
+#define RADIUS_SERVER_HOLDDOWN            30 /* Initial seconds a server is down */
+#define RADIUS_SERVER_MAXHOLDDOWN        300
+#define RADSEC_MAXCONNS                    8 /* TLS connections per RadSec server */
+#define PROXY_MAXREQUESTS               1024 /* Concurrent HTTP AAA requests of chilli_proxy */
 #define RADIUS_MD5LEN                     16 /* Length of MD5 hash */
 #define RADIUS_AUTHLEN                    16 /* RFC 2865: Length of authenticator */
 #define RADIUS_PWSIZE                    128 /* RFC 2865: Max 128 octets in password */
 #define RADIUS_CHAPSIZE                   24
 #define RADIUS_QUEUESIZE                 256 /* Same size as id address space */
+#define RADIUS_DECAPS_BATCH               32 /* Packets read per wakeup of the RADIUS socket */
 #define RADIUS_ATTR_VLEN                 253
 #define RADIUS_HDRSIZE                    20
 #define RADIUS_MPPEKEYSSIZE               32 /* Length of MS_CHAP_MPPE_KEYS attribute */
@@ -120,7 +139,9 @@
 #define MAX_REGEX_PASS_THROUGHS          512 /* Max number of allowed UAM pass-throughs */
 #define MAX_UAM_DOMAINS                  128 /* Max number of allowed UAM domains */
 #define MACOK_MAX                         56
-#define MAX_SELECT                        56
+#define RADIUS_MAXSOCKETS                 64 /* RADIUS source ports, 256 ids each */
+#define REDIR_MAXCLIENTS                 256 /* Connections read by the chilli process */
+#define MAX_SELECT                       (56 + RADIUS_MAXSOCKETS + REDIR_MAXCLIENTS)
 #define RADIUS_PACKSIZE                 4096
 #else
 #define PKT_MAX_LEN                     9000 /* Maximum packet size we receive */
@@ -129,7 +150,9 @@
 #define MAX_REGEX_PASS_THROUGHS            8 /* Max number of allowed UAM pass-throughs */
 #define MAX_UAM_DOMAINS                   32 /* Max number of allowed UAM domains */
 #define MACOK_MAX                         16
-#define MAX_SELECT                        16
+#define RADIUS_MAXSOCKETS                 16 /* RADIUS source ports, 256 ids each */
+#define REDIR_MAXCLIENTS                  64 /* Connections read by the chilli process */
+#define MAX_SELECT                       (16 + RADIUS_MAXSOCKETS + REDIR_MAXCLIENTS)
 #define RADIUS_PACKSIZE                 1600
 #define RADIUS_QUEUE_PACKET_PTR 1
 #endif
@@ -55,6 +55,7 @@ typedef enum {
   CMDSOCK_LISTLOC,
   CMDSOCK_LISTLOCSUM,
 #endif
+  CMDSOCK_STATS,
 } chilli_cmdtype;
 #define  CMDSOCK_OPT_JSON      (1)
 
@@ -351,8 +351,14 @@ void dhcp_authorize_mac(struct dhcp_t *this, uint8_t *hwaddr,
   if (!dhcp_hashget(this, &conn, hwaddr)) {
     struct app_conn_t * appconn = (struct app_conn_t*) conn->peer;
     if (appconn) {
+#ifdef ENABLE_SESSGARDEN
+      garden_ruleset *rs = appconn->s_params.garden;
+#endif
       memcpy(&appconn->s_params, params,
 	     sizeof(struct session_params));
+#ifdef ENABLE_SESSGARDEN
+      appconn->s_params.garden = rs;
+#endif
       session_param_defaults(&appconn->s_params);
       dnprot_accept(appconn);
     }
@@ -1683,13 +1689,66 @@ int dhcp_matchDNS(uint8_t *r, char *name) {
   return 0;
 }
 
+/*
+ *   dhcp_dns_reply() - Sends a locally built DNS answer, a copy of the
+ *   query packet with dns_len bytes of DNS message, back to the client.
+ */
+static
+void dhcp_dns_reply(struct dhcp_conn_t *conn, uint8_t *pack,
+		    uint8_t *answer, size_t dns_len) {
+
+  struct pkt_ethhdr_t *ethh = pkt_ethhdr(pack);
+  struct pkt_iphdr_t  *iph  = pkt_iphdr(pack);
+  struct pkt_udphdr_t *udph = pkt_udphdr(pack);
+
+  struct pkt_ethhdr_t *answer_ethh = pkt_ethhdr(answer);
+  struct pkt_iphdr_t  *answer_iph = pkt_iphdr(answer);
+  struct pkt_udphdr_t *answer_udph = pkt_udphdr(answer);
+
+  size_t udp_len;
+  size_t length;
+
+  /* UDP header */
+  udp_len = dns_len + PKT_UDP_HLEN;
+  answer_udph->len = htons(udp_len);
+  answer_udph->src = udph->dst;
+  answer_udph->dst = udph->src;
+
+  /* Ip header */
+  answer_iph->version_ihl = PKT_IP_VER_HLEN;
+  answer_iph->tos = 0;
+  answer_iph->tot_len = htons(udp_len + PKT_IP_HLEN);
+  answer_iph->id = 0;
+  answer_iph->opt_off_high = 0;
+  answer_iph->off_low = 0;
+  answer_iph->ttl = 0x10;
+  answer_iph->protocol = 0x11;
+  answer_iph->check = 0; /* Calculate at end of packet */
+  memcpy(&answer_iph->daddr, &iph->saddr, PKT_IP_ALEN);
+  memcpy(&answer_iph->saddr, &iph->daddr, PKT_IP_ALEN);
+
+  /* Ethernet header */
+  memcpy(answer_ethh->dst, &ethh->src, PKT_ETH_ALEN);
+  memcpy(answer_ethh->src, &ethh->dst, PKT_ETH_ALEN);
+
+  /* Work out checksums */
+  chksum(answer_iph);
+
+  /* Calculate total length */
+  length = udp_len + sizeofip(answer);
+
+  OTHER_SENDING(conn, answer_iph);
+  dhcp_send(dhcp, dhcp_conn_idx(conn), conn->hismac, answer, length);
+}
+
 /*
  *   dhcp_dns() - Checks DNS for bad packets or locally handled DNS.
+ *   fromUpstream: a reply sent by one of the configured DNS servers,
+ *   which may go into the DNS cache.
  *   returns: 0 = do not forward, 1 = forward DNS
  */
-static
 int dhcp_dns(struct dhcp_conn_t *conn, uint8_t *pack,
-	     size_t *plen, char isReq) {
+	     size_t *plen, char isReq, char fromUpstream) {
 
   if (*plen < DHCP_DNS_HLEN + sizeofudp(pack)) {
 
@@ -1706,6 +1765,7 @@ int dhcp_dns(struct dhcp_conn_t *conn, uint8_t *pack,
 
     size_t dlen = *plen - DHCP_DNS_HLEN - sizeofudp(pack);
     size_t olen = dlen;
+    size_t mlen = *plen - sizeofudp(pack); /* header included, for dns_name() */
 
     uint16_t flags   = ntohs(dnsp->flags);
     uint16_t qdcount = ntohs(dnsp->qdcount);
@@ -1714,7 +1774,7 @@ int dhcp_dns(struct dhcp_conn_t *conn, uint8_t *pack,
     uint16_t arcount = ntohs(dnsp->arcount);
 
     uint8_t *dptr = (uint8_t *)dnsp->records;
-    uint8_t q[512];
+    uint8_t q[256];
 
 #ifdef ENABLE_IPV6
     uint8_t *an_mark = 0;
@@ -1797,13 +1857,13 @@ int dhcp_dns(struct dhcp_conn_t *conn, uint8_t *pack,
     }
 #endif
 
-    memset(q, 0, sizeof(q));
+    q[0] = 0;
 
 #undef  copyres
 #define copyres(isq,n)                                          \
     for (i=0; dlen && i < n ## count; i++) {                    \
       if (dns_copy_res(conn, isq, &dptr, &dlen,                 \
-		       (uint8_t *)dnsp, olen,                   \
+		       (uint8_t *)dnsp, mlen,                   \
 		       q, sizeof(q), isReq,                     \
 		       &qmatch, &mod, mode)) {                  \
         syslog(LOG_WARNING, "dropping malformed DNS");		\
@@ -1865,9 +1925,7 @@ int dhcp_dns(struct dhcp_conn_t *conn, uint8_t *pack,
       char *hostname = _options.uamhostname;
       char *aliasname = _options.uamaliasname;
 
-      uint8_t *p;
-
-      uint8_t query[256];
+      uint8_t query[512];
       uint8_t reply[4];
 
       int match = 0;
@@ -1931,39 +1989,20 @@ int dhcp_dns(struct dhcp_conn_t *conn, uint8_t *pack,
 
 	uint8_t answer[1500];
 
-	struct pkt_ethhdr_t *ethh = pkt_ethhdr(pack);
-	struct pkt_iphdr_t  *iph  = pkt_iphdr(pack);
-	struct pkt_udphdr_t *udph = pkt_udphdr(pack);
-
-	struct pkt_ethhdr_t *answer_ethh;
-	struct pkt_iphdr_t  *answer_iph;
-	struct pkt_udphdr_t *answer_udph;
 	struct dns_packet_t *answer_dns;
 
-	size_t query_len = 0;
-	size_t udp_len;
-	size_t length;
-
-	int n;
-
-	p = dnsp->records;
+	ssize_t query_len;
 
 #if(_debug_)
 	syslog(LOG_DEBUG, "%s(%d): It was a matching query!\n", __FUNCTION__, __LINE__);
 #endif
 
-	do {
-	  if (query_len < 256)
-	    query[query_len++] = *p;
-	  else
-	    break;
-	}
-	while (*p++ != 0); /* TODO */
+	/* the question, as parsed above */
+	query_len = dns_name((uint8_t *)dnsp, mlen, DHCP_DNS_HLEN, 0, 0);
+	if (query_len < 0) return 0;
 
-        for (n=0; n<4; n++) {
-          if (query_len < 256)
-            query[query_len++] = *p++;
-        }
+	memcpy(query, dnsp->records, query_len + 4);
+	query_len += 4;
 
 	query[query_len++] = 0xc0;
 	query[query_len++] = 0x0c;
@@ -1982,9 +2021,6 @@ int dhcp_dns(struct dhcp_conn_t *conn, uint8_t *pack,
 
 	memcpy(answer, pack, *plen); /* TODO */
 
-	answer_ethh = pkt_ethhdr(answer);
-	answer_iph = pkt_iphdr(answer);
-	answer_udph = pkt_udphdr(answer);
 	answer_dns = pkt_dnspkt(answer);
 
 	/* DNS Header */
@@ -1996,37 +2032,7 @@ int dhcp_dns(struct dhcp_conn_t *conn, uint8_t *pack,
 	answer_dns->arcount = htons(0x0000);
 	memcpy(answer_dns->records, query, query_len);
 
-	/* UDP header */
-	udp_len = query_len + DHCP_DNS_HLEN + PKT_UDP_HLEN;
-	answer_udph->len = htons(udp_len);
-	answer_udph->src = udph->dst;
-	answer_udph->dst = udph->src;
-
-	/* Ip header */
-	answer_iph->version_ihl = PKT_IP_VER_HLEN;
-	answer_iph->tos = 0;
-	answer_iph->tot_len = htons(udp_len + PKT_IP_HLEN);
-	answer_iph->id = 0;
-	answer_iph->opt_off_high = 0;
-	answer_iph->off_low = 0;
-	answer_iph->ttl = 0x10;
-	answer_iph->protocol = 0x11;
-	answer_iph->check = 0; /* Calculate at end of packet */
-	memcpy(&answer_iph->daddr, &iph->saddr, PKT_IP_ALEN);
-	memcpy(&answer_iph->saddr, &iph->daddr, PKT_IP_ALEN);
-
-	/* Ethernet header */
-	memcpy(answer_ethh->dst, &ethh->src, PKT_ETH_ALEN);
-	memcpy(answer_ethh->src, &ethh->dst, PKT_ETH_ALEN);
-
-	/* Work out checksums */
-	chksum(answer_iph);
-
-	/* Calculate total length */
-	length = udp_len + sizeofip(answer);
-
-	OTHER_SENDING(conn, answer_iph);
-	dhcp_send(dhcp, dhcp_conn_idx(conn), conn->hismac, answer, length);
+	dhcp_dns_reply(conn, pack, answer, query_len + DHCP_DNS_HLEN);
 	return 0;
       }
     }
@@ -2034,7 +2040,6 @@ int dhcp_dns(struct dhcp_conn_t *conn, uint8_t *pack,
 #ifdef ENABLE_IPV6
     if (_options.ipv6 && mod > 0 && !isReq && an_mark && ancount > 0) {
       /* repack as IPv6 AAAA addresses */
-      uint8_t n[1500];
       uint8_t b[1500];
       uint8_t *p = an_mark, *bp = b, *bt = b;
       int new_ancount = 0;
@@ -2042,8 +2047,8 @@ int dhcp_dns(struct dhcp_conn_t *conn, uint8_t *pack,
 
       for (i=0; i < ancount; i++) {
 
-	ssize_t namelen =  dns_fullname((char*)n, sizeof(n)-1,
-					p, len, (uint8_t *)dnsp, olen, 0);
+	ssize_t namelen = dns_name((uint8_t *)dnsp, mlen,
+				   p - (uint8_t *)dnsp, 0, 0);
 
 	uint16_t type;
 	uint16_t class;
@@ -2163,6 +2168,17 @@ int dhcp_dns(struct dhcp_conn_t *conn, uint8_t *pack,
     }
 #endif
 
+#ifdef ENABLE_DNSCACHE
+    if (!isReq && fromUpstream && _options.dnscache &&
+        mode == DNS_DEFAULT_MODE
+#ifdef ENABLE_IPV6
+        && !_options.ipv6
+#endif
+        ) {
+      dns_cache_store((uint8_t *)dnsp, mlen, qmatch);
+    }
+#endif
+
     if (mod > 0) {
       chksum(pkt_iphdr(pack));
     }
@@ -2171,6 +2187,45 @@ int dhcp_dns(struct dhcp_conn_t *conn, uint8_t *pack,
   return 1;
 }
 
+#ifdef ENABLE_DNSCACHE
+/*
+ *   dhcp_dns_cached() - Answers the DNS query of an unauthenticated
+ *   client from the DNS cache. returns: 1 = answered, 0 = forward
+ */
+static
+int dhcp_dns_cached(struct dhcp_conn_t *conn, uint8_t *pack, size_t len) {
+  struct dns_packet_t *dnsp = pkt_dnspkt(pack);
+  uint8_t answer[1500];
+  size_t hlen = DHCP_DNS_HLEN + sizeofudp(pack);
+  size_t dns_len;
+
+  if (conn->authstate == DHCP_AUTH_PASS || len < hlen
+#ifdef ENABLE_MODULES
+      || _options.modules[0].name[0]
+#endif
+#ifdef ENABLE_IPV6
+      || _options.ipv6
+#endif
+      )
+    return 0;
+
+  dns_len = dns_cache_answer((uint8_t *)dnsp, len - sizeofudp(pack),
+			     (uint8_t *)pkt_dnspkt(answer),
+			     sizeof(answer) - sizeofudp(pack));
+  if (!dns_len)
+    return 0;
+
+#if(_debug_)
+  if (_options.debug)
+    syslog(LOG_DEBUG, "%s(%d): answered DNS from cache", __FUNCTION__, __LINE__);
+#endif
+
+  memcpy(answer, pack, sizeofudp(pack));
+  dhcp_dns_reply(conn, pack, answer, dns_len);
+  return 1;
+}
+#endif
+
 static
 int dhcp_uam_nat(struct dhcp_conn_t *conn,
 		 struct pkt_ethhdr_t *ethh,
@@ -2271,7 +2326,7 @@ int dhcp_dnsDNAT(struct dhcp_conn_t *conn,
       udph->dst == htons(DHCP_MDNS)) {
     if (_options.debug)
       syslog(LOG_DEBUG, "%s(%d): mDNS packet", __FUNCTION__, __LINE__);
-    if (!dhcp_dns(conn, pack, len, 1)) {
+    if (!dhcp_dns(conn, pack, len, 1, 0)) {
 #if(_debug_)
       if (_options.debug)
         syslog(LOG_DEBUG, "%s(%d): dhcp_dns()", __FUNCTION__, __LINE__);
@@ -2288,6 +2343,11 @@ int dhcp_dnsDNAT(struct dhcp_conn_t *conn,
       iph->protocol == PKT_IP_PROTO_UDP &&
       udph->dst == htons(DHCP_DNS)) {
 
+#ifdef ENABLE_DNSCACHE
+    if (_options.dnscache && dhcp_dns_cached(conn, pack, *len))
+      return -1; /* Answered locally */
+#endif
+
 #ifdef ENABLE_FORCEDNS
     if (_options.forcedns1_addr.s_addr) {
 
@@ -2331,7 +2391,7 @@ int dhcp_dnsDNAT(struct dhcp_conn_t *conn,
         }
       }
 
-    if (!dhcp_dns(conn, pack, len, 1)) {
+    if (!dhcp_dns(conn, pack, len, 1, 0)) {
 #if(_debug_)
       if (_options.debug)
         syslog(LOG_DEBUG, "%s(%d): dhcp_dns()", __FUNCTION__, __LINE__);
@@ -2356,12 +2416,18 @@ int dhcp_dnsunDNAT(struct dhcp_conn_t *conn,
 
   if (iph->protocol == PKT_IP_PROTO_UDP) {
 
+    /* only what the configured servers say may be cached */
+    char upstream = (udph->src == htons(DHCP_DNS) &&
+		     (iph->saddr == _options.dns1.s_addr ||
+		      iph->saddr == _options.dns2.s_addr));
+
 #ifdef ENABLE_FORCEDNS
     if (_options.forcedns1_addr.s_addr) {
       if (_options.forcedns1_addr.s_addr == iph->saddr &&
 	  udph->src == (_options.forcedns1_port ?
 			htons(_options.forcedns1_port) :
 			htons(DHCP_DNS))) {
+	upstream = 1;
 	iph->saddr = conn->dnatdns;
 	udph->src = htons(DHCP_DNS);
 	*do_checksum = 1;
@@ -2370,6 +2436,7 @@ int dhcp_dnsunDNAT(struct dhcp_conn_t *conn,
                udph->src == (_options.forcedns2_port ?
                              htons(_options.forcedns2_port) :
                              htons(DHCP_DNS))) {
+	upstream = 1;
 	iph->saddr = conn->dnatdns2;
 	udph->src = htons(DHCP_DNS);
 	*do_checksum = 1;
@@ -2390,7 +2457,7 @@ int dhcp_dnsunDNAT(struct dhcp_conn_t *conn,
 	*do_checksum = 1;
       }
 
-      if (!dhcp_dns(conn, pack, len, 0)) {
+      if (!dhcp_dns(conn, pack, len, 0, upstream)) {
 #if(_debug_)
         if (_options.debug)
           syslog(LOG_DEBUG, "%s(%d); dhcp_dns()", __FUNCTION__, __LINE__);
@@ -2541,44 +2608,9 @@ int dhcp_garden_check(struct dhcp_t *this,
       appconn = dhcp_get_appconn_pkt(conn,
 				     (struct pkt_iphdr_t *)ipph,
 				     !dst);
-    if (appconn) {
-#ifdef HAVE_PATRICIA
-      if (appconn->ptree) {
-
-	if (garden_patricia_check(appconn->ptree,
-				  appconn->s_params.pass_throughs,
-				  &appconn->s_params.pass_through_count,
-				  ipph, dst))
-	  found = 1;
-
-      } else {
-#endif
-	switch (garden_check(appconn->s_params.pass_throughs,
-			     &appconn->s_params.pass_through_count, &pt,
-			     ipph, dst
-#ifdef HAVE_PATRICIA
-			     , 0
-#endif
-			     )) {
-          case 1:
-            found = 1;
-            break;
-#ifdef ENABLE_GARDENEXT
-          case -1:
-            if (pt)
-              pass_through_rem(appconn->s_params.pass_throughs,
-                               &appconn->s_params.pass_through_count, pt
-#ifdef HAVE_PATRICIA
-                               , 0
-#endif
-                               );
-            break;
-#endif
-	}
-#ifdef HAVE_PATRICIA
-      }
-#endif
-    }
+    if (appconn &&
+	garden_ruleset_check(&appconn->s_params.garden, ipph, dst))
+      found = 1;
   }
 #endif
 
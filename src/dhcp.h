@@ -357,6 +357,9 @@ void dhcp_reset_tcp_mac(struct dhcp_t *this, uint8_t *hwaddr);
 
 int dhcp_filterDNS(struct dhcp_conn_t *conn, uint8_t *pack, size_t *plen);
 
+int dhcp_dns(struct dhcp_conn_t *conn, uint8_t *pack,
+	     size_t *plen, char isReq, char fromUpstream);
+
 int dhcp_gettag(struct dhcp_packet_t *pack, size_t length,
 		struct dhcp_tag_t **tag, uint8_t tagtype);
 
@@ -23,90 +23,69 @@
 
 extern struct dhcp_t *dhcp;
 
+/*
+ *  Walks the (possibly compressed) name at off in msg in place.
+ *  Compression pointers have to point strictly backwards, so every
+ *  walk terminates, and the name may not exceed 255 bytes. When data
+ *  is given, the name is decoded into it, dot separated. Returns the
+ *  number of bytes the name occupies at off, or -1 if malformed.
+ */
 ssize_t
-dns_fullname(char *data, size_t dlen,      /* buffer to store name */
-	     uint8_t *res, size_t reslen,  /* current resource */
-	     uint8_t *opkt, size_t olen,   /* original packet */
-	     int lvl) {
-  int ret = 0;
-  char *d = data;
-  unsigned char l;
-
-  if (lvl >= 15) return -1;
+dns_name(uint8_t *msg, size_t mlen, size_t off,
+	 char *data, size_t dlen) {
+  ssize_t wire = -1;
+  size_t lim = off;
+  size_t pos = off;
+  size_t total = 0;
+  size_t d = 0;
 
-#if(_debug_ > 1)
-  if (_options.debug)
-    syslog(LOG_DEBUG, "%s(%d): %s dlen=%zd reslen=%zd olen=%zd lvl=%d", __FUNCTION__, __LINE__,
-           __FUNCTION__, dlen, reslen, olen, lvl);
-#endif
-
-  /* only capture the first name in query */
-  if (d && d[0]) d = 0;
-
-  while (reslen-- > 0 && ++ret && (l = *res++) != 0) {
+  while (pos < mlen) {
+    uint8_t l = msg[pos];
 
     if ((l & 0xC0) == 0xC0) {
-      if (reslen == 0) return -1;
-      else {
-	unsigned short offset = ((l & ~0xC0) << 8) + *res;
+      size_t ptr;
 
-	ret++;
+      if (pos + 1 >= mlen) return -1;
+      ptr = ((l & 0x3F) << 8) | msg[pos + 1];
 
-	if (offset > olen) {
-          if (_options.debug)
-            syslog(LOG_DEBUG, "%s(%d): bad value", __FUNCTION__, __LINE__);
-	  return -1;
-	}
+      if (wire < 0) wire = pos + 2 - off;
 
-#if(_debug_ > 1)
+      if (ptr >= lim) {
         if (_options.debug)
-          syslog(LOG_DEBUG, "%s(%d): skip[%d] olen=%zd", __FUNCTION__, __LINE__, offset, olen);
-#endif
-
-	if (dns_fullname(d, dlen,
-			 opkt + (size_t) offset,
-			 olen - (size_t) offset,
-			 opkt, olen, lvl+1) < 0)
-	  return -1;
-	break;
+          syslog(LOG_DEBUG, "%s(%d): bad pointer %zu at %zu", __FUNCTION__, __LINE__, ptr, pos);
+        return -1;
       }
+
+      pos = lim = ptr;
+      continue;
     }
 
-    if (l >= dlen || l >= olen) {
-      if (_options.debug)
-        syslog(LOG_DEBUG, "%s(%d): bad value %d/%zu/%zu", __FUNCTION__, __LINE__, l, dlen, olen);
-      return -1;
+    /* 0x40 and 0x80 are not valid label types */
+    if (l & 0xC0) return -1;
+
+    if (l == 0) {
+      if (wire < 0) wire = pos + 1 - off;
+      if (data) {
+        if (d > 0) d--; /* trailing dot */
+        data[d] = 0;
+      }
+      return wire;
     }
 
-#if(_debug_ > 1)
-    if (_options.debug)
-      syslog(LOG_DEBUG, "%s(%d): part[%.*s] reslen=%zd l=%d dlen=%zd", __FUNCTION__, __LINE__, 
-             l, res, reslen, l, dlen);
-#endif
+    total += l + 1;
+    if (total > 255 || pos + 1 + l > mlen) return -1;
 
-    if (d) {
-      memcpy(d, res, l);
+    if (data) {
+      if (d + l + 1 >= dlen) return -1;
+      memcpy(data + d, msg + pos + 1, l);
       d += l;
-      dlen -= l;
-    }
-    res += l;
-    reslen -= l;
-    ret += l;
-
-    if (d) {
-      *d = '.';
-      d += 1;
-      dlen -= 1;
+      data[d++] = '.';
     }
-  }
 
-  if (lvl == 0 && d) {
-    int len = strlen((char *)data);
-    if (len && len == (d - data) && data[len-1] == '.')
-      data[len-1]=0;
+    pos += l + 1;
   }
 
-  return ret;
+  return -1;
 }
 
 static void
@@ -128,10 +107,15 @@ add_A_to_garden(uint8_t *p) {
     ;
 }
 
+/*
+ *  Copies one record at *pktp, *left bytes of payload remaining.
+ *  opkt/mlen is the whole DNS message, header included, so that
+ *  compressed names anywhere in it can be followed.
+ */
 int
 dns_copy_res(struct dhcp_conn_t *conn, int q,
 	     uint8_t **pktp, size_t *left,
-	     uint8_t *opkt,  size_t olen,
+	     uint8_t *opkt,  size_t mlen,
 	     uint8_t *question, size_t qsize,
 	     int isReq, int *qmatch, int *modified, int mode) {
 
@@ -141,7 +125,7 @@ dns_copy_res(struct dhcp_conn_t *conn, int q,
   uint8_t *p_pkt = *pktp;
   size_t len = *left;
 
-  uint8_t name[PKT_IP_PLEN];
+  char name[256];
   ssize_t namelen = 0;
   char required = 0;
 
@@ -162,13 +146,13 @@ dns_copy_res(struct dhcp_conn_t *conn, int q,
 
 #if(_debug_ > 1)
   if (_options.debug)
-    syslog(LOG_DEBUG, "%s(%d): left=%zd olen=%zd qsize=%zd",
-           __FUNCTION__, __LINE__, *left, olen, qsize);
+    syslog(LOG_DEBUG, "%s(%d): left=%zd mlen=%zd qsize=%zd",
+           __FUNCTION__, __LINE__, *left, mlen, qsize);
 #endif
 
-  memset(name, 0, sizeof(name));
-  namelen = dns_fullname((char*)name, sizeof(name)-1,
-			 p_pkt, len, opkt, olen, 0);
+  /* only decoded for the question and for logging */
+  namelen = dns_name(opkt, mlen, p_pkt - opkt,
+		     _options.debug ? name : 0, sizeof(name));
 
   if (namelen < 0 || namelen > len) return_error;
 
@@ -202,7 +186,9 @@ dns_copy_res(struct dhcp_conn_t *conn, int q,
 #endif
 
   if (q) {
-    if (dns_fullname((char *)question, qsize, *pktp, *left, opkt, olen, 0) < 0)
+    /* only capture the first name in query */
+    if (!question[0] &&
+        dns_name(opkt, mlen, *pktp - opkt, (char *)question, qsize) < 0)
       return_error;
 
     if (_options.debug)
@@ -434,3 +420,586 @@ dns_copy_res(struct dhcp_conn_t *conn, int q,
 
   return 0;
 }
+
+#ifdef ENABLE_DNSCACHE
+/*
+ *  Cache of upstream DNS answers, used to answer repeated queries of
+ *  clients that are not (yet) authenticated without forwarding them.
+ *  The table is direct mapped on a hash of the lower cased question;
+ *  an entry holds the response up to the end of the authority section,
+ *  with the offsets of its TTLs so they can be aged on the way out.
+ *  A miss leaves the forwarded query in its slot, and only an answer
+ *  with the ID and question of that query is taken.
+ */
+#define DNS_CACHE_MSG   512
+#define DNS_CACHE_RR     16
+
+struct dns_cache_entry {
+  uint32_t hash;
+  uint16_t len;              /* cached message length, 0 = unused */
+  uint16_t qlen;             /* question section length */
+  time_t stored;
+  time_t expires;
+  struct timeval pending;    /* time of the miss we wait an answer for */
+  uint8_t garden;            /* answer matched a uamdomain */
+  uint8_t nttl;
+  uint8_t na;
+  uint16_t ttl_off[DNS_CACHE_RR];
+  uint16_t a_off[DNS_CACHE_RR];
+  uint8_t msg[DNS_CACHE_MSG];
+};
+
+static struct dns_cache_entry *_dns_cache = 0;
+static uint32_t _dns_cache_size = 0;
+
+static struct {
+  uint64_t lookups;
+  uint64_t hits;
+  uint64_t expired;
+  uint64_t stores;
+  uint64_t evictions;
+  uint64_t local_usec;       /* time spent answering hits */
+  uint64_t upstream;         /* misses answered by upstream */
+  uint64_t upstream_usec;
+} _dns_cache_stats;
+
+static int dns_cache_init(void) {
+  uint32_t size = 1;
+
+  if (_dns_cache) return 0;
+  if (_options.dnscache <= 0) return -1;
+
+  while (size < (uint32_t) _options.dnscache && size < (1 << 20))
+    size <<= 1;
+
+  _dns_cache = calloc(size, sizeof(struct dns_cache_entry));
+  if (!_dns_cache) {
+    syslog(LOG_ERR, "%s: could not allocate DNS cache of %d entries",
+           strerror(errno), size);
+    return -1;
+  }
+
+  _dns_cache_size = size;
+  return 0;
+}
+
+void dns_cache_flush(void) {
+  if (_dns_cache) {
+    free(_dns_cache);
+    _dns_cache = 0;
+    _dns_cache_size = 0;
+  }
+}
+
+/*
+ *  Validates the (uncompressed) question at the start of a message and
+ *  computes its key; returns the question section length or -1.
+ */
+static int dns_cache_question(uint8_t *msg, size_t len, uint32_t *hash) {
+  uint8_t key[DNS_CACHE_MSG];
+  size_t off = DHCP_DNS_HLEN;
+  size_t k = 0;
+
+  while (off < len) {
+    uint8_t l = msg[off];
+    if (l == 0) break;
+    if (l > 63 || off + l + 1 >= len) return -1;
+    if (k + l + 1 > 255) return -1;
+    key[k++] = l;
+    for (off++; l > 0; l--, off++)
+      key[k++] = tolower(msg[off]);
+  }
+
+  if (off + 5 > len || k > 255) return -1;
+
+  memcpy(key + k, msg + off + 1, 4); /* type and class */
+  k += 4;
+
+  *hash = lookup(key, k, 0);
+  return (int) (off + 5 - DHCP_DNS_HLEN);
+}
+
+static struct dns_cache_entry *
+dns_cache_slot(uint8_t *msg, int qlen, uint32_t hash) {
+  struct dns_cache_entry *e = &_dns_cache[hash & (_dns_cache_size - 1)];
+  if (e->hash == hash && e->qlen == qlen &&
+      !strncasecmp((char *) e->msg + DHCP_DNS_HLEN,
+                   (char *) msg + DHCP_DNS_HLEN, qlen - 4) &&
+      !memcmp(e->msg + DHCP_DNS_HLEN + qlen - 4,
+              msg + DHCP_DNS_HLEN + qlen - 4, 4))
+    return e;
+  return 0;
+}
+
+/*
+ *  Remembers a (processed) upstream response to the query pending in
+ *  its slot; qmatch is the uamdomain verdict of dns_copy_res(), in
+ *  which case the TTLs have already been capped by uamdomainttl.
+ */
+void dns_cache_store(uint8_t *msg, size_t len, int qmatch) {
+  struct dns_packet_t *dnsp = (struct dns_packet_t *) msg;
+  struct dns_cache_entry *e;
+  uint16_t ancount, nscount, us;
+  uint32_t hash, minttl = 0xffffffff;
+  time_t now;
+  size_t off;
+  int qlen, i;
+
+  if (dns_cache_init()) return;
+
+  if (len <= DHCP_DNS_HLEN ||
+      (ntohs(dnsp->flags) & 0xFA0F) != 0x8000 ||
+      ntohs(dnsp->qdcount) != 1)
+    return;
+
+  ancount = ntohs(dnsp->ancount);
+  nscount = ntohs(dnsp->nscount);
+
+  if (ancount == 0 || ancount + nscount > DNS_CACHE_RR)
+    return;
+
+  qlen = dns_cache_question(msg, len, &hash);
+  if (qlen < 0) return;
+
+  e = dns_cache_slot(msg, qlen, hash);
+
+  /* the header kept with the pending question has the query's ID */
+  if (!e || !e->pending.tv_sec ||
+      ((struct dns_packet_t *) e->msg)->id != dnsp->id)
+    return;
+
+  {
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    _dns_cache_stats.upstream++;
+    _dns_cache_stats.upstream_usec +=
+        (tv.tv_sec - e->pending.tv_sec) * 1000000 +
+        (tv.tv_usec - e->pending.tv_usec);
+  }
+
+  now = mainclock_now();
+  e->na = 0;
+  e->pending.tv_sec = 0;
+
+  off = DHCP_DNS_HLEN + qlen;
+
+  for (i = 0; i < ancount + nscount; i++) {
+    ssize_t nl = dns_name(msg, len, off, 0, 0);
+    uint16_t type, class, rdlen;
+    uint32_t ul;
+
+    if (nl < 0 || off + nl + 10 > len) return;
+    off += nl;
+
+    memcpy(&us, msg + off, 2);
+    type = ntohs(us);
+    memcpy(&us, msg + off + 2, 2);
+    class = ntohs(us);
+    memcpy(&ul, msg + off + 4, 4);
+    memcpy(&us, msg + off + 8, 2);
+    rdlen = ntohs(us);
+
+    e->ttl_off[i] = off + 4;
+    if (ntohl(ul) < minttl)
+      minttl = ntohl(ul);
+
+    off += 10;
+    if (off + rdlen > len) return;
+
+    if (i < ancount && type == 1 && class == 1 && rdlen == 4)
+      e->a_off[e->na++] = off;
+
+    off += rdlen;
+  }
+
+  if (off > DNS_CACHE_MSG || minttl == 0 || minttl > 0x7fffffff)
+    return;
+
+  memcpy(e->msg, msg, off);
+  dnsp = (struct dns_packet_t *) e->msg;
+  dnsp->arcount = 0;
+
+  e->hash = hash;
+  e->qlen = qlen;
+  e->len = off;
+  e->nttl = ancount + nscount;
+  e->garden = (qmatch == 1);
+  e->stored = now;
+  e->expires = now + minttl;
+  _dns_cache_stats.stores++;
+}
+
+/*
+ *  Builds the answer to a query from the cache into ans; returns the
+ *  message length, or 0 when the query has to go upstream.
+ */
+size_t dns_cache_answer(uint8_t *msg, size_t len,
+			uint8_t *ans, size_t anslen) {
+  struct dns_packet_t *dnsp = (struct dns_packet_t *) msg;
+  struct dns_packet_t *ansp = (struct dns_packet_t *) ans;
+  struct dns_cache_entry *e;
+  struct timeval tv, done;
+  uint32_t hash, age;
+  uint16_t flags;
+  time_t now;
+  int qlen, i;
+
+  if (dns_cache_init()) return 0;
+
+  flags = ntohs(dnsp->flags);
+  if (len <= DHCP_DNS_HLEN ||
+      (flags & 0xF800) != 0 ||
+      ntohs(dnsp->qdcount) != 1 ||
+      ntohs(dnsp->ancount) != 0 ||
+      ntohs(dnsp->nscount) != 0 ||
+      ntohs(dnsp->arcount) > 1)
+    return 0;
+
+  qlen = dns_cache_question(msg, len, &hash);
+  if (qlen < 0) return 0;
+
+  gettimeofday(&tv, NULL);
+  _dns_cache_stats.lookups++;
+
+  e = dns_cache_slot(msg, qlen, hash);
+  now = mainclock_now();
+
+  if (!e || !e->len || e->expires <= now || e->len > anslen) {
+    if (e && e->len && e->expires <= now) {
+      _dns_cache_stats.expired++;
+      e->len = 0;
+    }
+    /* keep the query, its answer is the only one to be stored */
+    e = &_dns_cache[hash & (_dns_cache_size - 1)];
+    if (e->len && e->expires > now && e->hash != hash)
+      _dns_cache_stats.evictions++;
+    e->len = 0;
+    e->hash = hash;
+    e->qlen = qlen;
+    memcpy(e->msg, msg, DHCP_DNS_HLEN + qlen);
+    e->pending = tv;
+    return 0;
+  }
+
+  memcpy(ans, e->msg, e->len);
+
+  /* the client's ID, RD bit, and spelling of the question */
+  ansp->id = dnsp->id;
+  ansp->flags = htons((ntohs(ansp->flags) & ~0x0100) | (flags & 0x0100));
+  memcpy(ans + DHCP_DNS_HLEN, msg + DHCP_DNS_HLEN, qlen);
+
+  age = now - e->stored;
+  for (i = 0; i < e->nttl; i++) {
+    uint32_t ul;
+    memcpy(&ul, ans + e->ttl_off[i], 4);
+    ul = htonl(ntohl(ul) - age);
+    memcpy(ans + e->ttl_off[i], &ul, 4);
+  }
+
+  if (e->garden) {
+    for (i = 0; i < e->na; i++)
+      add_A_to_garden(e->msg + e->a_off[i]);
+  }
+
+  gettimeofday(&done, NULL);
+  _dns_cache_stats.hits++;
+  _dns_cache_stats.local_usec +=
+      (done.tv_sec - tv.tv_sec) * 1000000 +
+      (done.tv_usec - tv.tv_usec);
+
+  return e->len;
+}
+
+#ifdef ENABLE_CHILLIQUERY
+void dns_cache_print(int fd) {
+  char line[512];
+  uint64_t l = _dns_cache_stats.lookups;
+  uint64_t h = _dns_cache_stats.hits;
+  uint64_t u = _dns_cache_stats.upstream;
+
+  snprintf(line, sizeof line,
+           "dnscache (%u slots): lookups=%llu hits=%llu (%llu%%)"
+           " expired=%llu stored=%llu evicted=%llu"
+           " local=%lluus upstream=%lluus\n",
+           _dns_cache_size,
+           (unsigned long long) l, (unsigned long long) h,
+           (unsigned long long) (l ? h * 100 / l : 0),
+           (unsigned long long) _dns_cache_stats.expired,
+           (unsigned long long) _dns_cache_stats.stores,
+           (unsigned long long) _dns_cache_stats.evictions,
+           (unsigned long long) (h ? _dns_cache_stats.local_usec / h : 0),
+           (unsigned long long) (u ? _dns_cache_stats.upstream_usec / u : 0));
+  if (!safe_write(fd, line, strlen(line))) /* error */
+    ;
+}
+#endif
+#endif
+
+/*
+ *  Non-blocking resolver of A records, used by the chilli process for
+ *  names it needs at run time (see garden_names_load()). Queries go to
+ *  the configured dns1 (and dns2 on retry) over a UDP socket served by
+ *  net_select. Query IDs are random, and only replies from those
+ *  servers that match a pending ID and name are taken.
+ */
+#define DNS_RESOLVE_SLOTS    256
+#define DNS_RESOLVE_TIMEOUT    2
+#define DNS_RESOLVE_TRIES      3
+
+struct dns_resolve_t {
+  uint16_t id;
+  uint8_t inuse;
+  uint8_t tries;
+  time_t sent;
+  dns_resolve_cb cb;
+  void *ctx;
+  char name[256];
+};
+
+static struct dns_resolve_t _resolve[DNS_RESOLVE_SLOTS];
+static int _resolve_fd = -1;
+static int _resolve_pending = 0;
+static FILE *_resolve_urandom = 0;
+
+int dns_resolve_init(void) {
+  if (_resolve_fd >= 0) return _resolve_fd;
+
+  if (!_resolve_urandom &&
+      !(_resolve_urandom = fopen("/dev/urandom", "r")))
+    syslog(LOG_WARNING, "%s: fopen(/dev/urandom) failed", strerror(errno));
+
+  _resolve_fd = socket(AF_INET, SOCK_DGRAM, 0);
+  if (_resolve_fd < 0) {
+    syslog(LOG_ERR, "%s: resolver socket() failed", strerror(errno));
+    return -1;
+  }
+
+  ndelay_on(_resolve_fd);
+  coe(_resolve_fd);
+  return _resolve_fd;
+}
+
+static int dns_resolve_send(struct dns_resolve_t *r) {
+  uint8_t msg[DHCP_DNS_HLEN + 256 + 4];
+  struct sockaddr_in addr;
+  size_t len = DHCP_DNS_HLEN;
+  char *p = r->name;
+
+  /* ID, RD flag, one question */
+  memset(msg, 0, DHCP_DNS_HLEN);
+  msg[0] = r->id >> 8;
+  msg[1] = r->id & 0xff;
+  msg[2] = 0x01;
+  msg[5] = 1;
+
+  while (*p) {
+    char *e = strchr(p, '.');
+    size_t l = e ? (size_t)(e - p) : strlen(p);
+    if (l == 0 || l > 63 || len + l + 1 + 5 > sizeof(msg)) return -1;
+    msg[len++] = l;
+    memcpy(msg + len, p, l);
+    len += l;
+    p += l;
+    if (*p) p++;
+  }
+
+  msg[len++] = 0;
+  msg[len++] = 0; msg[len++] = 1; /* A */
+  msg[len++] = 0; msg[len++] = 1; /* IN */
+
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_port = htons(DHCP_DNS);
+  addr.sin_addr = (r->tries % 2 && _options.dns2.s_addr) ?
+      _options.dns2 : _options.dns1;
+
+  r->tries++;
+  r->sent = mainclock_now();
+
+  if (safe_sendto(_resolve_fd, msg, len, 0,
+		  (struct sockaddr *) &addr, sizeof(addr)) < 0) {
+    syslog(LOG_ERR, "%s: resolver sendto() failed", strerror(errno));
+    return -1;
+  }
+
+  return 0;
+}
+
+static struct dns_resolve_t *dns_resolve_find(uint16_t id) {
+  int i;
+  for (i = 0; i < DNS_RESOLVE_SLOTS; i++)
+    if (_resolve[i].inuse && _resolve[i].id == id)
+      return &_resolve[i];
+  return 0;
+}
+
+static uint16_t dns_resolve_id(void) {
+  uint16_t id;
+
+  do {
+    if (!_resolve_urandom ||
+	fread(&id, 1, sizeof(id), _resolve_urandom) != sizeof(id))
+      id = random() & 0xffff;
+  } while (_resolve_pending && dns_resolve_find(id));
+
+  return id;
+}
+
+/*
+ *  Starts resolving name; cb is called once with the addresses and the
+ *  smallest TTL of the answer, or with naddr < 0 if it failed.
+ */
+int dns_resolve(char *name, dns_resolve_cb cb, void *ctx) {
+  static uint16_t next = 0;
+  struct dns_resolve_t *r = 0;
+  int i;
+
+  if (dns_resolve_init() < 0 || !_options.dns1.s_addr ||
+      strlen(name) >= sizeof(r->name))
+    return -1;
+
+  for (i = 0; i < DNS_RESOLVE_SLOTS; i++) {
+    r = &_resolve[(next + i) % DNS_RESOLVE_SLOTS];
+    if (!r->inuse) break;
+  }
+
+  if (i == DNS_RESOLVE_SLOTS) return -1;
+
+  next = (next + i + 1) % DNS_RESOLVE_SLOTS;
+
+  r->id = dns_resolve_id();
+  r->inuse = 1;
+  r->tries = 0;
+  r->cb = cb;
+  r->ctx = ctx;
+  strlcpy(r->name, name, sizeof(r->name));
+
+  if (dns_resolve_send(r)) {
+    r->inuse = 0;
+    return -1;
+  }
+
+  _resolve_pending++;
+  return 0;
+}
+
+static void dns_resolve_done(struct dns_resolve_t *r, struct in_addr *addr,
+			     int naddr, uint32_t ttl) {
+  r->inuse = 0;
+  _resolve_pending--;
+  r->cb(r->ctx, addr, naddr, ttl);
+}
+
+void dns_resolve_cancel(void *ctx) {
+  int i;
+  for (i = 0; i < DNS_RESOLVE_SLOTS && _resolve_pending; i++) {
+    if (_resolve[i].inuse && _resolve[i].ctx == ctx) {
+      _resolve[i].inuse = 0;
+      _resolve_pending--;
+    }
+  }
+}
+
+int dns_resolve_read(void *nullData, int fd) {
+  uint8_t msg[sizeof(struct dns_packet_t)];
+  struct dns_packet_t *dnsp = (struct dns_packet_t *) msg;
+  struct in_addr addr[DNS_RESOLVE_ADDRS];
+  struct dns_resolve_t *r;
+  struct sockaddr_in from;
+  socklen_t fromlen = sizeof(from);
+  char name[256];
+  uint32_t ttl = 0xffffffff;
+  uint16_t ancount, flags, us;
+  int naddr = 0;
+  ssize_t len, nl;
+  size_t off;
+  int i;
+
+  len = safe_recvfrom(fd, msg, PKT_IP_PLEN, 0,
+		      (struct sockaddr *) &from, &fromlen);
+  if (len <= DHCP_DNS_HLEN) return 0;
+
+  if (fromlen < sizeof(from) || from.sin_port != htons(DHCP_DNS))
+    return 0;
+
+  /* a late reply to an earlier try comes from the other server */
+  if (from.sin_addr.s_addr != _options.dns1.s_addr &&
+      (!_options.dns2.s_addr ||
+       from.sin_addr.s_addr != _options.dns2.s_addr))
+    return 0;
+
+  r = dns_resolve_find(ntohs(dnsp->id));
+  flags = ntohs(dnsp->flags);
+
+  if (!r || !(flags & 0x8000) ||
+      ntohs(dnsp->qdcount) != 1)
+    return 0;
+
+  nl = dns_name(msg, len, DHCP_DNS_HLEN, name, sizeof(name));
+  if (nl < 0 || strcasecmp(name, r->name) ||
+      DHCP_DNS_HLEN + nl + 4 > len)
+    return 0;
+
+  if ((flags & 0x000F) != 0) {
+    if (_options.debug)
+      syslog(LOG_DEBUG, "%s(%d): %s rcode %d", __FUNCTION__, __LINE__,
+             r->name, flags & 0x000F);
+    dns_resolve_done(r, 0, -1, 0);
+    return 0;
+  }
+
+  ancount = ntohs(dnsp->ancount);
+  off = DHCP_DNS_HLEN + nl + 4;
+
+  for (i = 0; i < ancount; i++) {
+    uint16_t type, class, rdlen;
+    uint32_t ul;
+
+    nl = dns_name(msg, len, off, 0, 0);
+    if (nl < 0 || off + nl + 10 > len) break;
+    off += nl;
+
+    memcpy(&us, msg + off, 2);
+    type = ntohs(us);
+    memcpy(&us, msg + off + 2, 2);
+    class = ntohs(us);
+    memcpy(&ul, msg + off + 4, 4);
+    memcpy(&us, msg + off + 8, 2);
+    rdlen = ntohs(us);
+    off += 10;
+
+    if (off + rdlen > len) break;
+
+    /* CNAMEs are followed by the server, in order */
+    if (type == 1 && class == 1 && rdlen == 4 &&
+	naddr < DNS_RESOLVE_ADDRS) {
+      memcpy(&addr[naddr++].s_addr, msg + off, 4);
+      if (ntohl(ul) < ttl)
+	ttl = ntohl(ul);
+    }
+
+    off += rdlen;
+  }
+
+  if (_options.debug)
+    syslog(LOG_DEBUG, "%s(%d): %s resolved to %d addresses, ttl %u", __FUNCTION__, __LINE__,
+           r->name, naddr, naddr ? ttl : 0);
+
+  dns_resolve_done(r, addr, naddr ? naddr : -1, naddr ? ttl : 0);
+  return 0;
+}
+
+void dns_resolve_timeout(void) {
+  time_t now = mainclock_now();
+  int i;
+
+  for (i = 0; i < DNS_RESOLVE_SLOTS && _resolve_pending; i++) {
+    struct dns_resolve_t *r = &_resolve[i];
+    if (r->inuse && now - r->sent >= DNS_RESOLVE_TIMEOUT) {
+      if (r->tries >= DNS_RESOLVE_TRIES || dns_resolve_send(r)) {
+	syslog(LOG_WARNING, "could not resolve %s", r->name);
+	dns_resolve_done(r, 0, -1, 0);
+      }
+    }
+  }
+}
@@ -30,16 +30,35 @@ dns_getname(uint8_t **pktp, size_t *left,
 	    char *name, size_t namesz, size_t *nameln);
 
 ssize_t
-dns_fullname(char *data, size_t dlen,
-	     uint8_t *res, size_t reslen,
-	     uint8_t *opkt, size_t olen,
-	     int lvl);
+dns_name(uint8_t *msg, size_t mlen, size_t off,
+	 char *data, size_t dlen);
 
 int
 dns_copy_res(struct dhcp_conn_t *conn, int q,
 	     uint8_t **pktp, size_t *left,
-	     uint8_t *opkt, size_t olen,
+	     uint8_t *opkt, size_t mlen,
 	     uint8_t *question, size_t qsize,
 	     int isReq, int *qmatch, int *modified, int mode);
 
+#define DNS_RESOLVE_ADDRS 8
+
+typedef void (*dns_resolve_cb)(void *ctx, struct in_addr *addr,
+			       int naddr, uint32_t ttl);
+
+int dns_resolve_init(void);
+int dns_resolve(char *name, dns_resolve_cb cb, void *ctx);
+void dns_resolve_cancel(void *ctx);
+int dns_resolve_read(void *nullData, int fd);
+void dns_resolve_timeout(void);
+
+#ifdef ENABLE_DNSCACHE
+void dns_cache_store(uint8_t *msg, size_t len, int qmatch);
+size_t dns_cache_answer(uint8_t *msg, size_t len,
+			uint8_t *ans, size_t anslen);
+void dns_cache_flush(void);
+#ifdef ENABLE_CHILLIQUERY
+void dns_cache_print(int fd);
+#endif
+#endif
+
 #endif
@@ -82,44 +82,37 @@ static int chilli_garden(bstring b) {
 static int chilli_sessions(bstring b) {
   struct dhcp_conn_t *conn = dhcp->firstusedconn;
 
-  char *state = "<font color=green>Authorized</font>";
-
-  bstring s = bfromcstr("");
-  bcatcstr(b, "{\"service\":[{ \"");
-  bcatcstr(b, getenv("CAP_table"));
-  bcatcstr(b, "\":[ ");
+  jsonw_open(b, 0, '{');
+  jsonw_open(b, "service", '[');
+  jsonw_open(b, 0, '{');
+  /* the table name, as asked for, is the key */
+  jsonw_str(b, 0, getenv("CAP_table"));
+  bconchar(b, ':');
+  jsonw_open(b, 0, '[');
 
   while (conn) {
     struct app_conn_t *appconn = (struct app_conn_t *)conn->peer;
 
-    if (appconn && appconn->s_state.authenticated) {
+    jsonw_open(b, 0, '{');
+    jsonw_str(b, "state", appconn && appconn->s_state.authenticated ?
+	      "<font color=green>Authorized</font>" :
+	      "<font color=red>Redirect</font>");
+    jsonw_mac(b, "macAddress", conn->hismac);
+    jsonw_ip(b, "ipAddress", &conn->hisip);
 
-    } else {
-      state = "<font color=red>Redirect</font>";
+    if (appconn) {
+      session_json_params(&appconn->s_state, &appconn->s_params, b, 0);
+      session_json_acct(&appconn->s_state, &appconn->s_params, b, 0);
     }
-
-    bassignformat(s,
-		  "{"
-		  "\"state\":\"%s\","
-		  "\"macAddress\":\"%.2X-%.2X-%.2X-%.2X-%.2X-%.2X\","
-		  "\"ipAddress\":\"%s\",",
-		  state,
-		  conn->hismac[0], conn->hismac[1], conn->hismac[2],
-		  conn->hismac[3], conn->hismac[4], conn->hismac[5],
-		  inet_ntoa(conn->hisip)
-		  );
+    jsonw_close(b, '}');
 
     conn = conn->next;
-    if (appconn) {
-      session_json_params(&appconn->s_state, &appconn->s_params, s, 0);
-      bcatcstr(s, ",");
-      session_json_acct(&appconn->s_state, &appconn->s_params, s, 0);
-    }
-    bcatcstr(s, "},");
-    bconcat(b, s);
   }
 
-  bcatcstr(b, "]} ]}");
+  jsonw_close(b, ']');
+  jsonw_close(b, '}');
+  jsonw_close(b, ']');
+  jsonw_close(b, '}');
   return 0;
 }
 
@@ -134,31 +127,100 @@ struct ewt_service {
 
 static int NUM_SERVICES = sizeof(ewt_services) / sizeof(struct ewt_service);
 
-static void json_walk(bstring prefix, struct json_object *obj) {
-  json_object_object_foreach(obj, key, val) {
-    bstring tmp = bfromcstr("");
-    switch(json_object_get_type(val)) {
-      case json_type_object:
-        bassign(tmp, prefix);
-        bcatcstr(tmp, key);
-        bcatcstr(tmp, "_0_");
-        json_walk(tmp, val);
-        break;
-      case json_type_array:
-        bassign(tmp, prefix);
-        bcatcstr(tmp, key);
-        syslog(LOG_DEBUG, "%s(%d): a %s=%s", __FUNCTION__, __LINE__, tmp->data, json_object_to_json_string(val));
-        break;
-      default:
-        bassign(tmp, prefix);
-        bcatcstr(tmp, key);
-        syslog(LOG_DEBUG, "%s(%d): %s=%s", __FUNCTION__, __LINE__, tmp->data, json_object_to_json_string(val));
-        break;
-    }
-    bdestroy(tmp);
+/*
+ *  Logs the members of the requested service as CAP_ variables, read
+ *  with the SAX callbacks of the tokener rather than from a tree.
+ */
+struct ewt_walk {
+  const char *service;
+  bstring prefix;       /* CAP_ and the keys of the enclosing objects */
+  bstring key;
+  int plen[JSON_TOKENER_DEFAULT_DEPTH];
+  int depth;
+  int match;            /* the last top level key names the service */
+  int in;               /* depth inside the service object, or 0 */
+  int array;            /* depth of the array being logged, or 0 */
+  const char *array_at;
+};
+
+static int ewt_object_start(void *ud, const char *at) {
+  struct ewt_walk *w = (struct ewt_walk *)ud;
+  w->depth++;
+  if (w->array) return 0;
+  if (w->in) {
+    w->plen[w->depth - 1] = w->prefix->slen;
+    bconcat(w->prefix, w->key);
+    bcatcstr(w->prefix, "_0_");
+  } else if (w->depth == 2 && w->match) {
+    w->in = w->depth;
   }
+  return 0;
+}
+
+static int ewt_object_end(void *ud, const char *at) {
+  struct ewt_walk *w = (struct ewt_walk *)ud;
+  w->depth--;
+  if (w->array || !w->in) return 0;
+  if (w->depth < w->in)
+    return 1; /* done with the service */
+  btrunc(w->prefix, w->plen[w->depth]);
+  return 0;
 }
 
+static int ewt_array_start(void *ud, const char *at) {
+  struct ewt_walk *w = (struct ewt_walk *)ud;
+  w->depth++;
+  if (w->in && !w->array) {
+    w->array = w->depth;
+    w->array_at = at;
+  }
+  return 0;
+}
+
+static int ewt_array_end(void *ud, const char *at) {
+  struct ewt_walk *w = (struct ewt_walk *)ud;
+  if (w->array == w->depth) {
+    syslog(LOG_DEBUG, "%s(%d): a %s%s=%.*s", __FUNCTION__, __LINE__,
+	   w->prefix->data, w->key->data, (int)(at + 1 - w->array_at),
+	   w->array_at);
+    w->array = 0;
+  }
+  w->depth--;
+  return 0;
+}
+
+static int ewt_object_key(void *ud, const char *key, int len) {
+  struct ewt_walk *w = (struct ewt_walk *)ud;
+  if (w->array) return 0;
+  if (w->depth == 1)
+    w->match = (int) strlen(w->service) == len &&
+      !memcmp(w->service, key, len);
+  else if (w->in)
+    bassignblk(w->key, key, len);
+  return 0;
+}
+
+static int ewt_value(void *ud, enum json_type type, const char *s, int len) {
+  struct ewt_walk *w = (struct ewt_walk *)ud;
+  if (w->array || !w->in) return 0;
+  if (type == json_type_string)
+    syslog(LOG_DEBUG, "%s(%d): %s%s=\"%.*s\"", __FUNCTION__, __LINE__,
+	   w->prefix->data, w->key->data, len, s);
+  else
+    syslog(LOG_DEBUG, "%s(%d): %s%s=%.*s", __FUNCTION__, __LINE__,
+	   w->prefix->data, w->key->data, len, s);
+  return 0;
+}
+
+static const struct json_sax ewt_sax = {
+  ewt_object_start,
+  ewt_object_key,
+  ewt_object_end,
+  ewt_array_start,
+  ewt_array_end,
+  ewt_value,
+};
+
 int ewtapi(struct redir_t *redir,
 	   struct redir_socket_t *sock,
 	   struct redir_conn_t *conn,
@@ -180,19 +242,16 @@ int ewtapi(struct redir_t *redir,
   }
 
   if (httpreq->clen) {
-    struct json_object *obj = 0;
+    struct ewt_walk w;
     bblk_fromfd(b, 0, httpreq->clen);
-    if ((obj = json_tokener_parse((char *)b->data))) {
-      syslog(LOG_DEBUG, "%s(%d): obj.to_string()=%s", __FUNCTION__, __LINE__, json_object_to_json_string(obj));
-      json_object_object_foreach(obj, key, val) {
-	if (!strcmp(key, (char *)s->data)) {
-	  bstring tmp = bfromcstr("CAP_");
-	  json_walk(tmp, val);
-	  bdestroy(tmp);
-	}
-      }
-    }
-    /* delete obj */
+    syslog(LOG_DEBUG, "%s(%d): body=%s", __FUNCTION__, __LINE__, b->data);
+    memset(&w, 0, sizeof(w));
+    w.service = (char *)s->data;
+    w.prefix = bfromcstr("CAP_");
+    w.key = bfromcstr("");
+    json_tokener_parse_sax((char *)b->data, b->slen, &ewt_sax, &w);
+    bdestroy(w.prefix);
+    bdestroy(w.key);
   }
 
   bassignformat(b,
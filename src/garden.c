@@ -61,29 +61,16 @@ void garden_print_list(int fd, pass_through *ptlist, int ptcnt) {
 int garden_print_appconn(struct app_conn_t *appconn, void *d) {
   char line[512];
   int fd = * (int *) d;
-#ifdef HAVE_PATRICIA
-  void cb (prefix_t *prefix, void *data) {
-    struct node_pass_through_list *nd =
-        (struct node_pass_through_list *)data;
-    garden_print_list(fd, nd->ptlist, nd->ptcnt);
-  }
-#endif
-  if (appconn->s_params.pass_through_count > 0) {
+  garden_ruleset *rs = appconn->s_params.garden;
+  if (garden_ruleset_count(rs) > 0) {
     snprintf(line, sizeof line,
-		  "subscriber %s (%d/%d):\n",
+		  "subscriber %s (%d/%d, shared by %d):\n",
 		  inet_ntoa(appconn->hisip),
-		  appconn->s_params.pass_through_count,
-		  SESSION_PASS_THROUGH_MAX);
+		  rs->count, SESSION_PASS_THROUGH_MAX,
+		  rs->refcnt);
     if (!safe_write(fd, line, strlen(line))) /* error */
       ;
-#ifdef HAVE_PATRICIA
-    if (appconn->ptree) {
-      patricia_process(appconn->ptree, cb);
-    } else
-#endif
-    garden_print_list(fd,
-			appconn->s_params.pass_throughs,
-			appconn->s_params.pass_through_count);
+    garden_print_list(fd, rs->rules, rs->count);
   }
   return 0;
 }
@@ -151,8 +138,15 @@ void garden_print(int fd) {
 #endif
 
 #ifdef ENABLE_SESSGARDEN
+  garden_ruleset_print(fd);
   chilli_appconn_run(garden_print_appconn, &fd);
 #endif
+
+#ifdef ENABLE_UAMDOMAINFILE
+  garden_print_domainfile(fd);
+#endif
+
+  garden_print_names(fd);
 }
 #endif
 
@@ -161,10 +155,10 @@ int garden_patricia_print(int fd, patricia_tree_t *ptree) {
   return 0;
 }
 
-int garden_patricia_check(patricia_tree_t *ptree,
-			  pass_through *ptlist, uint32_t *ptcnt,
-			  struct pkt_ipphdr_t *ipph, int dst) {
-  int found = 0;
+static int garden_patricia_match(patricia_tree_t *ptree,
+				 pass_through **pt_match,
+				 struct pkt_ipphdr_t *ipph, int dst) {
+  int res = 0;
   prefix_t *prefix;
   patricia_node_t *pfx;
   struct in_addr sin;
@@ -177,22 +171,31 @@ int garden_patricia_check(patricia_tree_t *ptree,
     struct node_pass_through_list *
         nd = PATRICIA_DATA_GET(pfx, struct node_pass_through_list);
 
-    if (nd) {
-      pass_through *pt=0;
-      switch (garden_check(nd->ptlist, &nd->ptcnt,
-			   &pt, ipph, dst, ptree)) {
-        case 1:
-          found = 1;
-          break;
-        case -1:
-          if (pt)
-            pass_through_rem(ptlist, ptcnt, pt, ptree);
-          break;
-      }
-    }
+    if (nd)
+      res = garden_check(nd->ptlist, &nd->ptcnt,
+			 pt_match, ipph, dst, ptree);
   }
 
   patricia_prefix_deref (prefix);
+  return res;
+}
+
+int garden_patricia_check(patricia_tree_t *ptree,
+			  pass_through *ptlist, uint32_t *ptcnt,
+			  struct pkt_ipphdr_t *ipph, int dst) {
+  int found = 0;
+  pass_through *pt=0;
+
+  switch (garden_patricia_match(ptree, &pt, ipph, dst)) {
+    case 1:
+      found = 1;
+      break;
+    case -1:
+      if (pt)
+        pass_through_rem(ptlist, ptcnt, pt, ptree);
+      break;
+  }
+
   return found;
 }
 
@@ -461,7 +464,7 @@ int pass_through_add(pass_through *ptlist, uint32_t ptlen,
 
 int pass_throughs_from_string(pass_through *ptlist, uint32_t ptlen,
 			      uint32_t *ptcnt, char *s,
-			      char is_dyn, char is_rem
+			      char is_dyn, char is_rem, bstring names
 #ifdef HAVE_PATRICIA
 			      , patricia_tree_t *ptree
 #endif
@@ -571,6 +574,17 @@ int pass_throughs_from_string(pass_through *ptlist, uint32_t ptlen,
       int j = 0;
       pt.mask.s_addr = 0xffffffff;
 
+      if (names &&
+#ifdef ENABLE_GARDENEXT
+	  !pt.expiry &&
+#endif
+	  !inet_aton(p1, &pt.host)) {
+	/* resolved (and refreshed) by the chilli process, see garden_names_load() */
+	bformata(names, "%s%s:%d:%d", names->slen ? "," : "",
+		 p1, pt.proto, pt.port);
+	continue;
+      }
+
       if (!(host = gethostbyname(p1))) {
 	syslog(LOG_ERR, "%s: Invalid uamallowed domain or address: %s!", strerror(errno), p1);
 	continue;
@@ -601,6 +615,483 @@ int pass_throughs_from_string(pass_through *ptlist, uint32_t ptlen,
   return 0;
 }
 
+/*
+ *  Host names in uamallowed are left to the chilli process, which
+ *  resolves them all in parallel without blocking and refreshes each
+ *  when its TTL runs out. Addresses missing from a newer answer are
+ *  taken out of the garden again, unless the entry was there before the
+ *  name (a static uamallowed rule) or another name still resolves to it.
+ */
+#define GARDEN_NAME_MINTTL   30
+#define GARDEN_NAME_MAXTTL   86400
+#define GARDEN_NAME_RETRY    30
+
+struct garden_name_t {
+  pass_through pt;                  /* protocol and port of the entry */
+  struct in_addr addr[DNS_RESOLVE_ADDRS];
+  uint8_t owned[DNS_RESOLVE_ADDRS];  /* garden entry added by this name */
+  int naddr;
+  time_t refresh;
+  uint8_t pending;
+  struct garden_name_t *next;
+  char name[1];
+};
+
+static struct garden_name_t *_garden_names = 0;
+
+/*
+ *  Adds addr to the garden; returns 1 when the entry is new, and so
+ *  belongs to the name.
+ */
+static uint8_t garden_name_add(struct garden_name_t *gn,
+			       struct in_addr addr) {
+  pass_through pt = gn->pt;
+  uint32_t i;
+
+  pt.host = addr;
+
+  for (i = 0; i < _options.num_pass_throughs; i++)
+    if (pt_equal(&_options.pass_throughs[i], &pt))
+      return 0;
+
+  if (pass_through_add(_options.pass_throughs,
+		       MAX_PASS_THROUGHS,
+		       &_options.num_pass_throughs, &pt, 0
+#ifdef HAVE_PATRICIA
+		       , dhcp->ptree
+#endif
+		       )) {
+    syslog(LOG_ERR, "Too many pass-throughs! skipped %s", gn->name);
+    return 0;
+  }
+
+  return 1;
+}
+
+static void garden_name_rem(struct garden_name_t *gn, int i) {
+  pass_through pt = gn->pt;
+  struct garden_name_t *o;
+  int j;
+
+  if (!gn->owned[i]) return;
+
+  /* hand the entry over to another name with the same address */
+  for (o = _garden_names; o; o = o->next) {
+    if (o == gn || o->pt.proto != gn->pt.proto ||
+	o->pt.port != gn->pt.port)
+      continue;
+    for (j = 0; j < o->naddr; j++) {
+      if (o->addr[j].s_addr == gn->addr[i].s_addr) {
+	o->owned[j] = 1;
+	return;
+      }
+    }
+  }
+
+  pt.host = gn->addr[i];
+  pass_through_rem(_options.pass_throughs,
+		   &_options.num_pass_throughs, &pt
+#ifdef HAVE_PATRICIA
+		   , dhcp->ptree
+#endif
+		   );
+}
+
+static void garden_name_resolved(void *ctx, struct in_addr *addr,
+				 int naddr, uint32_t ttl) {
+  struct garden_name_t *gn = (struct garden_name_t *) ctx;
+  uint8_t owned[DNS_RESOLVE_ADDRS];
+  int i, j;
+
+  gn->pending = 0;
+
+  if (naddr < 0) {
+    /* keep what we had, and try again later */
+    gn->refresh = mainclock_now() + GARDEN_NAME_RETRY;
+    return;
+  }
+
+  for (i = 0; i < gn->naddr; i++) {
+    for (j = 0; j < naddr; j++)
+      if (addr[j].s_addr == gn->addr[i].s_addr) break;
+    if (j == naddr)
+      garden_name_rem(gn, i);
+  }
+
+  for (j = 0; j < naddr; j++) {
+    for (i = 0; i < gn->naddr; i++)
+      if (addr[j].s_addr == gn->addr[i].s_addr) break;
+    owned[j] = i < gn->naddr ? gn->owned[i] : garden_name_add(gn, addr[j]);
+  }
+
+  memcpy(gn->addr, addr, naddr * sizeof(struct in_addr));
+  memcpy(gn->owned, owned, naddr);
+  gn->naddr = naddr;
+
+  if (ttl < GARDEN_NAME_MINTTL) ttl = GARDEN_NAME_MINTTL;
+  if (ttl > GARDEN_NAME_MAXTTL) ttl = GARDEN_NAME_MAXTTL;
+  gn->refresh = mainclock_now() + ttl;
+}
+
+static void garden_names_release(struct garden_name_t *gn) {
+  while (gn) {
+    struct garden_name_t *n = gn->next;
+    if (gn->pending)
+      dns_resolve_cancel(gn);
+    free(gn);
+    gn = n;
+  }
+}
+
+void garden_names_free(void) {
+  garden_names_release(_garden_names);
+  _garden_names = 0;
+}
+
+/*
+ *  (Re)reads the names given to chilli_opt. The garden entries of
+ *  earlier answers went with the reloaded pass_throughs, so those of
+ *  names still listed are put back until their next refresh.
+ */
+void garden_names_load(void) {
+  struct garden_name_t *old = _garden_names;
+  char *s = _options.uamallowed_names;
+
+  _garden_names = 0;
+
+  while (s && *s) {
+    char *e = strchr(s, ',');
+    size_t len = e ? (size_t)(e - s) : strlen(s);
+    struct garden_name_t *gn = calloc(1, sizeof(*gn) + len);
+    struct garden_name_t *o;
+    char *c;
+
+    if (!gn) break;
+
+    memcpy(gn->name, s, len);
+    gn->pt.mask.s_addr = 0xffffffff;
+
+    /* name:proto:port */
+    if ((c = strrchr(gn->name, ':'))) {
+      gn->pt.port = atoi(c + 1);
+      *c = 0;
+      if ((c = strrchr(gn->name, ':'))) {
+	gn->pt.proto = atoi(c + 1);
+	*c = 0;
+      }
+    }
+
+    for (o = old; o; o = o->next) {
+      if (o->pt.proto == gn->pt.proto && o->pt.port == gn->pt.port &&
+	  !strcmp(o->name, gn->name)) {
+	int i;
+	memcpy(gn->addr, o->addr, o->naddr * sizeof(struct in_addr));
+	gn->naddr = o->naddr;
+	gn->refresh = o->pending ? 0 : o->refresh;
+	for (i = 0; i < gn->naddr; i++)
+	  gn->owned[i] = garden_name_add(gn, gn->addr[i]);
+	break;
+      }
+    }
+
+    gn->next = _garden_names;
+    _garden_names = gn;
+
+    s = e ? e + 1 : 0;
+  }
+
+  garden_names_release(old);
+  garden_names_timeout();
+}
+
+void garden_names_timeout(void) {
+  struct garden_name_t *gn;
+  time_t now = mainclock_now();
+
+  for (gn = _garden_names; gn; gn = gn->next) {
+    if (!gn->pending && gn->refresh <= now) {
+      if (!dns_resolve(gn->name, garden_name_resolved, gn))
+	gn->pending = 1;
+    }
+  }
+}
+
+#ifdef ENABLE_CHILLIQUERY
+void garden_print_names(int fd) {
+  char line[512];
+  struct garden_name_t *gn;
+
+  for (gn = _garden_names; gn; gn = gn->next) {
+    if (gn->pending)
+      snprintf(line, sizeof line, "uamallowed %s: %d addresses, resolving\n",
+	       gn->name, gn->naddr);
+    else
+      snprintf(line, sizeof line, "uamallowed %s: %d addresses, refresh in %ds\n",
+	       gn->name, gn->naddr, (int) (gn->refresh - mainclock_now()));
+    if (!safe_write(fd, line, strlen(line))) /* error */
+      ;
+  }
+}
+#endif
+
+#ifdef ENABLE_SESSGARDEN
+
+#define GARDEN_RULESET_HASHSIZE 256 /* must be a power of 2 */
+
+static garden_ruleset * _rulesets[GARDEN_RULESET_HASHSIZE];
+static uint32_t _ruleset_count = 0;
+
+static uint32_t garden_ruleset_hash(pass_through *ptlist, uint32_t ptcnt) {
+  uint32_t h = ptcnt;
+  uint32_t i;
+
+  for (i = 0; i < ptcnt; i++) {
+    uint32_t v[4];
+    v[0] = ptlist[i].host.s_addr;
+    v[1] = ptlist[i].mask.s_addr;
+    v[2] = (ptlist[i].proto << 16) | ptlist[i].port;
+#ifdef ENABLE_GARDENEXT
+    v[3] = (uint32_t) ptlist[i].expiry;
+#else
+    v[3] = 0;
+#endif
+    h = lookup((uint8_t *) v, sizeof(v), h);
+  }
+
+  return h;
+}
+
+static int garden_ruleset_equal(garden_ruleset *rs, uint32_t hash,
+				pass_through *ptlist, uint32_t ptcnt) {
+  uint32_t i;
+
+  if (rs->hash != hash || rs->count != ptcnt)
+    return 0;
+
+  for (i = 0; i < ptcnt; i++) {
+    if (!pt_equal(&rs->rules[i], &ptlist[i]))
+      return 0;
+#ifdef ENABLE_GARDENEXT
+    if (rs->rules[i].expiry != ptlist[i].expiry)
+      return 0;
+#endif
+  }
+
+  return 1;
+}
+
+garden_ruleset *garden_ruleset_intern(pass_through *ptlist, uint32_t ptcnt) {
+  uint32_t hash;
+  garden_ruleset *rs;
+  garden_ruleset **bucket;
+
+  if (!ptcnt) return 0;
+
+  hash = garden_ruleset_hash(ptlist, ptcnt);
+  bucket = &_rulesets[hash & (GARDEN_RULESET_HASHSIZE - 1)];
+
+  for (rs = *bucket; rs; rs = rs->next) {
+    if (garden_ruleset_equal(rs, hash, ptlist, ptcnt)) {
+      rs->refcnt++;
+      return rs;
+    }
+  }
+
+  rs = (garden_ruleset *)
+      calloc(1, sizeof(garden_ruleset) + sizeof(pass_through) * (ptcnt - 1));
+  if (!rs) {
+    syslog(LOG_ERR, "Out of memory for session garden");
+    return 0;
+  }
+
+  rs->refcnt = 1;
+  rs->hash = hash;
+  rs->count = ptcnt;
+  memcpy(rs->rules, ptlist, sizeof(pass_through) * ptcnt);
+
+#ifdef HAVE_PATRICIA
+  {
+    uint32_t i;
+    rs->ptree = patricia_new(32);
+    for (i = 0; i < ptcnt; i++)
+      garden_patricia_add(&rs->rules[i], rs->ptree);
+  }
+#endif
+
+  rs->next = *bucket;
+  *bucket = rs;
+  _ruleset_count++;
+
+  if (_options.debug)
+    syslog(LOG_DEBUG, "%s(%d): new session garden of %d entries (%d distinct)", __FUNCTION__, __LINE__,
+           ptcnt, _ruleset_count);
+
+  return rs;
+}
+
+garden_ruleset *garden_ruleset_ref(garden_ruleset *rs) {
+  if (rs) rs->refcnt++;
+  return rs;
+}
+
+void garden_ruleset_release(garden_ruleset *rs) {
+  garden_ruleset **prev;
+
+  if (!rs || --rs->refcnt > 0)
+    return;
+
+  for (prev = &_rulesets[rs->hash & (GARDEN_RULESET_HASHSIZE - 1)];
+       *prev; prev = &(*prev)->next) {
+    if (*prev == rs) {
+      *prev = rs->next;
+      break;
+    }
+  }
+
+#ifdef HAVE_PATRICIA
+  if (rs->ptree)
+    patricia_destroy (rs->ptree, free);
+#endif
+
+  _ruleset_count--;
+  free(rs);
+}
+
+uint32_t garden_ruleset_export(garden_ruleset *rs,
+			       pass_through *ptlist, uint32_t ptlen) {
+  uint32_t cnt = garden_ruleset_count(rs);
+  if (cnt > ptlen) cnt = ptlen;
+  if (cnt) memcpy(ptlist, rs->rules, sizeof(pass_through) * cnt);
+  return cnt;
+}
+
+static void garden_ruleset_replace(garden_ruleset **prs,
+				   pass_through *ptlist, uint32_t ptcnt) {
+  /* intern first so an unchanged ruleset is never freed in between */
+  garden_ruleset *rs = garden_ruleset_intern(ptlist, ptcnt);
+  garden_ruleset_release(*prs);
+  *prs = rs;
+}
+
+/*
+ *  The last string applied, to which ruleset, and the outcome. A burst
+ *  of Access-Accepts or CoA-Requests (a plan change) tends to apply the
+ *  same uamallowed= to sessions with the same ruleset; within the same
+ *  second those reuse the outcome rather than parse and resolve again.
+ */
+static struct {
+  garden_ruleset *in;
+  garden_ruleset *out;
+  time_t when;
+  char is_dyn;
+  char is_rem;
+  char s[256];
+} _ruleset_memo;
+
+int garden_ruleset_from_string(garden_ruleset **prs, char *s,
+			       char is_dyn, char is_rem) {
+  pass_through ptlist[SESSION_PASS_THROUGH_MAX];
+  garden_ruleset *in = *prs;
+  uint32_t ptcnt;
+
+  if (_ruleset_memo.when == mainclock_now() &&
+      _ruleset_memo.in == in &&
+      _ruleset_memo.is_dyn == is_dyn &&
+      _ruleset_memo.is_rem == is_rem &&
+      !strcmp(_ruleset_memo.s, s)) {
+    garden_ruleset *rs = garden_ruleset_ref(_ruleset_memo.out);
+    garden_ruleset_release(*prs);
+    *prs = rs;
+    return 0;
+  }
+
+  ptcnt = garden_ruleset_export(in, ptlist, SESSION_PASS_THROUGH_MAX);
+
+  pass_throughs_from_string(ptlist, SESSION_PASS_THROUGH_MAX,
+			    &ptcnt, s, is_dyn, is_rem, 0
+#ifdef HAVE_PATRICIA
+			    , 0
+#endif
+			    );
+
+  /* the memo holds on to both so their addresses stay theirs */
+  garden_ruleset_ref(in);
+  garden_ruleset_replace(prs, ptlist, ptcnt);
+
+  garden_ruleset_release(_ruleset_memo.in);
+  garden_ruleset_release(_ruleset_memo.out);
+  _ruleset_memo.in = in;
+  _ruleset_memo.out = garden_ruleset_ref(*prs);
+  _ruleset_memo.when = mainclock_now();
+  _ruleset_memo.is_dyn = is_dyn;
+  _ruleset_memo.is_rem = is_rem;
+  if (strlcpy(_ruleset_memo.s, s, sizeof(_ruleset_memo.s)) >=
+      sizeof(_ruleset_memo.s))
+    _ruleset_memo.when = 0;
+
+  return 0;
+}
+
+int garden_ruleset_check(garden_ruleset **prs,
+			 struct pkt_ipphdr_t *ipph, int dst) {
+  garden_ruleset *rs = *prs;
+  pass_through *pt = 0;
+  int res;
+
+  if (!rs) return 0;
+
+#ifdef HAVE_PATRICIA
+  if (rs->ptree)
+    res = garden_patricia_match(rs->ptree, &pt, ipph, dst);
+  else
+#endif
+    res = garden_check(rs->rules, &rs->count, &pt, ipph, dst
+#ifdef HAVE_PATRICIA
+		       , 0
+#endif
+		       );
+
+#ifdef ENABLE_GARDENEXT
+  if (res == -1 && pt) {
+    pass_through ptlist[SESSION_PASS_THROUGH_MAX];
+    pass_through expired;
+    uint32_t ptcnt;
+
+    memcpy(&expired, pt, sizeof(expired));
+    ptcnt = garden_ruleset_export(rs, ptlist, SESSION_PASS_THROUGH_MAX);
+    pass_through_rem(ptlist, &ptcnt, &expired
+#ifdef HAVE_PATRICIA
+		     , 0
+#endif
+		     );
+    garden_ruleset_replace(prs, ptlist, ptcnt);
+  }
+#endif
+
+  return res == 1;
+}
+
+#ifdef ENABLE_CHILLIQUERY
+void garden_ruleset_print(int fd) {
+  char line[128];
+  uint32_t refs = 0;
+  int i;
+
+  for (i = 0; i < GARDEN_RULESET_HASHSIZE; i++) {
+    garden_ruleset *rs;
+    for (rs = _rulesets[i]; rs; rs = rs->next)
+      refs += rs->refcnt;
+  }
+
+  snprintf(line, sizeof line,
+	   "session gardens (%d distinct, %d sessions):\n",
+	   _ruleset_count, refs);
+  if (!safe_write(fd, line, strlen(line))) /* error */
+    ;
+}
+#endif
+#endif
+
 #ifdef ENABLE_CHILLIREDIR
 int regex_pass_throughs_from_string(regex_pass_through *ptlist, uint32_t ptlen,
 				    uint32_t *ptcnt, char *s,
@@ -643,21 +1134,177 @@ int regex_pass_throughs_from_string(regex_pass_through *ptlist, uint32_t ptlen,
 
 #ifdef ENABLE_UAMDOMAINFILE
 
+/*
+ *  The uamdomainfile is compiled into two parts. Patterns which are
+ *  plain (escaped) domain names anchored at the end, such as
+ *  "example\.com$", "^www\.example\.com$" or "(^|\.)example\.com$",
+ *  go into a hash index keyed by name suffix. Everything else stays a
+ *  POSIX regex. Each pattern remembers its line order so that the
+ *  first matching line still decides, and only regexes which come
+ *  before the best literal match need to be evaluated.
+ */
+
+#define UAMDOMAIN_MAXNAME          256
+#define UAMDOMAIN_CACHE_SIZE       512 /* must be a power of 2 */
+#define UAMDOMAIN_CACHE_NAMELEN     96
+
 typedef struct uamdomain_regex_t {
   regex_t re;
+  uint32_t order;
   char neg;
   struct uamdomain_regex_t *next;
 } uamdomain_regex;
 
+typedef struct uamdomain_literal_t {
+  char *name;
+  size_t len;
+  uint32_t hash;
+  uint32_t order;
+  char exact;
+  char neg;
+  struct uamdomain_literal_t *next;
+} uamdomain_literal;
+
 static uamdomain_regex * _list_head = 0;
 
+static uamdomain_literal ** _lit_hash = 0;
+static uint32_t _lit_hash_size = 0;
+static uint32_t _lit_count = 0;
+static uint32_t _re_count = 0;
+
+static struct {
+  char name[UAMDOMAIN_CACHE_NAMELEN];
+  uint32_t hash;
+  int8_t verdict;
+  uint8_t inuse;
+} _dom_cache[UAMDOMAIN_CACHE_SIZE];
+
+static struct {
+  uint64_t lookups;
+  uint64_t cache_hits;
+  uint64_t literal_hits;
+  uint64_t regex_execs;
+} _dom_stats;
+
+/* hash of a name built from its last character backwards, so that
+   the hash of every suffix falls out of a single pass */
+#define uamdomain_hash_step(h, c) ((((h) << 5) + (h)) ^ (uint8_t)(c))
+#define UAMDOMAIN_HASH_INIT 5381
+
+static uint32_t uamdomain_hash(const char *s, size_t len) {
+  uint32_t h = UAMDOMAIN_HASH_INIT;
+  while (len-- > 0)
+    h = uamdomain_hash_step(h, s[len]);
+  return h;
+}
+
+/*
+ *  Returns the number of names written to out (0 when the pattern has
+ *  to stay a regex). A "domain" pattern yields both the exact name and
+ *  the ".name" suffix.
+ */
+static int uamdomain_literal_parse(const char *p, char *out, size_t outlen,
+				   char *exact, char *domain) {
+  size_t len = 0;
+
+  *exact = 0;
+  *domain = 0;
+
+  if (!strncmp(p, "^(.*\\.)?", 8)) {
+    *domain = 1;
+    p += 8;
+  } else if (!strncmp(p, "(^|\\.)", 6)) {
+    *domain = 1;
+    p += 6;
+  } else if (!strncmp(p, ".*\\.", 4)) {
+    out[len++] = '.';
+    p += 4;
+  } else if (*p == '^') {
+    *exact = 1;
+    p++;
+  }
+
+  while (*p && *p != '$') {
+    char c = *p++;
+    if (c == '\\') {
+      c = *p++;
+      if (c != '.' && c != '-')
+	return 0;
+    } else if (!isalnum((int) c) && c != '-' && c != '_') {
+      return 0;
+    }
+    if (len + 2 >= outlen)
+      return 0;
+    out[len++] = c;
+  }
+
+  if (*p != '$' || p[1] || len == 0 || (len == 1 && out[0] == '.'))
+    return 0;
+
+  out[len] = 0;
+  return 1;
+}
+
+static void uamdomain_literal_add(const char *name, char exact,
+				  uint32_t order, char neg) {
+  size_t len = strlen(name);
+  uint32_t hash = uamdomain_hash(name, len);
+  uamdomain_literal **pl = &_lit_hash[hash & (_lit_hash_size - 1)];
+  uamdomain_literal *l;
+
+  for (l = *pl; l; l = l->next) {
+    if (l->hash == hash && l->len == len && l->exact == exact &&
+	!memcmp(l->name, name, len)) {
+      /* an earlier line already decides this name */
+      return;
+    }
+  }
+
+  l = (uamdomain_literal *) calloc(sizeof(uamdomain_literal) + len + 1, 1);
+  if (!l) {
+    syslog(LOG_ERR, "memory allocation for uamdomain %s failed", name);
+    return;
+  }
+
+  l->name = (char *)(l + 1);
+  memcpy(l->name, name, len);
+  l->len = len;
+  l->hash = hash;
+  l->order = order;
+  l->exact = exact;
+  l->neg = neg;
+  l->next = *pl;
+  *pl = l;
+  _lit_count++;
+}
+
 void garden_free_domainfile(void) {
+  uint32_t i;
+
   while (_list_head) {
     uamdomain_regex * n = _list_head;
     _list_head = _list_head->next;
     regfree(&n->re);
     free(n);
   }
+
+  if (_lit_hash) {
+    for (i = 0; i < _lit_hash_size; i++) {
+      while (_lit_hash[i]) {
+	uamdomain_literal * l = _lit_hash[i];
+	_lit_hash[i] = l->next;
+	free(l);
+      }
+    }
+    free(_lit_hash);
+    _lit_hash = 0;
+  }
+
+  _lit_hash_size = 0;
+  _lit_count = 0;
+  _re_count = 0;
+
+  memset(_dom_cache, 0, sizeof(_dom_cache));
 }
 
 void garden_load_domainfile(void) {
@@ -667,6 +1314,8 @@ void garden_load_domainfile(void) {
     char * line = 0;
     size_t len = 0;
     ssize_t read;
+    uint32_t order = 0;
+    uint32_t lines = 0;
     FILE* fp;
 
     uamdomain_regex * uam_end = 0;
@@ -678,30 +1327,65 @@ void garden_load_domainfile(void) {
       return;
     }
 
+    while ((read = getline(&line, &len, fp)) != -1)
+      lines++;
+    rewind(fp);
+
+    for (_lit_hash_size = 64; _lit_hash_size < lines * 2; )
+      _lit_hash_size <<= 1;
+
+    _lit_hash = (uamdomain_literal **)
+        calloc(_lit_hash_size, sizeof(uamdomain_literal *));
+    if (!_lit_hash) {
+      syslog(LOG_ERR, "memory allocation for uamdomain index failed");
+      _lit_hash_size = 0;
+      fclose(fp);
+      return;
+    }
+
     while ((read = getline(&line, &len, fp)) != -1) {
       if (read <= 0) continue;
       else if (!line[0] || line[0] == '#' ||
 	       isspace((int) line[0])) continue;
       else {
-
-	uamdomain_regex * uam_re = (uamdomain_regex *)
-            calloc(sizeof(uamdomain_regex), 1);
-	if (uam_re == (uamdomain_regex *)0) {
-	  syslog(LOG_ERR, "memory allocation for a new regex %s failed", line);
-      fclose(fp);
-	  continue;
-	}
+	char name[UAMDOMAIN_MAXNAME];
+	char exact, domain;
+	char neg = 0;
 
 	char * pline = line;
 
-	while (isspace((int) pline[read-1]))
+	while (read > 0 && isspace((int) pline[read-1]))
 	  pline[--read] = 0;
 
 	if (pline[0] == '!') {
-	  uam_re->neg = 1;
+	  neg = 1;
 	  pline++;
 	}
 
+	if (uamdomain_literal_parse(pline, name, sizeof(name),
+				    &exact, &domain)) {
+          if (_options.debug)
+            syslog(LOG_DEBUG, "%s(%d): indexing %s as %s%s", __FUNCTION__, __LINE__,
+                   pline, domain ? "domain " : exact ? "name " : "suffix ", name);
+	  if (domain) {
+	    char dotted[UAMDOMAIN_MAXNAME + 1];
+	    uamdomain_literal_add(name, 1, order, neg);
+	    snprintf(dotted, sizeof(dotted), ".%s", name);
+	    uamdomain_literal_add(dotted, 0, order, neg);
+	  } else {
+	    uamdomain_literal_add(name, exact, order, neg);
+	  }
+	  order++;
+	  continue;
+	}
+
+	uamdomain_regex * uam_re = (uamdomain_regex *)
+            calloc(sizeof(uamdomain_regex), 1);
+	if (uam_re == (uamdomain_regex *)0) {
+	  syslog(LOG_ERR, "memory allocation for a new regex %s failed", line);
+	  continue;
+	}
+
         if (_options.debug)
           syslog(LOG_DEBUG, "%s(%d): compiling %s", __FUNCTION__, __LINE__, pline);
 	if (regcomp(&uam_re->re, pline, REG_EXTENDED | REG_NOSUB)) {
@@ -710,6 +1394,10 @@ void garden_load_domainfile(void) {
 	  continue;
 	}
 
+	uam_re->neg = neg;
+	uam_re->order = order++;
+	_re_count++;
+
 	if (uam_end) {
 	  uam_end->next = uam_re;
 	  uam_end = uam_re;
@@ -723,14 +1411,38 @@ void garden_load_domainfile(void) {
 
     if (line)
       free(line);
+
+    syslog(LOG_INFO, "uamdomainfile %s: %d names indexed, %d regex",
+           _options.uamdomainfile, _lit_count, _re_count);
   }
 }
 
-int garden_check_domainfile(char *question) {
+static int garden_match_domainfile(char *question, size_t qlen) {
   uamdomain_regex * uam_re = _list_head;
+  uamdomain_literal * best = 0;
+
+  if (_lit_hash && qlen < UAMDOMAIN_MAXNAME) {
+    uint32_t h = UAMDOMAIN_HASH_INIT;
+    size_t i = qlen;
+
+    while (i-- > 0) {
+      uamdomain_literal * l;
+      h = uamdomain_hash_step(h, question[i]);
+      for (l = _lit_hash[h & (_lit_hash_size - 1)]; l; l = l->next) {
+	if (l->hash == h && l->len == qlen - i &&
+	    (!l->exact || i == 0) &&
+	    (!best || l->order < best->order) &&
+	    !memcmp(l->name, question + i, l->len))
+	  best = l;
+      }
+    }
+  }
+
+  while (uam_re && (!best || uam_re->order < best->order)) {
+    int match;
 
-  while (uam_re) {
-    int match = !regexec(&uam_re->re, question, 0, 0, 0);
+    _dom_stats.regex_execs++;
+    match = !regexec(&uam_re->re, question, 0, 0, 0);
 
 #if(_debug_)
     if (match)
@@ -743,7 +1455,64 @@ int garden_check_domainfile(char *question) {
     uam_re = uam_re->next;
   }
 
+  if (best) {
+    _dom_stats.literal_hits++;
+#if(_debug_)
+    if (_options.debug)
+      syslog(LOG_DEBUG, "%s(%d): matched DNS name %s to %s", __FUNCTION__, __LINE__,
+             question, best->name);
+#endif
+    return best->neg ? 0 : 1;
+  }
+
   return -1;
 }
 
+int garden_check_domainfile(char *question) {
+  size_t qlen = strlen(question);
+  uint32_t h;
+  int idx;
+  int verdict;
+
+  _dom_stats.lookups++;
+
+  if (qlen >= UAMDOMAIN_CACHE_NAMELEN)
+    return garden_match_domainfile(question, qlen);
+
+  h = uamdomain_hash(question, qlen);
+  idx = h & (UAMDOMAIN_CACHE_SIZE - 1);
+
+  if (_dom_cache[idx].inuse && _dom_cache[idx].hash == h &&
+      !strcmp(_dom_cache[idx].name, question)) {
+    _dom_stats.cache_hits++;
+    return _dom_cache[idx].verdict;
+  }
+
+  verdict = garden_match_domainfile(question, qlen);
+
+  memcpy(_dom_cache[idx].name, question, qlen + 1);
+  _dom_cache[idx].hash = h;
+  _dom_cache[idx].verdict = verdict;
+  _dom_cache[idx].inuse = 1;
+
+  return verdict;
+}
+
+#ifdef ENABLE_CHILLIQUERY
+void garden_print_domainfile(int fd) {
+  char line[512];
+
+  snprintf(line, sizeof line,
+           "uamdomainfile (%d indexed/%d regex): lookups=%llu cached=%llu"
+           " indexed=%llu regexec=%llu\n",
+           _lit_count, _re_count,
+           (unsigned long long) _dom_stats.lookups,
+           (unsigned long long) _dom_stats.cache_hits,
+           (unsigned long long) _dom_stats.literal_hits,
+           (unsigned long long) _dom_stats.regex_execs);
+  if (!safe_write(fd, line, strlen(line))) /* error */
+    ;
+}
+#endif
+
 #endif
@@ -21,6 +21,7 @@
 #define _GARDEN_H_
 
 #include "pkt.h"
+#include "bstrlib.h"
 
 typedef struct pass_through_t {
   struct in_addr host;              /* IP or Network */
@@ -76,12 +77,51 @@ int pass_through_rem(pass_through *ptlist,
 
 int pass_throughs_from_string(pass_through *ptlist,
 			      uint32_t ptlen, uint32_t *ptcnt,
-			      char *s, char is_dyn, char is_rem
+			      char *s, char is_dyn, char is_rem,
+			      bstring names
 #ifdef HAVE_PATRICIA
 			      , patricia_tree_t *ptree
 #endif
 			      );
 
+#ifdef ENABLE_SESSGARDEN
+/*
+ *  Session walled garden rules are interned by content. Sessions with
+ *  identical rules share one immutable, reference counted ruleset (and
+ *  its patricia tree); changing a session's rules swaps its reference
+ *  for the ruleset matching the new content.
+ */
+typedef struct garden_ruleset_t {
+  uint32_t refcnt;
+  uint32_t hash;
+  uint32_t count;
+#ifdef HAVE_PATRICIA
+  patricia_tree_t *ptree;
+#endif
+  struct garden_ruleset_t *next;
+  pass_through rules[1];
+} garden_ruleset;
+
+#define garden_ruleset_count(rs) ((rs) ? (rs)->count : 0)
+
+garden_ruleset *garden_ruleset_intern(pass_through *ptlist, uint32_t ptcnt);
+garden_ruleset *garden_ruleset_ref(garden_ruleset *rs);
+void garden_ruleset_release(garden_ruleset *rs);
+
+uint32_t garden_ruleset_export(garden_ruleset *rs,
+			       pass_through *ptlist, uint32_t ptlen);
+
+int garden_ruleset_from_string(garden_ruleset **prs, char *s,
+			       char is_dyn, char is_rem);
+
+int garden_ruleset_check(garden_ruleset **prs,
+			 struct pkt_ipphdr_t *ipph, int dst);
+
+#ifdef ENABLE_CHILLIQUERY
+void garden_ruleset_print(int fd);
+#endif
+#endif
+
 int garden_check(pass_through *ptlist, uint32_t *ptcnt,
 		 pass_through **pt_match,
 		 struct pkt_ipphdr_t *ipph, int dst
@@ -90,8 +130,13 @@ int garden_check(pass_through *ptlist, uint32_t *ptcnt,
 #endif
 		 );
 
+void garden_names_load(void);
+void garden_names_free(void);
+void garden_names_timeout(void);
+
 #ifdef ENABLE_CHILLIQUERY
 void garden_print(int fd);
+void garden_print_names(int fd);
 #endif
 
 #ifdef HAVE_PATRICIA
@@ -109,6 +154,9 @@ void garden_patricia_reload(void);
 void garden_load_domainfile(void);
 void garden_free_domainfile(void);
 int  garden_check_domainfile(char *question);
+#ifdef ENABLE_CHILLIQUERY
+void garden_print_domainfile(int fd);
+#endif
 #endif
 
 #endif
@@ -0,0 +1,160 @@
+/* -*- mode: c; c-basic-offset: 2 -*- */
+/*
+ * Copyright (C) 2007-2012 David Bird (Coova Technologies) <support@coova.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include "chilli.h"
+
+#ifdef ENABLE_JSON
+
+/* Makes room for len more bytes (and the NUL) */
+#define jsonw_room(b, len)						\
+  ((b)->mlen - (b)->slen > (int)(len) ||				\
+   balloc((b), (b)->slen + (int)(len) + 1) == BSTR_OK)
+
+static inline void jsonw_put(bstring b, const char *s, size_t len) {
+  if (!jsonw_room(b, len)) return;
+  memcpy(b->data + b->slen, s, len);
+  b->slen += len;
+  b->data[b->slen] = 0;
+}
+
+/* The separator, if any, and the key of a member */
+static void jsonw_key(bstring b, char *key, size_t extra) {
+  size_t klen = key ? strlen(key) : 0;
+  unsigned char *p;
+
+  if (!jsonw_room(b, klen + 4 + extra)) return;
+
+  p = b->data + b->slen;
+  if (b->slen) {
+    switch (p[-1]) {
+      case '{': case '[': case ':': case ',': case '(':
+        break;
+      default:
+        *p++ = ',';
+    }
+  }
+
+  if (key) {
+    *p++ = '"';
+    memcpy(p, key, klen);
+    p += klen;
+    *p++ = '"';
+    *p++ = ':';
+  }
+
+  b->slen = p - b->data;
+  b->data[b->slen] = 0;
+}
+
+void jsonw_open(bstring b, char *key, char c) {
+  jsonw_key(b, key, 1);
+  jsonw_put(b, &c, 1);
+}
+
+void jsonw_close(bstring b, char c) {
+  jsonw_put(b, &c, 1);
+}
+
+void jsonw_strn(bstring b, char *key, const char *s, size_t len) {
+  static const char hex[] = "0123456789abcdef";
+  unsigned char *p;
+  size_t i;
+
+  jsonw_key(b, key, len + 2);
+  if (!jsonw_room(b, len + 2)) return;
+
+  p = b->data + b->slen;
+  *p++ = '"';
+
+  for (i = 0; i < len; i++) {
+    unsigned char c = s[i];
+
+    if (c >= 0x20 && c != '"' && c != '\\') {
+      *p++ = c;
+      continue;
+    }
+
+    /* worst case, \u00XX, and the rest of the string */
+    b->slen = p - b->data;
+    if (!jsonw_room(b, 6 + len - i)) return;
+    p = b->data + b->slen;
+
+    *p++ = '\\';
+    switch (c) {
+      case '"':  *p++ = '"';  break;
+      case '\\': *p++ = '\\'; break;
+      case '\n': *p++ = 'n';  break;
+      case '\r': *p++ = 'r';  break;
+      case '\t': *p++ = 't';  break;
+      default:
+        *p++ = 'u'; *p++ = '0'; *p++ = '0';
+        *p++ = hex[c >> 4];
+        *p++ = hex[c & 15];
+    }
+  }
+
+  *p++ = '"';
+  b->slen = p - b->data;
+  b->data[b->slen] = 0;
+}
+
+void jsonw_str(bstring b, char *key, const char *s) {
+  jsonw_strn(b, key, s ? s : "", s ? strlen(s) : 0);
+}
+
+void jsonw_int(bstring b, char *key, long long v) {
+  char buf[24];
+  char *p = buf + sizeof(buf);
+  unsigned long long u = v < 0 ? - (unsigned long long) v : v;
+
+  do {
+    *--p = '0' + u % 10;
+    u /= 10;
+  } while (u);
+
+  if (v < 0) *--p = '-';
+
+  jsonw_key(b, key, buf + sizeof(buf) - p);
+  jsonw_put(b, p, buf + sizeof(buf) - p);
+}
+
+void jsonw_mac(bstring b, char *key, uint8_t *mac) {
+  static const char hex[] = "0123456789ABCDEF";
+  char buf[REDIR_MACSTRLEN];
+  int i;
+
+  for (i = 0; i < PKT_ETH_ALEN; i++) {
+    buf[i * 3] = hex[mac[i] >> 4];
+    buf[i * 3 + 1] = hex[mac[i] & 15];
+    if (i < PKT_ETH_ALEN - 1) buf[i * 3 + 2] = '-';
+  }
+
+  jsonw_strn(b, key, buf, REDIR_MACSTRLEN);
+}
+
+void jsonw_ip(bstring b, char *key, struct in_addr *ip) {
+  char buf[INET_ADDRSTRLEN];
+
+  if (!inet_ntop(AF_INET, ip, buf, sizeof(buf)))
+    buf[0] = 0;
+
+  jsonw_str(b, key, buf);
+}
+
+#endif
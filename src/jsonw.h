@@ -0,0 +1,40 @@
+/* -*- mode: c; c-basic-offset: 2 -*- */
+/*
+ * Copyright (C) 2007-2012 David Bird (Coova Technologies) <support@coova.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef _JSONW_H
+#define _JSONW_H
+
+#include "system.h"
+#include "bstrlib.h"
+
+/*
+ *  JSON output appended straight into a bstring, strings escaped. The
+ *  separator before a member or element is taken from the last byte
+ *  of the buffer, so functions writing members of an object opened by
+ *  their caller need no state passed along. Keys are given unescaped.
+ */
+void jsonw_open(bstring b, char *key, char c);
+void jsonw_close(bstring b, char c);
+void jsonw_str(bstring b, char *key, const char *s);
+void jsonw_strn(bstring b, char *key, const char *s, size_t len);
+void jsonw_int(bstring b, char *key, long long v);
+void jsonw_mac(bstring b, char *key, uint8_t *mac);
+void jsonw_ip(bstring b, char *key, struct in_addr *ip);
+
+#endif
@@ -267,6 +267,48 @@ char *STRDUP(char *s) {
   return s;
 }
 
+/*
+ *  Parse host[:port][,weight[,secret]] into the server pool of a role.
+ */
+static int radius_pool_add(int role, char *arg) {
+  struct radius_pool_t *srv;
+  struct hostent *host;
+  char name[256];
+  char *p;
+
+  if (_options.radiuspoolcnt[role] == RADIUS_MAXSERVERS) {
+    syslog(LOG_ERR, "Too many RADIUS servers, ignoring %s", arg);
+    return -1;
+  }
+
+  srv = &_options.radiuspool[role][_options.radiuspoolcnt[role]];
+  memset(srv, 0, sizeof(*srv));
+  srv->weight = 1;
+
+  strlcpy(name, arg, sizeof(name));
+  if ((p = strchr(name, ','))) {
+    *p++ = 0;
+    srv->weight = atoi(p);
+    if ((p = strchr(arg, ',')) && (p = strchr(p + 1, ',')))
+      strlcpy(srv->secret, p + 1, sizeof(srv->secret));
+  }
+
+  if ((p = strchr(name, ':'))) {
+    *p++ = 0;
+    srv->port = atoi(p);
+  }
+
+  if (!(host = gethostbyname(name))) {
+    syslog(LOG_ERR, "Invalid RADIUS server address: %s! [%s]",
+	   name, strerror(errno));
+    return -1;
+  }
+
+  memcpy(&srv->addr.s_addr, host->h_addr, host->h_length);
+  _options.radiuspoolcnt[role]++;
+  return 0;
+}
+
 #ifdef ENABLE_MINICONFIG
 
 #define cmdline_parser2 mini_cmdline_parser2
@@ -327,6 +369,7 @@ int main(int argc, char **argv) {
   struct gengetopt_args_info args_info;
   struct hostent *host;
   char hostname[USERURLSIZE];
+  bstring names = bfromcstr("");
   int numargs;
   int ret = -1;
   int i;
@@ -423,7 +466,17 @@ int main(int argc, char **argv) {
 #endif
   _options.macallowlocal = args_info.macallowlocal_flag;
   _options.strictmacauth = args_info.strictmacauth_flag;
+#ifdef ENABLE_AUTHCACHE
+  _options.authcache = args_info.authcache_arg;
+  _options.authcachettl = args_info.authcachettl_arg;
+#else
+  if (args_info.authcache_arg)
+    syslog(LOG_ERR, "option authcache given when no support built-in");
+#endif
   _options.strictdhcp = args_info.strictdhcp_flag;
+#ifdef ENABLE_MINIPORTAL
+  _options.wwwtemplates = args_info.wwwtemplates_flag;
+#endif
   _options.no_wispr1 = args_info.nowispr1_flag;
   _options.no_wispr2 = args_info.nowispr2_flag;
   _options.wpaguests = args_info.wpaguests_flag;
@@ -432,6 +485,10 @@ int main(int argc, char **argv) {
   _options.challengetimeout2 = args_info.challengetimeout2_arg;
   _options.defsessiontimeout = args_info.defsessiontimeout_arg;
   _options.definteriminterval = args_info.definteriminterval_arg;
+  _options.interimjitter = args_info.interimjitter_arg > 100 ? 100 :
+      args_info.interimjitter_arg < 0 ? 0 : args_info.interimjitter_arg;
+  _options.interimrate = args_info.interimrate_arg < 0 ? 0 :
+      args_info.interimrate_arg;
   _options.defbandwidthmaxdown = args_info.defbandwidthmaxdown_arg;
   _options.defbandwidthmaxup = args_info.defbandwidthmaxup_arg;
   _options.defidletimeout = args_info.defidletimeout_arg;
@@ -478,6 +535,7 @@ int main(int argc, char **argv) {
   _options.seskeepalive = args_info.seskeepalive_flag;
   _options.uamallowpost = args_info.uamallowpost_flag;
   _options.redir = args_info.redir_flag;
+  _options.redirmaxconns = args_info.redirmaxconns_arg;
   _options.redirurl = args_info.redirurl_flag;
   _options.statusfilesave = args_info.statusfilesave_flag;
   _options.dhcpnotidle = args_info.dhcpnotidle_flag;
@@ -490,6 +548,9 @@ int main(int argc, char **argv) {
   _options.domaindnslocal = args_info.domaindnslocal_flag;
   _options.framedservice = args_info.framedservice_flag;
   _options.radsec = args_info.radsec_flag;
+  _options.radsecconns = args_info.radsecconns_arg;
+  _options.uamaaaconns = args_info.uamaaaconns_arg;
+  _options.uamaaaqueue = args_info.uamaaaqueue_arg;
 #if(_debug_ && !defined(ENABLE_CHILLIRADSEC))
   if (_options.radsec)
     syslog(LOG_ERR, "chilli_radsec not implemented. build with --enable-chilliradsec");
@@ -823,6 +884,12 @@ int main(int argc, char **argv) {
   _options.uamnatanyip = args_info.uamnatanyip_flag;
 #endif
   _options.dnsparanoia = args_info.dnsparanoia_flag;
+#ifdef ENABLE_DNSCACHE
+  _options.dnscache = args_info.dnscache_arg;
+#else
+  if (args_info.dnscache_arg)
+    syslog(LOG_ERR, "option dnscache given when no support built-in");
+#endif
   _options.radiusoriginalurl = args_info.radiusoriginalurl_flag;
   _options.routeonetone = args_info.routeonetone_flag;
 
@@ -840,18 +907,19 @@ int main(int argc, char **argv) {
     pass_throughs_from_string(_options.pass_throughs,
 			      MAX_PASS_THROUGHS,
 			      &_options.num_pass_throughs,
-			      args_info.uamallowed_arg[numargs], 0, 0
+			      args_info.uamallowed_arg[numargs], 0, 0, names
 #ifdef HAVE_PATRICIA
 			      , 0
 #endif
                               );
   }
+  _options.uamallowed_names = names->slen ? (char *)names->data : 0;
 #ifdef ENABLE_LAYER3
   for (numargs = 0; numargs < args_info.ipsrcallowed_given; ++numargs) {
     pass_throughs_from_string(_options.ipsrc_pass_throughs,
 			      MAX_IPSRC_PASS_THROUGHS,
 			      &_options.ipsrc_num_pass_throughs,
-			      args_info.ipsrcallowed_arg[numargs], 0, 0
+			      args_info.ipsrcallowed_arg[numargs], 0, 0, 0
 #ifdef HAVE_PATRICIA
 			      , 0
 #endif
@@ -865,7 +933,7 @@ int main(int argc, char **argv) {
     pass_throughs_from_string(_options.authed_pass_throughs,
 			      MAX_PASS_THROUGHS,
 			      &_options.num_authed_pass_throughs,
-			      args_info.authedallowed_arg[numargs], 0, 0
+			      args_info.authedallowed_arg[numargs], 0, 0, 0
 #ifdef HAVE_PATRICIA
 			      , 0
 #endif
@@ -971,6 +1039,17 @@ int main(int argc, char **argv) {
     }
   }
 
+  for (numargs = 0; numargs < MAX_UAM_PROBES; ++numargs) {
+    if (_options.uamprobes[numargs])
+      free(_options.uamprobes[numargs]);
+    _options.uamprobes[numargs] = 0;
+  }
+
+  for (numargs = 0;
+       numargs < args_info.uamprobe_given && numargs < MAX_UAM_PROBES;
+       ++numargs)
+    _options.uamprobes[numargs] = STRDUP(args_info.uamprobe_arg[numargs]);
+
   _options.allowdyn = 1;
 
 #ifdef ENABLE_UAMANYIP
@@ -1131,7 +1210,8 @@ int main(int argc, char **argv) {
       memcpy(&_options.radiusserver1.s_addr, host->h_addr, host->h_length);
     }
   }
-  else {
+  else if (!args_info.radiusauthserver_given &&
+	   !args_info.radiusacctserver_given) {
     syslog(LOG_ERR, "No radiusserver1 address given!");
     if (!args_info.forgiving_flag)
       goto end_processing;
@@ -1152,6 +1232,20 @@ int main(int argc, char **argv) {
     _options.radiusserver2.s_addr = 0;
   }
 
+  _options.radiuspoolcnt[0] = _options.radiuspoolcnt[1] = 0;
+
+  for (numargs = 0; numargs < args_info.radiusauthserver_given; ++numargs)
+    if (radius_pool_add(0, args_info.radiusauthserver_arg[numargs]) &&
+	!args_info.forgiving_flag)
+      goto end_processing;
+
+  for (numargs = 0; numargs < args_info.radiusacctserver_given; ++numargs)
+    if (radius_pool_add(1, args_info.radiusacctserver_arg[numargs]) &&
+	!args_info.forgiving_flag)
+      goto end_processing;
+
+  _options.radiusprobe = args_info.radiusprobe_arg;
+
   /* If no listen option is specified listen to any local port    */
   /* Do hostname lookup to translate hostname to IP address       */
   if (args_info.proxylisten_arg) {
@@ -1285,6 +1379,15 @@ int main(int argc, char **argv) {
     syslog(LOG_ERR, "option uamdomainfile given when no support built-in");
 #endif
 
+#ifdef ENABLE_ACCTSPOOL
+  _options.acctspool = STRDUP(args_info.acctspool_arg);
+  _options.acctspoolsize = args_info.acctspoolsize_arg;
+  _options.acctspoolrate = args_info.acctspoolrate_arg;
+#else
+  if (args_info.acctspool_arg)
+    syslog(LOG_ERR, "option acctspool given when no support built-in");
+#endif
+
 #ifdef ENABLE_MODULES
   _options.moddir = STRDUP(args_info.moddir_arg);
 #else
@@ -1432,6 +1535,7 @@ int main(int argc, char **argv) {
 
 end_processing:
   cmdline_parser_free (&args_info);
+  bdestroy(names);
 
   return ret;
 }
@@ -44,7 +44,8 @@ struct options_t _options;
 typedef struct _proxy_request {
   int index;
 
-  uint8_t reserved:4;
+  uint8_t reserved:3;
+  uint8_t failed:1;
   uint8_t authorized:1;
   uint8_t challenge:1;
   uint8_t inuse:1;
@@ -72,14 +73,45 @@ typedef struct _proxy_request {
   struct _proxy_request *prev, *next;
 
   time_t lasttime;
+  struct timeval received;
 
 } proxy_request;
 
+/*
+ *  RADIUS requests arriving while all uamaaaconns requests are in
+ *  flight wait here, in order, for up to uamaaaqueue entries.
+ */
+typedef struct _proxy_queued {
+  struct radius_t *radius;
+  struct sockaddr_in peer;
+  struct timeval received;
+  struct radius_packet_t pack;
+} proxy_queued;
+
 static int max_requests = 0;
 static int num_requests_free = 0;
 static proxy_request * requests = 0;
 static proxy_request * requests_free = 0;
 
+static proxy_queued * queue = 0;
+static int queue_size = 0;
+static int queue_head = 0;
+static int queue_len = 0;
+
+static struct {
+  uint64_t requests;
+  uint64_t failed;
+  uint64_t expired;
+  uint64_t queued;
+  uint64_t dropped;
+  uint64_t connects;
+  uint64_t total_ms;
+  uint32_t max_ms;
+  uint64_t hist[8];
+} proxy_stats;
+
+static const uint32_t proxy_hist_ms[] = { 10, 50, 100, 250, 500, 1000, 5000 };
+
 #ifdef USING_CURL
 static CURLM * curl_multi;
 static int still_running = 0;
@@ -89,10 +121,38 @@ static char nas_hwaddr[PKT_ETH_ALEN];
 
 static void print_requests(void) {
   proxy_request * req = 0;
+  uint64_t n = proxy_stats.requests;
   int i;
 
+  syslog(LOG_INFO, "requests %d/%d in use, %d/%d queued",
+         max_requests - num_requests_free, max_requests,
+         queue_len, queue_size);
+
+  syslog(LOG_INFO, "completed=%llu failed=%llu expired=%llu queued=%llu"
+         " dropped=%llu connects=%llu",
+         (unsigned long long) n,
+         (unsigned long long) proxy_stats.failed,
+         (unsigned long long) proxy_stats.expired,
+         (unsigned long long) proxy_stats.queued,
+         (unsigned long long) proxy_stats.dropped,
+         (unsigned long long) proxy_stats.connects);
+
+  syslog(LOG_INFO, "latency avg=%llums max=%ums <10ms=%llu <50ms=%llu"
+         " <100ms=%llu <250ms=%llu <500ms=%llu <1s=%llu <5s=%llu >=5s=%llu",
+         (unsigned long long) (n ? proxy_stats.total_ms / n : 0),
+         proxy_stats.max_ms,
+         (unsigned long long) proxy_stats.hist[0],
+         (unsigned long long) proxy_stats.hist[1],
+         (unsigned long long) proxy_stats.hist[2],
+         (unsigned long long) proxy_stats.hist[3],
+         (unsigned long long) proxy_stats.hist[4],
+         (unsigned long long) proxy_stats.hist[5],
+         (unsigned long long) proxy_stats.hist[6],
+         (unsigned long long) proxy_stats.hist[7]);
+
   for (i=0; i < max_requests; i++) {
     req = &requests[i];
+    if (!req->inuse) continue;
     syslog(LOG_INFO, "%.3d. inuse=%d prev=%.3d next=%.3d url=%s fd=%d",
            req->index, req->inuse ? 1 : 0,
            req->prev ? req->prev->index : -1,
@@ -102,6 +162,31 @@ static void print_requests(void) {
   }
 }
 
+static void proxy_stats_done(proxy_request *req) {
+  struct timeval now;
+  uint32_t ms;
+  int i;
+
+  gettimeofday(&now, 0);
+  ms = (now.tv_sec - req->received.tv_sec) * 1000 +
+      (now.tv_usec - req->received.tv_usec) / 1000;
+
+  proxy_stats.requests++;
+  if (req->failed)
+    proxy_stats.failed++;
+  proxy_stats.total_ms += ms;
+  if (ms > proxy_stats.max_ms)
+    proxy_stats.max_ms = ms;
+
+  for (i=0; i < 7 && ms >= proxy_hist_ms[i]; i++);
+  proxy_stats.hist[i]++;
+
+  if (_options.debug)
+    syslog(LOG_DEBUG, "%s(%d): request %d done in %u ms%s",
+           __FUNCTION__, __LINE__, req->index, ms,
+           req->failed ? " (failed)" : "");
+}
+
 static proxy_request * get_request() {
   proxy_request * req = 0;
   int i;
@@ -109,9 +194,16 @@ static proxy_request * get_request() {
   if (!requests) {
 
     /* Initialize linked list */
-    max_requests = 16; /* hard maximum! (should be configurable) */
+    max_requests = _options.uamaaaconns;
+    if (max_requests < 1) max_requests = 1;
+    if (max_requests > PROXY_MAXREQUESTS) max_requests = PROXY_MAXREQUESTS;
 
     requests = (proxy_request *) calloc(max_requests, sizeof(proxy_request));
+    if (!requests) {
+      syslog(LOG_ERR, "%s: calloc() failed", strerror(errno));
+      max_requests = 0;
+      return 0;
+    }
     for (i=0; i < max_requests; i++) {
       requests[i].index = i;
       if (i > 0)
@@ -137,9 +229,9 @@ static proxy_request * get_request() {
 #endif
 
   if (!req) {
-    /* problem */
-    syslog(LOG_ERR, "out of connections");
-    print_requests();
+#if(_debug_)
+    syslog(LOG_DEBUG, "out of connections");
+#endif
     return 0;
   }
 
@@ -174,20 +266,20 @@ static void close_request(proxy_request *req) {
 
   syslog(LOG_DEBUG, "%s", __FUNCTION__);
 
-  if (req->url)  bdestroy(req->url);
-  if (req->data) bdestroy(req->data);
+  /* url and data are kept for the next request in this slot */
+  if (req->url)  btrunc(req->url, 0);
+  if (req->data) btrunc(req->data, 0);
   if (req->post) bdestroy(req->post);
   if (req->wbuf) bdestroy(req->wbuf);
   if (req->dbuf) bdestroy(req->dbuf);
 
-  req->url =
-      req->data =
-      req->post =
+  req->post =
       req->dbuf =
       req->wbuf = 0;
 
   req->authorized = 0;
   req->challenge = 0;
+  req->failed = 0;
 
   req->inuse = 0;
   if (requests_free) {
@@ -207,15 +299,18 @@ static int http_aaa_finish(proxy_request *req) {
   struct radius_t *radius = req->radius;
 
 #ifdef USING_CURL
-#if(_debug_)
-  syslog(LOG_DEBUG, "calling curl_easy_cleanup()");
-#endif
+  /*
+   *  The easy handle stays with the request slot; its connection goes
+   *  back to the cache of the multi handle for the next request.
+   */
   if (req->curl) {
+    long connects = 0;
     if (req->error_buffer[0])
       syslog(LOG_DEBUG, "curl error %s", req->error_buffer);
+    if (curl_easy_getinfo(req->curl, CURLINFO_NUM_CONNECTS,
+			  &connects) == CURLE_OK)
+      proxy_stats.connects += connects;
     curl_multi_remove_handle(curl_multi, req->curl);
-    curl_easy_cleanup(req->curl);
-    req->curl = 0;
     req->error_buffer[0] = 0;
   }
 #else
@@ -424,6 +519,7 @@ static int http_aaa_finish(proxy_request *req) {
 
   radius_pkt_send(req->radius, &req->radius_res, &req->conn.peer);
 
+  proxy_stats_done(req);
   close_request(req);
 
   return 0;
@@ -456,7 +552,12 @@ static int http_aaa_setup(struct radius_t *radius, proxy_request *req) {
 
   req->radius = radius;
 
-  if ((curl = req->curl = curl_easy_init()) != NULL) {
+  if (req->curl)
+    curl_easy_reset(req->curl);
+  else
+    req->curl = curl_easy_init();
+
+  if ((curl = req->curl) != NULL) {
 
     if (req->post) {
       curl_easy_setopt(curl, CURLOPT_POSTFIELDS, (char *) req->post->data);
@@ -532,6 +633,18 @@ static int http_aaa_setup(struct radius_t *radius, proxy_request *req) {
     curl_easy_setopt(curl, CURLOPT_WRITEDATA, (char *) req->data);
 
     curl_easy_setopt(curl, CURLOPT_ERRORBUFFER, req->error_buffer);
+    curl_easy_setopt(curl, CURLOPT_PRIVATE, (char *) req);
+
+    /* keep connections to the AAA server open, and multiplexed if it speaks HTTP/2 */
+#if LIBCURL_VERSION_NUM >= 0x071900
+    curl_easy_setopt(curl, CURLOPT_TCP_KEEPALIVE, 1L);
+#endif
+#if LIBCURL_VERSION_NUM >= 0x072f00
+    curl_easy_setopt(curl, CURLOPT_HTTP_VERSION, (long) CURL_HTTP_VERSION_2TLS);
+#endif
+#if LIBCURL_VERSION_NUM >= 0x072b00
+    curl_easy_setopt(curl, CURLOPT_PIPEWAIT, 1L);
+#endif
 
     result = 0;
   }
@@ -733,22 +846,15 @@ static void http_aaa_register(int argc, char **argv, int i) {
   exit(0);
 }
 
-static void process_radius(struct radius_t *radius, struct radius_packet_t *pack, struct sockaddr_in *peer) {
+static void process_radius(struct radius_t *radius, proxy_request *req,
+			   struct radius_packet_t *pack, struct sockaddr_in *peer,
+			   struct timeval *received) {
   struct radius_attr_t *attr = NULL;
   char *error = 0;
 
-  proxy_request *req = get_request();
-
   bstring tmp;
   bstring tmp2;
 
-  if (!req) return;
-
-  if (!_options.uamaaaurl) {
-    syslog(LOG_ERR, "No --uamaaaurl parameter defined");
-    return;
-  }
-
   tmp = bfromcstralloc(10,"");
   tmp2 = bfromcstralloc(10,"");
 
@@ -756,6 +862,7 @@ static void process_radius(struct radius_t *radius, struct radius_packet_t *pack
   if (!req->data) req->data = bfromcstr("");
 
   memcpy(&req->conn.peer, peer, sizeof(req->conn.peer));
+  memcpy(&req->received, received, sizeof(req->received));
   memcpy(&req->radius_req, pack, sizeof(struct radius_packet_t));
   memset(&req->radius_res, '0', sizeof(struct radius_packet_t));
 
@@ -1039,12 +1146,94 @@ static void process_radius(struct radius_t *radius, struct radius_packet_t *pack
 
   } else {
     syslog(LOG_ERR, "problem: %s", error);
+    close_request(req);
   }
 
   bdestroy(tmp);
   bdestroy(tmp2);
 }
 
+static void queue_radius(struct radius_t *radius, struct radius_packet_t *pack,
+			 struct sockaddr_in *peer, struct timeval *received) {
+  proxy_queued *q;
+
+  if (!queue && _options.uamaaaqueue > 0) {
+    queue_size = _options.uamaaaqueue;
+    queue = (proxy_queued *) calloc(queue_size, sizeof(proxy_queued));
+    if (!queue) {
+      syslog(LOG_ERR, "%s: calloc() failed", strerror(errno));
+      queue_size = 0;
+    }
+  }
+
+  if (queue_len == queue_size) {
+    syslog(LOG_WARNING, "AAA request queue full, dropping RADIUS request");
+    proxy_stats.dropped++;
+    return;
+  }
+
+  q = &queue[(queue_head + queue_len) % queue_size];
+  q->radius = radius;
+  memcpy(&q->peer, peer, sizeof(q->peer));
+  memcpy(&q->received, received, sizeof(q->received));
+  memcpy(&q->pack, pack, sizeof(q->pack));
+  queue_len++;
+
+  proxy_stats.queued++;
+}
+
+static void proxy_radius(struct radius_t *radius, struct radius_packet_t *pack,
+			 struct sockaddr_in *peer) {
+  proxy_request *req = 0;
+  struct timeval received;
+
+  if (!_options.uamaaaurl) {
+    syslog(LOG_ERR, "No --uamaaaurl parameter defined");
+    return;
+  }
+
+  gettimeofday(&received, 0);
+
+  /* keep the order of requests already waiting */
+  if (!queue_len)
+    req = get_request();
+
+  if (req) {
+    radius_attr_index(pack);
+    process_radius(radius, req, pack, peer, &received);
+    radius_attr_unindex();
+  } else {
+    queue_radius(radius, pack, peer, &received);
+  }
+}
+
+/*
+ *  Hand waiting requests to slots freed up; those older than
+ *  max_conn_time have been given up on by the RADIUS client.
+ */
+static void run_queue(time_t expired_time) {
+  proxy_request *req;
+  proxy_queued *q;
+
+  while (queue_len && requests_free) {
+    q = &queue[queue_head];
+    queue_head = (queue_head + 1) % queue_size;
+    queue_len--;
+
+    if (q->received.tv_sec < expired_time) {
+      proxy_stats.expired++;
+      continue;
+    }
+
+    if (!(req = get_request()))
+      break;
+
+    radius_attr_index(&q->pack);
+    process_radius(q->radius, req, &q->pack, &q->peer, &q->received);
+    radius_attr_unindex();
+  }
+}
+
 int main(int argc, char **argv) {
   struct radius_packet_t radius_pack;
   struct radius_t *radius_auth;
@@ -1113,6 +1302,15 @@ int main(int argc, char **argv) {
 #ifdef USING_CURL
   curl_global_init(CURL_GLOBAL_ALL);
   curl_multi = curl_multi_init();
+
+  /*
+   *  Idle connections to the AAA server are kept in the connection
+   *  cache of the multi handle; with HTTP/2 requests share them.
+   */
+  curl_multi_setopt(curl_multi, CURLMOPT_MAXCONNECTS, (long) _options.uamaaaconns);
+#if LIBCURL_VERSION_NUM >= 0x072b00
+  curl_multi_setopt(curl_multi, CURLMOPT_PIPELINING, (long) CURLPIPE_MULTIPLEX);
+#endif
 #endif
 
   radiuslisten.s_addr = htonl(INADDR_ANY);
@@ -1169,10 +1367,14 @@ int main(int argc, char **argv) {
       if (requests[idx].inuse &&
 	  requests[idx].lasttime < expired_time) {
 	syslog(LOG_DEBUG, "remove expired index %d", idx);
+	proxy_stats.expired++;
+	requests[idx].failed = 1;
 	http_aaa_finish(&requests[idx]);
       }
     }
 
+    run_queue(expired_time);
+
 #ifdef USING_CURL
     curl_multi_fdset(curl_multi, &fdread, &fdwrite, &fdexcep, &maxfd);
 #else
@@ -1190,6 +1392,17 @@ int main(int argc, char **argv) {
     timeout.tv_sec = 1;
     timeout.tv_usec = 0;
 
+#ifdef USING_CURL
+    {
+      long ms = -1;
+      if (curl_multi_timeout(curl_multi, &ms) == CURLM_OK &&
+	  ms >= 0 && ms < 1000) {
+	timeout.tv_sec = 0;
+	timeout.tv_usec = ms * 1000;
+      }
+    }
+#endif
+
     status = select(maxfd + 1, &fdread, &fdwrite, &fdexcep, &timeout);
 
     switch (status) {
@@ -1232,7 +1445,7 @@ int main(int argc, char **argv) {
               return -1;
             }
 
-            process_radius(radius_auth, &radius_pack, &addr);
+            proxy_radius(radius_auth, &radius_pack, &addr);
           }
 
           if (FD_ISSET(radius_acct->fd, &fdread)) {
@@ -1251,7 +1464,7 @@ int main(int argc, char **argv) {
               return -1;
             }
 
-            process_radius(radius_acct, &radius_pack, &addr);
+            proxy_radius(radius_acct, &radius_pack, &addr);
           }
         }
 
@@ -1271,18 +1484,18 @@ int main(int argc, char **argv) {
 
           if (msg->msg == CURLMSG_DONE) {
 
-            int found = 0;
+            proxy_request *req = 0;
 
-            /* Find out which handle this message is about */
-            for (idx=0; (!found && (idx < max_requests)); idx++)
-              found = (msg->easy_handle == requests[idx].curl);
+            /* The request this handle is about */
+            curl_easy_getinfo(msg->easy_handle, CURLINFO_PRIVATE, (char **) &req);
 
-            if (found) {
-              --idx;
+            if (req && req->inuse) {
 #if(_debug_)
               syslog(LOG_DEBUG, "HTTP completed with status %d\n", msg->data.result);
 #endif
-              http_aaa_finish(&requests[idx]);
+              if (msg->data.result != CURLE_OK)
+                req->failed = 1;
+              http_aaa_finish(req);
             } else {
               syslog(LOG_ERR, "%s: Could not find request in queue", strerror(errno));
             }
@@ -1294,6 +1507,7 @@ int main(int argc, char **argv) {
         }
 #endif
 
+        run_queue(expired_time);
         break;
     }
   }
@@ -1302,6 +1516,12 @@ int main(int argc, char **argv) {
   radius_free(radius_acct);
 
 #ifdef USING_CURL
+  for (idx=0; idx < max_requests; idx++) {
+    if (requests[idx].curl) {
+      curl_multi_remove_handle(curl_multi, requests[idx].curl);
+      curl_easy_cleanup(requests[idx].curl);
+    }
+  }
   curl_multi_cleanup(curl_multi);
   curl_global_cleanup();
 #endif
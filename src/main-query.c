@@ -40,6 +40,7 @@ static cmd_info commands[] = {
   { CMDSOCK_LIST_IPPOOL,   "listippool",    NULL },
   { CMDSOCK_LIST_RADQUEUE, "listradqueue",  NULL },
   { CMDSOCK_LIST_GARDEN,   "listgarden",    NULL },
+  { CMDSOCK_STATS,         "stats",         NULL },
   { CMDSOCK_RELOAD,        "reload",        NULL },
   { CMDSOCK_DHCP_LIST,     "dhcp-list",     NULL },
   { CMDSOCK_DHCP_RELEASE,  "dhcp-release",  NULL },
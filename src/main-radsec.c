@@ -24,154 +24,662 @@
 
 struct options_t _options;
 
+/*
+ *  RADIUS packets chilli sends to the local auth and acct ports are
+ *  tunneled over a few persistent TLS connections to radiusserver1
+ *  (radiusserver2 while the first is unreachable). Requests are
+ *  pipelined: each connection keeps the request IDs in flight along
+ *  with where the request came from, so replies are matched by ID, and
+ *  a request goes to a connection on which its ID is free. Everything
+ *  read from the UDP sockets in one pass of the loop is written in one
+ *  TLS record per connection. Connections are (re)established without
+ *  blocking, resuming the last TLS session of the server.
+ */
+
+#define RADSEC_PORT          2083
+#define RADSEC_BUFSIZE      16384 /* Largest TLS record */
+#define RADSEC_BACKLOG         64 /* Requests waiting for a connection */
+#define RADSEC_BATCH           64 /* Packets read off a socket at once */
+#define RADSEC_RECONNECT        1 /* Seconds before reconnecting, doubled */
+#define RADSEC_MAXRECONNECT    60
+#define RADSEC_CONNTIMEOUT     10 /* Seconds to connect and handshake */
+#define RADSEC_REQTIMEOUT      30 /* Seconds to wait for a reply */
+
+#define RADSEC_CLOSED           0
+#define RADSEC_CONNECTING       1
+#define RADSEC_HANDSHAKE        2
+#define RADSEC_UP               3
+
+struct radsec_slot {
+  struct radius_t *via;          /* Socket to answer on, 0 = ID is free */
+  struct sockaddr_in peer;
+  time_t sent;
+};
+
+struct radsec_conn {
+  int srv;
+  int state;
+  int sock;
+  int want;                      /* Handshake wants to read (1) or write (2) */
+  time_t since;                  /* Start of connect, or of the last try */
+  time_t retry;
+  int backoff;
+  uint8_t ticket;                /* Session refreshed after the first read */
+
+  openssl_con *sslcon;
+
+  struct radsec_slot slot[256];
+  int inflight;
+
+  uint8_t obuf[RADSEC_BUFSIZE];
+  int olen;
+  int wlen;                      /* Length of a write to be retried */
+
+  uint8_t ibuf[RADIUS_PACKSIZE * 2];
+  int ilen;
+
+  struct radius_t *coa;          /* Own socket to chilli, so CoA ids are per connection */
+};
+
 static struct {
 
   struct radius_t *radius_auth;
   struct radius_t *radius_acct;
-  struct radius_t *radius_cli;
-
-  struct sockaddr_in auth_peer;
-  struct sockaddr_in acct_peer;
 
   openssl_env * env;
 
-  struct conn_t conn;
+  struct in_addr addr[2];
+  int nsrv;
+  void *session[2];              /* For TLS session resumption */
+
+  struct radsec_conn conn[2][RADSEC_MAXCONNS];
+  int nconn;
+
+  struct {
+    struct radius_t *via;
+    struct sockaddr_in peer;
+    struct radius_packet_t pack;
+  } backlog[RADSEC_BACKLOG];
+  int bhead;
+  int bcnt;
+
+  struct {
+    uint64_t requests;
+    uint64_t replies;
+    uint64_t records;
+    uint64_t retransmits;
+    uint64_t dropped;
+    uint64_t timeouts;
+    uint64_t handshakes;
+    uint64_t resumed;
+  } stats;
+
+} server;
 
-  struct radius_packet_t pack;
 
-  int pos;
+static void radsec_close(struct radsec_conn *c, int failed) {
+  int i;
 
-} server;
+  if (c->sslcon) {
+    if (c->state == RADSEC_UP)
+      openssl_shutdown(c->sslcon, 2);
+    openssl_free(c->sslcon);
+    c->sslcon = 0;
+  }
 
+  if (c->sock > 0)
+    close(c->sock);
+
+  /* What was in flight is retransmitted by chilli */
+  for (i = 0; i < 256; i++)
+    c->slot[i].via = 0;
+
+  c->sock = 0;
+  c->state = RADSEC_CLOSED;
+  c->inflight = 0;
+  c->olen = c->wlen = c->ilen = 0;
+
+  if (failed) {
+    c->retry = mainclock_now() + c->backoff;
+    c->backoff *= 2;
+    if (c->backoff > RADSEC_MAXRECONNECT)
+      c->backoff = RADSEC_MAXRECONNECT;
+  } else {
+    c->retry = mainclock_now();
+    c->backoff = RADSEC_RECONNECT;
+  }
+}
 
-static int connect_ssl(struct in_addr *addr, int port) {
-  if (conn_sock(&server.conn, addr, port)) {
-    return -1;
+static void radsec_failed(struct radsec_conn *c, char *what) {
+  syslog(LOG_ERR, "RADSEC: %s %s:%d failed, retry in %d seconds",
+         what, inet_ntoa(server.addr[c->srv]), RADSEC_PORT, c->backoff);
+
+  /* A session the server no longer accepts must not be offered again */
+  if (c->state == RADSEC_HANDSHAKE && server.session[c->srv]) {
+    openssl_free_session(server.session[c->srv]);
+    server.session[c->srv] = 0;
+  }
+
+  radsec_close(c, 1);
+}
+
+static void radsec_keep_session(struct radsec_conn *c) {
+  void *session = openssl_get_session(c->sslcon);
+  if (session) {
+    openssl_free_session(server.session[c->srv]);
+    server.session[c->srv] = session;
+  }
+}
+
+static void radsec_handshake(struct radsec_conn *c) {
+  switch (c->want = openssl_check_connect(c->sslcon)) {
+    case 0:
+      break;
+    case 1:
+    case 2:
+      return;
+    default:
+      radsec_failed(c, "TLS handshake with");
+      return;
   }
-  server.conn.sslcon = openssl_connect_fd(server.env, server.conn.sock, 10);
-  if (!server.conn.sslcon) {
-    syslog(LOG_ERR, "%s: Failed to connect to %s:%d", strerror(errno), inet_ntoa(*addr), port);
+
+  c->state = RADSEC_UP;
+  c->backoff = RADSEC_RECONNECT;
+  c->ticket = 0;
+  server.stats.handshakes++;
+
+  if (openssl_session_reused(c->sslcon))
+    server.stats.resumed++;
+  else
+    radsec_keep_session(c);
+
+  if (_options.debug)
+    syslog(LOG_DEBUG, "%s(%d): RADSEC: connected to %s:%d%s", __FUNCTION__, __LINE__,
+           inet_ntoa(server.addr[c->srv]), RADSEC_PORT,
+           openssl_session_reused(c->sslcon) ? " (resumed)" : "");
+}
+
+static void radsec_connect(struct radsec_conn *c) {
+  struct conn_t tcp;
+
+  memset(&tcp, 0, sizeof(tcp));
+
+  c->since = mainclock_now();
+
+  if (conn_sock(&tcp, &server.addr[c->srv], RADSEC_PORT) || tcp.sock <= 0) {
+    radsec_failed(c, "Connecting to");
+    return;
+  }
+
+  c->sock = tcp.sock;
+  c->state = RADSEC_CONNECTING;
+}
+
+static void radsec_connected(struct radsec_conn *c) {
+  int err = 0;
+  socklen_t errlen = sizeof(err);
+
+  if (getsockopt(c->sock, SOL_SOCKET, SO_ERROR, &err, &errlen) || err) {
+    errno = err;
+    radsec_failed(c, "Connecting to");
+    return;
+  }
+
+  if (!(c->sslcon = openssl_connect_nb(server.env, c->sock,
+                                       server.session[c->srv]))) {
+    radsec_failed(c, "TLS setup for");
+    return;
+  }
+
+  c->state = RADSEC_HANDSHAKE;
+  radsec_handshake(c);
+}
+
+static int radsec_flush(struct radsec_conn *c) {
+  int n;
+
+  if (c->state != RADSEC_UP || !c->olen)
+    return 0;
+
+  /* A write that would block is retried with the same length */
+  if (!c->wlen)
+    c->wlen = c->olen;
+
+  n = openssl_write_nb(c->sslcon, (char *) c->obuf, c->wlen);
+
+  if (n < 0) {
+    syslog(LOG_ERR, "RADSEC: write to %s:%d failed",
+           inet_ntoa(server.addr[c->srv]), RADSEC_PORT);
+    radsec_close(c, 0);
     return -1;
   }
+
+  if (n > 0) {
+    server.stats.records++;
+    memmove(c->obuf, c->obuf + n, c->olen - n);
+    c->olen -= n;
+    c->wlen = 0;
+  }
+
   return 0;
 }
 
-static int shutdown_ssl() {
-  if (server.conn.sslcon) {
-    openssl_shutdown(server.conn.sslcon, 2);
-    openssl_free(server.conn.sslcon);
+static int radsec_stage(struct radsec_conn *c, struct radius_packet_t *pack) {
+  int len = ntohs(pack->length);
+
+  if (c->olen + len > RADSEC_BUFSIZE) {
+    /* Make room by writing out what is staged */
+    if (radsec_flush(c) || c->olen + len > RADSEC_BUFSIZE)
+      return -1;
   }
-  close(server.conn.sock);
-  server.conn.sock = 0;
-  server.conn.connected = 0;
+
+  memcpy(c->obuf + c->olen, pack, len);
+  c->olen += len;
   return 0;
 }
 
-static void process_radius(struct radius_packet_t *pack, ssize_t len) {
-  int attempts = 0;
+/*
+ *  The connection a request goes to: the least loaded one of the first
+ *  server that has one up, on which the ID of the request is free.
+ */
+static struct radsec_conn *radsec_pick(uint8_t id, int len) {
+  struct radsec_conn *best = 0;
+  int s, i;
+
+  for (s = 0; s < server.nsrv; s++) {
+    int up = 0;
 
-try_again:
+    for (i = 0; i < server.nconn; i++) {
+      struct radsec_conn *c = &server.conn[s][i];
 
-  if (attempts++ == 5) {
-    syslog(LOG_ERR, "%s: Dropping RADIUS packet!", strerror(errno));
-    return;
+      if (c->state != RADSEC_UP) continue;
+      up = 1;
+
+      if (c->slot[id].via) continue;
+      if (c->olen + len > RADSEC_BUFSIZE && c->wlen) continue;
+
+      if (!best || c->inflight < best->inflight)
+        best = c;
+    }
+
+    if (up) break;
   }
 
-  syslog(LOG_DEBUG, "%s:%s", __FILE__, __FUNCTION__);
-
-  if (!server.conn.connected) {
-    syslog(LOG_DEBUG, "RADSEC: Connecting to %s:2083",
-           inet_ntoa(_options.radiusserver1));
-    if (connect_ssl(&_options.radiusserver1, 2083)) {
-      syslog(LOG_ERR, "%d Could not connect to RadSec server %s!",
-             errno, inet_ntoa(_options.radiusserver1));
-      syslog(LOG_DEBUG, "RADSEC: Connecting to %s:2083",
-             inet_ntoa(_options.radiusserver1));
-      if (connect_ssl(&_options.radiusserver2, 2083)) {
-	syslog(LOG_ERR, "%d Could not connect to RadSec server %s!",
-               errno, inet_ntoa(_options.radiusserver2));
-      } else {
-	syslog(LOG_DEBUG, "RADSEC: Connected to %s:2083",
-               inet_ntoa(_options.radiusserver2));
-	server.conn.connected = 1;
+  return best;
+}
+
+static int radsec_send(struct radius_t *via, struct sockaddr_in *peer,
+                       struct radius_packet_t *pack) {
+  struct radsec_conn *c;
+  int s, i;
+
+  /* Retransmission of a request still in flight: TCP delivers it */
+  for (s = 0; s < server.nsrv; s++) {
+    for (i = 0; i < server.nconn; i++) {
+      struct radsec_slot *slot = &server.conn[s][i].slot[pack->id];
+      if (slot->via == via &&
+          slot->peer.sin_addr.s_addr == peer->sin_addr.s_addr &&
+          slot->peer.sin_port == peer->sin_port) {
+        server.stats.retransmits++;
+        return 0;
+      }
+    }
+  }
+
+  if (!(c = radsec_pick(pack->id, ntohs(pack->length))))
+    return -1;
+
+  if (radsec_stage(c, pack))
+    return -1;
+
+  c->slot[pack->id].via = via;
+  c->slot[pack->id].peer = *peer;
+  c->slot[pack->id].sent = mainclock_now();
+  c->inflight++;
+  server.stats.requests++;
+  return 0;
+}
+
+/*
+ *  Sends what it can of the backlog. A request whose ID is still in
+ *  flight on every connection (the chilli source sockets share the ID
+ *  space) stays, in order, without holding up those behind it.
+ */
+static void radsec_backlog_drain(void) {
+  int n = server.bcnt;
+  int i, kept = 0;
+
+  for (i = 0; i < n; i++) {
+    int b = (server.bhead + i) % RADSEC_BACKLOG;
+
+    if (radsec_send(server.backlog[b].via, &server.backlog[b].peer,
+                    &server.backlog[b].pack)) {
+      int k = (server.bhead + kept++) % RADSEC_BACKLOG;
+      if (k != b) {
+        server.backlog[k].via = server.backlog[b].via;
+        server.backlog[k].peer = server.backlog[b].peer;
+        memcpy(&server.backlog[k].pack, &server.backlog[b].pack,
+               ntohs(server.backlog[b].pack.length));
       }
-    } else {
-      syslog(LOG_DEBUG, "RADSEC: Connected to %s:2083",
-             inet_ntoa(_options.radiusserver1));
-      server.conn.connected = 1;
     }
   }
 
-  if (!server.conn.connected) {
-    sleep(1);
-    goto try_again;
+  server.bcnt = kept;
+}
+
+static void radsec_request(struct radius_t *via, struct sockaddr_in *peer,
+                           struct radius_packet_t *pack) {
+  int b;
+
+  if (!server.bcnt && !radsec_send(via, peer, pack))
+    return;
+
+  if (server.bcnt == RADSEC_BACKLOG) {
+    if (_options.debug)
+      syslog(LOG_DEBUG, "%s(%d): RADSEC: no connection, dropping id=%d", __FUNCTION__, __LINE__, pack->id);
+    server.stats.dropped++;
+    return;
   }
 
-  {
-    int l = openssl_write(server.conn.sslcon, (char *)pack, len, 0);
-    syslog(LOG_DEBUG, "ssl_write %d",l);
-    if (l <= 0) {
-      shutdown_ssl();
-      /*
-       *  Immediately start to reconnect
-       */
-      goto try_again;
+  b = (server.bhead + server.bcnt++) % RADSEC_BACKLOG;
+  server.backlog[b].via = via;
+  server.backlog[b].peer = *peer;
+  memcpy(&server.backlog[b].pack, pack, ntohs(pack->length));
+}
+
+static void radsec_reply(struct radsec_conn *c, struct radius_packet_t *pack) {
+  struct radsec_slot *slot;
+  struct sockaddr_in coa;
+
+  switch (pack->code) {
+    case RADIUS_CODE_COA_REQUEST:
+    case RADIUS_CODE_DISCONNECT_REQUEST:
+    case RADIUS_CODE_STATUS_REQUEST:
+      if (!_options.coaport) break;
+      if (!c->coa) {
+        struct in_addr any;
+        any.s_addr = htonl(INADDR_ANY);
+        if (radius_new(&c->coa, &any, 0, 0, 0)) {
+          syslog(LOG_ERR, "Failed to create radius");
+          c->coa = 0;
+          break;
+        }
+        radius_set(c->coa, 0, 0);
+      }
+      memset(&coa, 0, sizeof(coa));
+      coa.sin_family = AF_INET;
+      coa.sin_port = htons(_options.coaport);
+      coa.sin_addr.s_addr = _options.radiuslisten.s_addr ?
+          _options.radiuslisten.s_addr : htonl(INADDR_LOOPBACK);
+      radius_pkt_send(c->coa, pack, &coa);
+      break;
+
+    default:
+      slot = &c->slot[pack->id];
+      if (!slot->via) {
+        if (_options.debug)
+          syslog(LOG_DEBUG, "%s(%d): RADSEC: unexpected reply id=%d", __FUNCTION__, __LINE__, pack->id);
+        break;
+      }
+      radius_pkt_send(slot->via, pack, &slot->peer);
+      slot->via = 0;
+      c->inflight--;
+      server.stats.replies++;
+      break;
+  }
+}
+
+static void radsec_read(struct radsec_conn *c) {
+  int n;
+
+  do {
+    n = openssl_read_nb(c->sslcon, (char *) c->ibuf + c->ilen,
+                        sizeof(c->ibuf) - c->ilen);
+    if (n < 0) {
+      syslog(LOG_ERR, "RADSEC: connection to %s:%d lost",
+             inet_ntoa(server.addr[c->srv]), RADSEC_PORT);
+      radsec_close(c, 0);
+      return;
     }
+
+    c->ilen += n;
+
+    while (c->ilen >= RADIUS_HDRSIZE) {
+      struct radius_packet_t *pack = (struct radius_packet_t *) c->ibuf;
+      int len = ntohs(pack->length);
+
+      if (len < RADIUS_HDRSIZE || len > RADIUS_PACKSIZE) {
+        syslog(LOG_ERR, "RADSEC: bad packet length %d from %s", len,
+               inet_ntoa(server.addr[c->srv]));
+        radsec_close(c, 1);
+        return;
+      }
+
+      if (c->ilen < len) break;
+
+      radsec_reply(c, pack);
+
+      memmove(c->ibuf, c->ibuf + len, c->ilen - len);
+      c->ilen -= len;
+    }
+  } while (n > 0 && c->state == RADSEC_UP);
+
+  /* A TLS 1.3 ticket only arrives after the handshake */
+  if (!c->ticket && c->state == RADSEC_UP) {
+    c->ticket = 1;
+    if (!openssl_session_reused(c->sslcon))
+      radsec_keep_session(c);
   }
 }
 
-static void process_radius_reply() {
-  uint8_t *d = (uint8_t *) &server.pack;
-  int l = openssl_read(server.conn.sslcon, (char *)d, 4, 0);
-  syslog(LOG_DEBUG, "reply %d", l);
-  if (l == 4) {
-    int len = ntohs(server.pack.length) - 4;
-    l = openssl_read(server.conn.sslcon, (char *)(d + 4), len, 0);
-    syslog(LOG_DEBUG, "reply %d", l);
-    if (l == len) {
-      syslog(LOG_DEBUG, "reply +%d", len);
-      switch (server.pack.code) {
-        case RADIUS_CODE_ACCESS_ACCEPT:
-        case RADIUS_CODE_ACCESS_REJECT:
-        case RADIUS_CODE_ACCESS_CHALLENGE:
-          syslog(LOG_DEBUG, "reply auth %d", len);
-          radius_pkt_send(server.radius_auth, &server.pack, &server.auth_peer);
+static void radsec_servers(void) {
+  struct in_addr addr[2];
+  int nsrv = 0, s, i;
+
+  addr[nsrv++] = _options.radiusserver1;
+  if (_options.radiusserver2.s_addr &&
+      _options.radiusserver2.s_addr != _options.radiusserver1.s_addr)
+    addr[nsrv++] = _options.radiusserver2;
+
+  for (s = 0; s < 2; s++) {
+    if (s < nsrv && s < server.nsrv &&
+        addr[s].s_addr == server.addr[s].s_addr)
+      continue;
+    for (i = 0; i < RADSEC_MAXCONNS; i++) {
+      struct radsec_conn *c = &server.conn[s][i];
+      if (c->state != RADSEC_CLOSED)
+        radsec_close(c, 0);
+      c->srv = s;
+      c->backoff = RADSEC_RECONNECT;
+      c->retry = 0;
+    }
+    openssl_free_session(server.session[s]);
+    server.session[s] = 0;
+  }
+
+  memcpy(server.addr, addr, sizeof(addr));
+  server.nsrv = nsrv;
+
+  server.nconn = _options.radsecconns;
+  if (server.nconn < 1) server.nconn = 1;
+  if (server.nconn > RADSEC_MAXCONNS) server.nconn = RADSEC_MAXCONNS;
+
+  for (s = 0; s < 2; s++)
+    for (i = server.nconn; i < RADSEC_MAXCONNS; i++)
+      if (server.conn[s][i].state != RADSEC_CLOSED)
+        radsec_close(&server.conn[s][i], 0);
+}
+
+/*
+ *  Once a second: (re)connect, give up on stalled handshakes and on
+ *  requests the server never answered. Connections to the second
+ *  server are only opened once all those to the first have failed,
+ *  and closed when idle again while one to the first is up.
+ */
+static void radsec_timeout(void) {
+  time_t now = mainclock_now();
+  int primary = 0, fallback = 1, s, i, id;
+
+  for (i = 0; i < server.nconn; i++) {
+    if (server.conn[0][i].state == RADSEC_UP)
+      primary = 1;
+    if (server.conn[0][i].backoff <= RADSEC_RECONNECT)
+      fallback = 0;
+  }
+
+  for (s = 0; s < server.nsrv; s++) {
+    for (i = 0; i < server.nconn; i++) {
+      struct radsec_conn *c = &server.conn[s][i];
+
+      switch (c->state) {
+        case RADSEC_CLOSED:
+          if (s > 0 && (primary || !fallback)) break;
+          if (now >= c->retry)
+            radsec_connect(c);
           break;
-        case RADIUS_CODE_ACCOUNTING_RESPONSE:
-          syslog(LOG_DEBUG, "reply acct %d", len);
-          radius_pkt_send(server.radius_acct, &server.pack, &server.acct_peer);
+
+        case RADSEC_CONNECTING:
+        case RADSEC_HANDSHAKE:
+          if (now - c->since >= RADSEC_CONNTIMEOUT)
+            radsec_failed(c, "Connecting to");
           break;
-        case RADIUS_CODE_COA_REQUEST:
-        case RADIUS_CODE_DISCONNECT_REQUEST:
-        case RADIUS_CODE_STATUS_REQUEST:
-          if (_options.coaport) {
-            syslog(LOG_DEBUG, "reply coa %d", len);
-            radius_pkt_send(server.radius_cli, &server.pack, &server.acct_peer);
+
+        case RADSEC_UP:
+          if (s > 0 && primary && !c->inflight && !c->olen) {
+            radsec_close(c, 0);
+            break;
+          }
+          for (id = 0; id < 256 && c->inflight; id++) {
+            if (c->slot[id].via && now - c->slot[id].sent > RADSEC_REQTIMEOUT) {
+              c->slot[id].via = 0;
+              c->inflight--;
+              server.stats.timeouts++;
+            }
           }
           break;
       }
     }
   }
-  if (l <= 0) {
-    shutdown_ssl();
-  }
 }
 
-static int cb_radius_auth_conf(struct radius_t *radius,
-			       struct radius_packet_t *pack,
-			       struct radius_packet_t *pack_req,
-			       void *cbp) {
-  process_radius(pack, pack->length);
+/*
+ *  Reads what is queued on one of the local UDP sockets. With a
+ *  connection given, the socket is its CoA socket and what is read are
+ *  chilli's answers, to go back over that connection.
+ */
+static int radsec_recv(struct radius_t *via, struct radsec_conn *c) {
+  struct radius_packet_t radius_pack;
+  struct sockaddr_in addr;
+  socklen_t fromlen;
+  ssize_t status;
+  int n;
+
+  for (n = 0; n < RADSEC_BATCH; n++) {
+    fromlen = sizeof(addr);
+
+    if ((status = recvfrom(via->fd, &radius_pack, sizeof(radius_pack), MSG_DONTWAIT,
+                           (struct sockaddr *) &addr, &fromlen)) <= 0) {
+      if (status < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+        syslog(LOG_ERR, "%s: recvfrom() failed", strerror(errno));
+        return -1;
+      }
+      break;
+    }
+
+    if (status < RADIUS_HDRSIZE || ntohs(radius_pack.length) > status ||
+        ntohs(radius_pack.length) < RADIUS_HDRSIZE)
+      continue;
+
+    if (c) {
+      /* chilli answering a CoA or Disconnect request */
+      if (c->state == RADSEC_UP)
+        radsec_stage(c, &radius_pack);
+      continue;
+    }
+
+    radsec_request(via, &addr, &radius_pack);
+  }
+
   return 0;
 }
 
+static void radsec_fd_set(fd_set *r, fd_set *w, int *maxfd) {
+  int s, i;
+
+  for (s = 0; s < server.nsrv; s++) {
+    for (i = 0; i < server.nconn; i++) {
+      struct radsec_conn *c = &server.conn[s][i];
+
+      if (c->coa) {
+        FD_SET(c->coa->fd, r);
+        if (c->coa->fd > *maxfd)
+          *maxfd = c->coa->fd;
+      }
+
+      switch (c->state) {
+        case RADSEC_CLOSED:
+          continue;
+        case RADSEC_CONNECTING:
+          FD_SET(c->sock, w);
+          break;
+        case RADSEC_HANDSHAKE:
+          FD_SET(c->sock, c->want == 2 ? w : r);
+          break;
+        case RADSEC_UP:
+          FD_SET(c->sock, r);
+          if (c->olen)
+            FD_SET(c->sock, w);
+          break;
+      }
+
+      if (c->sock > *maxfd)
+        *maxfd = c->sock;
+    }
+  }
+}
+
+static void radsec_fd_isset(fd_set *r, fd_set *w) {
+  int s, i;
+
+  for (s = 0; s < server.nsrv; s++) {
+    for (i = 0; i < server.nconn; i++) {
+      struct radsec_conn *c = &server.conn[s][i];
+
+      if (c->coa && FD_ISSET(c->coa->fd, r))
+        radsec_recv(c->coa, c);
+
+      switch (c->state) {
+        case RADSEC_CONNECTING:
+          if (FD_ISSET(c->sock, w))
+            radsec_connected(c);
+          break;
+        case RADSEC_HANDSHAKE:
+          if (FD_ISSET(c->sock, r) || FD_ISSET(c->sock, w))
+            radsec_handshake(c);
+          break;
+        case RADSEC_UP:
+          if (FD_ISSET(c->sock, r) || openssl_pending(c->sslcon))
+            radsec_read(c);
+          break;
+      }
+    }
+  }
+}
+
+static void radsec_flush_all(void) {
+  int s, i;
+  for (s = 0; s < server.nsrv; s++)
+    for (i = 0; i < server.nconn; i++)
+      radsec_flush(&server.conn[s][i]);
+}
+
 int main(int argc, char **argv) {
-  struct radius_packet_t radius_pack;
   struct in_addr radiuslisten;
 
   struct timeval timeout;
+  time_t lastcheck = 0;
 
-  int maxfd = 0;
+  int maxfd;
   fd_set fdread;
   fd_set fdwrite;
   fd_set fdexcep;
@@ -214,16 +722,6 @@ int main(int argc, char **argv) {
     return -1;
   }
 
-  if (_options.coaport) {
-    if (radius_new(&server.radius_cli, &radiuslisten, 0, 0, 0) ||
-	radius_init_q(server.radius_cli, 8)) {
-      syslog(LOG_ERR, "Failed to create radius");
-      return -1;
-    }
-    radius_set(server.radius_cli, 0, 0);
-    radius_set_cb_auth_conf(server.radius_cli, cb_radius_auth_conf);
-  }
-
   radius_set(server.radius_auth, 0, 0);
   radius_set(server.radius_acct, 0, 0);
 
@@ -241,9 +739,18 @@ int main(int argc, char **argv) {
 
     if (reload_config) {
       reload_options(argc, argv);
+      radsec_servers();
       reload_config = 0;
     }
 
+    mainclock_tick();
+
+    if (mainclock_now() != lastcheck) {
+      lastcheck = mainclock_now();
+      radsec_timeout();
+      radsec_backlog_drain();
+    }
+
     FD_ZERO(&fdread);
     FD_ZERO(&fdwrite);
     FD_ZERO(&fdexcep);
@@ -252,23 +759,15 @@ int main(int argc, char **argv) {
     FD_SET(server.radius_auth->fd, &fdread);
     FD_SET(server.radius_acct->fd, &fdread);
 
+    maxfd = selfpipe;
+
     if (server.radius_auth->fd > maxfd)
       maxfd = server.radius_auth->fd;
 
     if (server.radius_acct->fd > maxfd)
       maxfd = server.radius_acct->fd;
 
-    if (server.conn.sock) {
-      FD_SET(server.conn.sock, &fdread);
-      if (server.conn.sock > maxfd)
-	maxfd = server.conn.sock;
-    }
-
-    if (server.radius_cli) {
-      FD_SET(server.radius_cli->fd, &fdread);
-      if (server.radius_cli->fd > maxfd)
-	maxfd = server.radius_cli->fd;
-    }
+    radsec_fd_set(&fdread, &fdwrite, &maxfd);
 
     timeout.tv_sec = 1;
     timeout.tv_usec = 0;
@@ -284,65 +783,50 @@ int main(int argc, char **argv) {
       case 0:
       default:
         if (status > 0) {
-          struct sockaddr_in addr;
-          socklen_t fromlen = sizeof(addr);
 
           if (FD_ISSET(selfpipe, &fdread)) {
             chilli_handle_signal(0, 0);
           }
 
-          if (FD_ISSET(server.radius_auth->fd, &fdread)) {
-            /*
-             *    ---> Authentication
-             */
+          mainclock_tick();
 
-            if ((status = recvfrom(server.radius_auth->fd, &radius_pack, sizeof(radius_pack), 0,
-                                   (struct sockaddr *) &addr, &fromlen)) <= 0) {
-              syslog(LOG_ERR, "%s: recvfrom() failed", strerror(errno));
+          radsec_fd_isset(&fdread, &fdwrite);
 
+          /*
+           *    ---> Authentication
+           */
+          if (FD_ISSET(server.radius_auth->fd, &fdread))
+            if (radsec_recv(server.radius_auth, 0))
               return -1;
-            }
-
-            memcpy(&server.auth_peer, &addr, sizeof(addr));
-
-            process_radius(&radius_pack, status);
-          }
-
-          if (FD_ISSET(server.radius_acct->fd, &fdread)) {
-            /*
-             *    ---> Accounting
-             */
 
-            syslog(LOG_DEBUG, "received accounting");
-
-            if ((status = recvfrom(server.radius_acct->fd, &radius_pack, sizeof(radius_pack), 0,
-                                   (struct sockaddr *) &addr, &fromlen)) <= 0) {
-              syslog(LOG_ERR, "%s: recvfrom() failed", strerror(errno));
+          /*
+           *    ---> Accounting
+           */
+          if (FD_ISSET(server.radius_acct->fd, &fdread))
+            if (radsec_recv(server.radius_acct, 0))
               return -1;
-            }
-
-            memcpy(&server.acct_peer, &addr, sizeof(addr));
 
-            process_radius(&radius_pack, status);
-          }
-
-          if (server.radius_cli) {
-            if (FD_ISSET(server.radius_cli->fd, &fdread)) {
-              radius_decaps(server.radius_cli, 0);
-            }
-          }
-
-          if (server.conn.sock) {
-            if (FD_ISSET(server.conn.sock, &fdread)) {
-              process_radius_reply();
-            }
-          }
+          radsec_backlog_drain();
         }
 
+        radsec_flush_all();
         break;
     }
   }
 
+  if (_options.debug)
+    syslog(LOG_DEBUG, "%s(%d): RADSEC: requests=%llu replies=%llu records=%llu"
+           " retransmits=%llu dropped=%llu timeouts=%llu handshakes=%llu resumed=%llu",
+           __FUNCTION__, __LINE__,
+           (unsigned long long) server.stats.requests,
+           (unsigned long long) server.stats.replies,
+           (unsigned long long) server.stats.records,
+           (unsigned long long) server.stats.retransmits,
+           (unsigned long long) server.stats.dropped,
+           (unsigned long long) server.stats.timeouts,
+           (unsigned long long) server.stats.handshakes,
+           (unsigned long long) server.stats.resumed);
+
   selfpipe_finish();
 
   return 0;
@@ -28,10 +28,27 @@ static select_ctx sctx;
 #error This requires the UNIX IPC method
 #endif
 
+/*
+ *  Requests are allocated REDIR_REQUEST_CHUNK at a time, up to
+ *  redirmaxconns, and never freed; a closed one goes on the free list
+ *  with its buffers. Only those in use are on the requests list, which
+ *  the main loop walks.
+ */
 static int max_requests = 0;
+static int num_requests = 0;
 static redir_request * requests = 0;
+static redir_request * requests_last = 0;
 static redir_request * requests_free = 0;
 
+static struct {
+  int inuse;
+  int peak;
+  uint64_t accepted;
+  uint64_t evicted;       /* idle connections closed to make room */
+  uint64_t rejected;      /* new connections refused, none idle */
+  uint64_t timeouts;
+} redir_stats;
+
 #ifdef ENABLE_REDIRINJECT
 static bstring inject_fmt(redir_request *req, struct redir_conn_t *conn) {
   char *url = req->inject_url;
@@ -69,47 +86,97 @@ static bstring string_init_reset(bstring s) {
   return s;
 }
 
+static int redir_conn_finish(struct conn_t *conn, void *ctx);
+
+static void request_link(redir_request *req) {
+  req->next = 0;
+  req->prev = requests_last;
+  if (requests_last)
+    requests_last->next = req;
+  else
+    requests = req;
+  requests_last = req;
+}
+
+static void request_unlink(redir_request *req) {
+  if (req->prev)
+    req->prev->next = req->next;
+  else
+    requests = req->next;
+  if (req->next)
+    req->next->prev = req->prev;
+  else
+    requests_last = req->prev;
+  req->next = req->prev = 0;
+}
+
+
+static int grow_requests() {
+  redir_request *chunk;
+  int i, n = REDIR_REQUEST_CHUNK;
+
+  if (num_requests + n > max_requests)
+    n = max_requests - num_requests;
+
+  if (n <= 0) return -1;
+
+  chunk = (redir_request *) calloc(n, sizeof(redir_request));
+  if (!chunk) {
+    syslog(LOG_ERR, "%s: could not allocate %d requests", strerror(errno), n);
+    return -1;
+  }
+
+  for (i=0; i < n; i++) {
+    chunk[i].index = num_requests++;
+    chunk[i].next = requests_free;
+    requests_free = &chunk[i];
+  }
+
+  if (_options.debug)
+    syslog(LOG_DEBUG, "%s(%d): %d requests allocated", __FUNCTION__, __LINE__, num_requests);
+
+  return 0;
+}
+
 static redir_request * get_request() {
   redir_request * req = 0;
-  int i;
 
   if (!max_requests) {
+    max_requests = _options.redirmaxconns;
+    if (max_requests < 1) max_requests = 1;
+  }
 
-    max_requests = 2048; /* hard maximum! (should be configurable) */
+  if (!requests_free)
+    grow_requests();
 
-    requests = (redir_request *) calloc(max_requests, sizeof(redir_request));
-    for (i=0; i < max_requests; i++) {
-      requests[i].index = i;
-      if (i > 0)
-	requests[i].prev = &requests[i-1];
-      if ((i+1) < max_requests)
-	requests[i].next = &requests[i+1];
+  if (!requests_free) {
+    /*
+     *  At the cap: make room by closing the connection idle the
+     *  longest, of those waiting on their client with no upstream
+     *  socket. Only done when full, so a scan will do.
+     */
+    redir_request *r;
+    for (r = requests; r; r = r->next)
+      if (!r->proxy && !r->conn.sock &&
+	  (!req || r->last_active < req->last_active))
+	req = r;
+
+    if (!req) {
+      redir_stats.rejected++;
+      syslog(LOG_WARNING, "all %d redir connections busy", max_requests);
+      return 0;
     }
 
-    requests_free = requests;
-  }
+    if (_options.debug)
+      syslog(LOG_DEBUG, "%s(%d): evicting connection idle %d seconds",
+             __FUNCTION__, __LINE__, (int) (mainclock_tick() - req->last_active));
 
-  if (requests_free) {
-    if (_options.debug) {
-      int cnt = 0;
-      req = requests_free;
-      while (req) {
-	req = req->next;
-	cnt++;
-      }
-      syslog(LOG_DEBUG, "redir free connections %d", cnt);;
-    }
-    req = requests_free;
-    requests_free = requests_free->next;
-    if (requests_free)
-      requests_free->prev = 0;
+    redir_stats.evicted++;
+    redir_conn_finish(&req->conn, req);
   }
 
-  if (!req) {
-    /* problem */
-    syslog(LOG_ERR,"out of connections!");
-    return 0;
-  }
+  req = requests_free;
+  requests_free = requests_free->next;
 
   /*req->url  = string_init_reset(req->url);*/
   /*req->data = string_init_reset(req->data);*/
@@ -119,39 +186,58 @@ static redir_request * get_request() {
   req->hbuf = string_init_reset(req->hbuf);
   req->ibuf = string_init_reset(req->ibuf);
 
-  /*
-    syslog(LOG_DEBUG, "url->len  %d",req->url->slen);
-    syslog(LOG_DEBUG, "data->len %d",req->data->slen);
-    syslog(LOG_DEBUG, "post->len %d",req->post->slen);
-  */
-  syslog(LOG_DEBUG, "dbuf->len %d",req->dbuf->slen);
-  syslog(LOG_DEBUG, "wbuf->len %d",req->wbuf->slen);
-  syslog(LOG_DEBUG, "hbuf->len %d",req->hbuf->slen);
-  syslog(LOG_DEBUG, "ibuf->len %d",req->ibuf->slen);
-
   req->read_closed = 0;
   req->write_closed = 0;
   req->state = 0;
-  req->next = req->prev = 0;
   req->html = req->proxy = req->headers = 0;
   req->chunked = req->gzip = 0;
+  req->keepalive = req->pipelined = 0;
+  req->reqlen = 0;
   req->clen = -1;
   req->inuse = 1;
+  req->last_active = mainclock_tick();
+  request_link(req);
+
+  redir_stats.accepted++;
+  if (++redir_stats.inuse > redir_stats.peak)
+    redir_stats.peak = redir_stats.inuse;
+
   return req;
 }
 
 static void close_request(redir_request *req) {
-  syslog(LOG_DEBUG, "closing request");
+  if (_options.debug)
+    syslog(LOG_DEBUG, "closing request");
+  request_unlink(req);
   req->inuse = 0;
   req->proxy = 0;
   req->socket_fd = 0;
   req->state = 0;
   req->last_active = 0;
-  if (requests_free) {
-    requests_free->prev = req;
-    req->next = requests_free;
-  }
+  req->next = requests_free;
   requests_free = req;
+  redir_stats.inuse--;
+}
+
+static void redir_regex_print(void);
+
+static void print_requests() {
+  syslog(LOG_INFO, "redir connections: %d in use (peak %d) of %d allocated,"
+         " max %d; accepted %llu evicted %llu rejected %llu timeouts %llu",
+         redir_stats.inuse, redir_stats.peak, num_requests, max_requests,
+         (unsigned long long) redir_stats.accepted,
+         (unsigned long long) redir_stats.evicted,
+         (unsigned long long) redir_stats.rejected,
+         (unsigned long long) redir_stats.timeouts);
+  redir_reply_cache_print();
+  redir_probe_print();
+#ifdef ENABLE_MINIPORTAL
+  portal_print();
+#endif
+  redir_regex_print();
+#ifdef HAVE_SSL
+  openssl_print_stats(-1);
+#endif
 }
 
 static int
@@ -207,6 +293,24 @@ sock_redir_getstate(struct redir_t *redir,
     return -1;
   }
 
+#ifdef ENABLE_SESSGARDEN
+  /* the rules follow; the reference is chilli_redir's own */
+  conn->s_params.garden = 0;
+  {
+    pass_through ptlist[SESSION_PASS_THROUGH_MAX];
+    uint32_t ptcnt = 0;
+    if (safe_read(s, &ptcnt, sizeof(ptcnt)) != sizeof(ptcnt) ||
+	ptcnt > SESSION_PASS_THROUGH_MAX ||
+	(ptcnt && safe_read(s, ptlist, sizeof(pass_through) * ptcnt) !=
+	 (int) (sizeof(pass_through) * ptcnt))) {
+      syslog(LOG_WARNING, "no session garden from %s", remote.sun_path);
+      close(s);
+      return -1;
+    }
+    conn->s_params.garden = garden_ruleset_intern(ptlist, ptcnt);
+  }
+#endif
+
   close(s);
 
   return conn->s_state.authenticated == 1;
@@ -500,32 +604,306 @@ static int redir_conn_read(struct conn_t *conn, void *ctx) {
   return 0;
 }
 
-static int
-check_regex(regex_t *re, char *regex, char *s) {
+/*
+ *  The uamregex pass-throughs are compiled when the options are
+ *  (re)loaded. Rules whose host is a plain "^name$" are hashed on the
+ *  name, and the rules that pass the host test are cached per host,
+ *  so that a request only runs the path and query string regexes of
+ *  the rules that can apply to it.
+ */
+#define REDIR_REGEX_HASHSIZE     64 /* must be a power of 2 */
+#define REDIR_REGEX_HOSTLEN      96
+#define REDIR_REGEX_CANDIDATES   16
+
+typedef struct redir_regex_t {
+  regex_pass_through *pt;
+  regex_t re_host;
+  regex_t re_path;
+  regex_t re_qs;
+  char literal[REDIR_REGEX_HOSTLEN];
+  uint32_t hash;
+  uint16_t order;
+  uint8_t has_host:1;
+  uint8_t has_path:1;
+  uint8_t has_qs:1;
+  uint8_t neg_host:1;
+  uint8_t neg_path:1;
+  uint8_t neg_qs:1;
+  struct redir_regex_t *next;
+} redir_regex;
+
+static redir_regex _regex[MAX_REGEX_PASS_THROUGHS];
+static uint16_t _regex_count = 0;
+
+static redir_regex * _regex_hash[REDIR_REGEX_HASHSIZE];
+static uint16_t _regex_other[MAX_REGEX_PASS_THROUGHS];
+static uint16_t _regex_nother = 0;
+
+static struct {
+  char host[REDIR_REGEX_HOSTLEN];
+  uint32_t hash;
+  uint8_t inuse;
+  uint8_t count;
+  uint16_t cand[REDIR_REGEX_CANDIDATES];
+} _regex_cache[REDIR_REGEX_CACHE];
+
+static struct {
+  uint64_t lookups;
+  uint64_t cache_hits;
+  uint64_t regex_execs;
+} _regex_stats;
+
+static int redir_regex_compile(regex_t *re, char *regex) {
   int ret;
 
-#if(_debug_)
-  syslog(LOG_DEBUG, "Checking %s =~ %s", s, regex);
-#endif
-
   if ((ret = regcomp(re, regex, REG_EXTENDED | REG_NOSUB)) != 0) {
     char error[512];
     regerror(ret, re, error, sizeof(error));
-    syslog(LOG_ERR, "regcomp(%s) failed (%s)", regex, error);
-    regex[0] = 0;
+    syslog(LOG_ERR, "regcomp(%s) failed (%s), uamregex ignored",
+           regex, error);
     return -1;
   }
 
-  if ((ret = regexec(re, s, 0, 0, 0)) == 0) {
+  return 0;
+}
+
+/*
+ *  Copies the name of a "^www\.example\.com$" host pattern to out,
+ *  returns 0 when the pattern has to stay a regex.
+ */
+static int redir_regex_literal(const char *p, char *out, size_t outlen) {
+  size_t len = 0;
 
-    syslog(LOG_DEBUG, "Matched regex %s", regex);
+  if (*p++ != '^')
     return 0;
 
+  while (*p && *p != '$') {
+    char c = *p++;
+    if (c == '\\') {
+      c = *p++;
+      if (c != '.' && c != '-')
+	return 0;
+    } else if (!isalnum((int) c) && c != '-' && c != '_' && c != ':') {
+      return 0;
+    }
+    if (len + 1 >= outlen)
+      return 0;
+    out[len++] = c;
   }
 
+  if (*p != '$' || p[1] || len == 0)
+    return 0;
+
+  out[len] = 0;
   return 1;
 }
 
+static void redir_regex_free(void) {
+  uint16_t i;
+
+  for (i = 0; i < _regex_count; i++) {
+    if (_regex[i].has_host) regfree(&_regex[i].re_host);
+    if (_regex[i].has_path) regfree(&_regex[i].re_path);
+    if (_regex[i].has_qs) regfree(&_regex[i].re_qs);
+  }
+
+  memset(_regex, 0, sizeof(_regex));
+  memset(_regex_hash, 0, sizeof(_regex_hash));
+  memset(_regex_cache, 0, sizeof(_regex_cache));
+  _regex_count = 0;
+  _regex_nother = 0;
+}
+
+static void redir_regex_load(void) {
+  redir_regex **tail[REDIR_REGEX_HASHSIZE];
+  uint16_t nlit = 0;
+  int i;
+
+  redir_regex_free();
+
+  for (i = 0; i < REDIR_REGEX_HASHSIZE; i++)
+    tail[i] = &_regex_hash[i];
+
+  for (i = 0; i < MAX_REGEX_PASS_THROUGHS; i++) {
+    regex_pass_through *pt = &_options.regex_pass_throughs[i];
+    redir_regex *r = &_regex[_regex_count];
+
+    if (!pt->inuse)
+      break;
+
+    /* the slot may hold what was left of a rule that did not compile */
+    memset(r, 0, sizeof(*r));
+    r->pt = pt;
+    r->order = _regex_count;
+    r->neg_host = pt->neg_host;
+    r->neg_path = pt->neg_path;
+    r->neg_qs = pt->neg_qs;
+
+    if (pt->regex_host[0] && !pt->neg_host &&
+	redir_regex_literal(pt->regex_host, r->literal, sizeof(r->literal))) {
+      r->hash = lookup((uint8_t *) r->literal, strlen(r->literal), 0);
+    } else if (pt->regex_host[0]) {
+      if (redir_regex_compile(&r->re_host, pt->regex_host))
+	continue;
+      r->has_host = 1;
+    }
+
+    if (pt->regex_path[0]) {
+      if (redir_regex_compile(&r->re_path, pt->regex_path)) {
+	if (r->has_host) regfree(&r->re_host);
+	r->has_host = 0;
+	continue;
+      }
+      r->has_path = 1;
+    }
+
+    if (pt->regex_qs[0]) {
+      if (redir_regex_compile(&r->re_qs, pt->regex_qs)) {
+	if (r->has_host) regfree(&r->re_host);
+	if (r->has_path) regfree(&r->re_path);
+	r->has_host = r->has_path = 0;
+	continue;
+      }
+      r->has_qs = 1;
+    }
+
+    if (r->literal[0]) {
+      uint32_t idx = r->hash & (REDIR_REGEX_HASHSIZE - 1);
+      *tail[idx] = r;
+      tail[idx] = &r->next;
+      nlit++;
+    } else {
+      _regex_other[_regex_nother++] = r->order;
+    }
+
+    _regex_count++;
+  }
+
+  if (_regex_count)
+    syslog(LOG_INFO, "uamregex: %d rules compiled, %d hosts indexed",
+           _regex_count, nlit);
+}
+
+static int redir_regex_test(regex_t *re, char *s, char neg) {
+  _regex_stats.regex_execs++;
+  return (regexec(re, s, 0, 0, 0) == 0) != !!neg;
+}
+
+/*
+ *  Walks the hashed rules of the host and the others in their order,
+ *  leaving those that pass the host test in cand. A rule with neither
+ *  path nor query string decides the request, so the walk ends there.
+ *  Returns -1 when there are more rules than fit in cand.
+ */
+static int redir_regex_hostrules(char *host, uint32_t hash, uint16_t *cand) {
+  redir_regex *lit = _regex_hash[hash & (REDIR_REGEX_HASHSIZE - 1)];
+  uint16_t o = 0;
+  int n = 0;
+
+  while (1) {
+    redir_regex *r;
+
+    while (lit && (lit->hash != hash || strcmp(lit->literal, host)))
+      lit = lit->next;
+
+    if (lit && (o == _regex_nother || lit->order < _regex_other[o])) {
+      r = lit;
+      lit = lit->next;
+    } else if (o < _regex_nother) {
+      r = &_regex[_regex_other[o++]];
+      if (r->has_host && !redir_regex_test(&r->re_host, host, r->neg_host))
+	continue;
+    } else {
+      break;
+    }
+
+    if (n == REDIR_REGEX_CANDIDATES)
+      return -1;
+
+    cand[n++] = r->order;
+
+    if (!r->has_path && !r->has_qs)
+      break;
+  }
+
+  return n;
+}
+
+static int redir_regex_match(struct redir_httpreq_t *httpreq) {
+  uint16_t cand[MAX_REGEX_PASS_THROUGHS];
+  size_t hlen = strlen(httpreq->host);
+  uint32_t hash;
+  int n = -1;
+  int i;
+
+  if (!_regex_count)
+    return 0;
+
+  _regex_stats.lookups++;
+
+  hash = lookup((uint8_t *) httpreq->host, hlen, 0);
+  i = hash & (REDIR_REGEX_CACHE - 1);
+
+  if (_regex_cache[i].inuse && _regex_cache[i].hash == hash &&
+      !strcmp(_regex_cache[i].host, httpreq->host)) {
+    _regex_stats.cache_hits++;
+    n = _regex_cache[i].count;
+    memcpy(cand, _regex_cache[i].cand, n * sizeof(uint16_t));
+  } else if ((n = redir_regex_hostrules(httpreq->host, hash, cand)) >= 0) {
+    if (hlen < REDIR_REGEX_HOSTLEN) {
+      memcpy(_regex_cache[i].host, httpreq->host, hlen + 1);
+      memcpy(_regex_cache[i].cand, cand, n * sizeof(uint16_t));
+      _regex_cache[i].count = n;
+      _regex_cache[i].hash = hash;
+      _regex_cache[i].inuse = 1;
+    }
+  } else {
+    /* too many rules for this host to cache, test them all */
+    uint16_t o;
+    for (o = 0, n = 0; o < _regex_count; o++) {
+      redir_regex *r = &_regex[o];
+      if (r->literal[0] ? strcmp(r->literal, httpreq->host) :
+	  (r->has_host && !redir_regex_test(&r->re_host, httpreq->host,
+					    r->neg_host)))
+	continue;
+      cand[n++] = o;
+    }
+  }
+
+  for (i = 0; i < n; i++) {
+    redir_regex *r = &_regex[cand[i]];
+
+    if (r->has_path && !redir_regex_test(&r->re_path, httpreq->path,
+					 r->neg_path))
+      continue;
+
+    if (r->has_qs && !redir_regex_test(&r->re_qs, httpreq->qs,
+				       r->neg_qs))
+      continue;
+
+#if(_debug_)
+    syslog(LOG_DEBUG, "Matched REGEX host=[%s] path=[%s] qs=[%s]",
+           r->pt->regex_host, r->pt->regex_path, r->pt->regex_qs);
+#endif
+    return 1;
+  }
+
+  return 0;
+}
+
+static void redir_regex_print(void) {
+  uint64_t l = _regex_stats.lookups;
+  uint64_t h = _regex_stats.cache_hits;
+
+  if (!_regex_count) return;
+
+  syslog(LOG_INFO, "uamregex (%d rules): lookups=%llu cached=%llu (%llu%%)"
+         " regexec=%llu", _regex_count,
+         (unsigned long long) l, (unsigned long long) h,
+         (unsigned long long) (l ? h * 100 / l : 0),
+         (unsigned long long) _regex_stats.regex_execs);
+}
+
 static int
 redir_handle_url(struct redir_t *redir,
 		 struct redir_conn_t *conn,
@@ -535,7 +913,6 @@ redir_handle_url(struct redir_t *redir,
 		 redir_request *req) {
   int port = 80;
   int matches = 0;
-  int i = -1;
   char *p = 0;
 
 #ifdef ENABLE_REDIRINJECT
@@ -552,59 +929,7 @@ redir_handle_url(struct redir_t *redir,
     matches = hasInject = 1;
   } else {
 #endif
-    for (i=0; i < MAX_REGEX_PASS_THROUGHS; i++) {
-
-      if ( ! _options.regex_pass_throughs[i].inuse )
-	break;
-
-      /*
-	if ( ! _options.regex_pass_throughs[i].regex_host[0] &&
-	! _options.regex_pass_throughs[i].regex_path[0] &&
-	! _options.regex_pass_throughs[i].regex_qs[0] )
-	break;
-      */
-
-#if(_debug_)
-      syslog(LOG_DEBUG, "REGEX host=[%s] path=[%s] qs=[%s]",
-             _options.regex_pass_throughs[i].regex_host,
-             _options.regex_pass_throughs[i].regex_path,
-             _options.regex_pass_throughs[i].regex_qs);
-
-      syslog(LOG_DEBUG, "Host %s", httpreq->host);
-#endif
-
-      if (_options.regex_pass_throughs[i].regex_host[0]) {
-	switch(check_regex(&_options.regex_pass_throughs[i].re_host,
-			   _options.regex_pass_throughs[i].regex_host,
-			   httpreq->host)) {
-          case -1: return -1;
-          case 1: matches = _options.regex_pass_throughs[i].neg_host; break;
-          case 0: matches = !_options.regex_pass_throughs[i].neg_host; break;
-	}
-      }
-
-      if (matches && _options.regex_pass_throughs[i].regex_path[0]) {
-	switch(check_regex(&_options.regex_pass_throughs[i].re_path,
-			   _options.regex_pass_throughs[i].regex_path,
-			   httpreq->path)) {
-          case -1: return -1;
-          case 1: matches = _options.regex_pass_throughs[i].neg_path; break;
-          case 0: matches = !_options.regex_pass_throughs[i].neg_path; break;
-	}
-      }
-
-      if (matches && _options.regex_pass_throughs[i].regex_qs[0]) {
-	switch(check_regex(&_options.regex_pass_throughs[i].re_qs,
-			   _options.regex_pass_throughs[i].regex_qs,
-			   httpreq->qs)) {
-          case -1: return -1;
-          case 1: matches = _options.regex_pass_throughs[i].neg_qs; break;
-          case 0: matches = !_options.regex_pass_throughs[i].neg_qs; break;
-	}
-      }
-
-      if (matches) break;
-    }
+    matches = redir_regex_match(httpreq);
 #ifdef ENABLE_REDIRINJECT
   }
 #endif
@@ -753,6 +1078,11 @@ int redir_accept2(struct redir_t *redir, int idx) {
 
     redir_request *req = get_request();
 
+    if (!req) {
+      close(new_socket);
+      return 0;
+    }
+
     req->parent = redir;
 
     syslog(LOG_DEBUG, "redir_main() for %s", inet_ntoa(address.sin_addr));
@@ -767,8 +1097,13 @@ int redir_accept2(struct redir_t *redir, int idx) {
     conn_set_readhandler(&req->conn, redir_conn_read, req);
     conn_set_donehandler(&req->conn, redir_conn_finish, req);
 
-    switch (redir_main(redir, new_socket, new_socket,
-		       &address, &baddress, idx, req)) {
+    do {
+      req->pipelined = 0;
+      status = redir_main(redir, new_socket, new_socket,
+			  &address, &baddress, idx, req);
+    } while (status == 1 && req->pipelined);
+
+    switch (status) {
       case 1:
         syslog(LOG_DEBUG, "redir queued %s socket_fd=%d conn.fd=%d",
                inet_ntoa(address.sin_addr),
@@ -792,7 +1127,7 @@ int redir_accept2(struct redir_t *redir, int idx) {
 
 int main(int argc, char **argv) {
   int status;
-  int idx;
+  redir_request *req, *next;
   int active_last = 0;
   int active = 0;
 
@@ -845,6 +1180,7 @@ int main(int argc, char **argv) {
   }
 
   redir_set(redir, hwaddr, (_options.debug));
+  redir_regex_load();
   redir_set_cb_getstate(redir, sock_redir_getstate);
 
   redir->cb_handle_url = redir_handle_url;
@@ -853,6 +1189,7 @@ int main(int argc, char **argv) {
     syslog(LOG_ERR, "%s: select init", strerror(errno));
 
   selfpipe = selfpipe_init();
+  selfpipe_trap(SIGUSR2);
 
   /* epoll */
   net_select_addfd(&sctx, selfpipe, SELECT_READ);
@@ -884,23 +1221,31 @@ int main(int argc, char **argv) {
       reload_config = 0;
 
       redir_set(redir, hwaddr, _options.debug);
+      redir_regex_load();
     }
 
-    for (idx=0; idx < max_requests; idx++) {
+    for (req = requests; req; req = next) {
+
+      next = req->next;
 
-      conn_select_fd(&requests[idx].conn, &sctx);
+      conn_select_fd(&req->conn, &sctx);
 
-      if (requests[idx].inuse && requests[idx].socket_fd) {
+      if (req->socket_fd) {
 	time_t now = mainclock_tick();
-	int fd = requests[idx].socket_fd;
+	int fd = req->socket_fd;
 	int timeout = 60;
 
-	if (now - requests[idx].last_active > timeout) {
-	  syslog(LOG_DEBUG, "timeout connection %d", idx);
-	  redir_conn_finish(&requests[idx].conn, &requests[idx]);
+	/* between requests of a keep-alive connection */
+	if (req->keepalive && !req->proxy && !req->wbuf->slen)
+	  timeout = REDIR_HTTP_KEEPALIVE_TIME;
+
+	if (now - req->last_active > timeout) {
+	  syslog(LOG_DEBUG, "timeout connection %d", req->index);
+	  redir_stats.timeouts++;
+	  redir_conn_finish(&req->conn, req);
 	} else {
 	  int evt = SELECT_READ;
-	  if (conn_write_remaining(&requests[idx].conn))
+	  if (conn_write_remaining(&req->conn))
 	    evt |= SELECT_WRITE;
 	  net_select_fd(&sctx, fd, evt);
 	  active++;
@@ -918,13 +1263,13 @@ int main(int argc, char **argv) {
 	    snprintf(line, sizeof(line),
 			  "#%d (%d) %d connection from %s %d",
 			  timeout ? -1 : active, fd,
-			  (int) requests[idx].last_active,
+			  (int) req->last_active,
 			  inet_ntoa(address.sin_addr),
 			  ntohs(address.sin_port));
 
-	    if (requests[idx].conn.sock) {
+	    if (req->conn.sock) {
 	      addrlen = sizeof(address);
-	      if (getpeername(requests[idx].conn.sock,
+	      if (getpeername(req->conn.sock,
 			      (struct sockaddr *)&address,
 			      &addrlen) >= 0) {
 		snprintf(line+strlen(line),
@@ -976,7 +1321,8 @@ int main(int argc, char **argv) {
         if (status > 0) {
 
           if (net_select_read_fd(&sctx, selfpipe)==1) {
-            chilli_handle_signal(0, 0);
+            if (chilli_handle_signal(0, 0) == SIGUSR2)
+              print_requests();
           }
 
           if (redir->fd[0])
@@ -989,24 +1335,26 @@ int main(int argc, char **argv) {
                 redir_accept2(redir, 1) < 0)
               syslog(LOG_ERR, "redir_accept() failed!");
 
-          for (idx=0; idx < max_requests; idx++) {
+          for (req = requests; req; req = next) {
+
+            next = req->next;
 
             /*
              *  Update remote connections with activity
              */
-            conn_select_update(&requests[idx].conn, &sctx);
+            conn_select_update(&req->conn, &sctx);
 
             /*
              *  Check client connections with activity
              */
-            if (requests[idx].inuse && requests[idx].socket_fd) {
-              int fd = requests[idx].socket_fd;
+            if (req->socket_fd) {
+              int fd = req->socket_fd;
 
 #ifdef HAVE_SSL
-              if (requests[idx].sslcon) {
-                if (openssl_check_accept(requests[idx].sslcon, 0) < 0) {
+              if (req->sslcon) {
+                if (openssl_check_accept(req->sslcon, 0) < 0) {
                   syslog(LOG_DEBUG, "ssl error %d", errno);
-                  redir_conn_finish(&requests[idx].conn, &requests[idx]);
+                  redir_conn_finish(&req->conn, req);
                   continue;
                 }
               }
@@ -1015,29 +1363,29 @@ int main(int argc, char **argv) {
               switch (net_select_write_fd(&sctx, fd)) {
                 case 1:
                   syslog(LOG_DEBUG, "client writeable");
-                  redir_cli_rewrite(&requests[idx], &requests[idx].conn);
+                  redir_cli_rewrite(req, &req->conn);
                   break;
               }
 
               switch (net_select_read_fd(&sctx, fd)) {
                 case -1:
                   syslog(LOG_DEBUG, "EXCEPTION");
-                  redir_conn_finish(&requests[idx].conn,
-                                    &requests[idx]);
+                  redir_conn_finish(&req->conn,
+                                    req);
                   break;
 
                 case 1:
                   {
-                    if (requests[idx].proxy) {
+                    if (req->proxy) {
                       char b[PKT_MAX_LEN];
                       int r;
 
 #ifdef HAVE_SSL
-                      if (requests[idx].sslcon) {
+                      if (req->sslcon) {
                         /*
                           syslog(LOG_DEBUG, "proxy_read_ssl");
                         */
-                        r = openssl_read(requests[idx].sslcon,
+                        r = openssl_read(req->sslcon,
                                          b, sizeof(b)-1, 0);
                       } else
 #endif
@@ -1050,50 +1398,54 @@ int main(int argc, char **argv) {
                       if (r <= 0) {
 
                         syslog(LOG_DEBUG, "recv %d %d %d", r,
-                               requests[idx].conn.read_buf->slen -
-                               requests[idx].conn.read_pos,
+                               req->conn.read_buf->slen -
+                               req->conn.read_pos,
                                errno);
 
                         if (!(r == -1 &&
                               (errno == EWOULDBLOCK || errno == EAGAIN))) {
-                          if (redir_cli_rewrite(&requests[idx],
-                                                &requests[idx].conn) == 0) {
+                          if (redir_cli_rewrite(req,
+                                                &req->conn) == 0) {
                             syslog(LOG_DEBUG, "done reading and writing");
-                            redir_conn_finish(&requests[idx].conn,
-                                              &requests[idx]);
+                            redir_conn_finish(&req->conn,
+                                              req);
                           }
                         }
 
                       } else if (r > 0) {
 
                         int w;
-                        requests[idx].last_active = mainclock_tick();
-                        w = net_write(requests[idx].conn.sock, b, r);
+                        req->last_active = mainclock_tick();
+                        w = net_write(req->conn.sock, b, r);
 
                         /*
                           syslog(LOG_DEBUG, "proxy_write: %d", w);
                         */
                         if (r != w) {
                           syslog(LOG_ERR, "%s: problem writing what we read from client", strerror(errno));
-                          redir_conn_finish(&requests[idx].conn,
-                                            &requests[idx]);
+                          redir_conn_finish(&req->conn,
+                                            req);
                         }
                       }
 
                     } else {
-#ifdef HAVE_SSL
                    go_again:
-#endif
+                      req->last_active = mainclock_tick();
+                      req->pipelined = 0;
                       switch (redir_main(redir, fd, fd,
-                                         &requests[idx].conn.peer,
-                                         &requests[idx].baddr,
-                                         requests[idx].uiidx,
-                                         &requests[idx])) {
+                                         &req->conn.peer,
+                                         &req->baddr,
+                                         req->uiidx,
+                                         req)) {
                         case 1:
                           /*syslog(LOG_DEBUG, "redir cont'ed");*/
+                          if (req->pipelined) {
+                            /* next request already read */
+                            goto go_again;
+                          }
 #ifdef HAVE_SSL
-                          if (requests[idx].sslcon &&
-                              openssl_pending(requests[idx].sslcon) > 0) {
+                          if (req->sslcon &&
+                              openssl_pending(req->sslcon) > 0) {
                             syslog(LOG_DEBUG, "ssl_pending, trying again");
                             goto go_again;
                           }
@@ -1103,8 +1455,8 @@ int main(int argc, char **argv) {
                           syslog(LOG_DEBUG, "redir error");
                         default:
                           syslog(LOG_DEBUG, "redir completed");
-                          redir_conn_finish(&requests[idx].conn,
-                                            &requests[idx]);
+                          redir_conn_finish(&req->conn,
+                                            req);
                           break;
                       }
                     }
@@ -323,6 +323,8 @@ int net_select_prepare(select_ctx *sctx) {
 	  sctx->pfds[i].events |= POLLIN;
 	if (sctx->desc[i].evts & SELECT_WRITE)
 	  sctx->pfds[i].events |= POLLOUT;
+      } else {
+	sctx->pfds[i].fd = -1;
       }
     }
   }
@@ -350,14 +352,26 @@ int net_select_prepare(select_ctx *sctx) {
   return 0;
 }
 
+/*
+ *  The slot is left empty for net_select_reg() to reuse, rather than
+ *  moving the entries after it, as this may be called from within
+ *  net_run_selected() and epoll events point at the slots.
+ */
 int net_select_dereg(select_ctx *sctx, int oldfd) {
   int i;
   for (i=0; i < sctx->count; i++) {
     if (sctx->desc[i].fd == oldfd) {
-      for (; i < sctx->count - 1; i++)
-	memcpy(&sctx->desc[i], &sctx->desc[i+1], sizeof(select_fd));
+#if defined(USING_POLL) && defined(HAVE_SYS_EPOLL_H)
+      struct epoll_event event;
+      memset(&event, 0, sizeof(event));
+      /* fails when the fd is closed already */
+      epoll_ctl(sctx->efd, EPOLL_CTL_DEL, oldfd, &event);
+#endif
       memset(&sctx->desc[i], 0, sizeof(select_fd));
-      sctx->count--;
+      while (sctx->count > 0 &&
+	     !sctx->desc[sctx->count - 1].fd &&
+	     !sctx->desc[sctx->count - 1].evts)
+	sctx->count--;
       return 0;
     }
   }
@@ -395,14 +409,18 @@ int net_select_rereg(select_ctx *sctx, int oldfd, int newfd) {
 
 int net_select_reg(select_ctx *sctx, int fd, char evts,
 		   select_callback cb, void *ctx, int idx) {
+  int i;
   if (!evts) return -3;
   if (fd <= 0) return -2;
-  if (sctx->count == MAX_SELECT) return -1;
-  sctx->desc[sctx->count].fd = fd;
-  sctx->desc[sctx->count].cb = cb;
-  sctx->desc[sctx->count].ctx = ctx;
-  sctx->desc[sctx->count].idx = idx;
-  sctx->desc[sctx->count].evts = evts;
+  for (i=0; i < sctx->count; i++)
+    if (!sctx->desc[i].fd && !sctx->desc[i].evts)
+      break;
+  if (i == MAX_SELECT) return -1;
+  sctx->desc[i].fd = fd;
+  sctx->desc[i].cb = cb;
+  sctx->desc[i].ctx = ctx;
+  sctx->desc[i].idx = idx;
+  sctx->desc[i].evts = evts;
 #ifdef USING_POLL
 #ifdef HAVE_SYS_EPOLL_H
   {
@@ -412,7 +430,7 @@ int net_select_reg(select_ctx *sctx, int fd, char evts,
     event.events = 0;
     if (evts & SELECT_READ) event.events |= EPOLLIN;
     if (evts & SELECT_WRITE) event.events |= EPOLLOUT;
-    event.data.ptr = &sctx->desc[sctx->count];
+    event.data.ptr = &sctx->desc[i];
     if (epoll_ctl(sctx->efd, EPOLL_CTL_ADD, fd, &event))
       syslog(LOG_ERR, "%s: Failed to watch fd", strerror(errno));
   }
@@ -420,7 +438,8 @@ int net_select_reg(select_ctx *sctx, int fd, char evts,
 #else
   if (fd > sctx->maxfd) sctx->maxfd = fd;
 #endif
-  sctx->count++;
+  if (i == sctx->count)
+    sctx->count++;
   if (_options.debug)
     syslog(LOG_DEBUG, "net select count: %d", sctx->count);
   return 0;
@@ -629,17 +648,22 @@ int net_run_selected(select_ctx *sctx, int status) {
 #if defined(USING_POLL) && defined(HAVE_SYS_EPOLL_H)
   for (i=0; i < status; i++) {
     select_fd *sfd = (select_fd *)sctx->events[i].data.ptr;
-    sfd->cb(sfd->ctx, sfd->idx);
+    if (sfd->fd)
+      sfd->cb(sfd->ctx, sfd->idx);
   }
 #else
   for (i=0; i < sctx->count; i++) {
     if (sctx->desc[i].fd) {
 #ifdef USING_POLL
       char has_read = !!(sctx->pfds[i].revents & POLLIN);
+      char has_write = (sctx->desc[i].evts & SELECT_WRITE) &&
+          (sctx->pfds[i].revents & (POLLOUT | POLLERR | POLLHUP));
 #else
       char has_read = fd_isset(sctx->desc[i].fd, &sctx->rfds);
+      char has_write = (sctx->desc[i].evts & SELECT_WRITE) &&
+          fd_isset(sctx->desc[i].fd, &sctx->wfds);
 #endif
-      if (has_read) {
+      if (has_read || has_write) {
 	sctx->desc[i].cb(sctx->desc[i].ctx, sctx->desc[i].idx);
       }
     }
@@ -343,6 +343,9 @@ int options_fromfd(int fd, bstring bt) {
 #ifdef ENABLE_UAMDOMAINFILE
   if (!option_s_l(bt, &o.uamdomainfile)) return 0;
 #endif
+#ifdef ENABLE_ACCTSPOOL
+  if (!option_s_l(bt, &o.acctspool)) return 0;
+#endif
 #ifdef ENABLE_MODULES
   if (!option_s_l(bt, &o.moddir)) return 0;
 #endif
@@ -351,6 +354,7 @@ int options_fromfd(int fd, bstring bt) {
   if (!option_s_l(bt, &o.adminpasswd)) return 0;
   if (!option_s_l(bt, &o.adminupdatefile)) return 0;
   if (!option_s_l(bt, &o.rtmonfile)) return 0;
+  if (!option_s_l(bt, &o.uamallowed_names)) return 0;
 
   if (!option_s_l(bt, &o.ssid)) return 0;
   if (!option_s_l(bt, &o.vlan)) return 0;
@@ -371,6 +375,11 @@ int options_fromfd(int fd, bstring bt) {
       return 0;
   }
 
+  for (i=0; i < MAX_UAM_PROBES; i++) {
+    if (!option_s_l(bt, &o.uamprobes[i]))
+      return 0;
+  }
+
 #ifdef EX_OPTIONS_LOAD
 #include EX_OPTIONS_LOAD
 #endif
@@ -543,6 +552,9 @@ int options_save(char *file, bstring bt) {
 #ifdef ENABLE_UAMDOMAINFILE
   if (!option_s_s(bt, &o.uamdomainfile)) return 0;
 #endif
+#ifdef ENABLE_ACCTSPOOL
+  if (!option_s_s(bt, &o.acctspool)) return 0;
+#endif
 #ifdef ENABLE_MODULES
   if (!option_s_s(bt, &o.moddir)) return 0;
 #endif
@@ -551,6 +563,7 @@ int options_save(char *file, bstring bt) {
   if (!option_s_s(bt, &o.adminpasswd)) return 0;
   if (!option_s_s(bt, &o.adminupdatefile)) return 0;
   if (!option_s_s(bt, &o.rtmonfile)) return 0;
+  if (!option_s_s(bt, &o.uamallowed_names)) return 0;
 
   if (!option_s_s(bt, &o.ssid)) return 0;
   if (!option_s_s(bt, &o.vlan)) return 0;
@@ -571,6 +584,11 @@ int options_save(char *file, bstring bt) {
       return 0;
   }
 
+  for (i = 0; i < MAX_UAM_PROBES; i++) {
+    if (!option_s_s(bt, &o.uamprobes[i]))
+      return 0;
+  }
+
 #ifdef EX_OPTIONS_SAVE
 #include EX_OPTIONS_SAVE
 #endif
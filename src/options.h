@@ -109,6 +109,16 @@ struct options_t {
   int radiustimeout;             /* Retry timeout in milli seconds */
   int radiusretry;               /* Total amount of retries */
   int radiusretrysec;            /* Amount of retries after we switch to secondary */
+  int radiusprobe;               /* Seconds between Status-Server probes */
+  int radsecconns;               /* TLS connections per RadSec server */
+
+  struct radius_pool_t {         /* Servers by role: authentication, accounting */
+    struct in_addr addr;
+    uint16_t port;                  /* 0: radiusauthport or radiusacctport */
+    uint8_t weight;                 /* 0: only when no other server is up */
+    char secret[RADIUS_SECRETSIZE]; /* Empty: radiussecret */
+  } radiuspool[2][RADIUS_MAXSERVERS];
+  int radiuspoolcnt[2];
 
 #ifdef ENABLE_RADPROXY
   /* Radius proxy parameters */
@@ -163,6 +173,9 @@ struct options_t {
   char* uamsecret;               /* Shared secret */
   char* uamurl;                  /* URL of authentication server */
   char* uamaaaurl;               /* URL to use for HTTP based AAA */
+  int uamaaaconns;               /* Concurrent HTTP AAA requests */
+  int uamaaaqueue;               /* RADIUS requests waiting for one */
+  int redirmaxconns;             /* Connections of chilli_redir */
   char* uamhomepage;             /* URL of redirection homepage */
   char* wisprlogin;              /* Specific WISPr login url */
   char* usestatusfile;           /* Specific status file to use */
@@ -225,6 +238,9 @@ struct options_t {
   uint8_t strictmacauth:1;          /* Be strict about DHCP macauth (don't reply DHCP until we get RADIUS) */
   uint8_t strictdhcp:1;             /* Be strict about DHCP allocating from dyn-pool only */
   uint8_t dhcpmacset:1;             /* Set the dhcpif interface with the dhcpmac */
+#ifdef ENABLE_MINIPORTAL
+  uint8_t wwwtemplates:1;           /* Render miniportal pages in chilli_redir */
+#endif
   uint8_t uamallowpost:1;           /* Set to true if the UAMPORT is allowed to access a POST */
   uint8_t redir:1;                  /* Launch redir sub-process instead of forking */
   uint8_t redirurl:1;               /* Send redirection URL in UAM query string instead of HTTP redirect */
@@ -306,6 +322,7 @@ struct options_t {
 
   pass_through pass_throughs[MAX_PASS_THROUGHS];
   uint32_t num_pass_throughs;
+  char *uamallowed_names;         /* uamallowed host names, resolved by chilli */
 
 #ifdef ENABLE_AUTHEDALLOWED
   pass_through authed_pass_throughs[MAX_PASS_THROUGHS];
@@ -326,18 +343,28 @@ struct options_t {
 
   char* uamdomains[MAX_UAM_DOMAINS];
   int uamdomain_ttl;
+  char* uamprobes[MAX_UAM_PROBES];
+#ifdef ENABLE_DNSCACHE
+  int dnscache;                   /* Size of the DNS answer cache */
+#endif
 
   /* MAC Authentication */
   uint8_t macok[MACOK_MAX][PKT_ETH_ALEN]; /* Allowed MACs */
   int macoklen;                   /* Number of MAC addresses */
   char* macsuffix;               /* Suffix to add to MAC address */
   char* macpasswd;               /* Password to use for MAC authentication */
+#ifdef ENABLE_AUTHCACHE
+  int authcache;                  /* Size of the Access-Accept cache */
+  int authcachettl;               /* Longest time an Access-Accept is reused */
+#endif
 
   uint64_t defsessiontimeout;
   uint64_t defbandwidthmaxdown;
   uint64_t defbandwidthmaxup;
   uint32_t defidletimeout;
   uint16_t definteriminterval;
+  uint8_t interimjitter;          /* Percent to spread first interim */
+  uint32_t interimrate;           /* Interim updates per second */
 
   uint32_t challengetimeout;
   uint32_t challengetimeout2;
@@ -390,6 +417,12 @@ struct options_t {
   char *uamdomainfile;
 #endif
 
+#ifdef ENABLE_ACCTSPOOL
+  char *acctspool;               /* Spool file for unacknowledged accounting */
+  int acctspoolsize;             /* Its size in kbytes */
+  int acctspoolrate;             /* Replayed requests per second */
+#endif
+
   /* Command-Socket */
   char *cmdsocket;
   uint16_t cmdsocketport;
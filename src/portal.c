@@ -0,0 +1,740 @@
+/* -*- mode: c; c-basic-offset: 2 -*- */
+/*
+ * Copyright (C) 2007-2012 David Bird (Coova Technologies) <support@coova.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include "chilli.h"
+
+#ifdef ENABLE_MINIPORTAL
+
+/*
+ *  Miniportal pages rendered inside chilli_redir (wwwtemplates). The
+ *  .chi scripts build their pages from the .tmpl files of wwwdir with
+ *  uamfile() of uam.sh, which expands a file as a shell here-document.
+ *  Here a file is compiled once into runs of text and references to
+ *  variables, $(href ...) and $(uamfile ...), and kept until it changes
+ *  on disk. The page layouts of config-local.sh and the scripts are
+ *  reproduced below; requests those scripts would act upon (logins,
+ *  form posts) are left to wwwbin.
+ */
+
+#define PORTAL_NAMELEN   32
+#define PORTAL_DEPTH      4      /* nesting of $(uamfile ...) */
+
+#define PORTAL_TEXT       0
+#define PORTAL_VAR        1      /* $NAME ${NAME} ${NAME:-default} */
+#define PORTAL_HREF       2      /* $(href url text) */
+#define PORTAL_FILE       3      /* $(uamfile name [1]) */
+
+struct portal_seg {
+  uint8_t type;
+  uint8_t flag;                  /* default is a variable; file in a div */
+  int off, len;                  /* text, variable, url or file name */
+  int off2, len2;                /* default value or link text */
+};
+
+struct portal_tmpl {
+  char name[PORTAL_NAMELEN];
+  dev_t dev;
+  ino_t ino;
+  off_t size;
+  time_t mtime;
+  time_t checked;
+  bstring buf;                   /* what the segments point into */
+  struct portal_seg *seg;
+  int nseg;
+  int aseg;
+  int busy;                      /* being rendered: kept as it is */
+};
+
+struct portal_ctx {
+  struct redir_t *redir;
+  struct redir_conn_t *conn;
+  struct redir_httpreq_t *httpreq;
+  bstring tmp;
+  int depth;
+};
+
+static struct portal_tmpl _tmpl[REDIR_TEMPLATES];
+static int _ntmpl = 0;
+static int _tmpl_next = 0;
+
+static struct {
+  uint64_t pages;
+  uint64_t scripts;              /* left to wwwbin */
+  uint64_t compiles;
+} portal_stats;
+
+static struct portal_seg *portal_seg_new(struct portal_tmpl *t, int type) {
+  struct portal_seg *s;
+
+  if (t->nseg == t->aseg) {
+    int n = t->aseg ? t->aseg * 2 : 16;
+    s = realloc(t->seg, n * sizeof(struct portal_seg));
+    if (!s) return 0;
+    t->seg = s;
+    t->aseg = n;
+  }
+
+  s = &t->seg[t->nseg++];
+  memset(s, 0, sizeof(*s));
+  s->type = type;
+  return s;
+}
+
+static void portal_text(struct portal_tmpl *t, const char *p, int len) {
+  struct portal_seg *s = t->nseg ? &t->seg[t->nseg - 1] : 0;
+
+  if (len <= 0) return;
+
+  if (!s || s->type != PORTAL_TEXT || s->off + s->len != t->buf->slen) {
+    if (!(s = portal_seg_new(t, PORTAL_TEXT))) return;
+    s->off = t->buf->slen;
+  }
+
+  bcatblk(t->buf, p, len);
+  s->len += len;
+}
+
+/* keeps a name or argument in the buffer, returns its offset */
+static int portal_keep(struct portal_tmpl *t, const char *p, int len) {
+  int off = t->buf->slen;
+  bcatblk(t->buf, p, len);
+  return off;
+}
+
+static int portal_name(const char *p, const char *end) {
+  const char *q = p;
+  if (q < end && (isalpha((unsigned char)*q) || *q == '_'))
+    for (q++; q < end && (isalnum((unsigned char)*q) || *q == '_'); q++);
+  return q - p;
+}
+
+/*
+ *  The words of a $(...) command, double quotes removed; returns the
+ *  number of words found.
+ */
+static int portal_words(const char *p, const char *end,
+			const char **w, int *wl, int max) {
+  int n = 0;
+
+  while (p < end && n < max) {
+    while (p < end && isspace((unsigned char)*p)) p++;
+    if (p == end) break;
+    if (*p == '"') {
+      w[n] = ++p;
+      while (p < end && *p != '"') p++;
+      wl[n] = p - w[n];
+      if (p < end) p++;
+    } else {
+      w[n] = p;
+      while (p < end && !isspace((unsigned char)*p)) p++;
+      wl[n] = p - w[n];
+    }
+    n++;
+  }
+
+  return n;
+}
+
+/* $... at p, returns how much of the input it took */
+static int portal_dollar(struct portal_tmpl *t, const char *p, const char *end) {
+  struct portal_seg *s;
+  const char *q;
+  int n;
+
+  if (p + 1 < end && p[1] == '(') {
+    const char *w[4];
+    int wl[4];
+    int inq = 0;
+
+    for (q = p + 2; q < end && (inq || *q != ')'); q++)
+      if (*q == '"') inq = !inq;
+    if (q == end) return 0;
+
+    n = portal_words(p + 2, q, w, wl, 4);
+
+    if (n == 3 && wl[0] == 4 && !memcmp(w[0], "href", 4)) {
+      if ((s = portal_seg_new(t, PORTAL_HREF))) {
+	s->len = wl[1];
+	s->off = portal_keep(t, w[1], wl[1]);
+	s->len2 = wl[2];
+	s->off2 = portal_keep(t, w[2], wl[2]);
+      }
+    } else if (n >= 2 && wl[0] == 7 && !memcmp(w[0], "uamfile", 7) &&
+	       wl[1] < PORTAL_NAMELEN) {
+      if ((s = portal_seg_new(t, PORTAL_FILE))) {
+	s->flag = n > 2 && wl[2] == 1 && *w[2] == '1';
+	s->len = wl[1];
+	s->off = portal_keep(t, w[1], wl[1]);
+      }
+    } else {
+      syslog(LOG_WARNING, "%s: command not rendered: %.*s",
+	     t->name, (int)(q + 1 - p), p);
+    }
+
+    return q + 1 - p;
+  }
+
+  if (p + 1 < end && p[1] == '{') {
+    n = portal_name(p + 2, end);
+    q = p + 2 + n;
+    if (!n || q == end) return 0;
+
+    if (*q == '}') {
+      if ((s = portal_seg_new(t, PORTAL_VAR))) {
+	s->len = n;
+	s->off = portal_keep(t, p + 2, n);
+      }
+      return q + 1 - p;
+    }
+
+    if (end - q > 2 && q[0] == ':' && q[1] == '-') {
+      const char *d = q + 2, *e = d;
+      while (e < end && *e != '}') e++;
+      if (e == end) return 0;
+
+      if (!(s = portal_seg_new(t, PORTAL_VAR)))
+	return e + 1 - p;
+      s->len = n;
+      s->off = portal_keep(t, p + 2, n);
+
+      /* ${A:-$B} or ${A:-text} */
+      if (*d == '$' && (n = portal_name(d + 1, e)) && d + 1 + n == e) {
+	s->flag = 1;
+	s->len2 = n;
+	s->off2 = portal_keep(t, d + 1, n);
+      } else {
+	s->len2 = e - d;
+	s->off2 = portal_keep(t, d, e - d);
+      }
+      return e + 1 - p;
+    }
+
+    return 0;
+  }
+
+  if ((n = portal_name(p + 1, end))) {
+    if ((s = portal_seg_new(t, PORTAL_VAR))) {
+      s->len = n;
+      s->off = portal_keep(t, p + 1, n);
+    }
+    return n + 1;
+  }
+
+  return 0;
+}
+
+static void portal_compile(struct portal_tmpl *t, bstring src) {
+  const char *p = (char *) src->data;
+  const char *end = p + src->slen;
+  const char *text = p;
+
+  t->nseg = 0;
+  btrunc(t->buf, 0);
+
+  /* $(cat file) drops the trailing newlines, the here-document adds one */
+  while (end > p && end[-1] == '\n') end--;
+
+  while (p < end) {
+    if (*p == '\\' && p + 1 < end &&
+	(p[1] == '$' || p[1] == '\\' || p[1] == '`' || p[1] == '\n')) {
+      portal_text(t, text, p - text);
+      if (p[1] != '\n')
+	portal_text(t, p + 1, 1);
+      text = p += 2;
+    } else if (*p == '$') {
+      int n;
+      portal_text(t, text, p - text);
+      if ((n = portal_dollar(t, p, end)) > 0) {
+	text = p += n;
+      } else {
+	text = p;
+	p++;
+      }
+    } else {
+      p++;
+    }
+  }
+
+  portal_text(t, text, p - text);
+  portal_text(t, "\n", 1);
+  portal_stats.compiles++;
+}
+
+/*
+ *  The compiled name.txt or name.tmpl of wwwdir, as uampath() in
+ *  uam.sh picks them, checked against the file at most once a second.
+ *  A template being rendered (nested $(uamfile ...) calls) is neither
+ *  recompiled nor evicted until its render is done.
+ */
+static struct portal_tmpl *portal_tmpl_get(const char *name) {
+  struct portal_tmpl *t = 0;
+  time_t now = mainclock_now();
+  char path[512];
+  struct stat st;
+  bstring src;
+  int i, fd;
+
+  for (i = 0; i < _ntmpl; i++) {
+    if (!strcmp(_tmpl[i].name, name)) {
+      t = &_tmpl[i];
+      if (t->checked == now || t->busy)
+	return t->nseg ? t : 0;
+      break;
+    }
+  }
+
+  snprintf(path, sizeof(path), "%s/%s.txt", _options.wwwdir, name);
+  if (stat(path, &st) || !st.st_size) {
+    snprintf(path, sizeof(path), "%s/%s.tmpl", _options.wwwdir, name);
+    if (stat(path, &st)) {
+      if (t) {
+	t->checked = now;
+	t->nseg = 0;
+      }
+      return 0;
+    }
+  }
+
+  if (t && t->nseg && t->dev == st.st_dev && t->ino == st.st_ino &&
+      t->size == st.st_size && t->mtime == st.st_mtime) {
+    t->checked = now;
+    return t;
+  }
+
+  if (!t) {
+    if (_ntmpl < REDIR_TEMPLATES) {
+      t = &_tmpl[_ntmpl++];
+    } else {
+      for (i = 0; i < REDIR_TEMPLATES; i++) {
+	t = &_tmpl[_tmpl_next];
+	_tmpl_next = (_tmpl_next + 1) % REDIR_TEMPLATES;
+	if (!t->busy) break;
+      }
+      if (t->busy) return 0;
+    }
+    if (!t->buf) t->buf = bfromcstr("");
+    strlcpy(t->name, name, sizeof(t->name));
+  }
+
+  t->nseg = 0;
+  t->checked = now;
+
+  if ((fd = open(path, O_RDONLY)) < 0) {
+    syslog(LOG_ERR, "%s: could not open %s", strerror(errno), path);
+    return 0;
+  }
+
+  src = bfromcstr("");
+  bblk_fromfd(src, fd, -1);
+  close(fd);
+
+  if (_options.debug)
+    syslog(LOG_DEBUG, "%s(%d): compiling %s", __FUNCTION__, __LINE__, path);
+
+  portal_compile(t, src);
+  bdestroy(src);
+
+  t->dev = st.st_dev;
+  t->ino = st.st_ino;
+  t->size = st.st_size;
+  t->mtime = st.st_mtime;
+  return t->nseg ? t : 0;
+}
+
+static void portal_html(bstring out, const char *s, int len) {
+  const char *run = s, *end = s + len;
+  char *x;
+
+  for (; s < end; s++) {
+    switch (*s) {
+      case '&':  x = "&amp;";  break;
+      case '"':  x = "&quot;"; break;
+      case '\'': x = "&#39;";  break;
+      case '<':  x = "&lt;";   break;
+      case '>':  x = "&gt;";   break;
+      default: continue;
+    }
+    bcatblk(out, run, s - run);
+    bcatcstr(out, x);
+    run = s + 1;
+  }
+  bcatblk(out, run, s - run);
+}
+
+/*
+ *  The variables the scripts see: FORM_ parameters of the query string,
+ *  the CGI environment redir_main() sets for wwwbin, a few settings of
+ *  config.sh, and otherwise the environment of chilli.
+ */
+static void portal_var(struct portal_ctx *c, const char *name, int len,
+		       bstring out) {
+  struct redir_conn_t *conn = c->conn;
+  char n[64], buf[64];
+  char *v = 0;
+
+  if (len >= (int) sizeof(n)) return;
+  memcpy(n, name, len);
+  n[len] = 0;
+
+  if (!strncmp(n, "FORM_", 5)) {
+    if (redir_getparam(c->redir, c->httpreq->qs, n + 5, c->tmp))
+      btrunc(c->tmp, 0);
+    if (!c->tmp->slen && !strcmp(n, "FORM_userurl"))
+      bassigncstr(c->tmp, "http://coova.github.io/");
+    portal_html(out, (char *) c->tmp->data, c->tmp->slen);
+    return;
+  }
+
+  if (!strcmp(n, "LOCATION_NAME")) {
+    v = _options.locationname ? _options.locationname : "My HotSpot";
+  } else if (!strcmp(n, "AUTHENTICATED")) {
+    v = conn->s_state.authenticated &&
+      (conn->s_params.flags & REQUIRE_UAM_SPLASH) == 0 ? "1" : "0";
+  } else if (!strcmp(n, "REMOTE_MAC")) {
+    snprintf(buf, sizeof(buf), "%.2X-%.2X-%.2X-%.2X-%.2X-%.2X",
+	     conn->hismac[0], conn->hismac[1], conn->hismac[2],
+	     conn->hismac[3], conn->hismac[4], conn->hismac[5]);
+    v = buf;
+  } else if (!strcmp(n, "CHI_SESSION_ID") || !strcmp(n, "COOVA_SESSIONID")) {
+    v = conn->s_state.sessionid;
+  } else if (!strcmp(n, "CHI_USERNAME")) {
+    v = conn->s_state.redir.username;
+  } else if (!strcmp(n, "CHI_USERURL")) {
+    v = conn->s_state.redir.userurl;
+  } else if (!strcmp(n, "CHI_CHALLENGE") || !strcmp(n, "COOVA_CHALLENGE")) {
+    redir_chartohex(conn->s_state.redir.uamchal, buf, REDIR_MD5LEN);
+    v = buf;
+  } else if (!strcmp(n, "HS_UAMLISTEN")) {
+    v = inet_ntoa(c->redir->addr);
+  } else if (!strcmp(n, "HS_UAMPORT")) {
+    snprintf(buf, sizeof(buf), "%d", c->redir->port);
+    v = buf;
+  } else {
+    v = getenv(n);
+  }
+
+  if (v) portal_html(out, v, strlen(v));
+}
+
+static int portal_file(struct portal_ctx *c, const char *name, int div,
+		       bstring out);
+
+static void portal_render(struct portal_ctx *c, struct portal_tmpl *t,
+			  bstring out) {
+  char *b = (char *) t->buf->data;
+  char name[PORTAL_NAMELEN];
+  int i;
+
+  for (i = 0; i < t->nseg; i++) {
+    struct portal_seg *s = &t->seg[i];
+    int n;
+
+    switch (s->type) {
+      case PORTAL_TEXT:
+	bcatblk(out, b + s->off, s->len);
+	break;
+
+      case PORTAL_VAR:
+	n = out->slen;
+	portal_var(c, b + s->off, s->len, out);
+	if (out->slen == n && s->len2) {
+	  if (s->flag)
+	    portal_var(c, b + s->off2, s->len2, out);
+	  else
+	    bcatblk(out, b + s->off2, s->len2);
+	}
+	break;
+
+      case PORTAL_HREF:
+	bcatcstr(out, "<a href=\"");
+	bcatblk(out, b + s->off, s->len);
+	bcatcstr(out, "\">");
+	bcatblk(out, b + s->off2, s->len2);
+	bcatcstr(out, "</a>");
+	break;
+
+      case PORTAL_FILE:
+	memcpy(name, b + s->off, s->len);
+	name[s->len] = 0;
+	/* $(...) drops the trailing newline */
+	if (!portal_file(c, name, s->flag, out) &&
+	    out->slen && out->data[out->slen - 1] == '\n')
+	  btrunc(out, out->slen - 1);
+	break;
+    }
+  }
+}
+
+/* uamfile() of uam.sh */
+static int portal_file(struct portal_ctx *c, const char *name, int div,
+		       bstring out) {
+  struct portal_tmpl *t;
+
+  if (c->depth == PORTAL_DEPTH)
+    return -1;
+
+  if (div) bformata(out, "<div id=\"%s\">\n", name);
+
+  if ((t = portal_tmpl_get(name))) {
+    c->depth++;
+    t->busy++;
+    portal_render(c, t, out);
+    t->busy--;
+    c->depth--;
+  }
+
+  if (div) bcatcstr(out, "</div>\n");
+  return 0;
+}
+
+static int portal_is(struct portal_ctx *c, char *param, char *value) {
+  if (redir_getparam(c->redir, c->httpreq->qs, param, c->tmp))
+    return !value ? 0 : !*value;
+  return value ? !strcmp((char *) c->tmp->data, value) : c->tmp->slen > 0;
+}
+
+static int portal_env(char *name, char *value) {
+  char *v = getenv(name);
+  return v && !strcmp(v, value);
+}
+
+/* header() and footer() of config-local.sh */
+static void portal_header(struct portal_ctx *c, bstring out, char *head) {
+  bcatcstr(out, "<html><head>\n");
+  portal_file(c, "title", 0, out);
+  bcatcstr(out,
+	   "<meta http-equiv=\"Cache-control\" content=\"no-cache\"/>\n"
+	   "<meta http-equiv=\"Pragma\" content=\"no-cache\"/>\n"
+	   "<style>\n");
+  portal_file(c, "css", 0, out);
+  bcatcstr(out, "</style>\n<script>\n");
+  portal_file(c, "js", 0, out);
+  bcatcstr(out, "</script>\n");
+  if (head) bcatcstr(out, head);
+  bcatcstr(out, "</head><body>\n");
+  portal_file(c, "header", 1, out);
+  bcatcstr(out, "<div id=\"body\">\n");
+}
+
+static void portal_footer(struct portal_ctx *c, bstring out) {
+  bcatcstr(out, "</div>\n");
+  portal_file(c, "footer", 1, out);
+  bcatcstr(out,
+	   "<table style=\"clear:both;margin:auto;padding-top:10px;\" height=\"30\">\n"
+	   "<tr><td valign=\"center\" align=\"center\" style=\"color:#666;font-size:60%;\">Powered by</td>\n"
+	   "<td valign=\"center\" align=\"center\"><a href=\"http://coova.org/\"><img border=0 src=\"coova.jpg\"></a>\n"
+	   "</td></tr></table></body></html>\n");
+}
+
+static void portal_form(struct portal_ctx *c, bstring out,
+			char *action, char *name) {
+  bformata(out, "<form name=\"form\" method=\"post\" action=\"%s\">"
+	   "<INPUT TYPE=\"hidden\" NAME=\"userurl\" VALUE=\"", action);
+  portal_var(c, "FORM_userurl", 12, out);
+  bcatcstr(out, "\">");
+  portal_file(c, name, 1, out);
+  if (out->slen && out->data[out->slen - 1] == '\n')
+    btrunc(out, out->slen - 1);
+  bcatcstr(out, "</form>\n");
+}
+
+/* the login_success page of login.chi and tos.chi */
+static void portal_success(struct portal_ctx *c, bstring out, char *url) {
+  bstring head = bfromcstr("<meta http-equiv=\"refresh\" content=\"5;url=");
+  int n = head->slen;
+
+  if (!strcmp(url, "FORM_redirurl"))
+    portal_var(c, url, strlen(url), head);
+  if (head->slen == n)
+    portal_var(c, "FORM_userurl", 12, head);
+  bcatcstr(head, "\"/>");
+
+  portal_header(c, out, (char *) head->data);
+  portal_file(c, "login_success", 1, out);
+  portal_footer(c, out);
+  bdestroy(head);
+}
+
+static int portal_login(struct portal_ctx *c, bstring out) {
+  char path[512];
+  struct stat st;
+
+  if (portal_is(c, "username", 0))
+    return -1; /* dologin */
+
+  snprintf(path, sizeof(path), "%s/splash.chi", _options.wwwdir);
+  if (!stat(path, &st))
+    return -1;
+
+  if (portal_is(c, "res", "success") || portal_is(c, "res", "already")) {
+    portal_success(c, out, "FORM_redirurl");
+    return 0;
+  }
+
+  portal_header(c, out, 0);
+  portal_file(c, "login", 1, out);
+
+  if (portal_is(c, "res", "failed")) {
+    bcatcstr(out, "<div class=\"err\">");
+    if (portal_is(c, "reply", 0))
+      portal_var(c, "FORM_reply", 10, out);
+    else
+      bcatcstr(out, "Username and/or password was not valid");
+    bcatcstr(out, "</div>\n");
+  }
+
+  if (!(c->conn->s_state.authenticated &&
+	(c->conn->s_params.flags & REQUIRE_UAM_SPLASH) == 0)) {
+    if (_options.openidauth) {
+      bcatcstr(out, "<div id=\"login-label\" style=\"display:none;\">"
+	       "<label><a href=\"javascript:toggleAuth('login')\">"
+	       "&lt;&lt; back</a></label></div>\n");
+      portal_form(c, out, "login.chi", "openid_form");
+    }
+    portal_form(c, out, "login.chi", "login_form");
+  }
+
+  portal_file(c, "login_footer", 1, out);
+  if (portal_env("HS_REG_MODE", "self"))
+    portal_file(c, "login_register", 1, out);
+  if (portal_env("HS_USE_MAP", "on"))
+    portal_file(c, "login_map", 1, out);
+
+  portal_footer(c, out);
+  return 0;
+}
+
+static void portal_links(struct portal_ctx *c, bstring out) {
+  bcatcstr(out, "\n<div style=\"float:right;padding-right:20px;\">\n"
+	   "<a href=\"login.chi\">Login</a>\n");
+  if (portal_env("HS_REG_MODE", "self"))
+    bcatcstr(out, "<a href=\"register.chi\">Signup</a>\n");
+  bcatcstr(out, "</div>\n\n");
+}
+
+static int portal_terms(struct portal_ctx *c, bstring out) {
+  portal_header(c, out, 0);
+  portal_links(c, out);
+  portal_file(c, "terms", 1, out);
+  portal_links(c, out);
+  portal_footer(c, out);
+  return 0;
+}
+
+static int portal_tos(struct portal_ctx *c, bstring out) {
+  if (portal_is(c, "res", "success") || portal_is(c, "res", "already")) {
+    portal_success(c, out, "FORM_userurl");
+    return 0;
+  }
+
+  if (!portal_env("HS_REG_MODE", "tos") ||
+      portal_is(c, "button", 0) ||
+      (portal_is(c, "username", 0) && portal_is(c, "challenge", 0) &&
+       portal_is(c, "password", 0)))
+    return -1; /* dologin, or nothing to show */
+
+  portal_header(c, out, 0);
+  portal_file(c, "terms", 1, out);
+  portal_form(c, out, "tos.chi", "terms_form");
+  portal_footer(c, out);
+  return 0;
+}
+
+static int portal_error(struct portal_ctx *c, bstring out) {
+  portal_header(c, out, 0);
+  portal_file(c, "error", 1, out);
+  portal_footer(c, out);
+  return 0;
+}
+
+static struct {
+  char *file;
+  int (*page)(struct portal_ctx *, bstring);
+} portal_pages[] = {
+  { "login.chi", portal_login },
+  { "terms.chi", portal_terms },
+  { "tos.chi",   portal_tos },
+  { "error.chi", portal_error },
+  { 0, 0 }
+};
+
+/*
+ *  Renders the page body of a GET of file in wwwdir into out; returns
+ *  -1 when the page is to be left to wwwbin.
+ */
+int portal_page(struct redir_t *redir, struct redir_conn_t *conn,
+		struct redir_httpreq_t *httpreq, char *file, bstring out) {
+  struct portal_ctx c;
+  int i, ret = -1;
+
+  if (!_options.wwwtemplates || !_options.wwwdir || httpreq->is_post)
+    return -1;
+
+  for (i = 0; portal_pages[i].file; i++)
+    if (!strcmp(portal_pages[i].file, file))
+      break;
+
+  if (!portal_pages[i].file)
+    return -1;
+
+  memset(&c, 0, sizeof(c));
+  c.redir = redir;
+  c.conn = conn;
+  c.httpreq = httpreq;
+  c.tmp = bfromcstr("");
+
+  btrunc(out, 0);
+  ret = portal_pages[i].page(&c, out);
+  bdestroy(c.tmp);
+
+  if (ret)
+    portal_stats.scripts++;
+  else
+    portal_stats.pages++;
+
+  if (_options.debug)
+    syslog(LOG_DEBUG, "%s(%d): %s %s", __FUNCTION__, __LINE__, file,
+	   ret ? "left to wwwbin" : "rendered");
+
+  return ret;
+}
+
+/* Drops the compiled templates, on reload of the configuration */
+void portal_flush(void) {
+  int i;
+
+  for (i = 0; i < _ntmpl; i++) {
+    bdestroy(_tmpl[i].buf);
+    free(_tmpl[i].seg);
+  }
+
+  memset(_tmpl, 0, sizeof(_tmpl));
+  _ntmpl = 0;
+  _tmpl_next = 0;
+}
+
+void portal_print(void) {
+  if (!_options.wwwtemplates) return;
+  syslog(LOG_INFO, "miniportal: pages rendered %llu, left to wwwbin %llu, "
+	 "templates compiled %llu (%d kept)",
+	 (unsigned long long) portal_stats.pages,
+	 (unsigned long long) portal_stats.scripts,
+	 (unsigned long long) portal_stats.compiles, _ntmpl);
+}
+#endif
@@ -27,10 +27,20 @@
 
 static int
 radius_authcheck(struct radius_t *this, struct radius_packet_t *pack,
-		 struct radius_packet_t *pack_req);
+		 struct radius_packet_t *pack_req,
+		 char *secret, size_t secretlen);
 
 static int
-radius_acctcheck(struct radius_t *this, struct radius_packet_t *pack);
+radius_acctcheck(struct radius_t *this, struct radius_packet_t *pack,
+		 char *secret, size_t secretlen);
+
+int
+radius_cmptv(struct timeval *tv1, struct timeval *tv2);
+
+static int
+radius_pkt_sendfd(struct radius_t *this, int fd,
+		  struct radius_packet_t *pack,
+		  struct sockaddr_in *peer);
 
 void radius_addnasip(struct radius_t *radius, struct radius_packet_t *pack)  {
   struct in_addr inaddr;
@@ -77,26 +87,35 @@ void radius_addcalledstation(struct radius_t *this,
 
 int radius_printqueue(int fd, struct radius_t *this) {
   char line[1024];
-  int mx = 256;
+  int mx = this->nsocks * RADIUS_QUEUESIZE;
   int n;
 
   if (this->qsize)
     mx = this->qsize;
 
-  snprintf(line, sizeof(line), "next %d, first %d, last %d\n",
-		this->qnext, this->first, this->last);
+  snprintf(line, sizeof(line), "next %d, first %d, pending %d\n",
+		this->qnext, this->hlen ? this->heap[0] : -1, this->hlen);
 
   safe_write(fd, line, strlen(line));
 
+  for (n=0; n < this->nsocks; n++) {
+    struct sockaddr_in addr;
+    socklen_t addrlen = sizeof(addr);
+    if (getsockname(this->socks[n].fd, (struct sockaddr *)&addr, &addrlen))
+      addr.sin_port = 0;
+    snprintf(line, sizeof(line), "socket %d port %d outstanding %d\n",
+	     n, ntohs(addr.sin_port), this->socks[n].count);
+    safe_write(fd, line, strlen(line));
+  }
+
   for(n=0; n < mx; n++) {
     if (this->queue[n].state) {
       snprintf(line, sizeof(line),
-		    "n=%3d id=%3d state=%3d next=%3d prev=%3d %8d %8d %d\n",
+		    "n=%3d id=%3d state=%3d heap=%3d %8d %8d %d\n",
 		    n,
 		    RADIUS_QUEUE_PKT(this->queue[n].p,id),
 		    this->queue[n].state,
-		    this->queue[n].next,
-		    this->queue[n].prev,
+		    this->queue[n].hpos,
 		    (int) this->queue[n].timeout.tv_sec,
 		    (int) this->queue[n].timeout.tv_usec,
 		    (int) this->queue[n].retrans);
@@ -170,7 +189,8 @@ int radius_hmac_md5(struct radius_t *this, struct radius_packet_t *pack,
  * Update a packet with an accounting request authenticator
  */
 int radius_acctreq_authenticator(struct radius_t *this,
-				 struct radius_packet_t *pack) {
+				 struct radius_packet_t *pack,
+				 char *secret, size_t secretlen) {
 
   /* From RFC 2866: Authenticator is the MD5 hash of:
      Code + Identifier + Length + 16 zero octets + request attributes +
@@ -183,7 +203,7 @@ int radius_acctreq_authenticator(struct radius_t *this,
   /* Get MD5 hash on secret + authenticator */
   MD5Init(&context);
   MD5Update(&context, (void*) pack, ntohs(pack->length));
-  MD5Update(&context, (uint8_t*) this->secret, this->secretlen);
+  MD5Update(&context, (uint8_t*) secret, secretlen);
   MD5Final(pack->authenticator, &context);
 
   return 0;
@@ -215,79 +235,374 @@ int radius_authresp_authenticator(struct radius_t *this,
   return 0;
 }
 
-static int radius_queue_next(struct radius_t *this) {
-  int attempt = 0;
-  int qnext;
+/*
+ *  Retransmit schedule: a binary min-heap of queue indexes ordered by
+ *  timeout, each entry remembering its heap position.
+ */
+static void radius_heap_swap(struct radius_t *this, int a, int b) {
+  int t = this->heap[a];
+  this->heap[a] = this->heap[b];
+  this->heap[b] = t;
+  this->queue[this->heap[a]].hpos = a;
+  this->queue[this->heap[b]].hpos = b;
+}
 
-try_again:
+static void radius_heap_fix(struct radius_t *this, int pos) {
+  int c;
 
-  qnext = this->qnext;
+  while (pos > 0 &&
+	 radius_cmptv(&this->queue[this->heap[pos]].timeout,
+		      &this->queue[this->heap[(pos - 1) / 2]].timeout) < 0) {
+    radius_heap_swap(this, pos, (pos - 1) / 2);
+    pos = (pos - 1) / 2;
+  }
 
-#if(_debug_ > 1)
-  syslog(LOG_DEBUG, "qnext=%d",qnext);
-#endif
+  while ((c = 2 * pos + 1) < this->hlen) {
+    if (c + 1 < this->hlen &&
+	radius_cmptv(&this->queue[this->heap[c + 1]].timeout,
+		     &this->queue[this->heap[c]].timeout) < 0)
+      c++;
+    if (radius_cmptv(&this->queue[this->heap[c]].timeout,
+		     &this->queue[this->heap[pos]].timeout) >= 0)
+      break;
+    radius_heap_swap(this, pos, c);
+    pos = c;
+  }
+}
+
+static void radius_heap_push(struct radius_t *this, int idx) {
+  this->queue[idx].hpos = this->hlen;
+  this->heap[this->hlen++] = idx;
+  radius_heap_fix(this, this->hlen - 1);
+}
+
+static void radius_heap_remove(struct radius_t *this, int idx) {
+  int pos = this->queue[idx].hpos;
+
+  if (pos < 0 || pos >= this->hlen)
+    return;
+
+  this->queue[idx].hpos = -1;
+  if (pos != --this->hlen) {
+    this->heap[pos] = this->heap[this->hlen];
+    this->queue[this->heap[pos]].hpos = pos;
+    radius_heap_fix(this, pos);
+  }
+}
+
+/*
+ *  Server pool. Each role has its own list of servers; a request goes
+ *  to the usable server with the lowest (srtt + 1ms) * (outstanding + 1)
+ *  / weight. RADIUS_SERVER_FAILS consecutive timeouts open a server's
+ *  circuit for a hold down that doubles while it stays unanswered. A
+ *  down server is then tried again by a Status-Server probe or, when
+ *  radiusprobe is 0, by a single real request.
+ */
+static int radius_server_usable(struct radius_server_t *s, time_t now) {
+  switch (s->state) {
+    case RADIUS_SERVER_UP:
+      return 1;
+    case RADIUS_SERVER_DOWN:
+      return !_options.radiusprobe && now >= s->retry;
+  }
+  return 0;
+}
+
+static struct radius_server_t *
+radius_server_pick(struct radius_t *this, int role,
+		   struct radius_server_t *not) {
+  struct radius_server_t *best = 0;
+  time_t now = mainclock_now();
+  uint64_t bcost = 0;
+  int bweight = 0;
+  int backup, i;
+
+  for (backup = 0; !best && backup < 2; backup++) {
+    for (i = 0; i < this->nserver[role]; i++) {
+      struct radius_server_t *s = &this->server[role][i];
+      int weight = backup ? 1 : s->weight;
+      uint64_t cost;
+
+      if (s == not || (s->weight != 0) == backup ||
+	  !radius_server_usable(s, now))
+	continue;
+
+      cost = (uint64_t)(s->srtt + 1000) * (s->outstanding + 1);
+      if (!best || cost * bweight < bcost * weight) {
+	best = s;
+	bcost = cost;
+	bweight = weight;
+      }
+    }
+  }
 
-  if (this->queue[qnext].state == 1) {
+  if (!best && not)
+    return radius_server_pick(this, role, 0);
 
-    syslog(LOG_DEBUG, "skipping over active idx %d radius-id=%d",
-           qnext, RADIUS_QUEUE_PKT(this->queue[qnext].p,id));
+  if (!best) {
+    /* Every server is down: use the one due back first */
+    for (i = 0; i < this->nserver[role]; i++) {
+      struct radius_server_t *s = &this->server[role][i];
+      if (!best || s->retry < best->retry)
+	best = s;
+    }
+    return best;
+  }
 
-    if (attempt++ < (this->qsize ? this->qsize : 256)) {
-      this->qnext++;
+  if (best->state == RADIUS_SERVER_DOWN)
+    best->state = RADIUS_SERVER_TRIAL;
 
-      if (this->qsize)
-	this->qnext %= this->qsize;
+  return best;
+}
 
-      goto try_again;
+static struct radius_server_t *
+radius_server_find(struct radius_t *this, struct sockaddr_in *addr,
+		   int portcheck) {
+  int role, i;
+
+  for (role = 0; role < 2; role++)
+    for (i = 0; i < this->nserver[role]; i++) {
+      struct radius_server_t *s = &this->server[role][i];
+      if (s->addr.s_addr == addr->sin_addr.s_addr &&
+	  (!portcheck || htons(s->port) == addr->sin_port))
+	return s;
     }
 
-    syslog(LOG_ERR, "radius queue is full! qnext=%d qsize=%d",
-           qnext, this->qsize);
+  return 0;
+}
 
-    return -1;
+static void radius_server_down(struct radius_t *this,
+			       struct radius_server_t *s) {
+  if (s->state == RADIUS_SERVER_UP) {
+    s->holddown = _options.radiusprobe ? _options.radiusprobe :
+        RADIUS_SERVER_HOLDDOWN;
+    s->trips++;
+    syslog(LOG_WARNING, "RADIUS server %s:%d is not responding",
+	   inet_ntoa(s->addr), s->port);
+  } else if ((s->holddown *= 2) > RADIUS_SERVER_MAXHOLDDOWN) {
+    s->holddown = RADIUS_SERVER_MAXHOLDDOWN;
   }
 
-  return qnext;
+  s->state = RADIUS_SERVER_DOWN;
+  s->retry = mainclock_now() + s->holddown;
 }
 
-static int radius_queue_idx(struct radius_t *this, int id) {
-  int idx = id;
-  int cnt, sz;
+/*
+ *  Once a server is down, only the failure of the request or probe let
+ *  through on trial extends its holddown; the other requests still out
+ *  to it do not.
+ */
+static void radius_server_timeout(struct radius_t *this,
+				  struct radius_server_t *s, int trial) {
+  s->timeouts++;
+  if (s->state == RADIUS_SERVER_UP ?
+      ++s->fails >= RADIUS_SERVER_FAILS :
+      trial && s->state == RADIUS_SERVER_TRIAL)
+    radius_server_down(this, s);
+}
 
-  if (id < 0 || id >= RADIUS_QUEUESIZE) {
-    return -1;
+static void radius_server_reply(struct radius_t *this,
+				struct radius_server_t *s,
+				struct radius_queue_t *q) {
+  static const uint32_t bucket_ms[RADIUS_RTT_BUCKETS - 1] =
+      { 10, 25, 50, 100, 250, 500, 1000, 2500 };
+
+  s->replies++;
+  s->fails = 0;
+  s->lastreply = mainclock_now();
+
+  /* Only unambiguous samples, from packets sent once to this server */
+  if (q->srv == s && q->retrans == 0) {
+    struct timeval now;
+    uint32_t rtt, delta;
+    int b;
+
+    gettimeofday(&now, NULL);
+    rtt = (now.tv_sec - q->sent.tv_sec) * 1000000 +
+        (now.tv_usec - q->sent.tv_usec);
+
+    if (!s->srtt) {
+      s->srtt = rtt;
+      s->rttvar = rtt / 2;
+    } else {
+      delta = rtt > s->srtt ? rtt - s->srtt : s->srtt - rtt;
+      s->rttvar = (3 * s->rttvar + delta) / 4;
+      s->srtt = (7 * s->srtt + rtt) / 8;
+      if (!s->srtt) s->srtt = 1;
+    }
+
+    for (b = 0; b < RADIUS_RTT_BUCKETS - 1; b++)
+      if (rtt < bucket_ms[b] * 1000)
+	break;
+    s->rtt[b]++;
   }
 
-  if (this->qsize) {
-    sz = cnt = this->qsize;
-  } else {
-    sz = cnt = RADIUS_QUEUESIZE;
+  if (s->state != RADIUS_SERVER_UP) {
+    syslog(LOG_NOTICE, "RADIUS server %s:%d is responding again",
+	   inet_ntoa(s->addr), s->port);
+    s->state = RADIUS_SERVER_UP;
+  }
+}
+
+/*
+ * radius_queue_sign()
+ * Make a queued request valid for the secret of the server it is
+ * about to be sent to: re-encode User-Password and recompute the
+ * Message-Authenticator and accounting request authenticator.
+ */
+static void radius_queue_sign(struct radius_t *this, int idx,
+			      struct radius_server_t *to) {
+  struct radius_queue_t *q = &this->queue[idx];
+  struct radius_packet_t *pack = RADIUS_QUEUE_PKTPTR(q->p);
+  struct radius_attr_t *attr = 0;
+  char *secret = q->signer ? q->signer->secret : this->secret;
+  size_t secretlen = q->signer ? q->signer->secretlen : this->secretlen;
+
+  if (secretlen == to->secretlen && !memcmp(secret, to->secret, secretlen)) {
+    q->signer = to;
+    return;
+  }
+
+  if (!radius_getattr(pack, &attr, RADIUS_ATTR_USER_PASSWORD, 0,0,0)) {
+    uint8_t pwd[RADIUS_PWSIZE];
+    uint8_t enc[RADIUS_PWSIZE];
+    size_t pwdlen, enclen;
+
+    if (!radius_pwdecode(this, pwd, sizeof(pwd), &pwdlen,
+			 attr->v.t, attr->l-2, pack->authenticator,
+			 secret, secretlen) &&
+	!radius_pwencode(this, enc, sizeof(enc), &enclen,
+			 pwd, pwdlen, pack->authenticator,
+			 to->secret, to->secretlen) &&
+	enclen == attr->l-2)
+      memcpy(attr->v.t, enc, enclen);
+  }
+
+  if (!radius_getattr(pack, &attr, RADIUS_ATTR_MESSAGE_AUTHENTICATOR,
+		      0,0,0)) {
+    memset(attr->v.t, 0, RADIUS_MD5LEN);
+    radius_hmac_md5(this, pack, to->secret, to->secretlen, attr->v.t);
   }
 
-  while (cnt-- > 0) {
-    idx %= sz;
-    if (RADIUS_QUEUE_HASPKT(this->queue[idx].p)) {
+  if (pack->code == RADIUS_CODE_ACCOUNTING_REQUEST)
+    radius_acctreq_authenticator(this, pack, to->secret, to->secretlen);
+
+  q->signer = to;
+}
+
+/*
+ * radius_queue_send()
+ * (Re)transmit a queued request to a server of the pool.
+ */
+static int radius_queue_send(struct radius_t *this, int idx,
+			     struct radius_server_t *srv) {
+  struct radius_queue_t *q = &this->queue[idx];
+  struct sockaddr_in addr;
+
+  if (q->srv != srv) {
+    if (q->srv) q->srv->outstanding--;
+    srv->outstanding++;
+    q->srv = srv;
+  }
+
+  radius_queue_sign(this, idx, srv);
+
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_addr = srv->addr;
+  addr.sin_port = htons(srv->port);
+
+  gettimeofday(&q->sent, NULL);
+  q->trial = srv->state == RADIUS_SERVER_TRIAL;
+  srv->sent++;
+
 #if(_debug_ > 1)
-      syslog(LOG_DEBUG, "idx %d pid %d id %d", idx,
-             RADIUS_QUEUE_PKT(this->queue[idx].p,id), id);
+  syslog(LOG_DEBUG, "RADIUS id=%d sent to %s:%d",
+         RADIUS_QUEUE_PKT(q->p,id),
+         inet_ntoa(addr.sin_addr),
+         ntohs(addr.sin_port));
 #endif
-      if (RADIUS_QUEUE_PKT(this->queue[idx].p,id) == id)
-	return idx;
-    }
-    idx++;
+
+  if (radius_pkt_sendfd(this, this->socks[idx / RADIUS_QUEUESIZE].fd,
+			RADIUS_QUEUE_PKTPTR(q->p), &addr) < 0) {
+    srv->senderr++;
+    return -1;
   }
 
+  return 0;
+}
+
+/*
+ *  Free queue entries are kept in a FIFO per source socket, linked
+ *  through next, so ids are reused as late as possible.
+ */
+static void radius_queue_free(struct radius_t *this, int idx) {
+  struct radius_sock_t *s = &this->socks[idx / RADIUS_QUEUESIZE];
+
+  this->queue[idx].next = -1;
+  if (s->freetail >= 0)
+    this->queue[s->freetail].next = idx;
+  else
+    s->free = idx;
+  s->freetail = idx;
+}
+
+/*
+ * radius_queue_next()
+ * Pick a free entry on the least loaded source socket. The pick is
+ * remembered in qnext so radius_default_pack() and radius_queue_in()
+ * agree on it; it stays at the head of its free list until used.
+ */
+static int radius_queue_next(struct radius_t *this) {
+  int s = 0;
+  int i;
+
+  if (this->qnext >= 0 && this->queue[this->qnext].state == 0)
+    return this->qnext;
+
+  for (i = 1; i < this->nsocks; i++)
+    if (this->socks[i].count < this->socks[s].count)
+      s = i;
+
+  if (this->socks[s].free < 0) {
+    syslog(LOG_ERR, "radius queue is full! qsize=%d sockets=%d",
+	   this->qsize, this->nsocks);
+    return -1;
+  }
+
+  return (this->qnext = this->socks[s].free);
+}
+
+static int radius_queue_idx(struct radius_t *this, int sock, int id) {
+  int idx;
+
+  if (id < 0 || id >= RADIUS_QUEUESIZE ||
+      sock < 0 || sock >= this->nsocks) {
+    return -1;
+  }
+
+  if (this->qsize)
+    idx = this->idmap[id];
+  else
+    idx = sock * RADIUS_QUEUESIZE + id;
+
+  if (idx >= 0 && this->queue[idx].state == 1 &&
+      RADIUS_QUEUE_HASPKT(this->queue[idx].p) &&
+      RADIUS_QUEUE_PKT(this->queue[idx].p,id) == id)
+    return idx;
+
   return -1;
 }
 
 /*
  * radius_queue_in()
- * Place data in queue for later retransmission.
+ * Place data in queue for later retransmission. Returns the queue index.
  */
 int radius_queue_in(struct radius_t *this,
 		    struct radius_packet_t *pack,
 		    void *cbp) {
   struct radius_attr_t *ma = NULL; /* Message authenticator */
+  struct radius_sock_t *s;
   struct timeval *tv;
 
   int qnext = radius_queue_next(this);
@@ -316,13 +631,23 @@ int radius_queue_in(struct radius_t *this,
 
   /* If accounting request: Calculate authenticator */
   if (pack->code == RADIUS_CODE_ACCOUNTING_REQUEST) {
-    radius_acctreq_authenticator(this, pack);
+    radius_acctreq_authenticator(this, pack, this->secret, this->secretlen);
   }
 
   RADIUS_QUEUE_PKTALLOC(this->queue[qnext].p);
   if (!RADIUS_QUEUE_HASPKT(this->queue[qnext].p)) return -1;
   memcpy(RADIUS_QUEUE_PKTPTR(this->queue[qnext].p), pack, RADIUS_PACKSIZE);
 
+  /* Take it off the head of its free list */
+  s = &this->socks[qnext / RADIUS_QUEUESIZE];
+  if ((s->free = this->queue[qnext].next) < 0)
+    s->freetail = -1;
+  s->count++;
+  this->qnext = -1;
+
+  if (this->qsize)
+    this->idmap[pack->id] = qnext;
+
   this->queue[qnext].state = 1;
   this->queue[qnext].cbp = cbp;
   this->queue[qnext].retrans = 0;
@@ -332,34 +657,10 @@ int radius_queue_in(struct radius_t *this,
 
   tv->tv_sec += _options.radiustimeout;
 
-  this->queue[qnext].lastsent = this->lastreply;
+  this->queue[qnext].srv = 0;
+  this->queue[qnext].signer = 0;
 
-  /* Insert in linked list for handling timeouts */
-  this->queue[qnext].next = -1;         /* Last in queue */
-  this->queue[qnext].prev = this->last; /* Link to previous */
-
-  if (this->last != -1) {
-    /* Link previous to us */
-    this->queue[this->last].next = qnext;
-  }
-
-  /* End of queue */
-  this->last = qnext;
-
-  if (this->first == -1) {
-    /* First and last */
-    this->first = qnext;
-  }
-
-  this->qnext++;
-
-  if (this->qsize) {
-    /*
-     *  Note that if this value isn't set, then we are using the full 255.
-     *  We don't need to mod 255 since qnext is uint8_t and will simply rollover.
-     */
-    this->qnext %= this->qsize;
-  }
+  radius_heap_push(this, qnext);
 
 #if(_debug_ > 1)
   if (_options.debug) {
@@ -370,7 +671,7 @@ int radius_queue_in(struct radius_t *this,
   }
 #endif
 
-  return 0;
+  return qnext;
 }
 
 /*
@@ -378,7 +679,8 @@ int radius_queue_in(struct radius_t *this,
  * Remove data from queue.
  */
 static int
-radius_queue_out(struct radius_t *this, int idx,
+radius_queue_out(struct radius_t *this, int idx, int sock,
+		 struct radius_server_t *from,
 		 struct radius_packet_t *pack_in,
 		 struct radius_packet_t *pack_out,
 		 void **cbp) {
@@ -386,7 +688,7 @@ radius_queue_out(struct radius_t *this, int idx,
 
   if (idx < 0 && pack_in) {
     id = pack_in->id;
-    idx = radius_queue_idx(this, id);
+    idx = radius_queue_idx(this, sock, id);
   }
 
   if (idx < 0) {
@@ -410,13 +712,19 @@ radius_queue_out(struct radius_t *this, int idx,
   if (RADIUS_QUEUE_HASPKT(this->queue[idx].p)) {
     if (pack_in &&
 	radius_authcheck(this, pack_in,
-			 RADIUS_QUEUE_PKTPTR(this->queue[idx].p))) {
+			 RADIUS_QUEUE_PKTPTR(this->queue[idx].p),
+			 from ? from->secret : this->secret,
+			 from ? from->secretlen : this->secretlen)) {
       syslog(LOG_WARNING, "Authenticator does not match! req-id=%d res-id=%d",
              RADIUS_QUEUE_PKT(this->queue[idx].p,id),
              pack_in->id);
+      if (from) from->badauth++;
       return -1;
     }
 
+    if (pack_in && from)
+      radius_server_reply(this, from, &this->queue[idx]);
+
     memcpy(pack_out,
 	   RADIUS_QUEUE_PKTPTR(this->queue[idx].p), RADIUS_PACKSIZE);
 
@@ -427,18 +735,18 @@ radius_queue_out(struct radius_t *this, int idx,
 
   syslog(LOG_DEBUG, "RADIUS queue-out id=%d idx=%d", pack_out->id, idx);
 
-  this->queue[idx].state = 0;
+  if (this->qsize && this->idmap[pack_out->id] == idx)
+    this->idmap[pack_out->id] = -1;
 
-  /* Remove from linked list */
-  if (this->queue[idx].next == -1) /* Are we the last in queue? */
-    this->last = this->queue[idx].prev;
-  else
-    this->queue[this->queue[idx].next].prev = this->queue[idx].prev;
+  if (this->queue[idx].srv)
+    this->queue[idx].srv->outstanding--;
+  this->queue[idx].srv = 0;
 
-  if (this->queue[idx].prev == -1) /* Are we the first in queue? */
-    this->first = this->queue[idx].next;
-  else
-    this->queue[this->queue[idx].prev].next = this->queue[idx].next;
+  this->queue[idx].state = 0;
+  this->socks[idx / RADIUS_QUEUESIZE].count--;
+
+  radius_heap_remove(this, idx);
+  radius_queue_free(this, idx);
 
 #if(_debug_ > 1)
   if (_options.debug) {
@@ -479,30 +787,7 @@ static int radius_queue_reschedule(struct radius_t *this, int idx) {
 
   tv->tv_sec += _options.radiustimeout;
 
-  /* Remove from linked list */
-  if (this->queue[idx].next == -1) /* Are we the last in queue? */
-    this->last = this->queue[idx].prev;
-  else
-    this->queue[this->queue[idx].next].prev = this->queue[idx].prev;
-
-  if (this->queue[idx].prev == -1) /* Are we the first in queue? */
-    this->first = this->queue[idx].next;
-  else
-    this->queue[this->queue[idx].prev].next = this->queue[idx].next;
-
-  /* Insert in linked list for handling timeouts */
-  this->queue[idx].next = -1;         /* Last in queue */
-  this->queue[idx].prev = this->last; /* Link to previous (could be -1) */
-
-  if (this->last != -1) {
-    this->queue[this->last].next = idx; /* If not empty: link previous to us */
-  }
-
-  this->last = idx; /* End of queue */
-
-  if (this->first == -1) {
-    this->first = idx;  /* First and last */
-  }
+  radius_heap_fix(this, this->queue[idx].hpos);
 
 #if(deeplog)
   if (_options.debug) {
@@ -513,7 +798,6 @@ static int radius_queue_reschedule(struct radius_t *this, int idx) {
   return 0;
 }
 
-
 /*
  * radius_cmptv()
  * Returns an integer less than, equal to or greater than zero if tv1
@@ -599,12 +883,12 @@ radius_timeleft(struct radius_t *this, struct timeval *timeout)
 {
   struct timeval now, later, diff;
 
-  if (this->first == -1)
+  if (!this->hlen)
     return 0;
 
   gettimeofday(&now, NULL);
-  later.tv_sec = this->queue[this->first].timeout.tv_sec;
-  later.tv_usec = this->queue[this->first].timeout.tv_usec;
+  later.tv_sec = this->queue[this->heap[0]].timeout.tv_sec;
+  later.tv_usec = this->queue[this->heap[0]].timeout.tv_usec;
 
   /* First take the difference with |usec| < 1000000 */
   diff.tv_sec  = (later.tv_usec  - now.tv_usec) / 1000000 +
@@ -646,106 +930,252 @@ int radius_timeout(struct radius_t *this) {
   /* Retransmit any outstanding packets */
   /* Remove from queue if maxretrans exceeded */
   struct timeval now;
-  struct sockaddr_in addr;
   struct radius_packet_t pack_req;
   void *cbp;
+  int ret = 0;
+  int idx;
 
   gettimeofday(&now, NULL);
 
 #if(_debug_ > 1)
   if (_options.debug) {
-    syslog(LOG_DEBUG, "radius_timeout(%d) %8d %8d", this->first,
+    syslog(LOG_DEBUG, "radius_timeout(%d) %8d %8d",
+	   this->hlen ? this->heap[0] : -1,
            (int)now.tv_sec, (int)now.tv_usec);
     radius_printqueue(2, this);
   }
 #endif
 
-  if (this->first != -1 &&
-      radius_cmptv(&now, &this->queue[this->first].timeout) >= 0) {
-
-    if (this->queue[this->first].retrans < _options.radiusretry) {
+  while (this->hlen &&
+	 radius_cmptv(&now, &this->queue[(idx = this->heap[0])].timeout) >= 0) {
+    struct radius_server_t *srv = this->queue[idx].srv;
+    int probe = RADIUS_QUEUE_HASPKT(this->queue[idx].p) &&
+        RADIUS_QUEUE_PKT(this->queue[idx].p,code) == RADIUS_CODE_STATUS_SERVER;
 
-      memset(&addr, 0, sizeof(addr));
-      addr.sin_family = AF_INET;
+    if (srv)
+      radius_server_timeout(this, srv, this->queue[idx].trial);
 
-      if (this->queue[this->first].retrans == (_options.radiusretrysec - 1)) {
-	/* Use the other server for next retransmission */
-	if (this->queue[this->first].lastsent) {
-	  addr.sin_addr = this->hisaddr0;
-	  this->queue[this->first].lastsent = 0;
-	}
-	else {
-	  addr.sin_addr = this->hisaddr1;
-	  this->queue[this->first].lastsent = 1;
-	}
-      }
-      else {
-	/* Use the same server for next retransmission */
-	if (this->queue[this->first].lastsent) {
-	  addr.sin_addr = this->hisaddr1;
-	}
-	else {
-	  addr.sin_addr = this->hisaddr0;
-	}
-      }
-
-      if (RADIUS_QUEUE_HASPKT(this->queue[this->first].p)) {
-
-        /* Use the correct port for accounting and authentication */
-        if (RADIUS_QUEUE_PKT(this->queue[this->first].p,code)
-            == RADIUS_CODE_ACCOUNTING_REQUEST) {
-          addr.sin_port = htons(this->acctport);
-        } else {
-          addr.sin_port = htons(this->authport);
-        }
-
-        if (radius_pkt_send(this, RADIUS_QUEUE_PKTPTR(this->queue[this->first].p), &addr) < 0) {
-          radius_queue_reschedule(this, this->first);
-          return -1;    
-        }
+    if (probe) {
+      /* Status-Server is not retransmitted, nor seen by callbacks */
+      radius_queue_out(this, idx, 0, 0, 0, &pack_req, &cbp);
+      continue;
+    }
 
+    if (this->queue[idx].retrans < _options.radiusretry) {
+
+      if (RADIUS_QUEUE_HASPKT(this->queue[idx].p)) {
+	/* Fail over when due, or at once when the server went down */
+	if (!srv)
+	  /* its server left the pool on a reload */
+	  srv = radius_server_pick(this,
+				   RADIUS_QUEUE_PKT(this->queue[idx].p,code) ==
+				   RADIUS_CODE_ACCOUNTING_REQUEST ?
+				   RADIUS_ROLE_ACCT : RADIUS_ROLE_AUTH, 0);
+	else if (this->queue[idx].retrans == (_options.radiusretrysec - 1) ||
+		 srv->state != RADIUS_SERVER_UP)
+	  srv = radius_server_pick(this, srv->role, srv);
+
+        if (srv && radius_queue_send(this, idx, srv) < 0)
+          ret = -1;
       }
 
-      if (radius_queue_reschedule(this, this->first)) {
-	syslog(LOG_WARNING, "Matching request was not found in queue: %d!", this->first);
+      if (radius_queue_reschedule(this, idx)) {
+	syslog(LOG_WARNING, "Matching request was not found in queue: %d!", idx);
 	return -1;
       }
     }
     else { /* Finished retrans */
-      if (radius_queue_out(this, this->first,
-			   0, &pack_req, &cbp)) {
-	syslog(LOG_WARNING, "RADIUS idx=%d was not found in queue!",
-               this->first);
+      if (radius_queue_out(this, idx, 0,
+			   0, 0, &pack_req, &cbp)) {
+	syslog(LOG_WARNING, "RADIUS idx=%d was not found in queue!", idx);
 	return -1;
       }
 
       if ((pack_req.code == RADIUS_CODE_ACCOUNTING_REQUEST) &&
 	  (this->cb_acct_conf))
-        return this->cb_acct_conf(this, NULL, &pack_req, cbp);
+        ret = this->cb_acct_conf(this, NULL, &pack_req, cbp);
 
-      if ((pack_req.code == RADIUS_CODE_ACCESS_REQUEST) &&
-	  (this->cb_auth_conf))
-	return this->cb_auth_conf(this, NULL, &pack_req, cbp);
+      else if ((pack_req.code == RADIUS_CODE_ACCESS_REQUEST) &&
+	       (this->cb_auth_conf))
+	ret = this->cb_auth_conf(this, NULL, &pack_req, cbp);
     }
   }
 
 #if(_debug_ > 1)
   if (_options.debug) {
     syslog(LOG_DEBUG, "radius_timeout");
-    if (this->first > 0) {
-      syslog(LOG_DEBUG, "first %d, timeout %8d %8d", this->first,
-	     (int) this->queue[this->first].timeout.tv_sec,
-	     (int) this->queue[this->first].timeout.tv_usec);
+    if (this->hlen) {
+      syslog(LOG_DEBUG, "first %d, timeout %8d %8d", this->heap[0],
+	     (int) this->queue[this->heap[0]].timeout.tv_sec,
+	     (int) this->queue[this->heap[0]].timeout.tv_usec);
     }
     radius_printqueue(2, this);
   }
 #endif
 
-  return 0;
+  return ret;
 }
 
 
 
+/*
+ *  Attribute index of one received packet, built in a single pass so
+ *  that the many lookups made while handling a reply walk only the
+ *  attributes of the requested type (or vendor/type for VSAs).
+ */
+#define RADIUS_ATTR_INDEX_MAX (RADIUS_PACKSIZE / 2)
+#define RADIUS_ATTR_INDEX_VSA 64
+
+static struct {
+  struct radius_packet_t *pack;  /* Indexed packet, 0 if none */
+  uint16_t length;               /* Its length when indexed */
+  int16_t type[256];             /* First attribute of each type */
+  struct {
+    uint32_t vendor_id;
+    uint8_t vendor_type;
+    int16_t first;
+    int16_t last;
+  } vsa[RADIUS_ATTR_INDEX_VSA];  /* Open addressed by vendor/type */
+  uint8_t vsafull;               /* Fall back to filtering the VSA chain */
+  uint16_t off[RADIUS_ATTR_INDEX_MAX];
+  int16_t next[RADIUS_ATTR_INDEX_MAX];  /* Next of the same type */
+  int16_t vnext[RADIUS_ATTR_INDEX_MAX]; /* Next of the same vendor/type */
+} attr_index;
+
+static int radius_attr_vsa_slot(uint32_t vendor_id, uint8_t vendor_type,
+				int add) {
+  int h = (vendor_id * 31 + vendor_type) % RADIUS_ATTR_INDEX_VSA;
+  int n;
+
+  for (n = 0; n < RADIUS_ATTR_INDEX_VSA; n++) {
+    if (attr_index.vsa[h].first < 0) {
+      if (!add) return -1;
+      attr_index.vsa[h].vendor_id = vendor_id;
+      attr_index.vsa[h].vendor_type = vendor_type;
+      return h;
+    }
+    if (attr_index.vsa[h].vendor_id == vendor_id &&
+	attr_index.vsa[h].vendor_type == vendor_type)
+      return h;
+    h = (h + 1) % RADIUS_ATTR_INDEX_VSA;
+  }
+
+  return -1;
+}
+
+/*
+ * radius_attr_index()
+ * Index the attributes of pack for radius_getattr(), until
+ * radius_attr_unindex() or the packet is changed.
+ */
+void radius_attr_index(struct radius_packet_t *pack) {
+  int16_t last[256];
+  size_t len = ntohs(pack->length) - RADIUS_HDRSIZE;
+  size_t offset = 0;
+  int n = 0;
+  int i;
+
+  attr_index.pack = 0;
+
+  if (ntohs(pack->length) < RADIUS_HDRSIZE ||
+      ntohs(pack->length) > RADIUS_PACKSIZE)
+    return;
+
+  memset(attr_index.type, 0xff, sizeof(attr_index.type));
+  memset(last, 0xff, sizeof(last));
+  for (i = 0; i < RADIUS_ATTR_INDEX_VSA; i++)
+    attr_index.vsa[i].first = -1;
+  attr_index.vsafull = 0;
+
+  while (offset + 2 <= len && n < RADIUS_ATTR_INDEX_MAX) {
+    struct radius_attr_t *t =
+        (struct radius_attr_t *) (&pack->payload[offset]);
+
+    if (t->t == 0 || t->l < 2 || offset + t->l > len)
+      break;
+
+    attr_index.off[n] = offset;
+    attr_index.next[n] = -1;
+    attr_index.vnext[n] = -1;
+
+    if (last[t->t] < 0)
+      attr_index.type[t->t] = n;
+    else
+      attr_index.next[last[t->t]] = n;
+    last[t->t] = n;
+
+    if (t->t == RADIUS_ATTR_VENDOR_SPECIFIC && t->l >= 8) {
+      int s = radius_attr_vsa_slot(ntohl(t->v.vv.i), t->v.vv.t, 1);
+      if (s < 0) {
+	attr_index.vsafull = 1;
+      } else {
+	if (attr_index.vsa[s].first < 0)
+	  attr_index.vsa[s].first = n;
+	else
+	  attr_index.vnext[attr_index.vsa[s].last] = n;
+	attr_index.vsa[s].last = n;
+      }
+    }
+
+    offset += t->l;
+    n++;
+  }
+
+  attr_index.pack = pack;
+  attr_index.length = ntohs(pack->length);
+}
+
+void radius_attr_unindex(void) {
+  attr_index.pack = 0;
+}
+
+static int
+radius_getindexed(struct radius_packet_t *pack, struct radius_attr_t **attr,
+		  uint8_t type, uint32_t vendor_id, uint8_t vendor_type,
+		  int instance, size_t *roffset) {
+  struct radius_attr_t *t;
+  int vsa = (type == RADIUS_ATTR_VENDOR_SPECIFIC && vendor_id);
+  int filter = 0;
+  int count = 0;
+  int i;
+
+  if (vsa) {
+    int s = radius_attr_vsa_slot(vendor_id, vendor_type, 0);
+    if (s >= 0) {
+      i = attr_index.vsa[s].first;
+    } else if (attr_index.vsafull) {
+      i = attr_index.type[type];
+      filter = 1;
+    } else {
+      return -1;
+    }
+  } else {
+    i = attr_index.type[type];
+  }
+
+  for (; i >= 0; i = (vsa && !filter) ? attr_index.vnext[i] : attr_index.next[i]) {
+    if (attr_index.off[i] < *roffset)
+      continue;
+
+    t = (struct radius_attr_t *) (&pack->payload[attr_index.off[i]]);
+
+    if (filter && (t->l < 8 || ntohl(t->v.vv.i) != vendor_id ||
+		   t->v.vv.t != vendor_type))
+      continue;
+
+    if (count++ == instance) {
+      if (vsa)
+	*attr = (struct radius_attr_t *) &t->v.vv.t;
+      else
+	*attr = t;
+      *roffset = attr_index.off[i] + t->l;
+      return 0;
+    }
+  }
+
+  return -1;
+}
+
 /*
  * radius_addattr()
  * Add an attribute to a packet. The packet length is modified
@@ -762,6 +1192,9 @@ radius_addattr(struct radius_t *this, struct radius_packet_t *pack,
   uint16_t vlen;
   size_t pwlen;
 
+  if (pack == attr_index.pack)
+    radius_attr_unindex();
+
   a = (struct radius_attr_t *)((uint8_t*)pack + length);
 
   if (type == RADIUS_ATTR_USER_PASSWORD) {
@@ -886,6 +1319,10 @@ radius_getnextattr(struct radius_packet_t *pack, struct radius_attr_t **attr,
   size_t offset = *roffset;
   int count = 0;
 
+  if (pack == attr_index.pack && ntohs(pack->length) == attr_index.length)
+    return radius_getindexed(pack, attr, type, vendor_id, vendor_type,
+			     instance, roffset);
+
   /*
     if (0) {
     printf("radius_getattr payload(len=%d,off=%d) %.2x %.2x %.2x %.2x\n",
@@ -1292,9 +1729,12 @@ int radius_new(struct radius_t **this,
 
   /* Initialise queue */
   new_radius->queue = 0;
-  new_radius->qnext = 0;
-  new_radius->first = -1;
-  new_radius->last = -1;
+  new_radius->qnext = -1;
+  new_radius->heap = 0;
+  new_radius->hlen = 0;
+  new_radius->idmap = 0;
+  new_radius->socks = 0;
+  new_radius->nsocks = 0;
 
   /* Initialise radius socket */
   if ((new_radius->fd = socket(AF_INET, SOCK_DGRAM, 0)) < 0 ) {
@@ -1320,6 +1760,9 @@ int radius_new(struct radius_t **this,
     return -1;
   }
 
+  ndelay_on(new_radius->fd);
+  coe(new_radius->fd);
+
   if ((new_radius->urandom_fp = fopen("/dev/urandom", "r")) == 0) {
     syslog(LOG_ERR, "%s: fopen(/dev/urandom, r) failed", strerror(errno));
     close(new_radius->fd);
@@ -1361,9 +1804,27 @@ int radius_new(struct radius_t **this,
   return 0;
 }
 
+/*
+ * radius_init_q()
+ * Allocate the request queue. A size above RADIUS_QUEUESIZE opens
+ * additional source sockets on ephemeral ports of the listen address,
+ * each with its own id space, up to RADIUS_MAXSOCKETS.
+ */
 int radius_init_q(struct radius_t *this, int size) {
-  if (size <= 0 || size > RADIUS_QUEUESIZE) {
-    size = RADIUS_QUEUESIZE;
+  struct sockaddr_in addr;
+  int n = 1;
+  int i;
+
+  if (size <= 0 || size >= RADIUS_QUEUESIZE) {
+    n = (size + RADIUS_QUEUESIZE - 1) / RADIUS_QUEUESIZE;
+    if (n < 1)
+      n = 1;
+    if (n > RADIUS_MAXSOCKETS) {
+      syslog(LOG_WARNING, "RADIUS queue limited to %d",
+	     RADIUS_MAXSOCKETS * RADIUS_QUEUESIZE);
+      n = RADIUS_MAXSOCKETS;
+    }
+    size = n * RADIUS_QUEUESIZE;
     this->qsize = 0;
   } else {
     this->qsize = size;
@@ -1372,6 +1833,58 @@ int radius_init_q(struct radius_t *this, int size) {
   if (!(this->queue = calloc(sizeof(struct radius_queue_t), size)))
     return -1;
 
+  if (!(this->heap = calloc(sizeof(int), size)))
+    return -1;
+
+  if (!(this->socks = calloc(sizeof(struct radius_sock_t), n)))
+    return -1;
+
+  if (this->qsize) {
+    /* ids come from nextid, map them back to queue entries */
+    if (!(this->idmap = malloc(sizeof(int) * RADIUS_QUEUESIZE)))
+      return -1;
+    for (i = 0; i < RADIUS_QUEUESIZE; i++)
+      this->idmap[i] = -1;
+  }
+
+  for (i = 0; i < n; i++)
+    this->socks[i].free = this->socks[i].freetail = -1;
+
+  for (i = 0; i < size; i++) {
+    this->queue[i].hpos = -1;
+    radius_queue_free(this, i);
+  }
+
+  this->socks[0].fd = this->fd;
+  this->nsocks = 1;
+
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_addr = this->ouraddr;
+
+  while (this->nsocks < n) {
+    int fd = socket(AF_INET, SOCK_DGRAM, 0);
+
+    if (fd < 0) {
+      syslog(LOG_ERR, "%s: socket() failed!", strerror(errno));
+      return -1;
+    }
+
+    if (bind(fd, (struct sockaddr *) &addr, sizeof(addr)) < 0) {
+      syslog(LOG_ERR, "%s: bind() failed!", strerror(errno));
+      close(fd);
+      return -1;
+    }
+
+    ndelay_on(fd);
+    coe(fd);
+
+    this->socks[this->nsocks++].fd = fd;
+  }
+
+  if (n > 1)
+    syslog(LOG_DEBUG, "RADIUS queue of %d using %d sockets", size, n);
+
   return 0;
 }
 
@@ -1386,6 +1899,18 @@ radius_free(struct radius_t *this) {
   if (this->queue) {
     free(this->queue);
   }
+  if (this->heap) {
+    free(this->heap);
+  }
+  if (this->idmap) {
+    free(this->idmap);
+  }
+  if (this->socks) {
+    int n;
+    for (n = 1; n < this->nsocks; n++)
+      close(this->socks[n].fd);
+    free(this->socks);
+  }
   if (this->urandom_fp) {
     fd = fileno(this->urandom_fp);
     if (fclose(this->urandom_fp)) {
@@ -1408,20 +1933,133 @@ radius_free(struct radius_t *this) {
   return 0;
 }
 
+/*
+ * radius_set_servers()
+ * Build the server pools from radiusauthserver and radiusacctserver.
+ * A role without servers of its own uses those of the other role on
+ * its default port, and without either radiusserver1 and radiusserver2,
+ * the latter as a backup. Health and statistics of a server that stays
+ * in its pool are kept.
+ */
+static void radius_set_servers(struct radius_t *this) {
+  struct radius_server_t old[2][RADIUS_MAXSERVERS];
+  int nold[2];
+  int role, i, j;
+
+  memcpy(old, this->server, sizeof(old));
+  memcpy(nold, this->nserver, sizeof(nold));
+
+  for (role = 0; role < 2; role++) {
+    uint16_t port = role == RADIUS_ROLE_AUTH ? this->authport : this->acctport;
+    int from = _options.radiuspoolcnt[role] ? role : !role;
+    struct radius_server_t *s;
+
+    this->nserver[role] = 0;
+
+    if (_options.radsec) {
+      s = &this->server[role][this->nserver[role]++];
+      memset(s, 0, sizeof(*s));
+      inet_aton("127.0.0.1", &s->addr);
+      s->weight = 1;
+    }
+    else if (_options.radiuspoolcnt[from]) {
+      for (i = 0; i < _options.radiuspoolcnt[from]; i++) {
+	struct radius_pool_t *p = &_options.radiuspool[from][i];
+	s = &this->server[role][this->nserver[role]++];
+	memset(s, 0, sizeof(*s));
+	s->addr = p->addr;
+	s->port = from == role ? p->port : 0;
+	s->weight = p->weight;
+	if ((s->secretlen = strlen(p->secret)) > 0)
+	  memcpy(s->secret, p->secret, s->secretlen);
+      }
+    }
+    else {
+      s = &this->server[role][this->nserver[role]++];
+      memset(s, 0, sizeof(*s));
+      s->addr = _options.radiusserver1;
+      s->weight = 1;
+      if (_options.radiusserver2.s_addr &&
+	  _options.radiusserver2.s_addr != _options.radiusserver1.s_addr) {
+	s = &this->server[role][this->nserver[role]++];
+	memset(s, 0, sizeof(*s));
+	s->addr = _options.radiusserver2;
+      }
+    }
+
+    for (i = 0; i < this->nserver[role]; i++) {
+      s = &this->server[role][i];
+      s->role = role;
+      if (!s->port)
+	s->port = port;
+      if (!s->secretlen) {
+	memcpy(s->secret, this->secret, this->secretlen);
+	s->secretlen = this->secretlen;
+      }
+
+      for (j = 0; j < nold[role]; j++) {
+	struct radius_server_t *o = &old[role][j];
+	if (o->addr.s_addr == s->addr.s_addr && o->port == s->port) {
+	  struct radius_server_t n = *s;
+	  *s = *o;
+	  s->weight = n.weight;
+	  memcpy(s->secret, n.secret, sizeof(s->secret));
+	  s->secretlen = n.secretlen;
+	  break;
+	}
+      }
+
+      s->outstanding = 0;
+    }
+  }
+
+  /* Point queued requests at the new pools */
+  if (this->queue && this->socks) {
+    int mx = this->qsize ? this->qsize : this->nsocks * RADIUS_QUEUESIZE;
+    struct radius_server_t def;
+
+    memset(&def, 0, sizeof(def));
+    memcpy(def.secret, this->secret, this->secretlen);
+    def.secretlen = this->secretlen;
+
+    for (i = 0; i < mx; i++) {
+      struct radius_queue_t *q = &this->queue[i];
+      struct radius_server_t *o;
+
+      if (!q->state)
+	continue;
+
+      if ((o = q->srv)) {
+	o = &old[0][0] + (o - &this->server[0][0]);
+	q->srv = 0;
+	for (j = 0; j < this->nserver[o->role]; j++)
+	  if (this->server[o->role][j].addr.s_addr == o->addr.s_addr &&
+	      this->server[o->role][j].port == o->port) {
+	    q->srv = &this->server[o->role][j];
+	    q->srv->outstanding++;
+	    break;
+	  }
+      }
+
+      if ((o = q->signer)) {
+	q->signer = &old[0][0] + (o - &this->server[0][0]);
+	if (RADIUS_QUEUE_HASPKT(q->p))
+	  radius_queue_sign(this, i, q->srv ? q->srv : &def);
+	if (q->signer == &def)
+	  q->signer = 0;
+      }
+    }
+  }
+}
+
 void radius_set(struct radius_t *this, unsigned char *hwaddr, int debug) {
   this->debug = debug;
 
   /* Remote radius server parameters */
   if (_options.radsec) {
-    inet_aton("127.0.0.1", &this->hisaddr0);
-    this->hisaddr1.s_addr = this->hisaddr0.s_addr;
-
     this->secretlen = 6;
     strlcpy(this->secret, "radsec", sizeof(this->secret));
   } else {
-    this->hisaddr0.s_addr = _options.radiusserver1.s_addr;
-    this->hisaddr1.s_addr = _options.radiusserver2.s_addr;
-
     if ((this->secretlen = strlen(_options.radiussecret)) > RADIUS_SECRETSIZE) {
       syslog(LOG_ERR, "Radius secret too long. Truncating to %d characters",
              RADIUS_SECRETSIZE);
@@ -1449,7 +2087,10 @@ void radius_set(struct radius_t *this, unsigned char *hwaddr, int debug) {
     memcpy(this->nas_hwaddr, hwaddr, sizeof(this->nas_hwaddr));
   }
 
-  this->lastreply = 0; /* Start out using server 0 */
+  this->rsecret = this->secret;
+  this->rsecretlen = this->secretlen;
+
+  radius_set_servers(this);
   return;
 }
 
@@ -1507,17 +2148,13 @@ radius_set_cb_coa_ind(struct radius_t *this,
 }
 
 
-/*
- * radius_pkt_send()
- * Directly send a packet 
- */
-int radius_pkt_send(struct radius_t *this,
+static int radius_pkt_sendfd(struct radius_t *this, int fd,
       struct radius_packet_t *pack,
       struct sockaddr_in *peer) {
 
   size_t len = ntohs(pack->length);
 
-  if (sendto(this->fd, pack, len, 0,(struct sockaddr *) peer,
+  if (sendto(fd, pack, len, 0,(struct sockaddr *) peer,
        sizeof(struct sockaddr_in)) < 0) {
     syslog(LOG_ERR, "%s: sendto() failed!", strerror(errno));
     return -1;
@@ -1526,6 +2163,16 @@ int radius_pkt_send(struct radius_t *this,
   return 0;
 }
 
+/*
+ * radius_pkt_send()
+ * Directly send a packet 
+ */
+int radius_pkt_send(struct radius_t *this,
+      struct radius_packet_t *pack,
+      struct sockaddr_in *peer) {
+  return radius_pkt_sendfd(this, this->fd, pack, peer);
+}
+
 #ifdef ENABLE_RADPROXY
 /*
  * radius_pkt_send_proxy()
@@ -1555,37 +2202,105 @@ int radius_req(struct radius_t *this,
 	       struct radius_packet_t *pack,
 	       void *cbp)
 {
-  struct sockaddr_in addr;
+  int role = pack->code == RADIUS_CODE_ACCOUNTING_REQUEST ?
+      RADIUS_ROLE_ACCT : RADIUS_ROLE_AUTH;
+  int idx;
 
   /* Place packet in queue */
-  if (radius_queue_in(this, pack, cbp)) {
+  if ((idx = radius_queue_in(this, pack, cbp)) < 0) {
     syslog(LOG_ERR, "could not put in queue");
     return -1;
   }
 
-  memset(&addr, 0, sizeof(addr));
-  addr.sin_family = AF_INET;
+  return radius_queue_send(this, idx, radius_server_pick(this, role, 0));
+}
 
-  if (!this->lastreply) {
-    addr.sin_addr = this->hisaddr0;
-  }
-  else {
-    addr.sin_addr = this->hisaddr1;
-  }
+/*
+ * radius_servers_check()
+ * With radiusprobe, send a Status-Server to each server that is down
+ * and due for a retry, or that has been idle for radiusprobe seconds.
+ */
+void radius_servers_check(struct radius_t *this) {
+  struct radius_packet_t pack;
+  time_t now = mainclock_now();
+  int role, i, idx;
 
-  if (pack->code == RADIUS_CODE_ACCOUNTING_REQUEST)
-    addr.sin_port = htons(this->acctport);
-  else
-    addr.sin_port = htons(this->authport);
+  if (!_options.radiusprobe || now == this->probetime)
+    return;
 
-#if(_debug_ > 1)
-  syslog(LOG_DEBUG, "RADIUS id=%d sent to %s:%d",
-         pack->id,
-         inet_ntoa(addr.sin_addr),
-         ntohs(addr.sin_port));
-#endif
+  this->probetime = now;
+
+  for (role = 0; role < 2; role++)
+    for (i = 0; i < this->nserver[role]; i++) {
+      struct radius_server_t *s = &this->server[role][i];
+
+      if (s->state == RADIUS_SERVER_TRIAL || s->outstanding)
+	continue;
+
+      if (s->state == RADIUS_SERVER_DOWN ? now < s->retry :
+	  now - s->lastreply < _options.radiusprobe)
+	continue;
+
+      if (radius_default_pack(this, &pack, RADIUS_CODE_STATUS_SERVER))
+	return;
+
+      radius_addattr(this, &pack, RADIUS_ATTR_MESSAGE_AUTHENTICATOR,
+		     0, 0, 0, NULL, RADIUS_MD5LEN);
+
+      if (_options.radiusnasid)
+	radius_addattr(this, &pack, RADIUS_ATTR_NAS_IDENTIFIER, 0, 0, 0,
+		       (uint8_t *)_options.radiusnasid,
+		       strlen(_options.radiusnasid));
+
+      if ((idx = radius_queue_in(this, &pack, 0)) < 0)
+	return;
+
+      if (s->state == RADIUS_SERVER_DOWN)
+	s->state = RADIUS_SERVER_TRIAL;
 
-  return radius_pkt_send(this, pack, &addr);
+      s->probes++;
+      radius_queue_send(this, idx, s);
+    }
+}
+
+/*
+ * radius_printservers()
+ * Show state, RTT and error counts of the servers of the pool.
+ */
+int radius_printservers(int fd, struct radius_t *this) {
+  static const char *states[] = { "up", "down", "trial" };
+  char line[512];
+  int role, i, b;
+
+  for (role = 0; role < 2; role++)
+    for (i = 0; i < this->nserver[role]; i++) {
+      struct radius_server_t *s = &this->server[role][i];
+      size_t l;
+
+      l = snprintf(line, sizeof(line),
+		   "radius %s %s:%d weight=%d %s srtt=%uus rttvar=%uus"
+		   " outstanding=%d sent=%u replies=%u timeouts=%u"
+		   " badauth=%u senderr=%u probes=%u trips=%u rtt=",
+		   role == RADIUS_ROLE_AUTH ? "auth" : "acct",
+		   inet_ntoa(s->addr), s->port, s->weight,
+		   states[s->state], s->srtt, s->rttvar,
+		   s->outstanding, s->sent, s->replies, s->timeouts,
+		   s->badauth, s->senderr, s->probes, s->trips);
+
+      for (b = 0; b < RADIUS_RTT_BUCKETS && l < sizeof(line); b++)
+	l += snprintf(line + l, sizeof(line) - l, "%s%u",
+		      b ? "/" : "", s->rtt[b]);
+
+      if (l < sizeof(line) - 1) {
+	line[l++] = '\n';
+	line[l] = 0;
+      }
+
+      if (!safe_write(fd, line, strlen(line))) /* error */
+	;
+    }
+
+  return 0;
 }
 
 #ifdef ENABLE_RADPROXY
@@ -1617,6 +2332,56 @@ int radius_resp(struct radius_t *this,
 #endif
 
 #ifdef ENABLE_COA
+/*
+ *  Replies to the CoA and Disconnect-Requests of one radius_decaps()
+ *  batch, sent together once the batch is processed.
+ */
+struct radius_coa_reply {
+  struct sockaddr_in peer;
+  struct radius_packet_t pack;
+};
+
+static struct radius_coa_reply *coa_replies = 0;
+static int coa_nreplies = 0;
+static char coa_batching = 0;
+
+static void radius_coaresp_flush(struct radius_t *this) {
+  int i = 0;
+
+#ifdef HAVE_SENDMMSG
+  struct mmsghdr msgs[RADIUS_DECAPS_BATCH];
+  struct iovec iov[RADIUS_DECAPS_BATCH];
+
+  memset(msgs, 0, sizeof(struct mmsghdr) * coa_nreplies);
+
+  for (i=0; i < coa_nreplies; i++) {
+    iov[i].iov_base = &coa_replies[i].pack;
+    iov[i].iov_len = ntohs(coa_replies[i].pack.length);
+    msgs[i].msg_hdr.msg_name = &coa_replies[i].peer;
+    msgs[i].msg_hdr.msg_namelen = sizeof(struct sockaddr_in);
+    msgs[i].msg_hdr.msg_iov = &iov[i];
+    msgs[i].msg_hdr.msg_iovlen = 1;
+  }
+
+  i = 0;
+  while (i < coa_nreplies) {
+    int n = sendmmsg(this->fd, &msgs[i], coa_nreplies - i, 0);
+    if (n <= 0) {
+      syslog(LOG_ERR, "%s: sendmmsg() failed!", strerror(errno));
+      /* the one that failed is dropped, the rest sent one by one */
+      i++;
+      break;
+    }
+    i += n;
+  }
+#endif
+
+  for (; i < coa_nreplies; i++)
+    radius_pkt_send(this, &coa_replies[i].pack, &coa_replies[i].peer);
+
+  coa_nreplies = 0;
+}
+
 /*
  * radius_coaresp()
  * Send of a packet (no retransmit queue)
@@ -1633,12 +2398,23 @@ int radius_coaresp(struct radius_t *this,
 
   /* If packet contains message authenticator: Calculate it! */
   if (!radius_getattr(pack, &ma, RADIUS_ATTR_MESSAGE_AUTHENTICATOR, 0,0,0)) {
-    radius_hmac_md5(this, pack, this->secret, this->secretlen, ma->v.t);
+    radius_hmac_md5(this, pack, this->rsecret, this->rsecretlen, ma->v.t);
   }
 
   radius_authresp_authenticator(this, pack, req_auth,
-				this->secret,
-				this->secretlen);
+				this->rsecret,
+				this->rsecretlen);
+
+  if (coa_batching && !coa_replies)
+    coa_replies = (struct radius_coa_reply *)
+        calloc(RADIUS_DECAPS_BATCH, sizeof(struct radius_coa_reply));
+
+  if (coa_batching && coa_replies && coa_nreplies < RADIUS_DECAPS_BATCH) {
+    struct radius_coa_reply *r = &coa_replies[coa_nreplies++];
+    memcpy(&r->peer, peer, sizeof(r->peer));
+    memcpy(&r->pack, pack, ntohs(pack->length));
+    return 0;
+  }
 
   return radius_pkt_send(this, pack, peer);
 }
@@ -1654,6 +2430,9 @@ radius_default_pack(struct radius_t *this,
 		    struct radius_packet_t *pack,
 		    int code)
 {
+  if (pack == attr_index.pack)
+    radius_attr_unindex();
+
   memset(pack, 0, RADIUS_PACKSIZE);
   pack->code = code;
   pack->length = htons(RADIUS_HDRSIZE);
@@ -1665,7 +2444,7 @@ radius_default_pack(struct radius_t *this,
     if (qnext == -1)
       return -1;
 
-    pack->id = qnext;
+    pack->id = qnext % RADIUS_QUEUESIZE;
 
   } else {
     pack->id = this->nextid++;
@@ -1729,7 +2508,8 @@ radius_default_pack(struct radius_t *this,
  */
 static int
 radius_authcheck(struct radius_t *this, struct radius_packet_t *pack,
-		 struct radius_packet_t *pack_req)
+		 struct radius_packet_t *pack_req,
+		 char *secret, size_t secretlen)
 {
   uint8_t auth[RADIUS_AUTHLEN];
   MD5_CTX context;
@@ -1740,7 +2520,7 @@ radius_authcheck(struct radius_t *this, struct radius_packet_t *pack,
   MD5Update(&context, pack_req->authenticator, RADIUS_AUTHLEN);
   MD5Update(&context, ((uint8_t *) pack) + RADIUS_HDRSIZE,
 	    ntohs(pack->length) - RADIUS_HDRSIZE);
-  MD5Update(&context, (uint8_t *)this->secret, this->secretlen);
+  MD5Update(&context, (uint8_t *)secret, secretlen);
   MD5Final(auth, &context);
 
   res = memcmp(pack->authenticator, auth, RADIUS_AUTHLEN);
@@ -1758,7 +2538,8 @@ radius_authcheck(struct radius_t *this, struct radius_packet_t *pack,
  * Check that the authenticator on an accounting request is correct.
  */
 static int
-radius_acctcheck(struct radius_t *this, struct radius_packet_t *pack)
+radius_acctcheck(struct radius_t *this, struct radius_packet_t *pack,
+		 char *secret, size_t secretlen)
 {
   uint8_t auth[RADIUS_AUTHLEN];
   uint8_t padd[RADIUS_AUTHLEN] = {0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0};
@@ -1769,7 +2550,7 @@ radius_acctcheck(struct radius_t *this, struct radius_packet_t *pack)
   MD5Update(&context, (uint8_t *)padd, RADIUS_AUTHLEN);
   MD5Update(&context, ((uint8_t *)pack) + RADIUS_HDRSIZE,
 	    ntohs(pack->length) - RADIUS_HDRSIZE);
-  MD5Update(&context, (uint8_t *)this->secret, this->secretlen);
+  MD5Update(&context, (uint8_t *)secret, secretlen);
   MD5Final(auth, &context);
 
   return memcmp(pack->authenticator, auth, RADIUS_AUTHLEN);
@@ -1907,86 +2688,61 @@ static void chilli_extadmvsa(struct radius_t *radius,
 #endif
 
 /*
- * radius_decaps()
- * Read and process a received radius packet.
+ * radius_decaps_pack()
+ * Process a received radius packet.
  */
-int radius_decaps(struct radius_t *this, int idx) {
-  ssize_t status;
-  struct radius_packet_t pack;
+static int radius_decaps_pack(struct radius_t *this, int idx,
+			      struct radius_packet_t *pack,
+			      struct sockaddr_in *addr) {
   struct radius_packet_t pack_req;
+  struct radius_server_t *srv;
   void *cbp = NULL;
-  struct sockaddr_in addr;
-  socklen_t fromlen = sizeof(addr);
-
-  if ((status = recvfrom(this->fd, &pack, sizeof(pack), 0,
-			 (struct sockaddr *) &addr, &fromlen)) <= 0) {
-    syslog(LOG_ERR, "%s: recvfrom() failed", strerror(errno));
-    return -1;
-  }
 
-  if (status < RADIUS_HDRSIZE) {
-    syslog(LOG_WARNING, "Received radius packet which is too short: %zd < %d!",
-           status, RADIUS_HDRSIZE);
-    return -1;
-  }
+  syslog(LOG_DEBUG, "Received RADIUS packet id=%d", pack->id);
 
-  if (ntohs(pack.length) != (uint16_t)status) {
-    syslog(LOG_WARNING,
-           "%d Received radius packet with wrong length field %d !=%zd!",
-           errno, ntohs(pack.length), status);
-    return -1;
-  }
-
-  syslog(LOG_DEBUG, "Received RADIUS packet id=%d", pack.id);
-
-  switch (pack.code) {
+  switch (pack->code) {
     case RADIUS_CODE_DISCONNECT_REQUEST:
     case RADIUS_CODE_COA_REQUEST:
+      srv = radius_server_find(this, addr, 0);
+
       if (!this->coanocheck) {
         /* Check that request is from correct address */
-        if ((addr.sin_addr.s_addr != this->hisaddr0.s_addr) &&
-            (addr.sin_addr.s_addr != this->hisaddr1.s_addr)) {
+        if (!srv) {
           syslog(LOG_WARNING, "Received RADIUS from wrong address %.8x!",
-		 addr.sin_addr.s_addr);
+		 addr->sin_addr.s_addr);
           return -1;
         }
       }
 
-      if (radius_acctcheck(this, &pack)) {
-        syslog(LOG_WARNING, "RADIUS id=%d Authenticator did not match!", pack.id);
+      this->rsecret = srv ? srv->secret : this->secret;
+      this->rsecretlen = srv ? srv->secretlen : this->secretlen;
+
+      if (radius_acctcheck(this, pack, this->rsecret, this->rsecretlen)) {
+        syslog(LOG_WARNING, "RADIUS id=%d Authenticator did not match!", pack->id);
         return -1;
       }
       break;
 
     default:
-      /* Check that reply is from correct address */
-      if ((addr.sin_addr.s_addr != this->hisaddr0.s_addr) &&
-          (addr.sin_addr.s_addr != this->hisaddr1.s_addr)) {
-        syslog(LOG_WARNING, "Received radius reply from wrong address %s!",
-	       inet_ntoa(addr.sin_addr));
-        return -1;
-      }
-
-      /* Check that UDP source port is correct */
-      if ((addr.sin_port != htons(this->authport)) &&
-          (addr.sin_port != htons(this->acctport))) {
-        syslog(LOG_WARNING, "Received radius packet from wrong port %d!",
-	       ntohs(addr.sin_port));
+      /* Check that reply is from a server of the pool */
+      if (!(srv = radius_server_find(this, addr, 1))) {
+        syslog(LOG_WARNING, "Received radius reply from wrong address %s:%d!",
+	       inet_ntoa(addr->sin_addr), ntohs(addr->sin_port));
         return -1;
       }
 
-      if (radius_queue_out(this, -1, &pack, &pack_req, &cbp)) {
+      if (radius_queue_out(this, -1, idx, srv, pack, &pack_req, &cbp)) {
         syslog(LOG_WARNING, "RADIUS id %d was not found in queue!",
-	       (int) pack.id);
+	       (int) pack->id);
         return -1;
       }
 
-      /* Set which radius server to use next */
-      if (addr.sin_addr.s_addr == this->hisaddr0.s_addr)
-        this->lastreply = 0;
-      else
-        this->lastreply = 1;
+      /* A Status-Server probe only tells us the server is alive */
+      if (pack_req.code == RADIUS_CODE_STATUS_SERVER)
+        return 0;
 
+      this->rsecret = srv->secret;
+      this->rsecretlen = srv->secretlen;
       break;
   }
 
@@ -1994,7 +2750,7 @@ int radius_decaps(struct radius_t *this, int idx) {
 
 #ifdef ENABLE_EXTADMVSA
   chilli_extadmvsa(this, (struct app_conn_t *)cbp,
-		   &pack, &pack_req);
+		   pack, &pack_req);
 #endif
 
 #ifdef ENABLE_MODULES
@@ -2006,7 +2762,7 @@ int radius_decaps(struct radius_t *this, int idx) {
             (struct chilli_module *)_options.modules[i].ctx;
 	if (m->radius_handler) {
 	  int res = m->radius_handler(this, (struct app_conn_t *)cbp,
-				      &pack, &pack_req);
+				      pack, &pack_req);
 	  switch (res) {
             case CHILLI_RADIUS_OK:
               break;
@@ -2019,7 +2775,7 @@ int radius_decaps(struct radius_t *this, int idx) {
   }
 #endif
 
-  switch (pack.code) {
+  switch (pack->code) {
     case RADIUS_CODE_ACCESS_ACCEPT:
     case RADIUS_CODE_ACCESS_REJECT:
     case RADIUS_CODE_ACCESS_CHALLENGE:
@@ -2028,13 +2784,13 @@ int radius_decaps(struct radius_t *this, int idx) {
     case RADIUS_CODE_STATUS_ACCEPT:
     case RADIUS_CODE_STATUS_REJECT:
       if (this->cb_auth_conf)
-        return this->cb_auth_conf(this, &pack, &pack_req, cbp);
+        return this->cb_auth_conf(this, pack, &pack_req, cbp);
       else
         return 0;
       break;
     case RADIUS_CODE_ACCOUNTING_RESPONSE:
       if (this->cb_acct_conf)
-        return this->cb_acct_conf(this, &pack, &pack_req, cbp);
+        return this->cb_acct_conf(this, pack, &pack_req, cbp);
       else
         return 0;
       break;
@@ -2042,20 +2798,84 @@ int radius_decaps(struct radius_t *this, int idx) {
     case RADIUS_CODE_DISCONNECT_REQUEST:
     case RADIUS_CODE_COA_REQUEST:
       if (this->cb_coa_ind)
-        return this->cb_coa_ind(this, &pack, &addr);
+        return this->cb_coa_ind(this, pack, addr);
       else
         return 0;
       break;
 #endif
     default:
-      syslog(LOG_WARNING, "Received unknown RADIUS packet %d!", pack.code);
+      syslog(LOG_WARNING, "Received unknown RADIUS packet %d!", pack->code);
       return -1;
   }
 
-  syslog(LOG_WARNING, "Received unknown RADIUS packet %d!", pack.code);
+  syslog(LOG_WARNING, "Received unknown RADIUS packet %d!", pack->code);
   return -1;
 }
 
+/*
+ * radius_decaps()
+ * Read and process received radius packets, up to RADIUS_DECAPS_BATCH
+ * of those already waiting on the socket.
+ */
+int radius_decaps(struct radius_t *this, int idx) {
+  ssize_t status;
+  struct radius_packet_t pack;
+  struct sockaddr_in addr;
+  socklen_t fromlen;
+  int fd, n;
+  int ret = 0;
+
+  if (idx < 0 || idx >= this->nsocks)
+    idx = 0;
+
+  fd = this->socks ? this->socks[idx].fd : this->fd;
+
+#ifdef ENABLE_COA
+  coa_batching = 1;
+#endif
+
+  for (n=0; n < RADIUS_DECAPS_BATCH; n++) {
+    fromlen = sizeof(addr);
+
+    if ((status = recvfrom(fd, &pack, sizeof(pack), n ? MSG_DONTWAIT : 0,
+			   (struct sockaddr *) &addr, &fromlen)) <= 0) {
+      if (status < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+	break;
+      syslog(LOG_ERR, "%s: recvfrom() failed", strerror(errno));
+      ret = -1;
+      break;
+    }
+
+    if (status < RADIUS_HDRSIZE) {
+      syslog(LOG_WARNING, "Received radius packet which is too short: %zd < %d!",
+	     status, RADIUS_HDRSIZE);
+      ret = -1;
+      continue;
+    }
+
+    if (ntohs(pack.length) != (uint16_t)status) {
+      syslog(LOG_WARNING,
+	     "%d Received radius packet with wrong length field %d !=%zd!",
+	     errno, ntohs(pack.length), status);
+      ret = -1;
+      continue;
+    }
+
+    /* Index the attributes once for all lookups made while handling it */
+    radius_attr_index(&pack);
+    ret = radius_decaps_pack(this, idx, &pack, &addr);
+    radius_attr_unindex();
+  }
+
+#ifdef ENABLE_COA
+  coa_batching = 0;
+  if (coa_nreplies)
+    radius_coaresp_flush(this);
+#endif
+
+  return ret;
+}
+
 #ifdef ENABLE_RADPROXY
 /*
  * radius_proxy_ind()
@@ -183,28 +183,63 @@ struct radius_queue_t {      /* Holder for queued packets */
   int state;                 /* 0=empty, 1=full */
   void *cbp;                 /* Pointer used for callbacks */
   struct timeval timeout;    /* When do we retransmit this packet? */
+  int hpos;                  /* Position in retransmit heap. -1: None */
   int retrans;               /* How many times did we retransmit this? */
-  int lastsent;              /* 0 or 1 indicates last server used */
+  struct radius_server_t *srv;    /* Server last sent to */
+  struct radius_server_t *signer; /* Secret packet is signed with. 0: default */
+  struct timeval sent;       /* Time of last transmission */
+  uint8_t trial;             /* Last sent to a server on trial */
   struct sockaddr_in peer;   /* Address packet was sent to / received from */
   struct radius_packet_t
 #ifdef RADIUS_QUEUE_PACKET_PTR
   *
 #endif
   p;  /* The packet stored */
-  int next;                  /* Pointer to the next in queue. -1: Last */
-  int prev;                  /* Pointer to the previous in queue. -1: First */
+  int next;                  /* Next free entry. -1: Last */
 };
 
 typedef struct radius_queue_t * radius_queue;
 struct session_state;
 
+#define RADIUS_ROLE_AUTH  0
+#define RADIUS_ROLE_ACCT  1
+
+#define RADIUS_SERVER_UP    0
+#define RADIUS_SERVER_DOWN  1    /* Circuit open until retry */
+#define RADIUS_SERVER_TRIAL 2    /* One request or probe let through */
+
+#define RADIUS_RTT_BUCKETS  9    /* <10 <25 <50 <100 <250 <500 <1000 <2500 ms, more */
+
+/*
+ *  A server of the authentication or accounting pool. Requests go to
+ *  the server with the lowest smoothed RTT times outstanding requests
+ *  over weight; weight 0 servers are only used when no other is up.
+ */
 struct radius_server_t {
-  struct in_addr addr0;
-  struct in_addr addr1;
+  struct in_addr addr;
+  uint16_t port;
+  int role;
+  int weight;
   char secret[RADIUS_SECRETSIZE];
   size_t secretlen;
-  uint16_t authport;
-  uint16_t acctport;
+
+  int state;                 /* RADIUS_SERVER_UP, _DOWN or _TRIAL */
+  int fails;                 /* Consecutive timeouts */
+  time_t retry;              /* When a down server may be tried */
+  int holddown;              /* Current hold down in seconds */
+  time_t lastreply;
+  uint32_t srtt;             /* Smoothed RTT in usec */
+  uint32_t rttvar;
+  int outstanding;
+
+  uint32_t sent;
+  uint32_t replies;
+  uint32_t rtt[RADIUS_RTT_BUCKETS];
+  uint32_t timeouts;
+  uint32_t badauth;          /* Replies failing the authenticator check */
+  uint32_t senderr;
+  uint32_t probes;
+  uint32_t trips;            /* Times the circuit opened */
 };
 
 struct radius_t {
@@ -217,22 +252,37 @@ struct radius_t {
   int coanocheck;                /* Accept coa from all IP addresses */
 
 
-  int lastreply;                 /* 0 or 1 indicates last server reply */
-
   uint16_t authport;             /* His port for authentication */
   uint16_t acctport;             /* His port for accounting */
 
-  struct in_addr hisaddr0;       /* Server address */
-  struct in_addr hisaddr1;       /* Server address */
+  struct radius_server_t server[2][RADIUS_MAXSERVERS]; /* By role */
+  int nserver[2];
+  time_t probetime;              /* Last Status-Server round */
+
   char secret[RADIUS_SECRETSIZE];/* Shared secret */
   size_t secretlen;              /* Length of sharet secret */
+  char *rsecret;                 /* Secret of the server replying */
+  size_t rsecretlen;
 
   uint8_t nextid;                /* Next RADIUS id */
   radius_queue queue;            /* Outstanding replies */
-  uint8_t qsize;                 /* Queue length */
-  uint8_t qnext;                 /* Next location in queue to use */
-  int first;                     /* First packet in queue (oldest timeout) */
-  int last;                      /* Last packet in queue (youngest timeout) */
+  int qsize;                     /* Queue length */
+  int qnext;                     /* Next location in queue to use */
+  int *heap;                     /* Retransmit min-heap of queue indexes */
+  int hlen;                      /* Entries in heap */
+  int *idmap;                    /* RADIUS id to queue index when qsize */
+
+  /*
+   *  Each source socket has its own 8 bit RADIUS id space; queue
+   *  index = socket * RADIUS_QUEUESIZE + id. socks[0].fd is fd.
+   */
+  struct radius_sock_t {
+    int fd;
+    int count;                   /* Outstanding requests */
+    int free;                    /* First free queue entry. -1: Full */
+    int freetail;                /* Last free queue entry */
+  } *socks;
+  int nsocks;
 
 
 #ifdef ENABLE_RADPROXY
@@ -266,6 +316,11 @@ int radius_new(struct radius_t **this,
 
 int radius_printqueue(int fd, struct radius_t *this);
 
+int radius_printservers(int fd, struct radius_t *this);
+
+/* Probe servers that are down or idle; call once a second */
+void radius_servers_check(struct radius_t *this);
+
 int radius_init_q(struct radius_t *this, int size);
 
 /* Delete existing radius instance */
@@ -346,6 +401,10 @@ int radius_getnextattr(struct radius_packet_t *pack,
 		       uint8_t type, uint32_t vendor_id, uint8_t vendor_type,
 		       int instance, size_t *roffset);
 
+/* Index a received packet so radius_getattr() need not rescan it */
+void radius_attr_index(struct radius_packet_t *pack);
+void radius_attr_unindex(void);
+
 int radius_getattr(struct radius_packet_t *pack, struct radius_attr_t **attr,
 		   uint8_t type, uint32_t vendor_id, uint8_t vendor_type,
 		   int instance);
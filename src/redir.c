@@ -190,12 +190,19 @@ static int bytetosphex(uint8_t *src, const size_t IN_LEN, char *dst,
   }
 */
 
-static void redir_http(bstring s, char *code) {
-  bassigncstr(s, "HTTP/1.0 ");
-  bcatcstr(s, code);
-  bcatcstr(s, "\r\n");
+static void redir_http(bstring s, char *code, int keepalive) {
+  if (keepalive) {
+    bassigncstr(s, "HTTP/1.1 ");
+    bcatcstr(s, code);
+    bcatcstr(s, "\r\n");
+    bcatcstr(s, "Connection: keep-alive\r\n");
+  } else {
+    bassigncstr(s, "HTTP/1.0 ");
+    bcatcstr(s, code);
+    bcatcstr(s, "\r\n");
+    bcatcstr(s, "Connection: close\r\n");
+  }
   bcatcstr(s,
-	   "Connection: close\r\n"
 	   "Pragma: no-cache\r\n"
 	   "Expires: Fri, 01 Jan 1971 00:00:00 GMT\r\n"
 	   "Cache-Control: no-cache, must-revalidate\r\n");
@@ -461,16 +468,7 @@ static void bstring_buildurl(bstring str, struct redir_conn_t *conn,
   }
 
   bcatcstr(str, amp);
-  bcatcstr(str, "called=");
-  if (_options.nasmac)
-    bassigncstr(bt, _options.nasmac);
-  else
-    bassignformat(bt, "%.2X-%.2X-%.2X-%.2X-%.2X-%.2X",
-		  redir->nas_hwaddr[0], redir->nas_hwaddr[1], redir->nas_hwaddr[2],
-		  redir->nas_hwaddr[3], redir->nas_hwaddr[4], redir->nas_hwaddr[5]);
-
-  redir_urlencode(bt, bt2);
-  bconcat(str, bt2);
+  bconcat(str, redir->tpl_called);
 
   if (uid) {
     bcatcstr(str, amp);
@@ -511,20 +509,14 @@ static void bstring_buildurl(bstring str, struct redir_conn_t *conn,
     bconcat(str, bt2);
   }
 
-  if (redir->ssid) {
+  if (redir->tpl_ssid) {
     bcatcstr(str, amp);
-    bcatcstr(str, "ssid=");
-    bassigncstr(bt, redir->ssid);
-    redir_urlencode(bt, bt2);
-    bconcat(str, bt2);
+    bconcat(str, redir->tpl_ssid);
   }
 
-  if (_options.radiusnasid) {
+  if (redir->tpl_nasid) {
     bcatcstr(str, amp);
-    bcatcstr(str, "nasid=");
-    bassigncstr(bt, _options.radiusnasid);
-    redir_urlencode(bt, bt2);
-    bconcat(str, bt2);
+    bconcat(str, redir->tpl_nasid);
   }
 
 #ifdef ENABLE_IEEE8021Q
@@ -588,26 +580,14 @@ static void bstring_buildurl(bstring str, struct redir_conn_t *conn,
   }
 
 #ifdef ENABLE_UAMUIPORT
-  if (_options.uamuissl && _options.uamuiport) {
+  if (redir->tpl_ssl) {
     /*
      *  When we have uamuissl, a key/cert, and a uamuiport,
      *  then let's inform the captive portal of an SSL enabled
      *  services.
      */
     bcatcstr(str, amp);
-    bcatcstr(str, "ssl=");
-    if (_options.uamaliasname && _options.domain) {
-      bassignformat(bt, "https://%s.%s:%d/",
-                    _options.uamaliasname,
-                    _options.domain,
-                    _options.uamuiport);
-    } else {
-      bassignformat(bt, "https://%s:%d/",
-                    inet_ntoa(_options.uamalias),
-                    _options.uamuiport);
-    }
-    redir_urlencode(bt, bt2);
-    bconcat(str, bt2);
+    bconcat(str, redir->tpl_ssl);
   }
 #endif
 
@@ -1273,8 +1253,9 @@ static int redir_json_reply(struct redir_t *redir, int res, struct redir_conn_t
 			    char *hexchal, char *userurl, char *redirurl,
 			    uint8_t *hismac, struct in_addr *hisip,
 			    char *reply, char *qs, bstring s) {
+  /* kept for the next reply */
+  static bstring json = 0;
   bstring tmp = bfromcstr("");
-  bstring json = bfromcstr("");
 
   unsigned char flg = 0;
 #define FLG_cb     1
@@ -1286,6 +1267,9 @@ static int redir_json_reply(struct redir_t *redir, int res, struct redir_conn_t
   int state = conn->s_state.authenticated;
   int splash = (conn->s_params.flags & REQUIRE_UAM_SPLASH) == REQUIRE_UAM_SPLASH;
 
+  if (!json) json = bfromcstr("");
+  else btrunc(json, 0);
+
   redir_getparam(redir, qs, "callback", tmp);
 
   if (tmp->slen) {
@@ -1344,40 +1328,24 @@ static int redir_json_reply(struct redir_t *redir, int res, struct redir_conn_t
   if (state && splash)
     state = 3;
 
-  bcatcstr(json, "{\"version\":\"1.0\",\"clientState\":");
-
-  bassignformat(tmp, "%d", state);
-  bconcat(json, tmp);
-
-  if (_options.radiusnasid) {
-    bcatcstr(json, ",\"nasid\":\"");
-    bcatcstr(json, _options.radiusnasid);
-    bcatcstr(json, "\"");
-  }
+  jsonw_open(json, 0, '{');
+  jsonw_str(json, "version", "1.0");
+  jsonw_int(json, "clientState", state);
 
-  if (reply) {
-    struct json_object* reply_json_obj;
-    reply_json_obj = json_object_new_string(reply);
+  if (_options.radiusnasid)
+    jsonw_str(json, "nasid", _options.radiusnasid);
 
-    bcatcstr(json, ",\"message\":");
-    bcatcstr(json, json_object_to_json_string(reply_json_obj));
-    json_object_put(reply_json_obj);
-  }
+  if (reply)
+    jsonw_str(json, "message", reply);
 
-  if ((flg & FLG_chlg) && hexchal) {
-    bcatcstr(json, ",\"challenge\":\"");
-    bcatcstr(json, hexchal);
-    bcatcstr(json, "\"");
-  }
+  if ((flg & FLG_chlg) && hexchal)
+    jsonw_str(json, "challenge", hexchal);
 
   if (flg & FLG_loc) {
-    bcatcstr(json,",\"location\":{\"name\":\"");
-    if (_options.locationname)
-      bcatcstr(json, _options.locationname);
-    else if (_options.radiuslocationname)
-      bcatcstr(json, _options.radiuslocationname);
-    bcatcstr(json,"\"");
-    bcatcstr(json,"}");
+    jsonw_open(json, "location", '{');
+    jsonw_str(json, "name", _options.locationname ? _options.locationname :
+	      _options.radiuslocationname ? _options.radiuslocationname : "");
+    jsonw_close(json, '}');
   }
 
   if (flg & FLG_redir) {
@@ -1391,20 +1359,20 @@ static int redir_json_reply(struct redir_t *redir, int res, struct redir_conn_t
     session_json_fmt(&conn->s_state, &conn->s_params,
 		     json, res == REDIR_SUCCESS);
 
-  bcatcstr(json, "}");
+  jsonw_close(json, '}');
 
   if (flg & FLG_cb) {
     bcatcstr(json, ")");
   }
 
-  redir_http(s, "200 OK");
+  redir_http(s, "200 OK", conn->flags & KEEP_ALIVE);
 
   bcatcstr(s, "Content-Length: ");
   bassignformat(tmp , "%d", blength(json));
   bconcat(s, tmp);
 
   bcatcstr(s, "\r\nContent-Type: ");
-  if (tmp->slen) bcatcstr(s, "text/javascript");
+  if (flg & FLG_cb) bcatcstr(s, "text/javascript");
   else bcatcstr(s, "application/json");
 
   bcatcstr(s, "\r\n\r\n");
@@ -1415,7 +1383,6 @@ static int redir_json_reply(struct redir_t *redir, int res, struct redir_conn_t
     syslog(LOG_DEBUG, "%s(%d): sending json: %s\n", __FUNCTION__, __LINE__, json->data);
 #endif
 
-  bdestroy(json);
   bdestroy(tmp);
 
   return 0;
@@ -1467,11 +1434,47 @@ tcp_write_timeout(int timeout, struct redir_socket_t *sock, char *buf, size_t le
 
 static int timeout = 10;
 
+/*
+ *  Connections read in the chilli process never wait on a write: what
+ *  the socket does not take now is kept in obuf and written from the
+ *  main loop by redir_client_write().
+ */
+static ssize_t
+redir_client_queue(struct redir_socket_t *sock, char *buf, size_t len) {
+  redir_request *req = sock->client;
+  ssize_t c = 0;
+
+  if (!req->obuf->slen) {
+#ifdef HAVE_SSL
+    if (sock->sslcon) {
+      /* SSL_write() wants the same length again when it did not finish */
+      if (!(c = openssl_write_nb(sock->sslcon, buf, len)))
+	req->owlen = len;
+    } else
+#endif
+    {
+      c = safe_write(sock->fd[1], buf, len);
+      if (c < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+	c = 0;
+    }
+    if (c < 0) return -1;
+  }
+
+  if ((size_t) c < len &&
+      bcatblk(req->obuf, buf + c, len - c) != BSTR_OK)
+    return -1;
+
+  return (ssize_t) len;
+}
+
 ssize_t
 redir_write(struct redir_socket_t *sock, char *buf, size_t len) {
   ssize_t c;
   size_t r = 0;
 
+  if (sock->client)
+    return redir_client_queue(sock, buf, len);
+
 #if(_debug_ > 1)
   if (_options.debug)
     syslog(LOG_DEBUG, "%s(%d): redir_write(%zd)", __FUNCTION__, __LINE__, len);
@@ -1493,6 +1496,215 @@ redir_write(struct redir_socket_t *sock, char *buf, size_t len) {
   return (ssize_t)r;
 }
 
+/*
+ *  Sends the headers and body of a reply, with one writev() on a plain
+ *  socket.
+ */
+static ssize_t
+redir_write_reply(struct redir_socket_t *sock, bstring hdr, bstring body) {
+  struct iovec iov[2];
+  fd_set fdset;
+  struct timeval tv;
+  size_t len, r = 0;
+  ssize_t c;
+  int fd = sock->fd[1];
+  int i;
+
+  if (!body || !body->slen) return redir_write(sock, (char*)hdr->data, hdr->slen);
+
+  if (sock->client) {
+    if (redir_client_queue(sock, (char*)hdr->data, hdr->slen) < 0 ||
+	redir_client_queue(sock, (char*)body->data, body->slen) < 0)
+      return -1;
+    return (ssize_t) (hdr->slen + body->slen);
+  }
+
+#ifdef HAVE_SSL
+  if (sock->sslcon) {
+    c = redir_write(sock, (char*)hdr->data, hdr->slen);
+    if (c < hdr->slen) return c;
+    r = (size_t) c;
+    c = redir_write(sock, (char*)body->data, body->slen);
+    if (c < 0) return c;
+    return (ssize_t) (r + c);
+  }
+#endif
+
+  len = hdr->slen + body->slen;
+
+  while (r < len) {
+    iov[0].iov_base = hdr->data;
+    iov[0].iov_len = hdr->slen;
+    iov[1].iov_base = body->data;
+    iov[1].iov_len = body->slen;
+
+    /* skip what was written */
+    for (c = r, i = 0; c >= (ssize_t) iov[i].iov_len; i++)
+      c -= iov[i].iov_len;
+    iov[i].iov_base = (char *) iov[i].iov_base + c;
+    iov[i].iov_len -= c;
+
+    FD_ZERO(&fdset);
+    FD_SET(fd,&fdset);
+
+    tv.tv_sec = timeout;
+    tv.tv_usec = 0;
+
+    if (select(fd + 1,(fd_set *) 0,&fdset,(fd_set *) 0,&tv) == -1) {
+      if (errno == EINTR) continue;
+      break;
+    }
+
+    if (!FD_ISSET(fd, &fdset))
+      break;
+
+    c = writev(fd, &iov[i], 2 - i);
+    if (c < 0 && errno == EINTR) continue;
+    if (c <= 0) break;
+    r += (size_t) c;
+  }
+
+  return r ? (ssize_t) r : -1;
+}
+
+/*
+ *  Rendered redirect replies, by client MAC. Only the replies to
+ *  intercepted requests are kept (notyet, splash and already); the key
+ *  holds everything the URL and the WISPr body are built from, which
+ *  includes the session state fetched for the request, so a new
+ *  challenge or any change of the session renders the reply again.
+ */
+struct redir_reply_entry {
+  uint8_t used;
+  bstring key;
+  bstring hdr;
+  bstring body;
+};
+
+static struct redir_reply_entry *_reply_cache = 0;
+static bstring _reply_key = 0;
+
+static struct {
+  uint64_t hits;
+  uint64_t misses;
+} _reply_cache_stats;
+
+static void redir_reply_cache_flush(void) {
+  int i;
+
+  if (!_reply_cache) return;
+
+  for (i = 0; i < REDIR_REPLY_CACHE; i++) {
+    bdestroy(_reply_cache[i].key);
+    bdestroy(_reply_cache[i].hdr);
+    bdestroy(_reply_cache[i].body);
+  }
+
+  free(_reply_cache);
+  _reply_cache = 0;
+}
+
+static void redir_reply_key_str(bstring key, char *s) {
+  if (s) {
+    bconchar(key, 1);
+    bcatcstr(key, s);
+  }
+  bconchar(key, 0);
+}
+
+static struct redir_reply_entry *
+redir_reply_lookup(struct redir_conn_t *conn, int res, bstring url,
+		   long int timeleft, char* hexchal, char* uid,
+		   char* userurl, char* reply, char* redirurl,
+		   struct in_addr *hisip, int *hit) {
+  struct redir_reply_entry *e;
+  struct {
+    int res;
+    long int timeleft;
+    int type;
+    int flags;
+    uint16_t s_flags;
+    uint8_t uamprotocol;
+    uint8_t authenticated;
+    int lanidx;
+    uint16_t tag8021q;
+    uint8_t hismac[PKT_ETH_ALEN];
+    struct in_addr hisip;
+  } k;
+
+  if (!_reply_cache) {
+    _reply_cache = calloc(REDIR_REPLY_CACHE, sizeof(struct redir_reply_entry));
+    if (!_reply_cache) return 0;
+  }
+
+  if (!_reply_key) _reply_key = bfromcstralloc(512, "");
+
+  memset(&k, 0, sizeof(k));
+  k.res = res;
+  k.timeleft = timeleft;
+  k.type = conn->type;
+  k.flags = conn->flags & KEEP_ALIVE;
+  k.s_flags = conn->s_params.flags;
+  k.uamprotocol = conn->s_state.redir.uamprotocol;
+  k.authenticated = conn->s_state.authenticated;
+#ifdef ENABLE_MULTILAN
+  k.lanidx = conn->s_state.lanidx;
+#endif
+#ifdef ENABLE_IEEE8021Q
+  k.tag8021q = conn->s_state.tag8021q;
+#endif
+  memcpy(k.hismac, conn->hismac, PKT_ETH_ALEN);
+  if (hisip) k.hisip = *hisip;
+
+  bassignblk(_reply_key, &k, sizeof(k));
+  redir_reply_key_str(_reply_key, url ? (char *) url->data : 0);
+  redir_reply_key_str(_reply_key, hexchal);
+  redir_reply_key_str(_reply_key, uid);
+  redir_reply_key_str(_reply_key, userurl);
+  redir_reply_key_str(_reply_key, reply);
+  redir_reply_key_str(_reply_key, redirurl);
+  redir_reply_key_str(_reply_key, conn->lang);
+  redir_reply_key_str(_reply_key, conn->s_state.sessionid);
+#ifdef ENABLE_LOCATION
+  redir_reply_key_str(_reply_key, conn->s_state.location);
+#endif
+  redir_reply_key_str(_reply_key, (char *) conn->s_params.url);
+
+  e = &_reply_cache[lookup(conn->hismac, PKT_ETH_ALEN, 0) % REDIR_REPLY_CACHE];
+
+  *hit = e->used && biseq(e->key, _reply_key) == 1;
+  if (*hit)
+    _reply_cache_stats.hits++;
+  else
+    _reply_cache_stats.misses++;
+
+  return e;
+}
+
+void redir_reply_cache_print(void) {
+  uint64_t h = _reply_cache_stats.hits;
+  uint64_t m = _reply_cache_stats.misses;
+
+  syslog(LOG_INFO, "redir reply cache (%d slots): hits %llu misses %llu (%llu%%)",
+         REDIR_REPLY_CACHE, (unsigned long long) h, (unsigned long long) m,
+         (unsigned long long) (h + m ? h * 100 / (h + m) : 0));
+}
+
+static int redir_reply_send(struct redir_socket_t *sock, struct redir_conn_t *conn,
+			    bstring hdr, bstring body) {
+  ssize_t w = redir_write_reply(sock, hdr, body);
+
+  if (w < 0) {
+    syslog(LOG_ERR, "%s: redir_write()", strerror(errno));
+    return -1;
+  }
+
+  /* only a reply sent in full leaves the connection usable */
+  sock->keepalive = (conn->flags & KEEP_ALIVE) &&
+    w == hdr->slen + (body ? body->slen : 0);
+  return 0;
+}
+
 /* Make an HTTP redirection reply and send it to the client */
 int redir_reply(struct redir_t *redir, struct redir_socket_t *sock,
 		struct redir_conn_t *conn, int res, bstring url,
@@ -1502,6 +1714,9 @@ int redir_reply(struct redir_t *redir, struct redir_socket_t *sock,
 
   char *resp = NULL;
   bstring buffer;
+  bstring body = 0;
+  struct redir_reply_entry *cached = 0;
+  int hit = 0;
 
   switch (res) {
     case REDIR_ALREADY:
@@ -1555,6 +1770,22 @@ int redir_reply(struct redir_t *redir, struct redir_socket_t *sock,
       return -1;
   }
 
+  if (resp && conn->type != REDIR_STATUS &&
+#ifdef ENABLE_JSON
+      conn->format != REDIR_FMT_JSON &&
+#endif
+      (res == REDIR_NOTYET || res == REDIR_SPLASH || res == REDIR_ALREADY)) {
+    cached = redir_reply_lookup(conn, res, url, timeleft, hexchal, uid,
+				userurl, reply, redirurl, hisip, &hit);
+    if (hit) {
+#if(_debug_ > 1)
+      if (_options.debug)
+        syslog(LOG_DEBUG, "%s(%d): cached reply", __FUNCTION__, __LINE__);
+#endif
+      return redir_reply_send(sock, conn, cached->hdr, cached->body);
+    }
+  }
+
   buffer = bfromcstralloc(1024, "");
   if (!buffer) {
     syslog(LOG_ERR, "%s: bfromcstralloc() memory allocation error.", __FUNCTION__);
@@ -1573,7 +1804,7 @@ int redir_reply(struct redir_t *redir, struct redir_socket_t *sock,
       bstring bt;
       bstring bbody;
 
-      redir_http(buffer, "302 Moved Temporarily");
+      redir_http(buffer, "302 Moved Temporarily", conn->flags & KEEP_ALIVE);
       bcatcstr(buffer, "Location: ");
 
       if (url) {
@@ -1631,30 +1862,244 @@ int redir_reply(struct redir_t *redir, struct redir_socket_t *sock,
       bconcat(buffer, bt);
 
       bcatcstr(buffer, "\r\n"); /* end of headers */
-      bconcat(buffer, bbody);
 
-      bdestroy(bbody);
+      body = bbody;
       bdestroy(bt);
 
     } else {
-      redir_http(buffer, "200 OK");
-      bcatcstr(buffer,
-               "Content-type: text/html\r\n\r\n"
-               "<HTML><HEAD><TITLE>CoovaChilli</TITLE></HEAD><BODY>");
-      bcatcstr(buffer, credits);
-      bcatcstr(buffer, "</BODY></HTML>\r\n");
+      bstring bbody = bfromcstr("<HTML><HEAD><TITLE>CoovaChilli</TITLE></HEAD><BODY>");
+      bcatcstr(bbody, credits);
+      bcatcstr(bbody, "</BODY></HTML>\r\n");
+
+      redir_http(buffer, "200 OK", conn->flags & KEEP_ALIVE);
+      bformata(buffer, "Content-Length: %d\r\n", blength(bbody));
+      bcatcstr(buffer, "Content-type: text/html\r\n\r\n");
+      body = bbody;
     }
 
-  if (redir_write(sock, (char*)buffer->data, buffer->slen) < 0) {
-    syslog(LOG_ERR, "%s: redir_write()", strerror(errno));
+  if (redir_reply_send(sock, conn, buffer, body)) {
     bdestroy(buffer);
+    bdestroy(body);
     return -1;
   }
 
+  if (cached && _reply_key) {
+    /* the entry takes the rendered reply */
+    if (!cached->key) cached->key = bfromcstr("");
+    bassign(cached->key, _reply_key);
+    bdestroy(cached->hdr);
+    bdestroy(cached->body);
+    cached->hdr = buffer;
+    cached->body = body;
+    cached->used = 1;
+    return 0;
+  }
+
   bdestroy(buffer);
+  bdestroy(body);
   return 0;
 }
 
+/*
+ *  Connectivity checks of the client operating systems, answered from
+ *  replies rendered by redir_set(): before login a redirect to
+ *  /prelogin, which gives the real login URL, and after login what
+ *  the probe expects. An entry is "host/path", answered with 204 No
+ *  Content, or "host/path=body", answered with 200 OK and the body;
+ *  "default" stands for the well known probes below. The redirect
+ *  carries no WISPr XML, it would need a challenge of the client's
+ *  own, so WISPr clients are left to the full reply of redir_main().
+ */
+static char *redir_probe_defaults[] = {
+  "connectivitycheck.gstatic.com/generate_204",
+  "connectivitycheck.android.com/generate_204",
+  "clients3.google.com/generate_204",
+  "www.google.com/gen_204",
+  "captive.apple.com/hotspot-detect.html="
+  "<HTML><HEAD><TITLE>Success</TITLE></HEAD><BODY>Success</BODY></HTML>",
+  "www.apple.com/library/test/success.html="
+  "<HTML><HEAD><TITLE>Success</TITLE></HEAD><BODY>Success</BODY></HTML>",
+  "www.msftconnecttest.com/connecttest.txt=Microsoft Connect Test",
+  "www.msftncsi.com/ncsi.txt=Microsoft NCSI",
+  "detectportal.firefox.com/success.txt=success\n",
+  "nmcheck.gnome.org/check_network_status.txt=NetworkManager is online\n",
+  0
+};
+
+struct redir_probe_t {
+  char host[256];
+  char path[256];
+  bstring before[2];             /* [keep-alive] */
+  bstring after[2];
+  uint64_t hits_before;
+  uint64_t hits_after;
+};
+
+static struct redir_probe_t _probes[REDIR_MAXPROBES];
+static int _nprobes = 0;
+
+static void redir_probe_add(struct redir_t *redir, char *entry) {
+  struct redir_probe_t *p;
+  bstring url, enc;
+  char *slash, *eq;
+  size_t len;
+  int i;
+
+  if (_nprobes == REDIR_MAXPROBES) {
+    syslog(LOG_ERR, "too many uamprobe entries, max %d", REDIR_MAXPROBES);
+    return;
+  }
+
+  slash = strchr(entry, '/');
+  if (!slash || slash == entry) {
+    syslog(LOG_ERR, "uamprobe %s: expected host/path", entry);
+    return;
+  }
+
+  eq = strchr(slash, '=');
+  len = eq ? eq - slash - 1 : strlen(slash + 1);
+
+  p = &_probes[_nprobes];
+  memset(p, 0, sizeof(*p));
+
+  if ((size_t)(slash - entry) >= sizeof(p->host) || len >= sizeof(p->path)) {
+    syslog(LOG_ERR, "uamprobe %s: too long", entry);
+    return;
+  }
+
+  memcpy(p->host, entry, slash - entry);
+  memcpy(p->path, slash + 1, len);
+
+  url = bfromcstr("");
+  enc = bfromcstr("");
+  bassignformat(url, "http://%s/%s", p->host, p->path);
+  redir_urlencode(url, enc);
+
+  for (i = 0; i < 2; i++) {
+    p->before[i] = bfromcstr("");
+    redir_http(p->before[i], "302 Moved Temporarily", i);
+    bformata(p->before[i], "Location: http://%s:%d/prelogin?userurl=%s\r\n"
+	     "Content-Length: 0\r\n\r\n",
+	     inet_ntoa(redir->addr), redir->port, (char *) enc->data);
+
+    p->after[i] = bfromcstr("");
+    if (eq) {
+      redir_http(p->after[i], "200 OK", i);
+      bformata(p->after[i], "Content-Type: %s\r\nContent-Length: %d\r\n\r\n%s",
+	       (len > 4 && !strcmp(p->path + len - 4, ".txt")) ?
+	       "text/plain" : "text/html",
+	       (int) strlen(eq + 1), eq + 1);
+    } else {
+      redir_http(p->after[i], "204 No Content", i);
+      bcatcstr(p->after[i], "Content-Length: 0\r\n\r\n");
+    }
+  }
+
+  bdestroy(url);
+  bdestroy(enc);
+  _nprobes++;
+}
+
+static void redir_probes(struct redir_t *redir) {
+  int i, j;
+
+  for (i = 0; i < _nprobes; i++) {
+    for (j = 0; j < 2; j++) {
+      bdestroy(_probes[i].before[j]);
+      bdestroy(_probes[i].after[j]);
+    }
+  }
+  _nprobes = 0;
+
+  for (i = 0; i < MAX_UAM_PROBES && _options.uamprobes[i]; i++) {
+    if (!strcmp(_options.uamprobes[i], "default")) {
+      for (j = 0; redir_probe_defaults[j]; j++)
+	redir_probe_add(redir, redir_probe_defaults[j]);
+    } else {
+      redir_probe_add(redir, _options.uamprobes[i]);
+    }
+  }
+}
+
+/*
+ *  Answers the request if it is a probe; authed is set when the client
+ *  is to be told it is online.
+ */
+static int redir_probe_reply(struct redir_socket_t *sock,
+			     struct redir_conn_t *conn,
+			     struct redir_httpreq_t *httpreq, int authed) {
+  char *port = strchr(httpreq->host, ':');
+  size_t hlen = port ? (size_t)(port - httpreq->host) : strlen(httpreq->host);
+  int ka = (conn->flags & KEEP_ALIVE) ? 1 : 0;
+  int i;
+
+  if (!authed && httpreq->wispr &&
+      !(_options.no_wispr1 && _options.no_wispr2))
+    return -1;
+
+  for (i = 0; i < _nprobes; i++) {
+    struct redir_probe_t *p = &_probes[i];
+
+    if (strcmp(p->path, httpreq->path) ||
+	strlen(p->host) != hlen ||
+	strncasecmp(p->host, httpreq->host, hlen))
+      continue;
+
+    if (_options.debug)
+      syslog(LOG_DEBUG, "%s(%d): probe %s/%s %s", __FUNCTION__, __LINE__,
+             p->host, p->path, authed ? "online" : "redirected");
+
+    if (authed) {
+      p->hits_after++;
+      redir_reply_send(sock, conn, p->after[ka], 0);
+    } else {
+      p->hits_before++;
+      redir_reply_send(sock, conn, p->before[ka], 0);
+    }
+    return 0;
+  }
+
+  return -1;
+}
+
+#ifdef ENABLE_MINIPORTAL
+/*
+ *  Sends a miniportal page rendered by portal_page(), in place of
+ *  forking to run wwwbin.
+ */
+static int redir_portal_reply(struct redir_t *redir,
+			      struct redir_socket_t *sock,
+			      struct redir_conn_t *conn,
+			      struct redir_httpreq_t *httpreq, char *file) {
+  static bstring hdr = 0;
+  static bstring body = 0;
+
+  if (!hdr) {
+    hdr = bfromcstr("");
+    body = bfromcstr("");
+  }
+
+  if (portal_page(redir, conn, httpreq, file, body))
+    return -1;
+
+  redir_http(hdr, "200 OK", (conn->flags & KEEP_ALIVE) ? 1 : 0);
+  bformata(hdr, "Content-Type: text/html\r\nContent-Length: %d\r\n\r\n",
+	   body->slen);
+  redir_reply_send(sock, conn, hdr, body);
+  return 0;
+}
+#endif
+
+void redir_probe_print(void) {
+  int i;
+
+  for (i = 0; i < _nprobes; i++)
+    syslog(LOG_INFO, "probe %s/%s: redirected %llu online %llu",
+           _probes[i].host, _probes[i].path,
+           (unsigned long long) _probes[i].hits_before,
+           (unsigned long long) _probes[i].hits_after);
+}
+
 /* Allocate new instance of redir */
 int redir_new(struct redir_t **redir,
 	      struct in_addr *addr, int port, int uiport) {
@@ -1783,6 +2228,16 @@ int redir_listen(struct redir_t *redir) {
     }
   }
 
+#ifdef HAVE_SSL
+  /*
+   *  Set up the TLS context, and its shared session cache, before any
+   *  connection is handed to a child.
+   */
+  if (success && (_options.redirssl || _options.uamuissl) &&
+      _options.sslcertfile && _options.sslkeyfile)
+    initssl();
+#endif
+
   return success ? 0 : -1;
 }
 
@@ -1875,10 +2330,79 @@ int redir_free(struct redir_t *redir) {
   }
 #endif
 
+  bdestroy(redir->tpl_called);
+  bdestroy(redir->tpl_ssid);
+  bdestroy(redir->tpl_nasid);
+#ifdef ENABLE_UAMUIPORT
+  bdestroy(redir->tpl_ssl);
+#endif
+  redir_reply_cache_flush();
+
   free(redir);
   return 0;
 }
 
+/*
+ *  Encodes the URL parameters that only change with the configuration,
+ *  for bstring_buildurl() to paste into every redirect.
+ */
+static bstring redir_template(char *name, bstring value) {
+  bstring tpl = bfromcstr(name);
+  bstring enc = bfromcstr("");
+  redir_urlencode(value, enc);
+  bconcat(tpl, enc);
+  bdestroy(enc);
+  return tpl;
+}
+
+static void redir_templates(struct redir_t *redir) {
+  bstring bt = bfromcstr("");
+
+  bdestroy(redir->tpl_called);
+  bdestroy(redir->tpl_ssid);
+  bdestroy(redir->tpl_nasid);
+  redir->tpl_ssid = redir->tpl_nasid = 0;
+
+  if (_options.nasmac)
+    bassigncstr(bt, _options.nasmac);
+  else
+    bassignformat(bt, "%.2X-%.2X-%.2X-%.2X-%.2X-%.2X",
+		  redir->nas_hwaddr[0], redir->nas_hwaddr[1], redir->nas_hwaddr[2],
+		  redir->nas_hwaddr[3], redir->nas_hwaddr[4], redir->nas_hwaddr[5]);
+  redir->tpl_called = redir_template("called=", bt);
+
+  if (redir->ssid) {
+    bassigncstr(bt, redir->ssid);
+    redir->tpl_ssid = redir_template("ssid=", bt);
+  }
+
+  if (_options.radiusnasid) {
+    bassigncstr(bt, _options.radiusnasid);
+    redir->tpl_nasid = redir_template("nasid=", bt);
+  }
+
+#ifdef ENABLE_UAMUIPORT
+  bdestroy(redir->tpl_ssl);
+  redir->tpl_ssl = 0;
+
+  if (_options.uamuissl && _options.uamuiport) {
+    if (_options.uamaliasname && _options.domain) {
+      bassignformat(bt, "https://%s.%s:%d/",
+                    _options.uamaliasname,
+                    _options.domain,
+                    _options.uamuiport);
+    } else {
+      bassignformat(bt, "https://%s:%d/",
+                    inet_ntoa(_options.uamalias),
+                    _options.uamuiport);
+    }
+    redir->tpl_ssl = redir_template("ssl=", bt);
+  }
+#endif
+
+  bdestroy(bt);
+}
+
 /* Set redir parameters */
 void redir_set(struct redir_t *redir, uint8_t *hwaddr, int debug) {
   optionsdebug = debug; /* TODO: Do not change static variable from instance */
@@ -1896,6 +2420,12 @@ void redir_set(struct redir_t *redir, uint8_t *hwaddr, int debug) {
     memcpy(redir->nas_hwaddr, hwaddr, sizeof(redir->nas_hwaddr));
   }
 
+  redir_templates(redir);
+  redir_reply_cache_flush();
+  redir_probes(redir);
+#ifdef ENABLE_MINIPORTAL
+  portal_flush();
+#endif
   return;
 }
 
@@ -2111,6 +2641,8 @@ static int redir_getreq(struct redir_t *redir, struct redir_socket_t *sock,
 	char qs_delim = '?';
 	char *p2;
 
+	httpreq->http11 = strstr(p1, " HTTP/1.1") != 0;
+
 	if      (!strncmp("GET ",  p1, 4)) { p1 += 4; }
 	else if (!strncmp("HEAD ", p1, 5)) { p1 += 5; }
 	else if (httpreq->allow_post && !strncmp("POST ", p1, 5)) {
@@ -2178,7 +2710,7 @@ static int redir_getreq(struct redir_t *redir, struct redir_socket_t *sock,
 	else if (!strncmp(path, "msdownload", 10))
         { conn->type = REDIR_MSDOWNLOAD; return 0; }
 	else if (!strcmp(path, "prelogin"))
-        { conn->type = REDIR_PRELOGIN; return 0; }
+	  conn->type = REDIR_PRELOGIN;
 	else if (!strcmp(path, "macreauth"))
         { conn->type = REDIR_MACREAUTH; return 0; }
 	else if (!strcmp(path, "abort"))
@@ -2215,6 +2747,16 @@ static int redir_getreq(struct redir_t *redir, struct redir_socket_t *sock,
 #endif
 	done = 1;
 	eoh = 1;
+
+	/*
+	 *  What follows the blank line is the next request of a
+	 *  pipelining client, left in the buffer for the next round.
+	 */
+	if (rreq) rreq->reqlen = httpreq->data_in->slen - (buflen - 2);
+
+	if (!forked && !httpreq->is_post && !httpreq->close &&
+	    (httpreq->http11 || httpreq->keepalive))
+	  conn->flags |= KEEP_ALIVE;
 	break;
       } else {
 	/* headers */
@@ -2230,6 +2772,14 @@ static int redir_getreq(struct redir_t *redir, struct redir_socket_t *sock,
             syslog(LOG_DEBUG, "%s(%d): Host: %s", __FUNCTION__, __LINE__, httpreq->host);
 #endif
 	}
+	else if (!strncasecmp(buffer,"Connection:",11)) {
+	  p = buffer + 11;
+	  while (*p && isspace((int) *p)) p++;
+	  if (!strncasecmp(p, "close", 5))
+	    httpreq->close = 1;
+	  else if (!strncasecmp(p, "keep-alive", 10))
+	    httpreq->keepalive = 1;
+	}
 	else if (!strncasecmp(buffer,"Content-Length:",15)) {
 	  p = buffer + 15;
 	  while (*p && isspace((int) *p)) p++;
@@ -2240,18 +2790,20 @@ static int redir_getreq(struct redir_t *redir, struct redir_socket_t *sock,
             syslog(LOG_DEBUG, "%s(%d): Content-Length: %s", __FUNCTION__, __LINE__, p);
 #endif
 	}
-#ifdef ENABLE_USERAGENT
 	else if (!strncasecmp(buffer,"User-Agent:",11)) {
 	  p = buffer + 11;
 	  while (*p && isspace((int) *p)) p++;
+	  if (strstr(p, "CaptiveNetworkSupport") || strstr(p, "WISPr"))
+	    httpreq->wispr = 1;
+#ifdef ENABLE_USERAGENT
 	  strlcpy(conn->s_state.redir.useragent,
                   p, sizeof(conn->s_state.redir.useragent));
 #if(_debug_)
           if (_options.debug)
             syslog(LOG_DEBUG, "%s(%d): User-Agent: %s", __FUNCTION__, __LINE__, conn->s_state.redir.useragent);
 #endif
-	}
 #endif
+	}
 #ifdef ENABLE_ACCEPTLANGUAGE
 	else if (!strncasecmp(buffer,"Accept-Language:",16)) {
 	  p = buffer + 16;
@@ -2644,8 +3196,8 @@ static int redir_cb_radius_auth_conf(struct radius_t *radius,
       /* Now decode the MPPE attribue */
       if (!radius_keydecode(radius, dstbuffer, RADIUS_ATTR_VLEN, &dstlen,
 			    (uint8_t *)&attr->v.t, attr->l-2,
-			    pack_req->authenticator, radius->secret,
-			    radius->secretlen) != 0) {
+			    pack_req->authenticator, radius->rsecret,
+			    radius->rsecretlen) != 0) {
 	bytetosphex(dstbuffer, dstlen, hexString, sizeof(hexString));
         if (_options.debug)
           syslog(LOG_DEBUG, "%s(%d): plainstring MPPE_SEND_KEY: len %zu key %s", __FUNCTION__, __LINE__, dstlen, hexString);
@@ -2664,8 +3216,8 @@ static int redir_cb_radius_auth_conf(struct radius_t *radius,
       /* Now decode the MPPE attribue */
       if (!radius_keydecode(radius, dstbuffer, RADIUS_ATTR_VLEN, &dstlen,
 			    (uint8_t *)&attr->v.t, attr->l-2,
-			    pack_req->authenticator, radius->secret,
-			    radius->secretlen) != 0) {
+			    pack_req->authenticator, radius->rsecret,
+			    radius->rsecretlen) != 0) {
 	bytetosphex(dstbuffer, dstlen, hexString, sizeof(hexString));
         if (_options.debug)
           syslog(LOG_DEBUG, "%s(%d): plainstring MPPE_RECV_KEY: len %zu key %s", __FUNCTION__, __LINE__, dstlen, hexString);
@@ -3101,12 +3653,12 @@ int is_local_user(struct redir_t *redir, struct redir_conn_t *conn) {
 }
 
 /* redir_accept() does the following:
-   1) forks a child process
-   2) Accepts the tcp connection
+   1) Accepts the tcp connection
+   2) Reads the HTTP request without blocking, from the main loop
    3) Analyses a HTTP get request
    4) GET request can be one of the following:
    a) Logon request with username and challenge response
-   - Does a radius request
+   - Forks a child process, which does a radius request
    - If OK send result to parent and redirect to welcome page
    - Else redirect to error login page
    b) Logoff request
@@ -3122,13 +3674,274 @@ int is_local_user(struct redir_t *redir, struct redir_conn_t *conn) {
    matching MAC and src IP addresses.
 */
 
+/*
+ *  Connections read within the chilli process. The socket is non-blocking
+ *  and registered with the main select loop; redir_main() is called again
+ *  as data arrives and answers redirects, status and logout requests in
+ *  place. Only a login going to RADIUS and the serving of wwwdir files
+ *  fork, once the request has been read. When all slots are taken, the
+ *  connection gets a child process of its own, as before.
+ */
+static redir_request *redir_clients = 0;
+static redir_request *redir_clients_free = 0;
+
+static void redir_setenv_peer(struct sockaddr_in *address) {
+  char buffer[128];
+  snprintf(buffer,sizeof(buffer),"%s",inet_ntoa(address->sin_addr));
+  setenv("TCPREMOTEIP",buffer,1);
+  setenv("REMOTE_ADDR",buffer,1);
+  snprintf(buffer,sizeof(buffer),"%d",ntohs(address->sin_port));
+  setenv("TCPREMOTEPORT",buffer,1);
+  setenv("REMOTE_PORT",buffer,1);
+}
+
+static void redir_client_put(redir_request *req) {
+  req->inuse = 0;
+  req->socket_fd = 0;
+  req->state = 0;
+  req->next = redir_clients_free;
+  redir_clients_free = req;
+}
+
+static redir_request *redir_client_get(struct redir_t *redir) {
+  redir_request *req;
+  int i;
+
+  if (!redir->sctx) return 0;
+
+  if (!redir_clients) {
+    redir_clients = calloc(REDIR_MAXCLIENTS, sizeof(redir_request));
+    if (!redir_clients) return 0;
+    for (i=0; i < REDIR_MAXCLIENTS; i++) {
+      redir_clients[i].index = i;
+      if ((i+1) < REDIR_MAXCLIENTS)
+	redir_clients[i].next = &redir_clients[i+1];
+    }
+    redir_clients_free = redir_clients;
+  }
+
+  if (!(req = redir_clients_free)) {
+    if (_options.debug)
+      syslog(LOG_DEBUG, "%s(%d): all %d connections busy, forking",
+             __FUNCTION__, __LINE__, REDIR_MAXCLIENTS);
+    return 0;
+  }
+
+  redir_clients_free = req->next;
+  req->next = 0;
+
+  if (req->wbuf) btrunc(req->wbuf, 0);
+  else req->wbuf = bfromcstr("");
+
+  if (req->obuf) btrunc(req->obuf, 0);
+  else req->obuf = bfromcstr("");
+
+  if (!req->wbuf || !req->obuf) {
+    redir_client_put(req);
+    return 0;
+  }
+
+  req->parent = redir;
+  req->inuse = 1;
+  req->state = 0;
+  req->keepalive = 0;
+  req->pipelined = 0;
+  req->linger = 0;
+  req->reqlen = 0;
+  req->owlen = 0;
+  return req;
+}
+
+/*
+ *  Drops a connection that redir_main() has not finished; it has closed
+ *  the socket of those it did.
+ */
+static void redir_client_drop(redir_request *req) {
+#ifdef HAVE_SSL
+  if (req->sslcon) {
+    openssl_free(req->sslcon);
+    req->sslcon = 0;
+  }
+#endif
+  safe_close(req->socket_fd);
+  redir_client_put(req);
+}
+
+static int redir_client_write(redir_request *req, int idx);
+static int _redir_close(int infd, int outfd);
+
+static int redir_client_wait(redir_request *req, char evts,
+			     select_callback cb) {
+  struct redir_t *redir = req->parent;
+
+  if (net_select_reg(redir->sctx, req->socket_fd, evts, cb, req, 0)) {
+    syslog(LOG_ERR, "redir: no select slot for socket %d", req->socket_fd);
+    redir_client_drop(req);
+    return -1;
+  }
+
+  req->state |= REDIR_SOCKET_FD;
+  return 0;
+}
+
+/*
+ *  Writes what it can of obuf; returns 1 while some is left, 0 once
+ *  all is written and -1 on error.
+ */
+static int redir_client_flush(redir_request *req) {
+  while (req->obuf->slen) {
+    size_t len = req->owlen ? (size_t) req->owlen : (size_t) req->obuf->slen;
+    ssize_t c;
+
+#ifdef HAVE_SSL
+    if (req->sslcon) {
+      if (!(c = openssl_write_nb(req->sslcon, (char *) req->obuf->data, len))) {
+	req->owlen = len;
+	return 1;
+      }
+    } else
+#endif
+    {
+      c = safe_write(req->socket_fd, req->obuf->data, len);
+      if (c < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+	return 1;
+    }
+
+    if (c <= 0) return -1;
+
+    req->owlen = 0;
+    bdelete(req->obuf, 0, c);
+  }
+
+  return 0;
+}
+
+/*
+ *  Closes a connection once the reply redir_main() left in obuf has
+ *  been written.
+ */
+static void redir_client_close(redir_request *req) {
+#ifdef HAVE_SSL
+  if (req->sslcon) {
+    openssl_shutdown(req->sslcon, 2);
+    openssl_free(req->sslcon);
+    req->sslcon = 0;
+  }
+#endif
+  _redir_close(req->socket_fd, req->socket_fd);
+  redir_client_put(req);
+}
+
+static int redir_client_run(redir_request *req) {
+  struct redir_t *redir = req->parent;
+  int fd = req->socket_fd;
+  int status;
+
+  /*
+   *  Taken out of the select loop while redir_main() runs, it may close
+   *  the socket or hand it to a child process.
+   */
+  if (req->state & REDIR_SOCKET_FD) {
+    net_select_dereg(redir->sctx, fd);
+    req->state &= ~REDIR_SOCKET_FD;
+  }
+
+  req->last_active = mainclock_now();
+
+  /* a keep-alive reply may leave pipelined requests to answer */
+  do {
+    req->pipelined = 0;
+    status = redir_main(redir, fd, fd, &req->conn.peer, &req->baddr,
+			req->uiidx, req);
+  } while (status == 1 && req->pipelined && !req->obuf->slen);
+
+  /* the reply is finished from the main loop before anything else */
+  if (req->obuf->slen) {
+    if (status != 1) req->linger = 1;
+    return redir_client_wait(req, SELECT_WRITE,
+			     (select_callback) redir_client_write);
+  }
+
+  if (status == 1)
+    return redir_client_wait(req, SELECT_READ,
+			     (select_callback) redir_client_read);
+
+  redir_client_put(req);
+  return 0;
+}
+
+static int redir_client_write(redir_request *req, int idx) {
+  struct redir_t *redir = req->parent;
+  int status;
+
+  if (!req->inuse) return 0;
+
+  if ((status = redir_client_flush(req)) > 0)
+    return 0;
+
+  req->last_active = mainclock_now();
+
+  net_select_dereg(redir->sctx, req->socket_fd);
+  req->state &= ~REDIR_SOCKET_FD;
+
+  if (status < 0) {
+    if (_options.debug)
+      syslog(LOG_DEBUG, "%s(%d): %s: write to %s failed", __FUNCTION__, __LINE__,
+             strerror(errno), inet_ntoa(req->conn.peer.sin_addr));
+    redir_client_drop(req);
+    return 0;
+  }
+
+  if (req->linger) {
+    redir_client_close(req);
+    return 0;
+  }
+
+  if (req->pipelined)
+    return redir_client_run(req);
+
+  return redir_client_wait(req, SELECT_READ,
+			   (select_callback) redir_client_read);
+}
+
+int redir_client_read(redir_request *req, int idx) {
+  if (!req->inuse) return 0;
+  return redir_client_run(req);
+}
+
+/*
+ *  Called every second: closes connections that did not get a complete
+ *  request within REDIR_HTTP_MAX_TIME, or a next one on a keep-alive
+ *  connection within REDIR_HTTP_KEEPALIVE_TIME.
+ */
+void redir_client_timeout(struct redir_t *redir) {
+  time_t now = mainclock_now();
+  int i;
+
+  if (!redir_clients) return;
+
+  for (i=0; i < REDIR_MAXCLIENTS; i++) {
+    redir_request *req = &redir_clients[i];
+    int idle = (req->keepalive && !req->wbuf->slen && !req->obuf->slen) ?
+      REDIR_HTTP_KEEPALIVE_TIME : REDIR_HTTP_MAX_TIME;
+    if (req->inuse && req->last_active + idle <= now) {
+      if (_options.debug)
+        syslog(LOG_DEBUG, "%s(%d): closing idle connection %s",
+               __FUNCTION__, __LINE__, inet_ntoa(req->conn.peer.sin_addr));
+      if (req->state & REDIR_SOCKET_FD)
+	net_select_dereg(redir->sctx, req->socket_fd);
+      redir_client_drop(req);
+    }
+  }
+}
+
 int redir_accept(struct redir_t *redir, int idx) {
+  redir_request *req = 0;
   int status;
   int new_socket;
   struct sockaddr_in address;
   struct sockaddr_in baddress;
   socklen_t addrlen;
-  char buffer[128];
 
   addrlen = sizeof(struct sockaddr_in);
 
@@ -3147,6 +3960,24 @@ int redir_accept(struct redir_t *redir, int idx) {
 
   radius_packet_id++;
 
+  if (!(idx == 1 && _options.uamui && *_options.uamui) &&
+      (req = redir_client_get(redir)) != 0) {
+
+    if (ndelay_on(new_socket) < 0) {
+      syslog(LOG_ERR, "%s: could not set ndelay", strerror(errno));
+      safe_close(new_socket);
+      redir_client_put(req);
+      return 0;
+    }
+
+    memcpy(&req->conn.peer, &address, sizeof(address));
+    memcpy(&req->baddr, &baddress, sizeof(baddress));
+    req->uiidx = idx;
+    req->socket_fd = new_socket;
+
+    return redir_client_run(req);
+  }
+
   /* This forks a new process. The child really should close all
      unused file descriptors and free memory allocated. This however
      is performed when the process exits, so currently we don't
@@ -3163,12 +3994,7 @@ int redir_accept(struct redir_t *redir, int idx) {
     return 0;
   }
 
-  snprintf(buffer,sizeof(buffer),"%s",inet_ntoa(address.sin_addr));
-  setenv("TCPREMOTEIP",buffer,1);
-  setenv("REMOTE_ADDR",buffer,1);
-  snprintf(buffer,sizeof(buffer),"%d",ntohs(address.sin_port));
-  setenv("TCPREMOTEPORT",buffer,1);
-  setenv("REMOTE_PORT",buffer,1);
+  redir_setenv_peer(&address);
 
   if (idx == 1 && _options.uamui && *_options.uamui) {
 
@@ -3265,9 +4091,17 @@ pid_t redir_fork(int in, int out) {
      *  Setup child process
      */
     struct itimerval itval;
+    int i;
 
     set_signal(SIGALRM, redir_alarm);
 
+    /* connections still read by the parent are none of our business */
+    if (redir_clients)
+      for (i=0; i < REDIR_MAXCLIENTS; i++)
+	if (redir_clients[i].inuse && redir_clients[i].socket_fd != in &&
+	    redir_clients[i].socket_fd != out)
+	  safe_close(redir_clients[i].socket_fd);
+
     memset(&itval, 0, sizeof(itval));
     itval.it_interval.tv_sec = REDIR_MAXTIME;
     itval.it_interval.tv_usec = 0;
@@ -3294,9 +4128,48 @@ pid_t redir_fork(int in, int out) {
   return pid;
 }
 
+/*
+ *  Drops the garden reference that came with the session state.
+ */
+static void redir_main_release(struct redir_socket_t *socket) {
+#ifdef ENABLE_SESSGARDEN
+  if (socket->garden) {
+    garden_ruleset_release(*socket->garden);
+    *socket->garden = 0;
+    socket->garden = 0;
+  }
+#endif
+}
+
 int redir_main_exit(struct redir_socket_t *socket, int forked, redir_request *rreq) {
   /* if (httpreq->data_in) bdestroy(httpreq->data_in); */
   /* if (!forked) return 0; XXXX*/
+
+  redir_main_release(socket);
+
+  if (rreq && socket->keepalive) {
+    /*
+     *  HTTP/1.1 persistent connection: drop the request answered and
+     *  keep the socket (and SSL state) for the next one, which may
+     *  already be in the buffer.
+     */
+    if (rreq->reqlen > 0)
+      bdelete(rreq->wbuf, 0, rreq->reqlen);
+    rreq->reqlen = 0;
+    rreq->keepalive = 1;
+    rreq->pipelined = rreq->wbuf->slen > 0;
+#if(_debug_ > 1)
+    if (_options.debug)
+      syslog(LOG_DEBUG, "%s(%d): keep-alive, %d bytes pending", __FUNCTION__, __LINE__,
+             rreq->wbuf->slen);
+#endif
+    return 1;
+  }
+
+  /* closed by redir_client_write() once the reply is out */
+  if (socket->client && socket->client->obuf->slen)
+    return 0;
+
 #ifdef HAVE_SSL
   if (socket->sslcon) {
 #if(_debug_ > 1)
@@ -3314,6 +4187,23 @@ int redir_main_exit(struct redir_socket_t *socket, int forked, redir_request *rr
   return _redir_close(socket->fd[0], socket->fd[1]);
 }
 
+/*
+ *  The parent side of a connection handed to a child process, which now
+ *  owns it: the SSL state is dropped without a shutdown alert.
+ */
+static int redir_main_handoff(struct redir_socket_t *socket, redir_request *rreq) {
+  redir_main_release(socket);
+#ifdef HAVE_SSL
+  if (socket->sslcon) {
+    openssl_free(socket->sslcon);
+    socket->sslcon = 0;
+    if (rreq)
+      rreq->sslcon = 0;
+  }
+#endif
+  return _redir_close(socket->fd[0], socket->fd[1]);
+}
+
 int redir_main(struct redir_t *redir,
 	       int infd, int outfd,
 	       struct sockaddr_in *address,
@@ -3365,14 +4255,31 @@ int redir_main(struct redir_t *redir,
   if (_options.debug)							\
     syslog(LOG_DEBUG, "%s(%d): ---->>> resetting challenge: %s", __FUNCTION__, __LINE__, hexchal)
 
+#ifdef ENABLE_SESSGARDEN
+#define redir_msg_garden(msg, conn) {                                   \
+    pass_through ptlist[SESSION_PASS_THROUGH_MAX];                      \
+    uint32_t ptcnt = garden_ruleset_export(conn.s_params.garden,        \
+                                           ptlist,                      \
+                                           SESSION_PASS_THROUGH_MAX);   \
+    memcpy(msg.mdata.pass_throughs, ptlist,                             \
+           sizeof(pass_through) * ptcnt);                               \
+    msg.mdata.pass_through_count = ptcnt;                               \
+  }
+#else
+#define redir_msg_garden(msg, conn)
+#endif
+
 #ifdef USING_IPC_UNIX
 #define redir_msg_send(msgopt)                                          \
   msg.mdata.opt = msgopt;                                               \
   memcpy(&msg.mdata.address, address, sizeof(msg.mdata.address));       \
   memcpy(&msg.mdata.baddress, baddress, sizeof(msg.mdata.baddress));    \
   memcpy(&msg.mdata.params, &conn.s_params, sizeof(msg.mdata.params));  \
+  redir_msg_garden(msg, conn);                                          \
   memcpy(&msg.mdata.redir, &conn.s_state.redir, sizeof(msg.mdata.redir)); \
-  if (redir_send_msg(redir, &msg) < 0) {                                \
+  if (!forked && redir->cb_msg)                                         \
+    redir->cb_msg(redir, &msg);                                         \
+  else if (redir_send_msg(redir, &msg) < 0) {                           \
     syslog(LOG_ERR, "%s: write() failed! msgfd=%d type=%ld len=%d",     \
            strerror(errno), redir->msgfd, msg.mtype, (int)sizeof(msg.mdata)); \
     return redir_main_exit(&socket, forked, rreq);                      \
@@ -3383,8 +4290,11 @@ int redir_main(struct redir_t *redir,
   memcpy(&msg.mdata.address, address, sizeof(msg.mdata.address));       \
   memcpy(&msg.mdata.baddress, baddress, sizeof(msg.mdata.baddress));    \
   memcpy(&msg.mdata.params, &conn.s_params, sizeof(msg.mdata.params));  \
+  redir_msg_garden(msg, conn);                                          \
   memcpy(&msg.mdata.redir, &conn.s_state.redir, sizeof(msg.mdata.redir)); \
-  if (msgsnd(redir->msgid, (void *)&msg, sizeof(msg.mdata), 0) < 0) {   \
+  if (!forked && redir->cb_msg)                                         \
+    redir->cb_msg(redir, &msg);                                         \
+  else if (msgsnd(redir->msgid, (void *)&msg, sizeof(msg.mdata), 0) < 0) { \
     syslog(LOG_ERR, "%s: msgsnd() failed! msgid=%d type=%ld len=%d",    \
            strerror(errno), redir->msgid, msg.mtype, (int)sizeof(msg.mdata)); \
     return redir_main_exit(&socket, forked, rreq);                      \
@@ -3401,6 +4311,7 @@ int redir_main(struct redir_t *redir,
 
   socket.fd[0] = infd;
   socket.fd[1] = outfd;
+  socket.client = rreq && rreq->obuf ? rreq : 0;
 
   redir->starttime = mainclock_now();
 
@@ -3429,6 +4340,9 @@ int redir_main(struct redir_t *redir,
 
   /* get_state returns 0 for unauth'ed and 1 for auth'ed */
   state = redir->cb_getstate(redir, address, baddress, &conn);
+#ifdef ENABLE_SESSGARDEN
+  socket.garden = &conn.s_params.garden;
+#endif
 
   if (state == -1) {
 #if(_debug_ > 1)
@@ -3468,6 +4382,25 @@ int redir_main(struct redir_t *redir,
   if ((conn.flags & USING_SSL) == USING_SSL) {
     char done = 0, loop = 0;
 
+    if (rreq && !rreq->sslcon) {
+      /*
+       *  The handshake is left to a child, off the main loop; sessions
+       *  and ticket keys are shared between the children for resumption.
+       */
+      pid_t forkpid = redir_fork(infd, outfd);
+      if (forkpid > 0) /* parent */
+	return redir_main_handoff(&socket, rreq);
+      if (forkpid < 0)
+	return redir_main_exit(&socket, forked, rreq);
+      forked = 1;
+      rreq = 0;
+      socket.client = 0;
+      httpreq.data_in = 0;
+      if (ndelay_off(socket.fd[0])) {
+	syslog(LOG_ERR, "%s: fcntl() failed", strerror(errno));
+      }
+    }
+
     if (!rreq || !rreq->sslcon) {
       socket.sslcon = openssl_accept_fd(initssl(), socket.fd[0], 10, &conn);
       if (rreq) {
@@ -3498,6 +4431,7 @@ int redir_main(struct redir_t *redir,
           if (!loop) {
             if (_options.debug)
               syslog(LOG_DEBUG, "%s(%d): Continue... SSL pending", __FUNCTION__, __LINE__);
+            redir_main_release(&socket);
             return 1;
           }
           break;
@@ -3524,6 +4458,7 @@ int redir_main(struct redir_t *redir,
       if (_options.debug)
         syslog(LOG_DEBUG, "%s(%d): Continue...", __FUNCTION__, __LINE__);
 #endif
+      redir_main_release(&socket);
       return 1;
     default:
       if (_options.debug)
@@ -3536,6 +4471,10 @@ int redir_main(struct redir_t *redir,
     syslog(LOG_DEBUG, "%s(%d): Processing HTTP%s Request", __FUNCTION__, __LINE__, (conn.flags & USING_SSL) ? "S" : "");
 #endif
 
+  if (conn.type == REDIR_INIT && !httpreq.is_post &&
+      !redir_probe_reply(&socket, &conn, &httpreq, state == 1 && !splash))
+    return redir_main_exit(&socket, forked, rreq);
+
   switch (conn.type) {
 #ifdef ENABLE_WPAD
     case REDIR_WPAD:
@@ -3636,15 +4575,25 @@ int redir_main(struct redir_t *redir,
               return redir_main_exit(&socket, forked, rreq);
             }
 
+#ifdef ENABLE_MINIPORTAL
+          if (parse && conn.type == REDIR_WWW &&
+              !redir_portal_reply(redir, &socket, &conn, &httpreq, filename))
+            return redir_main_exit(&socket, forked, rreq);
+#endif
+
           if (!forked) {
             /*
              *  If not forked off the main process already, fork now
              *  before doing the chroot(), chrdir(), and so on..
              */
             forkpid = redir_fork(infd, outfd);
-            if (forkpid) { /* parent or error */
+            if (forkpid > 0) /* parent */
+              return redir_main_handoff(&socket, rreq);
+            if (forkpid < 0)
               return redir_main_exit(&socket, forked, rreq);
-            }
+            forked = 1;
+            socket.client = 0;
+            conn.flags &= ~KEEP_ALIVE; /* the child closes when done */
           }
 
           if (parse) {
@@ -3767,6 +4716,8 @@ int redir_main(struct redir_t *redir,
             }
 #endif
 
+            redir_setenv_peer(address);
+
             snprintf(buffer, sizeof(buffer), "%zd", httpreq.clen > 0 ? httpreq.clen : 0);
             setenv("CONTENT_LENGTH", buffer, 1);
 
@@ -3954,9 +4905,13 @@ int redir_main(struct redir_t *redir,
            *  TODO: make redir_radius asynchronous.
            */
           pid_t forkpid = redir_fork(infd, outfd);
-          if (forkpid) { /* parent or error */
+          if (forkpid > 0) /* parent */
+            return redir_main_handoff(&socket, rreq);
+          if (forkpid < 0)
             return redir_main_exit(&socket, forked, rreq);
-          }
+          forked = 1;
+          socket.client = 0;
+          conn.flags &= ~KEEP_ALIVE;
         }
 
 #ifdef ENABLE_MODULES
@@ -4301,8 +5256,10 @@ int redir_main(struct redir_t *redir,
     switch (redir->cb_handle_url(redir, &conn, &httpreq,
 				 &socket, address, rreq)) {
       case -1:
+        redir_main_release(&socket);
         return -1;
       case 0:
+        redir_main_release(&socket);
         return 1;
       default:
         break;
@@ -4389,3 +5346,10 @@ int redir_set_cb_getstate(struct redir_t *redir,
   return 0;
 }
 
+int redir_set_cb_msg(struct redir_t *redir,
+                     int (*cb_msg) (struct redir_t *redir,
+                                    struct redir_msg_t *msg)) {
+  redir->cb_msg = cb_msg;
+  return 0;
+}
+
@@ -142,7 +142,8 @@ struct redir_conn_t {
   struct in_addr ourip;        /* IP address to listen to */
   struct in_addr hisip;        /* Client IP address */
 
-#define USING_SSL (1<<0)
+#define USING_SSL  (1<<0)
+#define KEEP_ALIVE (1<<1)  /* connection kept open after the reply */
   uint8_t flags;
 
   /*
@@ -162,6 +163,10 @@ struct redir_conn_t {
 struct redir_httpreq_t {
   uint8_t allow_post:1;
   uint8_t is_post:1;
+  uint8_t http11:1;
+  uint8_t keepalive:1;
+  uint8_t close:1;
+  uint8_t wispr:1;               /* User-Agent of a WISPr smart client */
 
   char host[256];
   char path[256];
@@ -188,7 +193,12 @@ typedef struct _redir_request {
   uint8_t read_closed:1;
   uint8_t write_closed:1;
 
+  uint8_t keepalive:1;   /* replied to a request, waiting for the next */
+  uint8_t pipelined:1;   /* wbuf holds more of the next request */
+  uint8_t linger:1;      /* close once obuf is written */
+
   int clen;
+  int reqlen;            /* bytes of wbuf taken by the current request */
 
   /*bstring url;*/
   /*bstring data;*/
@@ -197,6 +207,8 @@ typedef struct _redir_request {
   bstring wbuf;
   bstring hbuf;
   bstring ibuf;
+  bstring obuf;          /* reply the socket did not take yet, in-process only */
+  int owlen;             /* length of an SSL write to repeat */
 
   time_t last_active;
 
@@ -226,9 +238,16 @@ struct redir_socket_t {
   int fd[2];
 #ifdef HAVE_SSL
   openssl_con *sslcon;
+#endif
+  char keepalive;        /* a complete keep-alive reply was written */
+  redir_request *client; /* read in the chilli process: writes are queued */
+#ifdef ENABLE_SESSGARDEN
+  garden_ruleset **garden; /* held by the session state, dropped on exit */
 #endif
 };
 
+struct redir_msg_t;
+
 struct redir_t {
   int fd[2];             /* File descriptors */
   int debug;
@@ -256,6 +275,14 @@ struct redir_t {
 
   unsigned char nas_hwaddr[6];   /* Hardware address of NAS */
 
+  /* URL parameters fixed by the configuration, encoded by redir_set() */
+  bstring tpl_called;
+  bstring tpl_ssid;
+  bstring tpl_nasid;
+#ifdef ENABLE_UAMUIPORT
+  bstring tpl_ssl;
+#endif
+
   int (*cb_getstate) (struct redir_t *redir,
 		      struct sockaddr_in *address,
 		      struct sockaddr_in *baddress,
@@ -267,6 +294,12 @@ struct redir_t {
 			struct redir_socket_t *socket,
 			struct sockaddr_in *peer,
 			redir_request *rreq);
+
+  /* delivers messages of connections read in the chilli process */
+  int (*cb_msg) (struct redir_t *redir,
+		 struct redir_msg_t *msg);
+
+  select_ctx *sctx;      /* main loop, for non-forked connections */
 };
 
 struct redir_msg_data {
@@ -275,6 +308,10 @@ struct redir_msg_data {
   struct sockaddr_in baddress;
   struct redir_state redir;
   struct session_params params;
+#ifdef ENABLE_SESSGARDEN
+  pass_through pass_throughs[SESSION_PASS_THROUGH_MAX];
+  uint32_t pass_through_count;
+#endif
 } __attribute__((packed));
 
 struct redir_msg_t {
@@ -294,6 +331,21 @@ void redir_set(struct redir_t *redir, uint8_t *hwaddr, int debug);
 
 int redir_accept(struct redir_t *redir, int idx);
 
+int redir_client_read(redir_request *req, int idx);
+
+void redir_client_timeout(struct redir_t *redir);
+
+void redir_reply_cache_print(void);
+
+void redir_probe_print(void);
+
+#ifdef ENABLE_MINIPORTAL
+int portal_page(struct redir_t *redir, struct redir_conn_t *conn,
+		struct redir_httpreq_t *httpreq, char *file, bstring out);
+void portal_flush(void);
+void portal_print(void);
+#endif
+
 int redir_setchallenge(struct redir_t *redir, struct in_addr *addr, uint8_t *challenge);
 
 int redir_set_cb_getstate(struct redir_t *redir,
@@ -302,6 +354,10 @@ int redir_set_cb_getstate(struct redir_t *redir,
                                               struct sockaddr_in *baddress,
                                               struct redir_conn_t *conn));
 
+int redir_set_cb_msg(struct redir_t *redir,
+                     int (*cb_msg) (struct redir_t *redir,
+                                    struct redir_msg_t *msg));
+
 int redir_main(struct redir_t *redir, int infd, int outfd,
 	       struct sockaddr_in *address,
 	       struct sockaddr_in *baddress,
@@ -28,88 +28,55 @@
 int session_redir_json_fmt(bstring json, char *userurl, char *redirurl,
 			   bstring logouturl, uint8_t *hismac,
 			   struct in_addr *hisip) {
-  bcatcstr(json,",\"redir\":{\"originalURL\":\"");
-  bcatcstr(json, userurl?userurl:"");
-  bcatcstr(json,"\",\"redirectionURL\":\"");
-  bcatcstr(json, redirurl?redirurl:"");
-  if (logouturl) {
-    bcatcstr(json,"\",\"logoutURL\":\"");
-    bconcat(json, logouturl);
-  }
-  bcatcstr(json,"\",\"ipAddress\":\"");
-  bcatcstr(json, inet_ntoa(*hisip));
+  jsonw_open(json, "redir", '{');
+  jsonw_str(json, "originalURL", userurl);
+  jsonw_str(json, "redirectionURL", redirurl);
+  if (logouturl)
+    jsonw_strn(json, "logoutURL", (char *)logouturl->data, logouturl->slen);
+  jsonw_ip(json, "ipAddress", hisip);
 #ifdef ENABLE_LAYER3
   if (!_options.layer3) {
 #endif
-    bcatcstr(json,"\",\"macAddress\":\"");
-    if (hismac) {
-      char mac[REDIR_MACSTRLEN+1];
-      snprintf(mac, sizeof(mac), "%.2X-%.2X-%.2X-%.2X-%.2X-%.2X",
-                    (unsigned int)hismac[0], (unsigned int)hismac[1],
-                    (unsigned int)hismac[2], (unsigned int)hismac[3],
-                    (unsigned int)hismac[4], (unsigned int)hismac[5]);
-      bcatcstr(json, mac);
-    }
+    if (hismac)
+      jsonw_mac(json, "macAddress", hismac);
+    else
+      jsonw_str(json, "macAddress", "");
 #ifdef ENABLE_LAYER3
   }
 #endif
-  bcatcstr(json,"\"}");
+  jsonw_close(json, '}');
   return 0;
 }
 
 int session_json_params(struct session_state *state,
 			struct session_params *params,
 			bstring json, int init) {
-  bstring tmp = bfromcstr("");
   time_t starttime = state->start_time;
 
-  bcatcstr(json,"\"sessionId\":\"");
-  bcatcstr(json,state->sessionid);
-  bcatcstr(json,"\",\"userName\":\"");
-  bcatcstr(json,state->redir.username);
-  bcatcstr(json, "\",\"startTime\":");
-  bassignformat(tmp, "%ld", (long) mainclock_towall(init ? mainclock_now() : starttime));
-  bconcat(json, tmp);
-  bcatcstr(json,",\"sessionTimeout\":");
-  bassignformat(tmp, "%ld", (long) params->sessiontimeout);
-  bconcat(json, tmp);
-  bcatcstr(json,",\"terminateTime\":");
-  bassignformat(tmp, "%ld", (long) params->sessionterminatetime);
-  bconcat(json, tmp);
-  bcatcstr(json,",\"idleTimeout\":");
-  bassignformat(tmp, "%ld", (long) params->idletimeout);
-  bconcat(json, tmp);
+  jsonw_str(json, "sessionId", state->sessionid);
+  jsonw_str(json, "userName", state->redir.username);
+  jsonw_int(json, "startTime",
+	    (long) mainclock_towall(init ? mainclock_now() : starttime));
+  jsonw_int(json, "sessionTimeout", (long) params->sessiontimeout);
+  jsonw_int(json, "terminateTime", (long) params->sessionterminatetime);
+  jsonw_int(json, "idleTimeout", (long) params->idletimeout);
 #ifdef ENABLE_IEEE8021Q
-  if (_options.ieee8021q && state->tag8021q) {
-    bcatcstr(json,",\"vlan\":");
-    bassignformat(tmp, "%d", (int)ntohs(state->tag8021q & PKT_8021Q_MASK_VID));
-    bconcat(json, tmp);
-  }
+  if (_options.ieee8021q && state->tag8021q)
+    jsonw_int(json, "vlan", (int)ntohs(state->tag8021q & PKT_8021Q_MASK_VID));
 #endif
-  if (params->maxinputoctets) {
-    bcatcstr(json,",\"maxInputOctets\":");
-    bassignformat(tmp, "%lld", params->maxinputoctets);
-    bconcat(json, tmp);
-  }
-  if (params->maxoutputoctets) {
-    bcatcstr(json,",\"maxOutputOctets\":");
-    bassignformat(tmp, "%lld", params->maxoutputoctets);
-    bconcat(json, tmp);
-  }
-  if (params->maxtotaloctets) {
-    bcatcstr(json,",\"maxTotalOctets\":");
-    bassignformat(tmp, "%lld", params->maxtotaloctets);
-    bconcat(json, tmp);
-  }
+  if (params->maxinputoctets)
+    jsonw_int(json, "maxInputOctets", params->maxinputoctets);
+  if (params->maxoutputoctets)
+    jsonw_int(json, "maxOutputOctets", params->maxoutputoctets);
+  if (params->maxtotaloctets)
+    jsonw_int(json, "maxTotalOctets", params->maxtotaloctets);
 
-  bdestroy(tmp);
   return 0;
 }
 
 int session_json_acct(struct session_state *state,
                       struct session_params *params,
                       bstring json, int init) {
-  bstring tmp = bfromcstr("");
   uint32_t inoctets = state->input_octets;
   uint32_t outoctets = state->output_octets;
   uint32_t ingigawords = (state->input_octets >> 32);
@@ -122,42 +89,27 @@ int session_json_acct(struct session_state *state,
 
   init = init || !state->authenticated;
 
-  bcatcstr(json,"\"sessionTime\":");
-  bassignformat(tmp, "%ld", init ? 0 : (long)sessiontime);
-  bconcat(json, tmp);
-  bcatcstr(json,",\"idleTime\":");
-  bassignformat(tmp, "%ld", init ? 0 : (long)idletime);
-  bconcat(json, tmp);
-  bcatcstr(json,",\"inputOctets\":");
-  bassignformat(tmp, "%ld",init ? 0 :  (long)inoctets);
-  bconcat(json, tmp);
-  bcatcstr(json,",\"outputOctets\":");
-  bassignformat(tmp, "%ld", init ? 0 : (long)outoctets);
-  bconcat(json, tmp);
-  bcatcstr(json,",\"inputGigawords\":");
-  bassignformat(tmp, "%ld", init ? 0 : (long)ingigawords);
-  bconcat(json, tmp);
-  bcatcstr(json,",\"outputGigawords\":");
-  bassignformat(tmp, "%ld", init ? 0 : (long)outgigawords);
-  bconcat(json, tmp);
-  bassignformat(tmp, ",\"viewPoint\":\"%s\"",
-		_options.swapoctets ? "nas" : "client");
-  bconcat(json, tmp);
+  jsonw_int(json, "sessionTime", init ? 0 : (long)sessiontime);
+  jsonw_int(json, "idleTime", init ? 0 : (long)idletime);
+  jsonw_int(json, "inputOctets", init ? 0 : (long)inoctets);
+  jsonw_int(json, "outputOctets", init ? 0 : (long)outoctets);
+  jsonw_int(json, "inputGigawords", init ? 0 : (long)ingigawords);
+  jsonw_int(json, "outputGigawords", init ? 0 : (long)outgigawords);
+  jsonw_str(json, "viewPoint", _options.swapoctets ? "nas" : "client");
 
-  bdestroy(tmp);
   return 0;
 }
 
 int session_json_fmt(struct session_state *state,
 		     struct session_params *params,
 		     bstring json, int init) {
-  bcatcstr(json,",\"session\":{");
+  jsonw_open(json, "session", '{');
   session_json_params(state,params,json,init);
-  bcatcstr(json,"}");
+  jsonw_close(json, '}');
 
-  bcatcstr(json,",\"accounting\":{");
+  jsonw_open(json, "accounting", '{');
   session_json_acct(state,params,json,init);
-  bcatcstr(json,"}");
+  jsonw_close(json, '}');
 
   return 0;
 }
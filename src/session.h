@@ -64,8 +64,8 @@ struct session_params {
 #endif
 
 #ifdef ENABLE_SESSGARDEN
-  pass_through pass_throughs[SESSION_PASS_THROUGH_MAX];
-  uint32_t pass_through_count;
+  /* shared ruleset, only meaningful in the process owning the session */
+  garden_ruleset *garden;
 #endif
 } __attribute__((packed));
 
@@ -28,6 +28,18 @@ static openssl_env * sslenv_cli = 0;
 #define HAVE_OPENSSL 1
 #else
 #define HAVE_OPENSSL_ENGINE 1
+#ifdef HAVE_OPENSSL
+#define HAVE_OPENSSL_SESSIONS 1
+#endif
+#endif
+
+#ifdef HAVE_OPENSSL_SESSIONS
+#include <sys/mman.h>
+#include <openssl/rand.h>
+#include <openssl/hmac.h>
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+#include <openssl/core_names.h>
+#endif
 #endif
 
 openssl_env * initssl() {
@@ -122,6 +134,353 @@ openssl_cacert_location(openssl_env *env, char *file, char *dir) {
   return err;
 }
 
+#ifdef HAVE_OPENSSL_SESSIONS
+/*
+ *  TLS session resumption for the redirector. Handshakes are done in
+ *  forked children, so the server session cache and the secret the
+ *  session ticket keys are derived from live in an anonymous shared
+ *  mapping made before any fork: a session set up by one child can be
+ *  resumed in the next. The ticket key changes every
+ *  REDIR_SSL_TICKET_TIME seconds; tickets of the previous period are
+ *  still accepted, and renewed. A cache slot is written only by the
+ *  process that moved its sequence number to odd; a reader finding the
+ *  slot changed under it takes that as a miss.
+ */
+
+struct openssl_session_slot {
+  volatile uint32_t seq;
+  time_t expires;
+  unsigned int idlen;
+  unsigned char id[SSL_MAX_SSL_SESSION_ID_LENGTH];
+  int len;
+  unsigned char der[REDIR_SSL_SESSION_LEN];
+};
+
+struct openssl_shared {
+  unsigned char secret[32];
+  struct {
+    unsigned long full;
+    unsigned long resumed;
+    unsigned long failed;
+    unsigned long msec_full;     /* total handshake times */
+    unsigned long msec_resumed;
+    unsigned long usec_max;
+    unsigned long lookups;
+    unsigned long hits;
+    unsigned long stores;
+  } stats;
+  struct openssl_session_slot slots[REDIR_SSL_SESSIONS];
+};
+
+static struct openssl_shared *_ssl_shared = 0;
+
+#define ssl_stat_add(n, v) __sync_fetch_and_add(&_ssl_shared->stats.n, (v))
+
+static int openssl_session_init(void) {
+  if (_ssl_shared) return 0;
+
+  _ssl_shared = mmap(0, sizeof(struct openssl_shared),
+		     PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+
+  if (_ssl_shared == MAP_FAILED) {
+    syslog(LOG_ERR, "%s: could not map TLS session cache", strerror(errno));
+    _ssl_shared = 0;
+    return -1;
+  }
+
+  if (RAND_bytes(_ssl_shared->secret, sizeof(_ssl_shared->secret)) <= 0) {
+    syslog(LOG_ERR, "could not seed TLS session ticket keys");
+    munmap(_ssl_shared, sizeof(struct openssl_shared));
+    _ssl_shared = 0;
+    return -1;
+  }
+
+  return 0;
+}
+
+static struct openssl_session_slot *
+openssl_session_slot(const unsigned char *id, unsigned int idlen) {
+  return &_ssl_shared->slots[lookup((uint8_t *) id, idlen, 0) % REDIR_SSL_SESSIONS];
+}
+
+static int openssl_session_new(SSL *ssl, SSL_SESSION *sess) {
+  struct openssl_session_slot *slot;
+  const unsigned char *id;
+  unsigned char *p;
+  unsigned int idlen;
+  uint32_t seq;
+  int len;
+
+  id = SSL_SESSION_get_id(sess, &idlen);
+  len = i2d_SSL_SESSION(sess, 0);
+
+  if (!idlen || idlen > SSL_MAX_SSL_SESSION_ID_LENGTH ||
+      len <= 0 || len > REDIR_SSL_SESSION_LEN)
+    return 0;
+
+  slot = openssl_session_slot(id, idlen);
+  seq = slot->seq;
+  if ((seq & 1) || !__sync_bool_compare_and_swap(&slot->seq, seq, seq + 1))
+    return 0;
+
+  slot->idlen = idlen;
+  memcpy(slot->id, id, idlen);
+  p = slot->der;
+  slot->len = i2d_SSL_SESSION(sess, &p);
+  slot->expires = mainclock_now() + SSL_SESSION_get_timeout(sess);
+
+  __sync_synchronize();
+  slot->seq = seq + 2;
+
+  ssl_stat_add(stores, 1);
+  return 0;
+}
+
+static SSL_SESSION *
+openssl_session_get(SSL *ssl,
+#if OPENSSL_VERSION_NUMBER >= 0x10100000L
+		    const
+#endif
+		    unsigned char *id, int idlen, int *copy) {
+  struct openssl_session_slot *slot;
+  unsigned char der[REDIR_SSL_SESSION_LEN];
+  const unsigned char *p = der;
+  uint32_t seq;
+  int len;
+
+  *copy = 0;
+  ssl_stat_add(lookups, 1);
+
+  if (idlen <= 0 || idlen > SSL_MAX_SSL_SESSION_ID_LENGTH)
+    return 0;
+
+  slot = openssl_session_slot(id, idlen);
+  seq = slot->seq;
+  if (seq & 1) return 0;
+  __sync_synchronize();
+
+  if (slot->idlen != idlen || memcmp(slot->id, id, idlen) ||
+      slot->expires <= mainclock_now())
+    return 0;
+
+  len = slot->len;
+  if (len <= 0 || len > REDIR_SSL_SESSION_LEN)
+    return 0;
+  memcpy(der, slot->der, len);
+
+  __sync_synchronize();
+  if (slot->seq != seq) return 0;
+
+  ssl_stat_add(hits, 1);
+  return d2i_SSL_SESSION(0, &p, len);
+}
+
+static void openssl_session_remove(SSL_CTX *ctx, SSL_SESSION *sess) {
+  struct openssl_session_slot *slot;
+  const unsigned char *id;
+  unsigned int idlen;
+  uint32_t seq;
+
+  id = SSL_SESSION_get_id(sess, &idlen);
+  if (!idlen || idlen > SSL_MAX_SSL_SESSION_ID_LENGTH)
+    return;
+
+  slot = openssl_session_slot(id, idlen);
+  seq = slot->seq;
+  if ((seq & 1) || !__sync_bool_compare_and_swap(&slot->seq, seq, seq + 1))
+    return;
+
+  if (slot->idlen == idlen && !memcmp(slot->id, id, idlen))
+    slot->idlen = 0;
+
+  __sync_synchronize();
+  slot->seq = seq + 2;
+}
+
+/*
+ *  Session ticket keys of a period: the name carries the period, the
+ *  AES and HMAC keys are derived from the shared secret. The keys of
+ *  the current and previous period are kept by each process.
+ */
+struct openssl_ticket_key {
+  uint32_t period;
+  unsigned char name[16];
+  unsigned char aes[32];
+  unsigned char mac[32];
+};
+
+static void openssl_ticket_derive(uint32_t period, char *label,
+				  unsigned char *out, unsigned int len) {
+  unsigned char in[32];
+  unsigned char md[EVP_MAX_MD_SIZE];
+  unsigned int mdlen = 0;
+  size_t l = strlen(label);
+
+  memcpy(in, label, l);
+  in[l++] = period >> 24;
+  in[l++] = period >> 16;
+  in[l++] = period >> 8;
+  in[l++] = period;
+
+  HMAC(EVP_sha256(), _ssl_shared->secret, sizeof(_ssl_shared->secret),
+       in, l, md, &mdlen);
+  memcpy(out, md, len < mdlen ? len : mdlen);
+}
+
+static struct openssl_ticket_key *openssl_ticket_key(uint32_t period) {
+  static struct openssl_ticket_key keys[2];
+  struct openssl_ticket_key *k = &keys[period & 1];
+
+  if (k->period != period || !k->name[0]) {
+    k->period = period;
+    k->name[0] = 'c';
+    k->name[1] = period >> 16;
+    k->name[2] = period >> 8;
+    k->name[3] = period;
+    openssl_ticket_derive(period, "ticket name", k->name + 4, 12);
+    openssl_ticket_derive(period, "ticket aes", k->aes, sizeof(k->aes));
+    openssl_ticket_derive(period, "ticket mac", k->mac, sizeof(k->mac));
+  }
+
+  return k;
+}
+
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+#define OPENSSL_TICKET_MAC_CTX EVP_MAC_CTX
+static int openssl_ticket_mac(EVP_MAC_CTX *hctx, unsigned char *key) {
+  OSSL_PARAM params[2];
+  params[0] = OSSL_PARAM_construct_utf8_string(OSSL_MAC_PARAM_DIGEST, "SHA256", 0);
+  params[1] = OSSL_PARAM_construct_end();
+  return EVP_MAC_init(hctx, key, 32, params);
+}
+#else
+#define OPENSSL_TICKET_MAC_CTX HMAC_CTX
+static int openssl_ticket_mac(HMAC_CTX *hctx, unsigned char *key) {
+  return HMAC_Init_ex(hctx, key, 32, EVP_sha256(), 0);
+}
+#endif
+
+static int openssl_ticket_cb(SSL *ssl, unsigned char *name, unsigned char *iv,
+			     EVP_CIPHER_CTX *ectx, OPENSSL_TICKET_MAC_CTX *hctx,
+			     int enc) {
+  uint32_t now = mainclock_now() / REDIR_SSL_TICKET_TIME;
+  struct openssl_ticket_key *k;
+
+  if (enc) {
+    k = openssl_ticket_key(now);
+    if (RAND_bytes(iv, EVP_MAX_IV_LENGTH) <= 0)
+      return -1;
+    memcpy(name, k->name, sizeof(k->name));
+    if (!EVP_EncryptInit_ex(ectx, EVP_aes_256_cbc(), 0, k->aes, iv) ||
+	!openssl_ticket_mac(hctx, k->mac))
+      return -1;
+    return 1;
+  } else {
+    uint32_t period = (now & 0xff000000) |
+      (name[1] << 16) | (name[2] << 8) | name[3];
+
+    if (name[0] != 'c' || (period != now && period + 1 != now))
+      return 0;
+
+    k = openssl_ticket_key(period);
+    if (memcmp(name, k->name, sizeof(k->name)))
+      return 0;
+
+    if (!openssl_ticket_mac(hctx, k->mac) ||
+	!EVP_DecryptInit_ex(ectx, EVP_aes_256_cbc(), 0, k->aes, iv))
+      return -1;
+
+    /* a ticket of the previous period gets renewed */
+    return period == now ? 1 : 2;
+  }
+}
+
+static void openssl_session_setup(SSL_CTX *ctx) {
+  if (openssl_session_init()) {
+    SSL_CTX_set_session_cache_mode(ctx, SSL_SESS_CACHE_OFF);
+    return;
+  }
+
+  SSL_CTX_set_session_id_context(ctx, (unsigned char *) "chilli", 6);
+  SSL_CTX_set_timeout(ctx, REDIR_SSL_SESSION_TIME);
+  SSL_CTX_set_session_cache_mode(ctx, SSL_SESS_CACHE_SERVER |
+				 SSL_SESS_CACHE_NO_INTERNAL);
+  SSL_CTX_sess_set_new_cb(ctx, openssl_session_new);
+  SSL_CTX_sess_set_get_cb(ctx, openssl_session_get);
+  SSL_CTX_sess_set_remove_cb(ctx, openssl_session_remove);
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+  SSL_CTX_set_tlsext_ticket_key_evp_cb(ctx, openssl_ticket_cb);
+#else
+  SSL_CTX_set_tlsext_ticket_key_cb(ctx, openssl_ticket_cb);
+#endif
+}
+
+/*
+ *  Accounts for a server handshake just completed (ok) or failed.
+ */
+static void openssl_accept_done(openssl_con *c, int ok) {
+  struct timeval now;
+  unsigned long usec, max;
+  int reused;
+
+  if (!_ssl_shared || !c->started.tv_sec) return;
+
+  if (!ok) {
+    ssl_stat_add(failed, 1);
+    return;
+  }
+
+  gettimeofday(&now, 0);
+  usec = (now.tv_sec - c->started.tv_sec) * 1000000 +
+    (now.tv_usec - c->started.tv_usec);
+  if ((long) usec < 0) usec = 0;
+
+  reused = SSL_session_reused(c->con);
+  if (reused) {
+    ssl_stat_add(resumed, 1);
+    ssl_stat_add(msec_resumed, usec / 1000);
+  } else {
+    ssl_stat_add(full, 1);
+    ssl_stat_add(msec_full, usec / 1000);
+  }
+
+  while ((max = _ssl_shared->stats.usec_max) < usec &&
+	 !__sync_bool_compare_and_swap(&_ssl_shared->stats.usec_max, max, usec))
+    ;
+
+  if (_options.debug)
+    syslog(LOG_DEBUG, "%s(%d): TLS handshake %s in %lu usec", __FUNCTION__, __LINE__,
+	   reused ? "resumed" : "full", usec);
+}
+#endif
+
+void openssl_print_stats(int fd) {
+#ifdef HAVE_OPENSSL_SESSIONS
+  char line[512];
+  unsigned long f, r;
+
+  if (!_ssl_shared) return;
+
+  f = _ssl_shared->stats.full;
+  r = _ssl_shared->stats.resumed;
+
+  snprintf(line, sizeof line,
+	   "tls handshakes: full=%lu (avg %lums) resumed=%lu (avg %lums)"
+	   " failed=%lu max=%lums; session cache (%d slots):"
+	   " lookups=%lu hits=%lu stored=%lu\n",
+	   f, f ? _ssl_shared->stats.msec_full / f : 0,
+	   r, r ? _ssl_shared->stats.msec_resumed / r : 0,
+	   _ssl_shared->stats.failed, _ssl_shared->stats.usec_max / 1000,
+	   REDIR_SSL_SESSIONS, _ssl_shared->stats.lookups,
+	   _ssl_shared->stats.hits, _ssl_shared->stats.stores);
+
+  if (fd < 0)
+    syslog(LOG_INFO, "%s", line);
+  else if (!safe_write(fd, line, strlen(line))) /* error */
+    ;
+#endif
+}
+
 int
 _openssl_env_init(openssl_env *env, char *engine, int server) {
   /*
@@ -160,7 +519,11 @@ _openssl_env_init(openssl_env *env, char *engine, int server) {
 
   if (server) {
     SSL_CTX_set_options(env->ctx, SSL_OP_SINGLE_DH_USE);
+#ifdef HAVE_OPENSSL_SESSIONS
+    openssl_session_setup(env->ctx);
+#else
     SSL_CTX_set_session_cache_mode(env->ctx, SSL_SESS_CACHE_OFF);
+#endif
     SSL_CTX_set_quiet_shutdown(env->ctx, 1);
   }
   return 1;
@@ -281,6 +644,146 @@ openssl_connect_fd(openssl_env *env, int fd, int timeout) {
   return c;
 }
 
+/*
+ *  Non-blocking client connections: openssl_connect_nb() only sets up
+ *  the connection on a (connected) socket, offering a session to
+ *  resume; openssl_check_connect() then advances the handshake and
+ *  returns 0 once done, 1 or 2 when it wants to read or write, and -1
+ *  on failure.
+ */
+openssl_con *
+openssl_connect_nb(openssl_env *env, int fd, void *session) {
+#ifdef HAVE_OPENSSL
+  openssl_con *c = (openssl_con *)calloc(1, sizeof(*c));
+  if (!c) return 0;
+
+  c->env = env;
+  c->con = (SSL *)SSL_new(env->ctx);
+  if (!c->con) {
+    free(c);
+    return 0;
+  }
+  c->sock = fd;
+
+  SSL_set_fd(c->con, c->sock);
+
+#ifdef HAVE_OPENSSL_ENGINE
+  SSL_set_app_data(c->con, c);
+#endif
+
+  if (session)
+    SSL_set_session(c->con, (SSL_SESSION *) session);
+
+  SSL_set_connect_state(c->con);
+  return c;
+#else
+  return openssl_connect_fd(env, fd, 0);
+#endif
+}
+
+int
+openssl_check_connect(openssl_con *c) {
+#ifdef HAVE_OPENSSL
+  int rc;
+
+  if (!c || !c->con) return -1;
+
+  if (SSL_is_init_finished(c->con)) return 0;
+
+  if ((rc = SSL_connect(c->con)) > 0) return 0;
+
+  switch (SSL_get_error(c->con, rc)) {
+    case SSL_ERROR_WANT_READ: return 1;
+    case SSL_ERROR_WANT_WRITE: return 2;
+  }
+
+#if(_debug_)
+  {
+    unsigned long error;
+    while ((error = ERR_get_error()))
+      syslog(LOG_DEBUG, "%s(%d): TLS: %s", __FUNCTION__, __LINE__, ERR_error_string(error, NULL));
+  }
+#endif
+  return -1;
+#else
+  return c ? 0 : -1;
+#endif
+}
+
+/*
+ *  Reads and writes that never wait: > 0 bytes transferred, 0 when the
+ *  socket would block, -1 when the connection is gone.
+ */
+int
+openssl_read_nb(openssl_con *con, char *b, int l) {
+#ifdef HAVE_OPENSSL
+  int rbytes;
+
+  if (!con || !con->con) return -1;
+
+  if ((rbytes = SSL_read(con->con, b, l)) > 0)
+    return rbytes;
+
+  switch (SSL_get_error(con->con, rbytes)) {
+    case SSL_ERROR_WANT_READ:
+    case SSL_ERROR_WANT_WRITE:
+      return 0;
+  }
+  return -1;
+#else
+  int rbytes = openssl_read(con, b, l, 0);
+  return rbytes > 0 ? rbytes : -1;
+#endif
+}
+
+int
+openssl_write_nb(openssl_con *con, char *b, int l) {
+#ifdef HAVE_OPENSSL
+  int wbytes;
+
+  if (!con || !con->con) return -1;
+
+  if ((wbytes = SSL_write(con->con, b, l)) > 0)
+    return wbytes;
+
+  switch (SSL_get_error(con->con, wbytes)) {
+    case SSL_ERROR_WANT_READ:
+    case SSL_ERROR_WANT_WRITE:
+      return 0;
+  }
+  return -1;
+#else
+  int wbytes = openssl_write(con, b, l, 0);
+  return wbytes > 0 ? wbytes : -1;
+#endif
+}
+
+void *
+openssl_get_session(openssl_con *con) {
+#ifdef HAVE_OPENSSL
+  if (con && con->con)
+    return SSL_get1_session(con->con);
+#endif
+  return 0;
+}
+
+void
+openssl_free_session(void *session) {
+#ifdef HAVE_OPENSSL
+  if (session)
+    SSL_SESSION_free((SSL_SESSION *) session);
+#endif
+}
+
+int
+openssl_session_reused(openssl_con *con) {
+#ifdef HAVE_OPENSSL
+  if (con && con->con)
+    return SSL_session_reused(con->con);
+#endif
+  return 0;
+}
+
 int
 openssl_check_accept(openssl_con *c, struct redir_conn_t *conn) {
 
@@ -314,6 +817,9 @@ openssl_check_accept(openssl_con *c, struct redir_conn_t *conn) {
           break;
       }
 
+#ifdef HAVE_OPENSSL_SESSIONS
+      openssl_accept_done(c, 0);
+#endif
       return -1;
 
     } else {
@@ -321,6 +827,10 @@ openssl_check_accept(openssl_con *c, struct redir_conn_t *conn) {
 #ifdef HAVE_OPENSSL_ENGINE
       X509 *peer_cert = SSL_get_peer_certificate(c->con);
 
+#ifdef HAVE_OPENSSL_SESSIONS
+      openssl_accept_done(c, 1);
+#endif
+
       if (peer_cert) {
 	char subj[1024];
 
@@ -401,6 +911,7 @@ openssl_accept_fd(openssl_env *env, int fd, int timeout, struct redir_conn_t *co
 #endif
   c->sock = fd;
   c->timeout = timeout;
+  gettimeofday(&c->started, 0);
 
   SSL_set_fd(c->con, c->sock);
 
@@ -413,6 +924,8 @@ openssl_accept_fd(openssl_env *env, int fd, int timeout, struct redir_conn_t *co
   SSL_set_app_data(c->con, c);
 #endif
   SSL_set_accept_state(c->con);
+  /* in-process redir connections repeat a write from a buffer that may move */
+  SSL_set_mode(c->con, SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER);
 
 #ifdef HAVE_OPENSSL_ENGINE
   SSL_set_verify_result(c->con, X509_V_OK);
@@ -86,6 +86,7 @@ typedef struct {
   SSL *con;
   int sock;
   int timeout;
+  struct timeval started;  /* of the server handshake */
 } openssl_con;
 
 openssl_env * initssl();
@@ -106,7 +107,15 @@ int openssl_pending(openssl_con *con);
 struct redir_conn_t;
 openssl_con *openssl_accept_fd(openssl_env *env, int fd, int timeout, struct redir_conn_t *);
 openssl_con *openssl_connect_fd(openssl_env *env, int fd, int timeout);
+openssl_con *openssl_connect_nb(openssl_env *env, int fd, void *session);
+int openssl_check_connect(openssl_con *c);
+int openssl_read_nb(openssl_con *con, char *b, int l);
+int openssl_write_nb(openssl_con *con, char *b, int l);
+void *openssl_get_session(openssl_con *con);
+void openssl_free_session(void *session);
+int openssl_session_reused(openssl_con *con);
 int openssl_check_accept(openssl_con *c, struct redir_conn_t *);
+void openssl_print_stats(int fd);
 
 #endif
 #endif
@@ -29,6 +29,26 @@ extern struct ippool_t *ippool;
 #ifdef ENABLE_BINSTATFILE
 static int has_loaded = 0;
 
+#ifdef ENABLE_SESSGARDEN
+static int loadstatus_garden(FILE *file, garden_ruleset **garden) {
+  pass_through ptlist[SESSION_PASS_THROUGH_MAX];
+  uint32_t cnt;
+
+  if (fread(&cnt, sizeof(cnt), 1, file) != 1 ||
+      cnt > SESSION_PASS_THROUGH_MAX)
+    return -1;
+
+  if (cnt && fread(ptlist, sizeof(pass_through), cnt, file) != cnt)
+    return -1;
+
+  if (fgetc(file) != MARK_NEXT)
+    return -1;
+
+  *garden = garden_ruleset_intern(ptlist, cnt);
+  return 0;
+}
+#endif
+
 int loadstatus(void) {
   char filedest[512];
   FILE *file;
@@ -36,6 +56,9 @@ int loadstatus(void) {
 
   struct dhcp_conn_t dhcpconn;
   struct app_conn_t appconn;
+#ifdef ENABLE_SESSGARDEN
+  garden_ruleset *garden = 0;
+#endif
 
   time_t r_wall, r_rt, r_rtoffset;
   time_t wall, rt, rtoffset;
@@ -91,6 +114,12 @@ int loadstatus(void) {
     struct ippoolm_t *newipm = 0;
     int n;
 
+#ifdef ENABLE_SESSGARDEN
+    /* not consumed by a session in the last round */
+    garden_ruleset_release(garden);
+    garden = 0;
+#endif
+
     /* todo: read a md5 checksum or magic token */
 
     if ((c = fgetc(file)) != MARK_NEXT) {
@@ -164,6 +193,14 @@ int loadstatus(void) {
 	    return -1;
 	  }
 
+#ifdef ENABLE_SESSGARDEN
+	  if (loadstatus_garden(file, &garden)) {
+	    syslog(LOG_ERR, "%s: bad binary file", strerror(errno));
+	    fclose(file);
+	    return -1;
+	  }
+#endif
+
 	  if (chilli_new_conn(&aconn) == 0) {
 	    /* set/copy all the pointers/internals */
 	    appconn.unit = aconn->unit;
@@ -202,12 +239,9 @@ int loadstatus(void) {
 			     &_options.dns1, &_options.dns2);
 	    }
 
-#if defined(ENABLE_SESSGARDEN) && defined(HAVE_PATRICIA)
-	    if (aconn->s_params.pass_through_count) {
-	      garden_patricia_load_list(&aconn->ptree,
-					aconn->s_params.pass_throughs,
-					aconn->s_params.pass_through_count);
-	    }
+#ifdef ENABLE_SESSGARDEN
+	    aconn->s_params.garden = garden;
+	    garden = 0;
 #endif
 	  }
 
@@ -240,6 +274,14 @@ int loadstatus(void) {
 	    return -1;
 	  }
 
+#ifdef ENABLE_SESSGARDEN
+	  if (loadstatus_garden(file, &garden)) {
+	    syslog(LOG_ERR, "%s: bad binary file", strerror(errno));
+	    fclose(file);
+	    return -1;
+	  }
+#endif
+
 	  if (conn->peer) {
 	    /*
 	     * Already have an appconn.
@@ -248,6 +290,11 @@ int loadstatus(void) {
 
 	    syslog(LOG_INFO, "Overwriting existing appconn %d", appconn.s_state.authenticated);
 
+#ifdef ENABLE_SESSGARDEN
+	    garden_ruleset_release(aconn->s_params.garden);
+	    appconn.s_params.garden = garden;
+	    garden = 0;
+#endif
 	    memcpy(&aconn->s_params, &appconn.s_params, sizeof(struct session_params));
 	    memcpy(&aconn->s_state, &appconn.s_state, sizeof(struct session_state));
 
@@ -277,6 +324,11 @@ int loadstatus(void) {
 	      appconn.uplink = newipm;
 	      appconn.dnlink = conn;
 
+#ifdef ENABLE_SESSGARDEN
+	      appconn.s_params.garden = garden;
+	      garden = 0;
+#endif
+
 	      /* initialize app_conn_t */
 	      memcpy(aconn, &appconn, sizeof(struct app_conn_t));
 	      conn->peer = aconn;
@@ -298,6 +350,10 @@ int loadstatus(void) {
     }
   }
 
+#ifdef ENABLE_SESSGARDEN
+  garden_ruleset_release(garden);
+#endif
+
   fclose(file);
   printstatus();
   return 0;
@@ -359,6 +415,16 @@ int printstatus(void) {
         if (appconn) {
           fwrite(appconn, sizeof(struct app_conn_t), 1, file);
           fputc(MARK_NEXT, file);
+#ifdef ENABLE_SESSGARDEN
+          {
+            garden_ruleset *rs = appconn->s_params.garden;
+            uint32_t cnt = garden_ruleset_count(rs);
+            fwrite(&cnt, sizeof(cnt), 1, file);
+            if (cnt)
+              fwrite(rs->rules, sizeof(pass_through), cnt, file);
+            fputc(MARK_NEXT, file);
+          }
+#endif
         }
         break;
     }
@@ -100,6 +100,10 @@
 #include <sys/un.h>
 #endif
 
+#ifdef HAVE_SYS_UIO_H
+#include <sys/uio.h>
+#endif
+
 #ifdef HAVE_POLL_H
 #include <poll.h>
 #endif
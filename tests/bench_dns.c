@@ -0,0 +1,141 @@
+/* -*- mode: c; c-basic-offset: 2 -*- */
+/*
+ * Copyright (C) 2007-2012 David Bird (Coova Technologies) <support@coova.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+/*
+ *  Replays DNS messages, one UDP payload per file such as those in
+ *  corpus/dns, through dhcp_dns() and reports the rate.
+ *
+ *    bench_dns [-n messages] files...
+ */
+
+#include "chilli.h"
+
+struct options_t _options;
+
+#define MAX_MSGS 256
+
+static struct {
+  uint8_t *pack;
+  size_t plen;
+  char isReq;
+} msgs[MAX_MSGS];
+static int nmsgs;
+
+static int load(const char *file) {
+  struct pkt_iphdr_t *iph;
+  struct pkt_udphdr_t *udph;
+  uint8_t m[PKT_IP_PLEN];
+  size_t len, plen;
+  FILE *f;
+
+  if (nmsgs == MAX_MSGS)
+    return 0;
+
+  if (!(f = fopen(file, "r"))) {
+    perror(file);
+    return -1;
+  }
+
+  len = fread(m, 1, sizeof(m), f);
+  fclose(f);
+
+  if (len < 12) {
+    fprintf(stderr, "%s: too short\n", file);
+    return -1;
+  }
+
+  plen = PKT_ETH_HLEN + PKT_IP_HLEN + PKT_UDP_HLEN + len;
+  msgs[nmsgs].pack = calloc(1, plen);
+  msgs[nmsgs].plen = plen;
+  msgs[nmsgs].isReq = !(m[2] & 0x80);
+
+  iph = pkt_iphdr(msgs[nmsgs].pack);
+  iph->version_ihl = PKT_IP_VER_HLEN;
+  iph->tot_len = htons(plen - PKT_ETH_HLEN);
+  iph->protocol = PKT_IP_PROTO_UDP;
+
+  udph = pkt_udphdr(msgs[nmsgs].pack);
+  udph->src = htons(msgs[nmsgs].isReq ? 1024 : DHCP_DNS);
+  udph->dst = htons(msgs[nmsgs].isReq ? DHCP_DNS : 1024);
+  udph->len = htons(plen - PKT_ETH_HLEN - PKT_IP_HLEN);
+
+  memcpy(pkt_dnspkt(msgs[nmsgs].pack), m, len);
+  nmsgs++;
+  return 0;
+}
+
+int main(int argc, char **argv) {
+  static struct dhcp_t parent;
+  struct dhcp_conn_t conn;
+  struct timespec t0, t1;
+  long count = 200000;
+  long n, bytes = 0;
+  double secs;
+  int i;
+
+  for (i = 1; i < argc; i++) {
+    if (!strcmp(argv[i], "-n") && i + 1 < argc)
+      count = atol(argv[++i]);
+    else if (load(argv[i]))
+      return 1;
+  }
+
+  if (!nmsgs) {
+    fprintf(stderr, "usage: bench_dns [-n messages] files...\n");
+    return 1;
+  }
+
+  memset(&conn, 0, sizeof(conn));
+  conn.parent = &parent;
+  parent.rawif[0].fd = -1;
+
+  /* dhcp_dns() may rewrite the message, so every pass starts from a copy */
+  for (i = 0; i < nmsgs; i++) {
+    uint8_t *pack = malloc(msgs[i].plen);
+    size_t plen = msgs[i].plen;
+    memcpy(pack, msgs[i].pack, plen);
+    if (dhcp_dns(&conn, pack, &plen, msgs[i].isReq, 0) != 1) {
+      fprintf(stderr, "message %d is dropped\n", i);
+      return 1;
+    }
+    free(pack);
+  }
+
+  clock_gettime(CLOCK_MONOTONIC, &t0);
+
+  for (n = 0; n < count; n++) {
+    uint8_t pack[PKT_BUFFER];
+    int k = n % nmsgs;
+    size_t plen = msgs[k].plen;
+
+    memcpy(pack, msgs[k].pack, plen);
+    dhcp_dns(&conn, pack, &plen, msgs[k].isReq, 0);
+    bytes += plen;
+  }
+
+  clock_gettime(CLOCK_MONOTONIC, &t1);
+
+  secs = (t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) / 1e9;
+
+  printf("dhcp_dns: %ld of %d messages in %.3f s,"
+	 " %.0f msg/s, %.0f ns/msg, %.1f MB/s\n",
+	 count, nmsgs, secs, count / secs, secs * 1e9 / count,
+	 bytes / secs / 1e6);
+  return 0;
+}
@@ -0,0 +1,217 @@
+/* -*- mode: c; c-basic-offset: 2 -*- */
+/*
+ * Copyright (C) 2007-2012 David Bird (Coova Technologies) <support@coova.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+/*
+ *  Writes a uamdomainfile of the usual shapes (domains, exact names,
+ *  suffixes, negations and real regexes), then checks and times
+ *  garden_check_domainfile() against running regexec() down the
+ *  lines in order, which is what the matcher replaced.
+ *
+ *    bench_domainfile [-p patterns] [-r passes]
+ */
+
+#include "chilli.h"
+
+struct options_t _options;
+
+#ifdef ENABLE_UAMDOMAINFILE
+
+struct line {
+  regex_t re;
+  char neg;
+};
+
+static struct line *lines;
+static int nlines;
+
+static char **questions;
+static int nquestions;
+
+static void add_question(const char *fmt, int i) {
+  char q[256];
+  snprintf(q, sizeof(q), fmt, i);
+  questions[nquestions++] = strdup(q);
+}
+
+static int write_file(FILE *f, int npatterns) {
+  int i;
+
+  lines = calloc(npatterns, sizeof(struct line));
+  questions = calloc(npatterns * 3, sizeof(char *));
+
+  for (i = 0; i < npatterns; i++) {
+    char p[256];
+
+    switch (i % 8) {
+    case 0:
+      snprintf(p, sizeof(p), "(^|\\.)site%d\\.com$", i);
+      add_question("www.site%d.com", i);
+      add_question("a.b.site%d.com.evil.net", i);
+      break;
+    case 1:
+      snprintf(p, sizeof(p), "^www\\.site%d\\.net$", i);
+      add_question("www.site%d.net", i);
+      add_question("mail.site%d.net", i);
+      break;
+    case 2:
+      snprintf(p, sizeof(p), ".*\\.cdn%d\\.org$", i);
+      add_question("img.cdn%d.org", i);
+      add_question("cdn%d.org", i);
+      break;
+    case 3:
+      snprintf(p, sizeof(p), "site%d\\.info$", i);
+      add_question("site%d.info", i);
+      break;
+    case 4:
+      snprintf(p, sizeof(p), "^(.*\\.)?app%d\\.io$", i);
+      add_question("app%d.io", i);
+      add_question("eu.app%d.io", i);
+      break;
+    case 5: /* shadows part of the domain pattern three lines on */
+      snprintf(p, sizeof(p), "!^ads\\.site%d\\.com$", i + 3);
+      add_question("ads.site%d.com", i + 3);
+      break;
+    case 6:
+      snprintf(p, sizeof(p), "^img[0-9]+\\.media%d\\.com$", i);
+      add_question("img42.media%d.com", i);
+      add_question("imgx.media%d.com", i);
+      break;
+    case 7:
+      snprintf(p, sizeof(p), "^(api|login)\\.auth%d\\.example$", i);
+      add_question("login.auth%d.example", i);
+      add_question("unknown%d.example.com", i);
+      break;
+    }
+
+    fprintf(f, "%s\n", p);
+
+    lines[nlines].neg = p[0] == '!';
+    if (regcomp(&lines[nlines].re, p + lines[nlines].neg,
+		REG_EXTENDED | REG_NOSUB)) {
+      fprintf(stderr, "could not compile %s\n", p);
+      return -1;
+    }
+    nlines++;
+  }
+
+  return 0;
+}
+
+static int regex_list(char *question) {
+  int i;
+  for (i = 0; i < nlines; i++)
+    if (!regexec(&lines[i].re, question, 0, 0, 0))
+      return lines[i].neg ? 0 : 1;
+  return -1;
+}
+
+static double elapsed(struct timespec *t0) {
+  struct timespec t1;
+  clock_gettime(CLOCK_MONOTONIC, &t1);
+  return (t1.tv_sec - t0->tv_sec) + (t1.tv_nsec - t0->tv_nsec) / 1e9;
+}
+
+int main(int argc, char **argv) {
+  char file[] = "/tmp/bench_domainfileXXXXXX";
+  struct timespec t0;
+  int npatterns = 400;
+  int passes = 20;
+  int *verdict;
+  double secs;
+  int fd, i, p;
+  FILE *f;
+
+  for (i = 1; i < argc; i++) {
+    if (!strcmp(argv[i], "-p") && i + 1 < argc)
+      npatterns = atoi(argv[++i]);
+    else if (!strcmp(argv[i], "-r") && i + 1 < argc)
+      passes = atoi(argv[++i]);
+  }
+
+  if (npatterns < 8 || passes < 1) {
+    fprintf(stderr, "usage: bench_domainfile [-p patterns] [-r passes]\n");
+    return 1;
+  }
+
+  if ((fd = mkstemp(file)) < 0 || !(f = fdopen(fd, "w"))) {
+    perror(file);
+    return 1;
+  }
+
+  if (write_file(f, npatterns)) {
+    fclose(f);
+    unlink(file);
+    return 1;
+  }
+  fclose(f);
+
+  _options.uamdomainfile = file;
+  garden_load_domainfile();
+  unlink(file);
+
+  verdict = calloc(nquestions, sizeof(int));
+
+  clock_gettime(CLOCK_MONOTONIC, &t0);
+  for (i = 0; i < nquestions; i++)
+    verdict[i] = regex_list(questions[i]);
+  secs = elapsed(&t0);
+  printf("regex list: %d lines, %d names, %.0f ns/lookup\n",
+	 nlines, nquestions, secs * 1e9 / nquestions);
+
+  clock_gettime(CLOCK_MONOTONIC, &t0);
+  for (i = 0; i < nquestions; i++) {
+    int v = garden_check_domainfile(questions[i]);
+    if (v != verdict[i]) {
+      fprintf(stderr, "%s: matcher says %d, regex list %d\n",
+	      questions[i], v, verdict[i]);
+      return 1;
+    }
+  }
+  secs = elapsed(&t0);
+  printf("matcher, first pass: %.0f ns/lookup\n",
+	 secs * 1e9 / nquestions);
+
+  clock_gettime(CLOCK_MONOTONIC, &t0);
+  for (p = 0; p < passes; p++)
+    for (i = 0; i < nquestions; i++)
+      if (garden_check_domainfile(questions[i]) != verdict[i]) {
+	fprintf(stderr, "%s: cached verdict differs\n", questions[i]);
+	return 1;
+      }
+  secs = elapsed(&t0);
+  printf("matcher, %d more passes: %.0f ns/lookup\n",
+	 passes, secs * 1e9 / nquestions / passes);
+
+#ifdef ENABLE_CHILLIQUERY
+  fflush(stdout);
+  garden_print_domainfile(1);
+#endif
+
+  garden_free_domainfile();
+  return 0;
+}
+
+#else
+
+int main(int argc, char **argv) {
+  printf("uamdomainfile not configured\n");
+  return 77;
+}
+
+#endif
@@ -0,0 +1,227 @@
+/* -*- mode: c; c-basic-offset: 2 -*- */
+/*
+ * Copyright (C) 2007-2012 David Bird (Coova Technologies) <support@coova.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+/*
+ *  Renders the reply of "chilli_query list" in JSON for a set of
+ *  sessions, half of them authenticated and some with user names
+ *  that need escaping, checks that it parses and has every session,
+ *  and reports the time per list.
+ *
+ *    bench_json [-n sessions] [-r rounds] [-p]    (-p prints a list)
+ */
+
+#include "chilli.h"
+
+struct options_t _options;
+
+#if defined(ENABLE_CHILLIQUERY) && defined(ENABLE_JSON)
+
+static int nsessions_seen;
+
+static int json_value(const char **p, int depth);
+
+static void json_ws(const char **p) {
+  while (**p == ' ' || **p == '\t' || **p == '\n' || **p == '\r')
+    (*p)++;
+}
+
+static int json_string(const char **p) {
+  if (**p != '"') return -1;
+  for ((*p)++; **p != '"'; (*p)++) {
+    if ((unsigned char) **p < 0x20) return -1;
+    if (**p == '\\') {
+      (*p)++;
+      if (**p == 'u') {
+	int i;
+	for (i = 1; i <= 4; i++)
+	  if (!isxdigit((int) (*p)[i])) return -1;
+	*p += 4;
+      } else if (!**p || !strchr("\"\\/bfnrt", **p)) {
+	return -1;
+      }
+    }
+  }
+  (*p)++;
+  return 0;
+}
+
+static int json_container(const char **p, int depth, char close) {
+  (*p)++;
+  json_ws(p);
+  if (**p == close) {
+    (*p)++;
+    return 0;
+  }
+  for (;;) {
+    if (close == '}') {
+      json_ws(p);
+      if (json_string(p)) return -1;
+      json_ws(p);
+      if (*(*p)++ != ':') return -1;
+    }
+    if (json_value(p, depth + 1)) return -1;
+    json_ws(p);
+    if (**p == close) {
+      (*p)++;
+      return 0;
+    }
+    if (*(*p)++ != ',') return -1;
+  }
+}
+
+static int json_value(const char **p, int depth) {
+  json_ws(p);
+  switch (**p) {
+  case '{':
+    /* a session is an object in the array of the top object */
+    if (depth == 2) nsessions_seen++;
+    return json_container(p, depth, '}');
+  case '[':
+    return json_container(p, depth, ']');
+  case '"':
+    return json_string(p);
+  case 't':
+    return strncmp(*p, "true", 4) ? -1 : (*p += 4, 0);
+  case 'f':
+    return strncmp(*p, "false", 5) ? -1 : (*p += 5, 0);
+  case 'n':
+    return strncmp(*p, "null", 4) ? -1 : (*p += 4, 0);
+  default:
+    {
+      char *end;
+      strtod(*p, &end);
+      if (end == *p) return -1;
+      *p = end;
+      return 0;
+    }
+  }
+}
+
+static void list(bstring s, struct dhcp_conn_t *first) {
+  struct dhcp_conn_t *conn;
+
+  btrunc(s, 0);
+  jsonw_open(s, 0, '{');
+  jsonw_open(s, "sessions", '[');
+  for (conn = first; conn; conn = conn->next)
+    chilli_print(s, LIST_JSON_FMT, 0, conn);
+  jsonw_close(s, ']');
+  jsonw_close(s, '}');
+}
+
+int main(int argc, char **argv) {
+  struct app_conn_t *appconns;
+  struct dhcp_conn_t *conns;
+  struct timespec t0, t1;
+  bstring s = bfromcstr("");
+  const char *p;
+  int n = 10000, rounds = 20, print = 0;
+  double secs;
+  int i;
+
+  for (i = 1; i < argc; i++) {
+    if (!strcmp(argv[i], "-n") && i + 1 < argc)
+      n = atoi(argv[++i]);
+    else if (!strcmp(argv[i], "-r") && i + 1 < argc)
+      rounds = atoi(argv[++i]);
+    else if (!strcmp(argv[i], "-p"))
+      print = 1;
+  }
+
+  if (n < 1 || rounds < 1) {
+    fprintf(stderr, "usage: bench_json [-n sessions] [-r rounds] [-p]\n");
+    return 1;
+  }
+
+  mainclock_tick();
+
+  appconns = calloc(n, sizeof(struct app_conn_t));
+  conns = calloc(n, sizeof(struct dhcp_conn_t));
+
+  for (i = 0; i < n; i++) {
+    struct app_conn_t *a = &appconns[i];
+    struct dhcp_conn_t *c = &conns[i];
+
+    a->inuse = 1;
+    a->unit = i;
+    a->hisip.s_addr = htonl(0x0a000000 + i);
+    a->s_state.authenticated = i & 1;
+    a->s_state.start_time = mainclock_now() - i;
+    a->s_state.input_octets = 123456789LL * i;
+    a->s_state.output_octets = 98765LL * i;
+    a->s_params.sessiontimeout = 3600;
+    a->s_params.idletimeout = 600;
+    a->s_params.maxinputoctets = 1000000LL * i;
+    snprintf(a->s_state.sessionid, sizeof(a->s_state.sessionid),
+	     "%08x%08x", i, i * 7);
+    snprintf(a->s_state.redir.username, sizeof(a->s_state.redir.username),
+	     i % 100 != 1 ? "user%d@example.com" : "we\"ird\\user\t%d", i);
+
+    c->inuse = 1;
+    c->peer = a;
+    c->hisip = a->hisip;
+    c->hismac[0] = 0x02;
+    c->hismac[4] = i >> 8;
+    c->hismac[5] = i;
+    c->authstate = a->s_state.authenticated ? DHCP_AUTH_PASS : DHCP_AUTH_DNAT;
+    c->next = i + 1 < n ? &conns[i + 1] : 0;
+  }
+
+  list(s, conns);
+
+  p = (const char *) s->data;
+  if (json_value(&p, 0) || (json_ws(&p), *p)) {
+    fprintf(stderr, "not JSON at offset %d\n", (int) (p - (char *) s->data));
+    return 1;
+  }
+
+  if (nsessions_seen != n) {
+    fprintf(stderr, "%d sessions listed of %d\n", nsessions_seen, n);
+    return 1;
+  }
+
+  if (print) {
+    fwrite(s->data, 1, s->slen, stdout);
+    printf("\n");
+    return 0;
+  }
+
+  clock_gettime(CLOCK_MONOTONIC, &t0);
+  for (i = 0; i < rounds; i++)
+    list(s, conns);
+  clock_gettime(CLOCK_MONOTONIC, &t1);
+
+  secs = (t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) / 1e9;
+
+  printf("list json: %d sessions, %d bytes, %.2f ms per list,"
+	 " %.0f ns per session\n",
+	 n, s->slen, secs * 1e3 / rounds, secs * 1e9 / rounds / n);
+
+  bdestroy(s);
+  return 0;
+}
+
+#else
+
+int main(int argc, char **argv) {
+  printf("chilli_query or JSON not configured\n");
+  return 77;
+}
+
+#endif
@@ -0,0 +1,250 @@
+/* -*- mode: c; c-basic-offset: 2 -*- */
+/*
+ * Copyright (C) 2007-2012 David Bird (Coova Technologies) <support@coova.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+/*
+ *  Pushes Access-Requests and Accounting-Requests, alternately,
+ *  through radius_req() to a stand-in RADIUS server on the loopback,
+ *  served from the same select loop, and reports the rate and the
+ *  latency percentiles from radius_req() to the reply callback.
+ *
+ *    bench_radius [-n requests] [-w window]
+ */
+
+#include "chilli.h"
+#include "md5.h"
+
+struct options_t _options;
+
+#define SECRET "testing123"
+
+static struct timespec *sent;
+static double *latency;
+static long replies;
+static long failed;
+
+static double since(struct timespec *t0) {
+  struct timespec t1;
+  clock_gettime(CLOCK_MONOTONIC, &t1);
+  return (t1.tv_sec - t0->tv_sec) + (t1.tv_nsec - t0->tv_nsec) / 1e9;
+}
+
+static int conf(struct radius_t *r, struct radius_packet_t *pack,
+		struct radius_packet_t *pack_req, void *cbp) {
+  long k = (long) cbp;
+
+  if (!pack || (pack->code != RADIUS_CODE_ACCESS_ACCEPT &&
+		pack->code != RADIUS_CODE_ACCOUNTING_RESPONSE))
+    failed++;
+  else
+    latency[replies++] = since(&sent[k]) * 1e6;
+
+  return 0;
+}
+
+static int server_socket(uint16_t *port) {
+  struct sockaddr_in addr;
+  socklen_t len = sizeof(addr);
+  int fd = socket(AF_INET, SOCK_DGRAM, 0);
+
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+  if (fd < 0 || bind(fd, (struct sockaddr *) &addr, sizeof(addr)) ||
+      getsockname(fd, (struct sockaddr *) &addr, &len)) {
+    perror("stand-in server");
+    return -1;
+  }
+
+  ndelay_on(fd);
+  *port = ntohs(addr.sin_port);
+  return fd;
+}
+
+/* Accepts whatever is queued: Access-Accept or Accounting-Response */
+static void serve(int fd) {
+  struct radius_packet_t pack;
+  struct sockaddr_in from;
+  socklen_t fromlen;
+  ssize_t n;
+  MD5_CTX context;
+
+  for (;;) {
+    fromlen = sizeof(from);
+    if ((n = recvfrom(fd, &pack, sizeof(pack), 0,
+		      (struct sockaddr *) &from, &fromlen)) < RADIUS_HDRSIZE)
+      return;
+
+    pack.code = pack.code == RADIUS_CODE_ACCESS_REQUEST ?
+        RADIUS_CODE_ACCESS_ACCEPT : RADIUS_CODE_ACCOUNTING_RESPONSE;
+    pack.length = htons(RADIUS_HDRSIZE);
+
+    MD5Init(&context);
+    MD5Update(&context, (uint8_t *) &pack, RADIUS_HDRSIZE);
+    MD5Update(&context, (uint8_t *) SECRET, strlen(SECRET));
+    MD5Final(pack.authenticator, &context);
+
+    sendto(fd, &pack, RADIUS_HDRSIZE, 0,
+	   (struct sockaddr *) &from, fromlen);
+  }
+}
+
+static int request(long k) {
+  struct radius_packet_t pack;
+  char s[64];
+
+  if (k & 1) {
+    radius_default_pack(radius, &pack, RADIUS_CODE_ACCOUNTING_REQUEST);
+    radius_addattr(radius, &pack, RADIUS_ATTR_ACCT_STATUS_TYPE, 0, 0,
+		   RADIUS_STATUS_TYPE_INTERIM_UPDATE, NULL, 0);
+    snprintf(s, sizeof(s), "%08lx", k);
+    radius_addattr(radius, &pack, RADIUS_ATTR_ACCT_SESSION_ID, 0, 0, 0,
+		   (uint8_t *) s, strlen(s));
+  } else {
+    radius_default_pack(radius, &pack, RADIUS_CODE_ACCESS_REQUEST);
+    snprintf(s, sizeof(s), "user%ld@example.com", k);
+    radius_addattr(radius, &pack, RADIUS_ATTR_USER_NAME, 0, 0, 0,
+		   (uint8_t *) s, strlen(s));
+    radius_addattr(radius, &pack, RADIUS_ATTR_USER_PASSWORD, 0, 0, 0,
+		   (uint8_t *) "password", 8);
+  }
+
+  clock_gettime(CLOCK_MONOTONIC, &sent[k]);
+  return radius_req(radius, &pack, (void *) k);
+}
+
+static int cmp(const void *a, const void *b) {
+  double x = *(const double *) a, y = *(const double *) b;
+  return x < y ? -1 : x > y;
+}
+
+int main(int argc, char **argv) {
+  struct in_addr lo;
+  struct timespec t0;
+  long count = 50000;
+  int window = 128;
+  long k = 0;
+  int authfd, acctfd;
+  double secs;
+  int i;
+
+  for (i = 1; i < argc; i++) {
+    if (!strcmp(argv[i], "-n") && i + 1 < argc)
+      count = atol(argv[++i]);
+    else if (!strcmp(argv[i], "-w") && i + 1 < argc)
+      window = atoi(argv[++i]);
+  }
+
+  if (count < 1 || window < 1) {
+    fprintf(stderr, "usage: bench_radius [-n requests] [-w window]\n");
+    return 1;
+  }
+
+  if ((authfd = server_socket(&_options.radiusauthport)) < 0 ||
+      (acctfd = server_socket(&_options.radiusacctport)) < 0)
+    return 1;
+
+  lo.s_addr = htonl(INADDR_LOOPBACK);
+  _options.radiusserver1 = lo;
+  _options.radiussecret = SECRET;
+  _options.radiustimeout = 1;
+  _options.radiusretry = 3;
+
+  mainclock_tick();
+
+  if (radius_new(&radius, &lo, 0, 0, 0) ||
+      radius_init_q(radius, window)) {
+    fprintf(stderr, "radius_new() failed\n");
+    return 1;
+  }
+
+  radius_set(radius, 0, 0);
+  radius_set_cb_auth_conf(radius, conf);
+  radius_set_cb_acct_conf(radius, conf);
+
+  sent = calloc(count, sizeof(struct timespec));
+  latency = calloc(count, sizeof(double));
+
+  clock_gettime(CLOCK_MONOTONIC, &t0);
+
+  while (replies + failed < count) {
+    struct timeval tv;
+    fd_set fds;
+    int maxfd = acctfd > authfd ? acctfd : authfd;
+
+    /* a few at a time, a full window at once overflows the sockets */
+    for (i = 0; i < 32 && k < count && k - replies - failed < window; i++)
+      if (request(k++)) {
+	fprintf(stderr, "radius_req() failed at %ld\n", k - 1);
+	return 1;
+      }
+
+    FD_ZERO(&fds);
+    FD_SET(authfd, &fds);
+    FD_SET(acctfd, &fds);
+    for (i = 0; i < radius->nsocks; i++) {
+      FD_SET(radius->socks[i].fd, &fds);
+      if (radius->socks[i].fd > maxfd)
+	maxfd = radius->socks[i].fd;
+    }
+
+    tv.tv_sec = 1;
+    tv.tv_usec = 0;
+    radius_timeleft(radius, &tv);
+
+    if (select(maxfd + 1, &fds, 0, 0, &tv) < 0 && errno != EINTR) {
+      perror("select");
+      return 1;
+    }
+
+    mainclock_tick();
+
+    if (FD_ISSET(authfd, &fds))
+      serve(authfd);
+    if (FD_ISSET(acctfd, &fds))
+      serve(acctfd);
+
+    for (i = 0; i < radius->nsocks; i++)
+      if (FD_ISSET(radius->socks[i].fd, &fds))
+	radius_decaps(radius, i);
+
+    radius_timeout(radius);
+  }
+
+  secs = since(&t0);
+
+  qsort(latency, replies, sizeof(double), cmp);
+
+  printf("radius: %ld requests (auth+acct), window %d, %d sockets,"
+	 " %.3f s, %.0f req/s\n",
+	 count, window, radius->nsocks, secs, count / secs);
+
+  if (replies)
+    printf("latency us: p50 %.0f p90 %.0f p99 %.0f p99.9 %.0f max %.0f\n",
+	   latency[replies / 2], latency[replies * 9 / 10],
+	   latency[replies * 99 / 100], latency[replies * 999 / 1000],
+	   latency[replies - 1]);
+
+  if (failed) {
+    fprintf(stderr, "%ld requests failed or timed out\n", failed);
+    return 1;
+  }
+
+  return 0;
+}
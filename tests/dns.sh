@@ -0,0 +1,5 @@
+#!/bin/sh
+# Fuzzes and benchmarks dhcp_dns() with the messages in corpus/dns.
+corpus=${srcdir:-.}/corpus/dns
+./fuzz_dns -n 200000 $corpus/*.bin || exit 1
+./bench_dns -n 1000000 $corpus/*.bin || exit 1
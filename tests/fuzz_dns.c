@@ -0,0 +1,262 @@
+/* -*- mode: c; c-basic-offset: 2 -*- */
+/*
+ * Copyright (C) 2007-2012 David Bird (Coova Technologies) <support@coova.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+/*
+ *  Feeds DNS messages through dhcp_dns() and so dns_copy_res() and
+ *  dns_name(). The seeds (built in, plus any files given on the
+ *  command line) must parse; mutations of them only have to be
+ *  rejected or parsed without crashing. Each packet lives in a buffer
+ *  of its exact size, so running under valgrind or with
+ *  -fsanitize=address catches reads past the end.
+ *
+ *    fuzz_dns [-n iterations] [seed files...]
+ */
+
+#include "chilli.h"
+
+struct options_t _options;
+
+#define MAX_SEEDS 64
+
+struct seed {
+  uint8_t *msg;
+  size_t len;
+  char isReq;
+};
+
+static struct seed seeds[MAX_SEEDS];
+static int nseeds;
+
+static uint32_t rnd_state = 0x2545f491;
+
+static uint32_t rnd(void) {
+  rnd_state ^= rnd_state << 13;
+  rnd_state ^= rnd_state >> 17;
+  rnd_state ^= rnd_state << 5;
+  return rnd_state;
+}
+
+static void add_seed(uint8_t *msg, size_t len) {
+  if (nseeds == MAX_SEEDS || len < 12) return;
+  seeds[nseeds].msg = malloc(len);
+  memcpy(seeds[nseeds].msg, msg, len);
+  seeds[nseeds].len = len;
+  seeds[nseeds].isReq = !(msg[2] & 0x80);
+  nseeds++;
+}
+
+/*
+ *  Wraps the message in ethernet, IP and UDP headers and hands it to
+ *  dhcp_dns(), in a buffer of exactly its size. Returns what
+ *  dhcp_dns() does: 1 when it parsed, 0 when it was dropped or, for
+ *  a query, answered with an error (the answer goes nowhere, the
+ *  raw interface is closed).
+ */
+static int walk(uint8_t *msg, size_t len, char isReq) {
+  static struct dhcp_t parent;
+  struct dhcp_conn_t conn;
+  struct pkt_iphdr_t *iph;
+  struct pkt_udphdr_t *udph;
+  size_t plen = PKT_ETH_HLEN + PKT_IP_HLEN + PKT_UDP_HLEN + len;
+  uint8_t *pack = calloc(1, plen);
+  int ret;
+
+  memset(&conn, 0, sizeof(conn));
+  conn.parent = &parent;
+  parent.rawif[0].fd = -1;
+
+  iph = pkt_iphdr(pack);
+  iph->version_ihl = PKT_IP_VER_HLEN;
+  iph->tot_len = htons(plen - PKT_ETH_HLEN);
+  iph->protocol = PKT_IP_PROTO_UDP;
+
+  udph = pkt_udphdr(pack);
+  udph->src = htons(isReq ? 1024 : DHCP_DNS);
+  udph->dst = htons(isReq ? DHCP_DNS : 1024);
+  udph->len = htons(plen - PKT_ETH_HLEN - PKT_IP_HLEN);
+
+  memcpy(pkt_dnspkt(pack), msg, len);
+  ret = dhcp_dns(&conn, pack, &plen, isReq, 0);
+  free(pack);
+  return ret;
+}
+
+static size_t put_name(uint8_t *p, const char *name) {
+  size_t n = 0;
+  while (*name) {
+    const char *dot = strchr(name, '.');
+    size_t l = dot ? (size_t)(dot - name) : strlen(name);
+    p[n++] = l;
+    memcpy(p + n, name, l);
+    n += l;
+    name += l;
+    if (*name) name++;
+  }
+  p[n++] = 0;
+  return n;
+}
+
+static size_t put_header(uint8_t *p, uint16_t flags, int qd, int an) {
+  memset(p, 0, 12);
+  p[0] = 0x12; p[1] = 0x34;
+  p[2] = flags >> 8; p[3] = flags;
+  p[5] = qd;
+  p[7] = an;
+  return 12;
+}
+
+static size_t put_rdata(uint8_t *p, uint16_t type,
+			uint8_t *rdata, uint16_t rdlen) {
+  size_t n = 0;
+  p[n++] = 0; p[n++] = type;
+  p[n++] = 0; p[n++] = 1;
+  p[n++] = 0; p[n++] = 0; p[n++] = 0x0e; p[n++] = 0x10;
+  p[n++] = rdlen >> 8; p[n++] = rdlen;
+  memcpy(p + n, rdata, rdlen);
+  return n + rdlen;
+}
+
+static size_t put_rr(uint8_t *p, uint16_t ptr, uint16_t type,
+		     uint8_t *rdata, uint16_t rdlen) {
+  p[0] = 0xc0 | (ptr >> 8); p[1] = ptr;
+  return 2 + put_rdata(p + 2, type, rdata, rdlen);
+}
+
+static void builtin_seeds(void) {
+  uint8_t m[512], rd[64];
+  uint8_t a[4] = { 192, 0, 2, 1 };
+  size_t n, qend;
+
+  /* plain A query, the name ends within 12 bytes of the end */
+  n = put_header(m, 0x0100, 1, 0);
+  n += put_name(m + n, "www.coova.org");
+  m[n++] = 0; m[n++] = 1; m[n++] = 0; m[n++] = 1;
+  qend = n;
+  add_seed(m, n);
+
+  /* its reply, the answer name compressed to the question */
+  put_header(m, 0x8180, 1, 1);
+  n = qend;
+  n += put_rr(m + n, 12, 1, a, 4);
+  add_seed(m, n);
+
+  /* CNAME chain, the target compressed into the tail of the message */
+  put_header(m, 0x8180, 1, 2);
+  n = qend;
+  rd[0] = 3; memcpy(rd + 1, "cdn", 3); rd[4] = 0xc0; rd[5] = 16;
+  n += put_rr(m + n, 12, 5, rd, 6);
+  n += put_rr(m + n, qend + 12, 1, a, 4);
+  add_seed(m, n);
+
+  /* name with a 63 byte label, repeated uncompressed in the last record */
+  n = put_header(m, 0x8180, 1, 1);
+  m[n++] = 63; memset(m + n, 'a', 63); n += 63;
+  n += put_name(m + n, "example.com");
+  m[n++] = 0; m[n++] = 1; m[n++] = 0; m[n++] = 1;
+  m[n++] = 63; memset(m + n, 'a', 63); n += 63;
+  n += put_name(m + n, "example.com");
+  n += put_rdata(m + n, 1, a, 4);
+  add_seed(m, n);
+}
+
+static int read_seed(const char *file) {
+  uint8_t m[PKT_IP_PLEN];
+  FILE *f = fopen(file, "r");
+  size_t n;
+
+  if (!f) {
+    perror(file);
+    return -1;
+  }
+
+  n = fread(m, 1, sizeof(m), f);
+  fclose(f);
+  add_seed(m, n);
+  return 0;
+}
+
+static size_t mutate(uint8_t *m, size_t len) {
+  int k, edits = 1 + rnd() % 4;
+
+  for (k = 0; k < edits; k++) {
+    size_t at = 12 + rnd() % (len - 12 + 1);
+    switch (rnd() % 5) {
+    case 0: /* flip bits */
+      if (at < len) m[at] ^= 1 << (rnd() % 8);
+      break;
+    case 1: /* truncate */
+      if (at > 12) len = at;
+      break;
+    case 2: /* compression pointer anywhere, forwards included */
+      if (at + 1 < len) {
+	uint16_t to = rnd() % (len + 16);
+	m[at] = 0xc0 | (to >> 8);
+	m[at + 1] = to;
+      }
+      break;
+    case 3: /* oversized label or rdlength */
+      if (at < len) m[at] = 0x3f + rnd() % 0xc1;
+      break;
+    case 4: /* more records than there are */
+      m[4 + (rnd() % 4) * 2 + 1] += 1 + rnd() % 3;
+      break;
+    }
+  }
+
+  return len;
+}
+
+int main(int argc, char **argv) {
+  long iterations = 200000;
+  long it, rejected = 0;
+  int i;
+
+  for (i = 1; i < argc; i++) {
+    if (!strcmp(argv[i], "-n") && i + 1 < argc)
+      iterations = atol(argv[++i]);
+    else if (read_seed(argv[i]))
+      return 1;
+  }
+
+  builtin_seeds();
+
+  for (i = 0; i < nseeds; i++) {
+    if (walk(seeds[i].msg, seeds[i].len, seeds[i].isReq) != 1) {
+      fprintf(stderr, "seed %d (%zu bytes) does not parse\n",
+	      i, seeds[i].len);
+      return 1;
+    }
+  }
+
+  for (it = 0; it < iterations; it++) {
+    struct seed *s = &seeds[rnd() % nseeds];
+    uint8_t m[PKT_IP_PLEN];
+    size_t len;
+
+    memcpy(m, s->msg, s->len);
+    len = mutate(m, s->len);
+
+    if (walk(m, len, s->isReq) != 1)
+      rejected++;
+  }
+
+  printf("%d seeds parsed, %ld mutations, %ld rejected\n",
+	 nseeds, iterations, rejected);
+  return 0;
+}